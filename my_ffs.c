@@ -14,26 +14,97 @@
 #include <strlib.h>
 #include <ctype.h>
 
+#ifdef FFS_FIXED_DEVICE
+#include "ffs_device.h"
+#endif
+
 
+#ifndef FFS_FIXED_DEVICE
 // External link to section table...
 // The section table contains an entry for each physical flash memory part and
 // describes the size of allocation units (sectors) on the part and how many 
 // are available to use.  Also, the table contains function pointers to
 // primative routines to read, write, and erase a sector on the part.
 extern FFS_FLASH_SECTION FlashSectionTable[];
+#else
+// Fixed device build: the board's ffs_device.h supplies the geometry as constants and
+// the primitives as inline functions.  A volume with no section table uses them
+// directly.  This entry only describes the geometry for code that wants a section...
+static FFS_FLASH_SECTION FixedDeviceSection =
+{
+   0,                                  // Device
+   0,                                  // Start
+   FFS_DEVICE_SECTOR_COUNT,            // Count
+   FFS_DEVICE_SECTOR_SIZE,             // SectorSize
+   NULL, NULL, NULL                    // Primitives are called directly, not thru here.
+};
+#endif
 
-// Singleton static object created at runtime...
+// Default volume, built on FlashSectionTable.  Additional volumes are created with
+// FFSMount() and each one carries its own section table, descriptors and lock...
 FFS_GLOBALS  ThemyffsObject;
 FFS_GLOBALS* myffsObj = &ThemyffsObject;
 
 
 //---------------------------------------------------------------------------------------
-// At some point we may need some syncronization...
+// Syncronization.  Each volume has its own lock, so operations on different volumes
+// never wait on each other.  The lock primitives are supplied by the platform...
+//---------------------------------------------------------------------------------------
+// Operations that change the volume take the update lock as well, and hold it thruout.
+// While one of them waits for a background erase it lets go of the volume lock, so
+// reads (which only take the volume lock) can run.  A read of the bank being erased
+// suspends the erase until the read lock is let go...
+//---------------------------------------------------------------------------------------
+// A fixed device build may supply its own lock macros in ffs_device.h (for example,
+// empty ones on a single task system)...
+//---------------------------------------------------------------------------------------
+#ifndef FFS_LOCK
+#define FFS_INITLOCK()  (LockHandle = FFSPlatformCreateLock(), UpdateLockHandle = FFSPlatformCreateLock())
+#define FFS_TERMLOCK()  (FFSPlatformDeleteLock(LockHandle), FFSPlatformDeleteLock(UpdateLockHandle))
+#define FFS_LOCK()      (FFSPlatformLock(LockHandle))
+#define FFS_UNLOCK()    (FFSPlatformUnlock(LockHandle))
+#define FFS_UPDATE_LOCK()    do { FFSPlatformLock(UpdateLockHandle); FFS_LOCK(); } while(0)
+#define FFS_UPDATE_UNLOCK()  do { FFS_UNLOCK(); FFSPlatformUnlock(UpdateLockHandle); } while(0)
+#endif
+
+// With only the one lock, updates can't let reads in, so erases are never backgrounded...
+#ifndef FFS_UPDATE_LOCK
+#define FFS_UPDATE_LOCK()    FFS_LOCK()
+#define FFS_UPDATE_UNLOCK()  FFS_UNLOCK()
+#define FFS_NO_READ_WINDOW
+#endif
+
+#define FFS_READ_LOCK()      FFS_LOCK()
+#define FFS_READ_UNLOCK()    do { ResumeErase(); FFS_UNLOCK(); } while(0)
+
+// For operations that only change the volume in some cases...
+#define FFS_LOCK_FOR(Update)    do { if( Update ) FFS_UPDATE_LOCK();   else FFS_READ_LOCK();   } while(0)
+#define FFS_UNLOCK_FOR(Update)  do { if( Update ) FFS_UPDATE_UNLOCK(); else FFS_READ_UNLOCK(); } while(0)
+
+// Time base for collection budgets.  A fixed device build may supply its own...
+#ifndef FFS_TICKS
+#define FFS_TICKS()     (FFSPlatformTicks())
+#endif
+
+#ifndef FFS_YIELD
+#define FFS_YIELD()     (FFSPlatformYield())
+#endif
+
+
+//---------------------------------------------------------------------------------------
+// Check map access. The map is FFS_CHECK_PLANES bit planes, one bit per sector each...
 //---------------------------------------------------------------------------------------
-//#define FFS_LOCK()      (_flash().lockWrite())
-//#define FFS_UNLOCK()    (_flash().unlockWrite())
-void FFS_LOCK(void);
-void FFS_UNLOCK(void);
+#define CHECK_MAP_BIT(Sector)           (1UL << ((Sector) % FFS_CHECK_WORD_BITS))
+#define CHECK_MAP_WORD(Plane, Sector)   (CheckMap[(Plane) * CheckMapWords + (Sector) / FFS_CHECK_WORD_BITS])
+#define CHECK_MAP_SET(Plane, Sector)    (CHECK_MAP_WORD(Plane, Sector) |= CHECK_MAP_BIT(Sector))
+#define CHECK_MAP_TEST(Plane, Sector)   (CHECK_MAP_WORD(Plane, Sector) &  CHECK_MAP_BIT(Sector))
+
+// Tell a benchmark that a Check() pass is starting...
+#ifdef FFS_MICROBENCH
+#define CHECK_PASS(Pass)   do { if( BenchMark ) BenchMark( Pass ); } while(0)
+#else
+#define CHECK_PASS(Pass)
+#endif
 
 
 //---------------------------------------------------------------------------------------
@@ -55,9 +126,16 @@ void FFS_UNLOCK(void);
 //---------------------------------------------------------------------------------------
 int FFSInitialize( void )
 {
-   myffsObj->SectorArray = NULL;
+   myffsObj->CheckMap    = NULL;
+#ifndef FFS_FIXED_DEVICE
+   myffsObj->Sections    = FlashSectionTable;
+#else
+   myffsObj->Sections    = NULL;            // Use the fixed device primitives.
+#endif
 
    myffsObj->initializationComplete = false;
+
+   return 0;
 }
 
 
@@ -76,12 +154,21 @@ int FFSInitialize( void )
 //---------------------------------------------------------------------------------------
 Jcffs::~Jcffs( void )
 {
-   FFS_LOCK();
+   // Never mounted (or already unmounted), so there is no lock or map...
+   if( initializationComplete == false )
+   {
+      return;
+   }
+
+   FFS_UPDATE_LOCK();
 
-   // Free Sector Array...
-   if( myffsObj->SectorArray )
+   // Let the part have the last sectors freed...
+   IssueDiscards();
+
+   // Free the check map if we allocated it...
+   if( CheckMap && CheckMapOwned )
    {
-      _mem_free(SectorArray);
+      _mem_free(CheckMap);
    }
 
    FFS_TERMLOCK();
@@ -113,31 +200,43 @@ int Jcffs::open( char* Filename, int flags, int permissions )
 {
    FFS_FILE_NODE*         Fnode;
    FFS_FILE_DESCRIPTOR*   Fdesc;
+   FFS_SECTOR_HEADER      SecHead;
    int                     fd;
    unsigned long           CreateCount = 0;
+   bool                    Recalled;
 
 
    if( initializationComplete == false )
    {
-      myffsObj->Initialize();
+      Initialize();
    }
 
-   // Allocate a descriptor table entry...
+   // Opening an existing file doesn't change the volume, so it can run while an update
+   // waits for an erase...
+   FFS_LOCK_FOR( flags & FFS_CREATE );
+
+   // Allocate a descriptor table entry. This must be done under the volume lock since
+   // several tasks may be opening files on this volume at the same time...
    if( (fd = GetDescriptor()) < 0 )
    {
+      FFS_UNLOCK_FOR( flags & FFS_CREATE );
       return fd;                      // fd will have error code from GetDescriptor().
    }
 
-   FFS_LOCK();
-
    // Now, point to our new entry...
    Fdesc = &(FileDescriptors[fd]);
    Fnode = &(Fdesc->Fnode);                       // Copy ptr for convenience.
+   Fdesc->Class = ClassOf( Filename );
 
 
-   // See if file exists. Find Fnode on flash and copy into memory.
+   // See if file exists.  If it was closed lately, the open cache has everything we
+   // need.  Otherwise find Fnode on flash and copy into memory.
    // LocateFileNode() will return with sector==-1 if file is not found...
-   LocateFileNode(Filename, Fnode, &Fdesc->FnodeSector);
+   if( !(Recalled = RecallFile(Filename, Fdesc)) )
+   {
+      LocateFileNode(Filename, Fnode, &Fdesc->FnodeSector);
+      Fdesc->TailSector = -1;                     // Found when first needed.
+   }
 
    // If we are not creating this file and it doesn't exist, then return error...
    if( !(flags & FFS_CREATE) && Fdesc->FnodeSector == -1 )
@@ -145,12 +244,12 @@ int Jcffs::open( char* Filename, int flags, int permissions )
       FreeDescriptor(fd);                         // Free our descriptor entry.
 
       // File does not exist! Return error...
-      FFS_UNLOCK();
+      FFS_UNLOCK_FOR( flags & FFS_CREATE );
       return FFS_RC_FILE_DOES_NOT_EXIST;
    }
 
    // If we are creating a new file, then prepare for new file.
-   if( flags && FFS_CREATE )
+   if( flags & FFS_CREATE )
    {
       // If old file exists, indicate that we want to delete it when the new file
       // is fully written out and closed...
@@ -172,18 +271,29 @@ int Jcffs::open( char* Filename, int flags, int permissions )
          {
             strcpy(Fnode->Filename, Filename);
          }
+         Fnode->NameHash = FFSHashName(Fnode->Filename);
       }
       Fdesc->FnodeSector = -1;                    // Indicate no fnode allocated yet.
       Fnode->FileSize    = 0;                     // No file length to begin with.
       Fnode->Permissions = permissions;           // Save permissions.
       Fnode->Count       = CreateCount;           // Keep track of create count.
+      Fnode->Flags       = 0;                     // New chains start out in order.
       // Fnode->DataTime = time();                // Save date/time of file creation.
+      Fdesc->FnodeVersion = FFS_FILE_SYSTEM_VERSION;
+      Fdesc->TailSector   = -1;                   // The new chain has none yet.
+      Fdesc->IndexLoaded  = 0;
+   }
+   else if( !Recalled )
+   {
+      // Older formats can't record an out of order chain, so remember which one it is...
+      ReadSectorHeader( Fdesc->FnodeSector, &SecHead );
+      Fdesc->FnodeVersion = SecHead.Version;
    }
 
    // Set up descriptor...
-   Fdesc->Flags = flags;                          // Save open flags.
+   Fdesc->Flags      = flags;                     // Save open flags.
 
-   FFS_UNLOCK();
+   FFS_UNLOCK_FOR( flags & FFS_CREATE );
 
    return fd;
 }
@@ -200,12 +310,19 @@ int Jcffs::open( char* Filename, int flags, int permissions )
 //
 //    Returns:          Indication of error.
 //
-//    Notes:
+//    Notes:            The descriptor is freed even if there is an error.  A file that
+//                      was only opened, not created, and written past its end gets a
+//                      new fnode here, see GrowFileNode().
 //
 //---------------------------------------------------------------------------------------
 int Jcffs::close( int fd )
 {
    FFS_FILE_DESCRIPTOR*  Fdesc;              // ptr to file descriptor entry.
+   FFS_SECTOR_HEADER     SecHead;
+   FFS_FILE_NODE         OldFnode;
+   unsigned long         OldSector;
+   bool                  Update;
+   int                   rc = 0;
 
    // Sanity check...
    if(fd > FFS_MAX_FILE_DESCRIPTORS || !FileDescriptors[fd].InUse )
@@ -213,32 +330,90 @@ int Jcffs::close( int fd )
       return FFS_RC_INVALID_FILE_DESCRIPTOR;
    }
 
-   FFS_LOCK();
-
    Fdesc = &(FileDescriptors[fd]);                // Copy ptr for convenience.
 
-   // If this is a new file, we will have to write out the fnode...
+   // Closing a file that was only read doesn't change the volume...
+   Update = Fdesc->WriteFnode || Fdesc->DeleteOldFile || Fdesc->Grown;
+
+   FFS_LOCK_FOR( Update );
+
+   IoClass = Fdesc->Class;
+
+   // Another task may have created the same name since this file was opened, and
+   // replaced the file this one was to replace.  Replace whatever has the name now,
+   // and be newer than it...
+   if( Fdesc->WriteFnode || Fdesc->DeleteOldFile )
+   {
+      OldSector = Fdesc->DeleteOldFile ? Fdesc->OldFnodeSector : -1;
+      if( OldSector == -1 ||
+          ReadSectorHeader( OldSector, &SecHead ) < 0 ||
+          SecHead.Status != FFS_SECTOR_HEADER_INUSE_FILENODE ||
+          ReadFileNode( OldSector, &SecHead, &OldFnode ) < 0 ||
+          !SameName( OldFnode.Filename, Fdesc->Fnode.Filename ) )
+      {
+         LocateFileNode( Fdesc->Fnode.Filename, &OldFnode, &OldSector );
+      }
+
+      Fdesc->DeleteOldFile  = (OldSector != -1);
+      Fdesc->OldFnodeSector = OldSector;
+      if( OldSector != -1 && Fdesc->Fnode.Count <= OldFnode.Count )
+      {
+         Fdesc->Fnode.Count = OldFnode.Count + 1;
+      }
+   }
+
+   // If this is a new file, we will have to write out the fnode.  A big one gets an index
+   // of its chain first, which the fnode points to, and the chain gets its skips...
    if( Fdesc->WriteFnode )
    {
-      WriteSector( Fdesc->FnodeSector,
-                   sizeof(FFS_SECTOR_HEADER),
-                   &(Fdesc->Fnode),
-                   sizeof(FFS_FILE_NODE) );
+      WriteIndex( Fdesc->FnodeSector, &(Fdesc->Fnode) );
+      if( !(Fdesc->Fnode.Flags & FFS_FNODE_UNORDERED) )
+      {
+         WriteSkips( Fdesc->FnodeSector );
+      }
+      WriteFileNode( Fdesc->FnodeSector, FFS_FILE_SYSTEM_VERSION, &(Fdesc->Fnode) );
+   }
+
+   // An existing file that was written past its end gets a new fnode with its new size,
+   // unless it has been erased...
+   else if( Fdesc->Grown && !Fdesc->Unlinked )
+   {
+      rc = GrowFileNode( Fdesc );
    }
 
    // If this is a new file and there was an existing older file out there, then
    // we need to delete the old file...
    if(Fdesc->DeleteOldFile)
    {
-      FreeSectors( Fdesc->OldFnodeSector );
+      DeleteFile( Fdesc->OldFnodeSector );
+   }
+
+   // Whatever was cached under this name is gone now.  The new file's fnode is just
+   // written, and its tail and index are found again when they are needed...
+   if( Update )
+   {
+      ForgetFile( Fdesc->Fnode.Filename );
+      Fdesc->Changed     = 0;
+      Fdesc->TailSector  = -1;
+      Fdesc->IndexLoaded = 0;
    }
 
-   // Now free the descriptor...
-   FreeDescriptor( fd );
+   // A file erased while it was open is freed once the last descriptor on it is...
+   if( Fdesc->Unlinked )
+   {
+      OldSector = Fdesc->FnodeSector;
+      FreeDescriptor( fd );
+      QueueDelete( OldSector );
+   }
+   else
+   {
+      RememberFile( Fdesc );
+      FreeDescriptor( fd );
+   }
 
-   FFS_UNLOCK();
+   FFS_UNLOCK_FOR( Update );
 
-   return 0;
+   return rc;
 }
 
 
@@ -262,9 +437,10 @@ int Jcffs::read( int fd, char* buf, int n )
    FFS_SECTOR_HEADER     SecHead;            // Current sector file pos is in.
    FFS_FILE_NODE*        Fnode;              // Ptr to In-core fnode in file desc entry.
    FFS_FILE_DESCRIPTOR*  Fdesc;              // ptr to file descriptor entry.
-   unsigned long          Sector;             // Sector number.
+   unsigned long          Sector = -1;        // Sector number, -1 until located.
    unsigned long          Offset;             // Offset into current sector.
    unsigned long          RemLen;             // Calc'd rem length in current sector.
+   unsigned long          HoleLength;         // Length of hole file pos is in.
    int                    rc;
    int                    TotalRead = 0;      // Total up amount read to return to caller.
 
@@ -284,17 +460,7 @@ int Jcffs::read( int fd, char* buf, int n )
       return FFS_RC_INVALID_FILE_POSITION;
    }
 
-   FFS_LOCK();
-
-   // Locate position in file by getting which sector we currently are positioned at. If
-   // position is invalid (maybe beyond file), then LocatePosition() will return error code.
-   if( (rc = LocatePosition(Fdesc, Fdesc->Position, &Sector, &SecHead, &Offset)) < 0)
-   {
-      FFS_UNLOCK();
-      return rc;
-   }
-
-   FFS_LOCK();
+   FFS_READ_LOCK();
 
    // Check to see if there are that many bytes left to read from file. If not, adjust
    // requested number of bytes...
@@ -308,6 +474,31 @@ int Jcffs::read( int fd, char* buf, int n )
    // sector...
    while( n )
    {
+      // Locate position in file by getting which sector we currently are positioned at.
+      // If position is invalid, then LocatePosition() will return error code...
+      if( Sector == -1 )
+      {
+         if( (rc = LocatePosition(Fdesc, Fdesc->Position, &Sector, &SecHead, &Offset, &HoleLength)) < 0)
+         {
+            FFS_READ_UNLOCK();
+            return rc;
+         }
+
+         // A hole has no sector behind it and reads as zeros...
+         if( rc > 0 )
+         {
+            RemLen = (n < HoleLength) ? n : HoleLength;
+            memset( buf, 0, RemLen );
+
+            n               -= RemLen;
+            Fdesc->Position += RemLen;
+            TotalRead       += RemLen;
+            buf             += RemLen;
+            Sector           = -1;
+            continue;
+         }
+      }
+
       // Calculate remaining length in this sector...
       RemLen = SecHead.SectorLength - Offset;
 
@@ -317,7 +508,8 @@ int Jcffs::read( int fd, char* buf, int n )
          RemLen = n;                              // Just read what's left in this sector.
       }
 
-      ReadSector(Sector, Offset, buf, RemLen);    // Read what we can from this sector.
+      ReadSector(Sector, Offset, (unsigned char*)buf, RemLen);    // Read what we can from this sector.
+      NoteBankRead(Sector);
 
       n               -= RemLen;                  // Update what is remaining to read.
       Fdesc->Position += RemLen;                  // Update file position.
@@ -330,19 +522,22 @@ int Jcffs::read( int fd, char* buf, int n )
 
       buf             += RemLen;                  // Update buffer pointer.
 
-      // Read next sector header. If we can't, then there is a problem with file system...
-      Sector = SecHead.Next;
-      if((rc = ReadSector(Sector, 0, &SecHead, sizeof(FFS_SECTOR_HEADER))) < 0)
+      // Read next sector header.  If it doesn't carry on right where this one left off
+      // (a hole, or a chain out of file order), locate the position from scratch...
+      Sector = FFS_SUCCESSOR(SecHead);
+      if( Sector == -1 ||
+          ReadSectorHeader(Sector, &SecHead) < 0 ||
+          (SecHead.FileOffset != -1 && SecHead.FileOffset != Fdesc->Position) )
       {
-         FFS_UNLOCK();
-         return rc;
+         Sector = -1;
+         continue;
       }
 
       // Point to where data starts in this sector...
       Offset = SecHead.DataOffset;
    }
 
-   FFS_UNLOCK();
+   FFS_READ_UNLOCK();
 
    return TotalRead;
 }
@@ -360,7 +555,14 @@ int Jcffs::read( int fd, char* buf, int n )
 //
 //    Returns:          None
 //
-//    Notes:
+//    Notes:            Writing past the end of the file (after a seek), or into a hole,
+//                      allocates a sector that starts at the file position.  A gap left
+//                      inside the last sector is programmed to zeros, so it can't be
+//                      written later; gaps past the last sector stay holes.  So does a
+//                      gap before the first write to a new file, which starts the fnode
+//                      sector.
+//
+//                      An existing file that grows gets a new fnode when it is closed.
 //
 //---------------------------------------------------------------------------------------
 int Jcffs::write( int fd, char* buf, int n  )
@@ -369,7 +571,6 @@ int Jcffs::write( int fd, char* buf, int n  )
    FFS_FILE_NODE*        Fnode;              // Ptr to In-core fnode in file desc entry.
    FFS_FILE_DESCRIPTOR*  Fdesc;              // Ptr to file descriptor entry.
    unsigned long          Sector;             // Sector number.
-   unsigned long          NewSector;          // A newly allocated sector.
    unsigned long          Offset;             // Offset into current sector.
    unsigned long          RemLen;             // Calc'd rem length in current sector.
    int                    rc;
@@ -382,45 +583,46 @@ int Jcffs::write( int fd, char* buf, int n  )
       return FFS_RC_INVALID_FILE_DESCRIPTOR;
    }
 
-   FFS_LOCK();
+   FFS_UPDATE_LOCK();
+   BeginWrites();
 
    Fdesc = &(FileDescriptors[fd]);                // Copy ptr for convenience.
    Fnode = &(Fdesc->Fnode);                       // Copy ptr for convenience.
+   IoClass = Fdesc->Class;
 
-   // Is this a new file and first time?  Then we need to allocate the first sector. The
-   // first sector is where the Fnode will live, but not now; when the file is closed.
-   if (Fdesc->FnodeSector == -1)
-   {
-
-       // Calc offset that is beyond sector header and filenode containing filename...
-       Offset = sizeof(FFS_SECTOR_HEADER) + sizeof(FFS_FILE_NODE);
-
-       if( (rc = AllocateSectorWithFilenode( &Sector, &SecHead )) != 0)
-       {
-          FFS_UNLOCK();
-          return rc;
-       }
-
-       // Indicate we need to write out fnode when file closes.
-       Fdesc->WriteFnode  = 1;
-       Fdesc->FnodeSector = Sector;               // And save first sector# where fnode goes.
-   }
-   else
+   // Writing past the end of the file leaves a gap that must read as zeros. The part of
+   // it that is inside the last sector has to be programmed to zeros, since it would
+   // read back erased.  The rest has no sector behind it and is a hole...
+   if( Fdesc->Position > Fnode->FileSize && Fdesc->FnodeSector != -1 && n > 0 )
    {
-      // Locate position in file by getting which sector we currently are positioned at. If
-      // position is invalid (maybe beyond file), then LocatePosition() will return error code.
-      // The nice thing about LocatePosition() is that if the first sector has not been
-      // allocated yet, then he will allocate it. LocatePosition() will return position
-      // to start writing to...
-      if( (rc = LocatePosition(Fdesc, Fdesc->Position, &Sector, &SecHead, &Offset)) < 0)
+      if( LocatePosition( Fdesc, Fnode->FileSize, &Sector, &SecHead, &Offset, &RemLen ) == 0 )
       {
-         FFS_UNLOCK();
-         return rc;
+         RemLen = SecHead.SectorLength - Offset;
+         if( RemLen > Fdesc->Position - Fnode->FileSize )
+         {
+            RemLen = Fdesc->Position - Fnode->FileSize;
+         }
+         IoCause = FFS_WRITE_DATA;
+         ZeroSectorData( Sector, Offset, RemLen );
+         IoCause = FFS_WRITE_METADATA;
       }
    }
 
    while( n )
    {
+      // Find the sector the file position is in. If there isn't one, LocateWritePosition()
+      // allocates it (the first one gets the fnode) and chains it to the file...
+      if( (rc = LocateWritePosition( Fdesc, n, &Sector, &SecHead, &Offset )) != 0 )
+      {
+         EndWrites();
+         if( !Fdesc->WriteFnode )
+         {
+            ForgetFile( Fnode->Filename );
+         }
+         FFS_UPDATE_UNLOCK();
+         return rc;
+      }
+
       // Calculate remaining length in this sector...
       RemLen = SecHead.SectorLength - Offset;
 
@@ -431,775 +633,5885 @@ int Jcffs::write( int fd, char* buf, int n  )
       }
 
       // Write out to sector...
-      WriteSector(Sector, Offset, buf, RemLen);    // Write what we can into this sector.
+      IoCause = FFS_WRITE_DATA;
+      WriteSector(Sector, Offset, (unsigned char*)buf, RemLen);    // Write what we can into this sector.
+      IoCause = FFS_WRITE_METADATA;
 
       n               -= RemLen;                  // Update what is remaining to read.
       Fdesc->Position += RemLen;                  // Update file position.
       TotalWritten    += RemLen;                  // Update total written so far.
+      buf             += RemLen;                  // Update buffer pointer.
 
-      // Update total file size in Fnode...
+      // Update total file size in Fnode.  An existing file's fnode has to be written
+      // again for it...
       if( Fdesc->Position > Fnode->FileSize )
       {
          Fnode->FileSize = Fdesc->Position;
+         if( !Fdesc->WriteFnode )
+         {
+            Fdesc->Grown = 1;
+         }
       }
+   }
 
-      // Are we done writing?
-      if( n == 0 )
-      {
-         break;                                   // yes, we're done writing.
-      }
-
-      buf             += RemLen;                  // Update buffer pointer.
-
-      // Allocate another sector. If we can't, then we are out of room. AllocateSector()
-      // allocates a free sector and writes out an updated sector header, which is also
-      // returned.
-      if((rc = AllocateSector( &NewSector, &SecHead )) != 0)
-      {
-         FFS_UNLOCK();
-         return rc;
-      }
+   rc = EndWrites();
 
-      // Chain new sector to previous one.  When a Sector is allocated, it's Next chain
-      // pointer is 0xFFFFFFFF so that we can update it later (like right now)...
-      WriteSector( Sector,
-                   ((char*)&(SecHead.Next) - (char*)&SecHead),   // Offset to Next field.
-                   &NewSector,                   // Update Next field with new sector nbr.
-                   sizeof(NewSector));
+   NoteLogical( TotalWritten );
 
-      // For every sector after the first one, data starts right after header...
-      Offset = sizeof(FFS_SECTOR_HEADER);
-      // Now make new sector the current sector...
-      Sector = NewSector;
+   // A new file isn't seen until it is closed, but an existing one has changed...
+   if( !Fdesc->WriteFnode )
+   {
+      ForgetFile( Fnode->Filename );
    }
 
-   FFS_UNLOCK();
+   FFS_UPDATE_UNLOCK();
 
-   return TotalWritten;
+   return ( rc < 0 ) ? rc : TotalWritten;
 }
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::NextDirectory
+//    Function Name:    Jcffs::Seek
 //
-//    Purpose:          Return next Fnode on each call.
+//    Purpose:          Move the file position.
 //
-//    Inputs:           fd  - File descriptor number.
-//                      buf - Pointer to buffer to write from.
-//                      n   - Length of buffer, maximum size to write.
+//    Inputs:           fd     - File descriptor number.
+//                      Offset - Offset relative to Whence.
+//                      Whence - FFS_SEEK_SET, FFS_SEEK_CUR or FFS_SEEK_END.
 //
-//    Returns:          0   - Operation was successful. An fnode was returned.
-//                      1   - Operation complete, no more files.
-//                      <0  - Jcffs return code.
+//    Returns:          New position, or Jcffs error code.
 //
-//    Notes:
+//    Notes:            Only files open for writing may be positioned past the end.
+//                      Nothing is allocated until data is written there.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::NextDirectory( unsigned long* Handle, FFS_FILE_NODE* Fnode  )
+long Jcffs::Seek( int fd, long Offset, int Whence )
 {
-   FFS_SECTOR_HEADER     SecHead;            // Current sector file pos is in.
-   unsigned long          Sector;             // Sector number.
-
+   FFS_FILE_DESCRIPTOR*  Fdesc;              // Ptr to file descriptor entry.
+   long                   Position;           // New position.
 
-   if( initializationComplete == false )
+   // Sanity check...
+   if( fd < 0 || fd >= FFS_MAX_FILE_DESCRIPTORS || !FileDescriptors[fd].InUse )
    {
-      Initialize();
+      return FFS_RC_INVALID_FILE_DESCRIPTOR;
    }
 
-   FFS_LOCK();
-
-   for( Sector = *Handle; ValidSector(Sector); Sector++ )
-   {
-      ReadSector( Sector, 0, &SecHead, sizeof(FFS_SECTOR_HEADER) );
-
-      if( SecHead.Status == FFS_SECTOR_HEADER_INUSE_FILENODE )
-      {
-         // Read Fnode...
-         ReadSector(  Sector,
-                      sizeof(FFS_SECTOR_HEADER),
-                      Fnode,
-                      sizeof(FFS_FILE_NODE) );
+   FFS_READ_LOCK();
 
-         *Handle = Sector + 1;
+   Fdesc = &(FileDescriptors[fd]);                // Copy ptr for convenience.
 
-         // Check to see if this file is currently being created and there
-         // isn't a displayable name...
-         if( Fnode->Filename[0] == 0xff && Fnode->FileSize == -1)
-         {
-            strcpy(Fnode->Filename, "[New File]");
-         }
+   switch( Whence )
+   {
+      case FFS_SEEK_SET:  Position = Offset;                                 break;
+      case FFS_SEEK_CUR:  Position = (long)Fdesc->Position + Offset;         break;
+      case FFS_SEEK_END:  Position = (long)Fdesc->Fnode.FileSize + Offset;   break;
+      default:            Position = -1;                                     break;
+   }
 
-         return 0;
-      }
+   if( Position < 0 ||
+       ((unsigned long)Position > Fdesc->Fnode.FileSize &&
+        !(Fdesc->Flags & (FFS_WRONLY | FFS_RDWR | FFS_CREATE))) )
+   {
+      FFS_READ_UNLOCK();
+      return FFS_RC_INVALID_FILE_POSITION;
    }
 
-   FFS_UNLOCK();
+   Fdesc->Position = Position;
 
-   return 1;          // No more files.
+   FFS_READ_UNLOCK();
+
+   return Position;
 }
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::Erase
+//    Function Name:    Jcffs::PunchHole
 //
-//    Purpose:          Erase a file.
+//    Purpose:          Release the flash behind a range of a file.
 //
-//    Inputs:           filename - Name of file to erase.
+//    Inputs:           fd     - File descriptor number.
+//                      Offset - Start of range.
+//                      Length - Length of range.
 //
-//    Returns:          0 - If operation was successful.
-//                      <0 - Returns Jcffs return code.
+//    Returns:          0 or Jcffs error code.
 //
-//    Notes:
+//    Notes:            A run of sectors wholly inside the range is unlinked by
+//                      programming the Bypass field of the sector before it, and then
+//                      freed.  Bypass can only be programmed once, so that sector must
+//                      not have been bypassed already.  The fnode sector, the last
+//                      sector of the chain, older format sectors, and the ends of the
+//                      range that only partly cover a sector stay allocated and have
+//                      their data programmed to zeros instead.  The file size does not
+//                      change.  Unlinking sectors drops the file's index, and its skips
+//                      may point into the run, so no descriptor open on the file
+//                      follows them any more.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::Erase( char* filename  )
+int Jcffs::PunchHole( int fd, unsigned long Offset, unsigned long Length )
 {
-   FFS_FILE_NODE         Fnode;              // File node returned by LocateFileNode().
-   unsigned long          Sector;             // Sector number.
+   FFS_SECTOR_HEADER     SecHead;            // Current sector header.
+   FFS_FILE_DESCRIPTOR*  Fdesc;              // Ptr to file descriptor entry.
+   unsigned long          Sector;             // Current sector.
+   unsigned long          Successor;          // Sector after the current one.
+   unsigned long          Start = 0;          // File offset of current sector's data.
+   unsigned long          DataLength;         // Data length of current sector.
+   unsigned long          End;                // End of range.
+   unsigned long          From, To;           // Part of range in current sector.
+   unsigned long          Pred = -1;          // Sector before current one.
+   unsigned long          PredBypass = 0;     // And its Bypass field.
+   int                    PredVersion = 0;    // And its format.
+   unsigned long          RunPred = -1;       // Sector before a run to release.
+   int                    RunPredVersion = 0;
+   unsigned long          RunFirst = -1;      // First sector of run to release.
+   unsigned long          Walked = 0;         // Loop guard.
+   int                    rc;
 
+   // Sanity check...
+   if( fd < 0 || fd >= FFS_MAX_FILE_DESCRIPTORS || !FileDescriptors[fd].InUse )
+   {
+      return FFS_RC_INVALID_FILE_DESCRIPTOR;
+   }
 
-   if( initializationComplete == false )
+   FFS_UPDATE_LOCK();
+
+   Fdesc = &(FileDescriptors[fd]);                // Copy ptr for convenience.
+   IoClass = Fdesc->Class;
+
+   if( !(Fdesc->Flags & (FFS_WRONLY | FFS_RDWR | FFS_CREATE)) )
    {
-      Initialize();
+      FFS_UPDATE_UNLOCK();
+      return FFS_RC_INVALID_FILE_DESCRIPTOR;
    }
 
-   FFS_LOCK();
+   // Only what is inside the file can be punched...
+   End = Offset + Length;
+   if( End < Offset || End > Fdesc->Fnode.FileSize )
+   {
+      End = Fdesc->Fnode.FileSize;
+   }
 
-   // See if file exists. Find Fnode on flash and copy into memory.
-   // LocateFileNode() will return with sector==-1 if file is not found...
-   LocateFileNode(filename, &Fnode, &Sector);
+   Sector = Fdesc->FnodeSector;
 
-   // See if file was found. If not, return.
-   if(Sector == -1)
+   while( Sector != -1 )
    {
-      FFS_UNLOCK();
-      return FFS_RC_FILE_NOT_FOUND;
+      if( (rc = ReadSectorHeader( Sector, &SecHead )) < 0 || ++Walked > TotalSectors )
+      {
+         ForgetFile( Fdesc->Fnode.Filename );
+         FFS_UPDATE_UNLOCK();
+         return (rc < 0) ? rc : FFS_RC_INVALID_SECTOR_NUMBER;
+      }
+
+      if( SecHead.FileOffset != -1 )
+      {
+         Start = SecHead.FileOffset;
+      }
+
+      // In an ordered chain, nothing further on is in the range...
+      if( Start >= End && !(Fdesc->Fnode.Flags & FFS_FNODE_UNORDERED) )
+      {
+         break;
+      }
+
+      DataLength = SecHead.SectorLength - SecHead.DataOffset;
+      Successor  = FFS_SUCCESSOR(SecHead);
+
+      From = (Start > Offset) ? Start : Offset;
+      To   = (Start + DataLength < End) ? Start + DataLength : End;
+
+      if( From == Start && To == Start + DataLength &&
+          Sector != Fdesc->FnodeSector && Successor != -1 &&
+          SecHead.Version >= FFS_FILE_SYSTEM_VERSION_V3 &&
+          (RunFirst != -1 || (PredVersion >= FFS_FILE_SYSTEM_VERSION_V3 && PredBypass == -1)) )
+      {
+         // Whole sector is in the range and can be unlinked. Start or grow a run...
+         if( RunFirst == -1 )
+         {
+            RunFirst       = Sector;
+            RunPred        = Pred;
+            RunPredVersion = PredVersion;
+         }
+      }
+      else
+      {
+         // Unlink the run that ends here...
+         if( RunFirst != -1 )
+         {
+            if( (rc = UnlinkRun( Fdesc, RunPred, RunPredVersion, RunFirst, Sector )) < 0 )
+            {
+               ForgetFile( Fdesc->Fnode.Filename );
+               FFS_UPDATE_UNLOCK();
+               return rc;
+            }
+            RunFirst = -1;
+         }
+
+         // Whatever of the range is in this sector now reads as zeros...
+         if( From < To )
+         {
+            ZeroSectorData( Sector, SecHead.DataOffset + (From - Start), To - From );
+         }
+      }
+
+      Pred        = Sector;
+      PredBypass  = SecHead.Bypass;
+      PredVersion = SecHead.Version;
+      Start      += DataLength;
+      Sector      = Successor;
    }
 
-   // Erase file...
-   FreeSectors(Sector);
+   // The range ended right after a run...
+   rc = 0;
+   if( RunFirst != -1 )
+   {
+      rc = UnlinkRun( Fdesc, RunPred, RunPredVersion, RunFirst, Sector );
+   }
 
-   FFS_UNLOCK();
+   ForgetFile( Fdesc->Fnode.Filename );
 
-   return 0;
+   FFS_UPDATE_UNLOCK();
+
+   return (rc < 0) ? rc : 0;
 }
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::Rename
+//    Function Name:    Jcffs::ImportBatch
 //
-//    Purpose:          Rename a file.
+//    Purpose:          Create a set of files in one operation.
 //
-//    Inputs:           filename     - Name of file to rename.
-//                      new_filename - new file name.
+//    Inputs:           Entries - The files to create.
+//                      Count   - Number of entries.
 //
-//    Returns:          0 - Operation successful, file renamed.
-//                      <0 - Jcffs error code.
+//    Returns:          Number of files created, or Jcffs error code if none were.
 //
-//    Notes:            Currently, this feature assumes that all sectors are the same size.
+//    Notes:            Opening, writing and closing each file searches the volume for
+//                      its name and for every sector it allocates.  Here the volume is
+//                      searched once: free sectors are marked in the claimed plane of
+//                      the check map (Check isn't using it, we hold the lock) and any
+//                      existing files with the same names are found on the way.  Every
+//                      sector is then planned before anything is written, so each
+//                      header goes out once with its Next already in it.
 //
-//                      To perform this feature, we will allocate a new fnode sector,
-//                      copy data to new sector, erase old file, save new fnode.
+//                      All of the data is written before any fnode.  A file only exists
+//                      once its fnode is programmed, so if power is lost part way thru,
+//                      Check() frees the data of the files that didn't get one and the
+//                      old files are still there.  Old files are deleted last.
 //
+//                      A file can't be empty (Check() frees an fnode of size 0), so an
+//                      entry of size 0 fails with FFS_RC_INVALID_ARGUMENT and an existing
+//                      file of its name is left alone.  Names in a batch must differ; a
+//                      repeated name fails with FFS_RC_NEW_NAME_EXISTS.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::Rename( char* filename, char* new_filename )
+int Jcffs::ImportBatch( FFS_IMPORT_ENTRY* Entries, int Count )
 {
-   FFS_FILE_NODE         Fnode;              // File node returned by LocateFileNode().
-   FFS_SECTOR_HEADER     SecHead;
-   unsigned long          Sector;             // Sector number.
-   unsigned long          NewSector;          // New sector number.
-   unsigned long          NextSector;         // Saved sector chain pointer.
-   unsigned char          Buffer[100];
-   unsigned long          Length;
-   int                    rc;
-   unsigned long          Offset;
-   int                    n;
+   int   i;
+   int   rc;
 
    if( initializationComplete == false )
    {
       Initialize();
    }
 
-   FFS_LOCK();
-
-   // See if file exists. Find Fnode on flash and copy into memory.
-   // LocateFileNode() will return with sector==-1 if file is not found...
-   LocateFileNode(filename, &Fnode, &Sector);
-
-   // See if file was found. If not, return.
-   if(Sector == -1)
+   // The plan is made in the check map...
+   if( CheckMap == NULL )
    {
-      FFS_UNLOCK();
-      return FFS_RC_FILE_NOT_FOUND;
+      return FFS_RC_OUT_OF_MEMORY;
    }
 
-   // Now, make sure new filename doesn't exist...
-   LocateFileNode(new_filename, &Fnode, &NewSector);
-
-   // See if file was found. If it was, return.
-   if(NewSector != -1)
+   for( i = 0; i < Count; i++ )
    {
-      FFS_UNLOCK();
-      return FFS_RC_NEW_NAME_EXISTS;
+      Entries[i].CopyFrom = -1;
    }
 
-   // Read Sector header...
-   ReadSector( Sector, 0, &SecHead, sizeof(FFS_SECTOR_HEADER));
+   FFS_UPDATE_LOCK();
 
-   Length = SecHead.SectorLength - SecHead.DataOffset;
-   NextSector = SecHead.Next;
+   rc = ImportEntries( Entries, Count );
 
-   // Allocate new fnode sector...
-   if( (rc = AllocateSectorWithFilenode( &NewSector, &SecHead )) != 0)
-   {
-      FFS_UNLOCK();
-      return rc;
-   }
+   FFS_UPDATE_UNLOCK();
 
-   // Check to make sector is same size...
-   if( Length != (SecHead.SectorLength - SecHead.DataOffset) )
-   {
-      FreeSectors( NewSector );
-      FFS_UNLOCK();
-      return FFS_RC_OUT_OF_SPACE;
-   }
+   return rc;
+}
 
-   // Now, copy data from old fnode sector to new fnode sector...
-   Offset = SecHead.DataOffset;
-   while( Length )
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ImportEntries
+//
+//    Purpose:          Create a set of files, with the update lock held.
+//
+//    Inputs:           Entries - The files to create.
+//                      Count   - Number of entries.
+//
+//    Returns:          Number of files created, or Jcffs error code if none were.
+//
+//    Notes:            See ImportBatch().  Copy() comes in here too, with an entry
+//                      whose data is read from the file it copies.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ImportEntries( FFS_IMPORT_ENTRY* Entries, int Count )
+{
+   FFS_SECTOR_HEADER    SecHead;
+   FFS_FLASH_SECTION*   Section;
+   FFS_FILE_NODE        Fnode;
+   FFS_FILE_NODE        NewFnode;
+   FFS_IMPORT_ENTRY*    Entry;
+   char                  CompName[FFS_MAX_FILENAME_LENGTH + 1];
+   char                  FnodeName[FFS_MAX_FILENAME_LENGTH + 1];
+   unsigned long         Sector;
+   unsigned long         RelSector;
+   unsigned long         ProbeHash;
+   unsigned long         Remaining;
+   unsigned long         FnodeSize;
+   unsigned long         DataLength;
+   int                   HaveFnode;
+   int                   HasHash;
+   int                   Imported = 0;
+   int                   Flushed;
+   int                   i, j;
+   int                   rc = 0;
+
+   // Sectors of files being deleted can only be planned once they are free...
+   ReclaimDeleted( -1 );
+
+   // Hash each name the way LocateFileNode() does and check for repeats...
+   for( i = 0; i < Count; i++ )
    {
-      n = sizeof(Buffer);
-      if( Length < n )
+      Entry = &Entries[i];
+
+      ImportFileNode( Entry, &NewFnode );
+      strcpy( CompName, NewFnode.Filename );
+      StringToUpperCase( CompName );
+
+      Entry->NameHash       = FFSHashName( CompName );
+      Entry->FnodeSector    = -1;
+      Entry->Written        = 0;
+      Entry->OldFnodeSector = -1;
+      Entry->Count          = 0;
+      Entry->Result         = 0;
+
+      if( Entry->Size == 0 )
       {
-         n = Length;
+         Entry->Result = FFS_RC_INVALID_ARGUMENT;
+         continue;
+      }
+
+      for( j = 0; j < i; j++ )
+      {
+         if( Entries[j].NameHash == Entry->NameHash )
+         {
+            ImportFileNode( &Entries[j], &Fnode );
+            StringToUpperCase( Fnode.Filename );
+            if( strcmp( Fnode.Filename, CompName ) == 0 )
+            {
+               Entry->Result = FFS_RC_NEW_NAME_EXISTS;
+               break;
+            }
+         }
       }
-      ReadSector( Sector, Offset, Buffer, n);
-      WriteSector( NewSector, Offset, Buffer, n);
-      Length -= n;
-      Offset += n;
    }
 
-   // OK, now update fnode with new name...
-   if( strlen(new_filename ) >= sizeof(Fnode.Filename) )
+   // One pass thru the volume finds the free sectors and the existing files.  A
+   // sector without our key is taken as free, as FindFreeSector() does...
+   memset( &CHECK_MAP_WORD( CHECK_PLANE_CLAIMED, 0 ), 0, CheckMapWords * sizeof(unsigned long) );
+
+   for( Sector = 0; Sector < TotalSectors; Sector++ )
    {
-      memcpy(Fnode.Filename, new_filename, sizeof(Fnode.Filename) - 1);
-      Fnode.Filename[ sizeof(Fnode.Filename) - 1 ] = 0;
+      HasHash = ReadNameProbe( Sector, &SecHead, &ProbeHash );
+
+      if( SecHead.Key != FFS_SECTOR_HEADER_KEY ||
+          SecHead.Status == FFS_SECTOR_HEADER_FREE ||
+          SecHead.Status == FFS_SECTOR_HEADER_FREE_DIRTY )
+      {
+         CHECK_MAP_SET( CHECK_PLANE_CLAIMED, Sector );
+         continue;
+      }
+
+      if( SecHead.Status != FFS_SECTOR_HEADER_INUSE_FILENODE )
+      {
+         continue;
+      }
+
+      HaveFnode = 0;
+
+      for( i = 0; i < Count; i++ )
+      {
+         Entry = &Entries[i];
+
+         // The first file found with a name is the one open() would find...
+         if( Entry->Result != 0 || Entry->OldFnodeSector != -1 ||
+             ( HasHash && ProbeHash != Entry->NameHash ) )
+         {
+            continue;
+         }
+
+         if( !HaveFnode )
+         {
+            ReadFileNode( Sector, &SecHead, &Fnode );
+            strcpy( FnodeName, Fnode.Filename );
+            StringToUpperCase( FnodeName );
+            HaveFnode = 1;
+         }
+
+         ImportFileNode( Entry, &NewFnode );
+         StringToUpperCase( NewFnode.Filename );
+
+         if( strcmp( FnodeName, NewFnode.Filename ) == 0 )
+         {
+            Entry->OldFnodeSector = Sector;
+            Entry->Count          = Fnode.Count + 1;
+         }
+      }
    }
-   else
+
+   // Plan: make sure the free sectors, taken in order, hold every file...
+   Sector = NextMapSector( CHECK_PLANE_CLAIMED, 0 );
+
+   for( i = 0; i < Count; i++ )
    {
-      strcpy(Fnode.Filename, new_filename);
+      Entry = &Entries[i];
+      if( Entry->Result != 0 )
+      {
+         continue;
+      }
+
+      ImportFileNode( Entry, &NewFnode );
+      FnodeSize = FFSFileNodeSize( FFS_FILE_SYSTEM_VERSION, &NewFnode );
+
+      for( Remaining = Entry->Size; Remaining; )
+      {
+         if( Sector >= TotalSectors || !GetFlashSectionEntry( Sector, &Section, &RelSector ) )
+         {
+            // Nothing has been written yet, so fail the whole batch...
+            for( j = i; j < Count; j++ )
+            {
+               if( Entries[j].Result == 0 )
+               {
+                  Entries[j].Result = FFS_RC_OUT_OF_SPACE;
+               }
+            }
+            return FFS_RC_OUT_OF_SPACE;
+         }
+
+         DataLength = Section->SectorSize - FFSHeaderSize( FFS_FILE_SYSTEM_VERSION ) -
+                      ( Remaining == Entry->Size ? FnodeSize : 0 );
+         Remaining -= ( Remaining < DataLength ) ? Remaining : DataLength;
+         Sector     = NextMapSector( CHECK_PLANE_CLAIMED, Sector + 1 );
+      }
    }
 
-   // Write new Fnode back out...
-   WriteSector( NewSector, sizeof(FFS_SECTOR_HEADER), &Fnode, sizeof(FFS_FILE_NODE));
+   // Stream the data.  The plan is replayed, so each file gets the sectors above...
+   Sector = NextMapSector( CHECK_PLANE_CLAIMED, 0 );
 
-   // Update chain pointer (if not -1)...
-   if( NextSector != -1 )
+   // Sectors are taken without going thru the collector's counts...
+   GcCountsValid = false;
+
+   BeginWrites();
+
+   for( i = 0, rc = 0; i < Count && rc >= 0; i++ )
    {
-      WriteSector( NewSector,
-                   ((char*)&(SecHead.Next) - (char*)&SecHead),   // Offset to Next field.
-                   &NextSector,                   // Update Next field with new sector nbr.
-                   sizeof(NextSector));
+      Entry = &Entries[i];
+      if( Entry->Result != 0 )
+      {
+         continue;
+      }
+
+      IoClass = ClassOf( Entry->Filename );
+
+      if( (rc = ImportFile( Entry, &Sector )) >= 0 )
+      {
+         NoteLogical( Entry->Size );
+      }
    }
 
-   // Erase old fnode. Change status to FREE-DIRTY and then rewrite...
-   SecHead.Status = FFS_SECTOR_HEADER_FREE_DIRTY;  // Mark this sector as free but needing erase.
-   WriteSector( Sector, (char*)&SecHead.Version - (char*)&SecHead, &(SecHead.Version), 4);
+   // The last of the data goes out here, and may fail too...
+   Flushed = EndWrites();
+   if( rc >= 0 )
+   {
+      rc = Flushed;
+   }
 
-   FFS_UNLOCK();
+   if( rc < 0 )
+   {
+      // Give back what this batch has written so far.  None of it is there...
+      for( j = 0; j < Count; j++ )
+      {
+         DiscardImport( &Entries[j] );
+         if( Entries[j].Result == 0 )
+         {
+            Entries[j].Result = rc;
+         }
+      }
+      return rc;
+   }
 
-   return 0;
+   // Commit: program all of the fnodes.  A file whose fnode doesn't go out isn't there,
+   // so it gives its sectors back and the file it would have replaced stays...
+   for( i = 0, rc = 0; i < Count; i++ )
+   {
+      Entry = &Entries[i];
+      if( Entry->Result == 0 && Entry->FnodeSector != -1 )
+      {
+         IoClass = ClassOf( Entry->Filename );
+         ImportFileNode( Entry, &NewFnode );
+         if( (Entry->Result = WriteSkips( Entry->FnodeSector )) >= 0 &&
+             (Entry->Result = WriteFileNode( Entry->FnodeSector, FFS_FILE_SYSTEM_VERSION, &NewFnode )) >= 0 )
+         {
+            Entry->Result = 0;
+         }
+         else
+         {
+            rc = Entry->Result;
+            DiscardImport( Entry );
+         }
+      }
+   }
+
+   // ...and only then delete the files they replace...
+   for( i = 0; i < Count; i++ )
+   {
+      Entry = &Entries[i];
+      if( Entry->Result == 0 )
+      {
+         if( Entry->OldFnodeSector != -1 )
+         {
+            IoClass = ClassOf( Entry->Filename );
+            DeleteFile( Entry->OldFnodeSector );
+         }
+         Imported++;
+         ForgetFile( Entry->Filename );
+      }
+   }
+
+   return ( Imported == 0 && rc < 0 ) ? rc : Imported;
 }
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::Space
+//    Function Name:    Jcffs::DiscardImport
 //
-//    Purpose:          Get information about used and free space or clear all space.
+//    Purpose:          Give back the sectors an import entry has written.
 //
-//    Inputs:           Option     - 0 - Return number of free bytes.
-//                                   1 - Return the number of free Sectors.
-//                                   2 - Return the total number of bytes in file system.
-//                                   3 - Return the total number of Sectors in file system.
-//                                   128 - Clear all space (used and unused).
+//    Inputs:           Entry - The import entry.
 //
+//    Returns:          Nothing.
 //
-//    Returns:          Total Free size in bytes.
+//    Notes:            Each header went out with the next planned sector already in its
+//                      Next, whether or not that sector was written after it, so the
+//                      chain isn't followed.  The plan is replayed instead, for just
+//                      the sectors written, see ImportFile().
 //
-//    Notes:            Currently, this feature assumes that all sectors are the same size.
+//---------------------------------------------------------------------------------------
+void Jcffs::DiscardImport( FFS_IMPORT_ENTRY* Entry )
+{
+   unsigned long   Sector = Entry->FnodeSector;
+   unsigned long   i;
+
+   for( i = 0; i < Entry->Written && Sector < TotalSectors; i++ )
+   {
+      WriteSectorStatus( Sector, FFS_FILE_SYSTEM_VERSION, FFS_SECTOR_HEADER_FREE_DIRTY );
+      Sector = NextMapSector( CHECK_PLANE_CLAIMED, Sector + 1 );
+   }
+
+   Entry->FnodeSector = -1;
+   Entry->Written     = 0;
+}
+
+
+//---------------------------------------------------------------------------------------
 //
-//                      To perform this feature, we will allocate a new fnode sector,
-//                      copy data to new sector, erase old file, save new fnode.
+//    Function Name:    Jcffs::ImportFileNode
+//
+//    Purpose:          Build the fnode for an import entry.
+//
+//    Inputs:           Entry - The import entry.
+//
+//    Outputs:          Fnode - Its file node.
 //
+//    Returns:          Nothing.
+//
+//    Notes:            The name is truncated the way open() truncates it.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::Space( int Option )
+void Jcffs::ImportFileNode( FFS_IMPORT_ENTRY* Entry, FFS_FILE_NODE* Fnode )
+{
+   strncpy( Fnode->Filename, Entry->Filename, FFS_MAX_FILENAME_LENGTH );
+   Fnode->Filename[FFS_MAX_FILENAME_LENGTH] = 0;
+
+   Fnode->NameHash    = FFSHashName( Fnode->Filename );
+   Fnode->FileSize    = Entry->Size;
+   Fnode->DataTime    = -1;
+   Fnode->Count       = Entry->Count;
+   Fnode->Permissions = Entry->Permissions;
+   Fnode->Flags       = 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ImportFile
+//
+//    Purpose:          Write one imported file's sectors.
+//
+//    Inputs:           Entry  - The import entry.
+//                      Sector - First free sector planned for it.
+//
+//    Outputs:          Sector - First free sector after the ones it used.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            Each sector is erased (unless the collector already has) and
+//                      its header, with the next planned sector already in Next, is
+//                      written in one go.  The fnode is
+//                      left for the commit.  Sectors are full length so the file can
+//                      be appended to later.  The entry counts the headers written, so
+//                      a failed batch can give back exactly those.
+//
+//                      A copy follows the file it copies along from sector to sector,
+//                      the way read() does, rather than locating each piece.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ImportFile( FFS_IMPORT_ENTRY* Entry, unsigned long* Sector )
 {
    FFS_SECTOR_HEADER     SecHead;
+   FFS_SECTOR_HEADER     FromHead;
    FFS_FLASH_SECTION*    Section;
-   unsigned long          Sector;
+   FFS_FILE_NODE         Fnode;
+   unsigned char          Buffer[256];
    unsigned long          RelSector;
-   unsigned long          TotalSize = 0;
+   unsigned long          FromSector = -1;       // Where a copy has got to in its file.
+   unsigned long          FromOffset = 0;
+   unsigned long          FileOffset = 0;
+   unsigned long          DataLength;
+   unsigned long          NextSector;
+   unsigned long          Chunk;
+   unsigned long          Done;
+   bool                   Clean;
+   int                    rc;
 
+   ImportFileNode( Entry, &Fnode );
 
-   if( initializationComplete == false )
+   while( FileOffset < Entry->Size )
    {
-      Initialize();
-   }
+      GetFlashSectionEntry( *Sector, &Section, &RelSector );
+      ReadSectorHeader( *Sector, &SecHead );
 
-   FFS_LOCK();
+      // A clean sector was erased by the collector, which counted the erase...
+      Clean = FFS_SECTOR_CLEAN(SecHead);
 
-   if( Option == 128 )
-   {
-      // Erase all sectors in flash file system...
-      for( Sector = 0; GetFlashSectionEntry( Sector, &Section, &RelSector ); Sector++ )
+      SecHead.Key            = FFS_SECTOR_HEADER_KEY;
+      if( !Clean )
       {
-         EraseSector( Sector );
-         TotalSize += (Section->SectorSize - sizeof(FFS_SECTOR_HEADER));
+         SecHead.EraseCount++;
       }
-   } else if( Option >= 0 && Option <= 3 )
-   {
-      // Go thru all sectors and tally space depending on option...
-      for( Sector = 0; GetFlashSectionEntry( Sector, &Section, &RelSector ); Sector++ )
+      SecHead.Version        = FFS_FILE_SYSTEM_VERSION;
+      SecHead.Status         = FFS_SECTOR_HEADER_INUSE;
+      SecHead.SectorChecksum = 0xffff;
+      SecHead.SectorLength   = Section->SectorSize;
+      SecHead.DataOffset     = FFSHeaderSize( FFS_FILE_SYSTEM_VERSION );
+      SecHead.FileOffset     = FileOffset;
+      SecHead.Bypass         = -1;
+      SecHead.Skip           = -1;
+
+      // The first sector is where the fnode will go...
+      if( FileOffset == 0 )
       {
-         ReadSector(Sector, 0, &SecHead, sizeof(FFS_SECTOR_HEADER));
+         SecHead.Status      = FFS_SECTOR_HEADER_INUSE_FILENODE;
+         SecHead.DataOffset += FFSFileNodeSize( FFS_FILE_SYSTEM_VERSION, &Fnode );
+         Entry->FnodeSector  = *Sector;
+      }
 
-         if( Option == 2                        ||          // Tally all Bytes
-             Option == 3                        ||          // Tally all
-             SecHead.Status == FFS_SECTOR_HEADER_FREE ||
-             SecHead.Status == FFS_SECTOR_HEADER_FREE_DIRTY )
+      DataLength = SecHead.SectorLength - SecHead.DataOffset;
+      if( DataLength > Entry->Size - FileOffset )
+      {
+         DataLength = Entry->Size - FileOffset;
+      }
+
+      NextSector   = NextMapSector( CHECK_PLANE_CLAIMED, *Sector + 1 );
+      SecHead.Next = ( FileOffset + DataLength < Entry->Size ) ? NextSector : -1;
+
+      // The erase sends the queued programs out first, so it reports their failure too...
+      if( !Clean && (rc = EraseSector( *Sector )) < 0 )
+      {
+         return rc;
+      }
+      if( (rc = WriteSectorHeader( *Sector, &SecHead )) < 0 )
+      {
+         return rc;
+      }
+      Entry->Written++;
+
+      IoCause = FFS_WRITE_DATA;
+
+      if( Entry->CopyFrom >= 0 )
+      {
+         rc = CopyData( &FileDescriptors[Entry->CopyFrom], FileOffset,
+                        *Sector, SecHead.DataOffset, DataLength,
+                        &FromSector, &FromHead, &FromOffset );
+      }
+      else if( Entry->Buffer )
+      {
+         rc = WriteSector( *Sector,
+                           SecHead.DataOffset,
+                           (unsigned char*)Entry->Buffer + FileOffset,
+                           DataLength );
+      }
+      else
+      {
+         for( Done = 0, rc = 0; Done < DataLength && rc >= 0; Done += Chunk )
          {
-            if(Option == 0 || Option == 2)
-            {
-               TotalSize += (Section->SectorSize - sizeof(FFS_SECTOR_HEADER));
-            }
-            else
+            Chunk = ( DataLength - Done < sizeof(Buffer) ) ? DataLength - Done : sizeof(Buffer);
+
+            if( Entry->Read( Entry->Context, FileOffset + Done, Buffer, Chunk ) != (int)Chunk )
             {
-               TotalSize += 1;   // Just count sectors.
+               rc = FFS_RC_IMPORT_READ_FAILED;
+               break;
             }
 
+            rc = WriteSector( *Sector, SecHead.DataOffset + Done, Buffer, Chunk );
          }
       }
-   }
 
-   FFS_UNLOCK();
+      IoCause = FFS_WRITE_METADATA;
 
-   return TotalSize;
+      if( rc < 0 )
+      {
+         return rc;
+      }
+
+      FileOffset += DataLength;
+      *Sector     = NextSector;
+   }
+
+   return 0;
 }
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::Check
+//    Function Name:    Jcffs::CopyData
 //
-//    Purpose:          Check and fix file system.
+//    Purpose:          Copy part of a file into a sector of its copy.
 //
-//    Inputs:           None
+//    Inputs:           Fdesc      - The file being copied.
+//                      FileOffset - Where the part starts in it.
+//                      Sector     - Sector of the copy.
+//                      Offset     - Where the part goes in it.
+//                      Length     - Length of the part.
+//                      FromSector - Sector of the file FileOffset is in, or -1 to
+//                                   locate it.
+//                      FromHead   - Its header.
+//                      FromOffset - Where FileOffset is in it.
 //
+//    Outputs:          FromSector, FromHead, FromOffset - Where the part ends, for
+//                                   the next call.
 //
-//    Returns:          Total count of sectors fixed.
+//    Returns:          0 or Jcffs error code.
 //
-//    Notes:
+//    Notes:            The next sector of the file is taken while it carries on right
+//                      where the last one left off, as in read().  A hole in the file
+//                      is programmed as zeros, which is what it reads as.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::Check( void )
+int Jcffs::CopyData( FFS_FILE_DESCRIPTOR* Fdesc,
+                    unsigned long        FileOffset,
+                    unsigned long        Sector,
+                    unsigned long        Offset,
+                    unsigned long        Length,
+                    unsigned long*       FromSector,
+                    FFS_SECTOR_HEADER*   FromHead,
+                    unsigned long*       FromOffset )
 {
-   int                   TotalFixedSectors = 0;
-   unsigned long         Sector;
-   unsigned long         DeleteSector;
-   unsigned long         NextSector;
-   FFS_SECTOR_HEADER    SecHeader;
-   FFS_FLASH_SECTION*   Section;
-   FFS_FILE_NODE        Fnode;
-   FFS_FILE_NODE        NextFnode;
-
+   unsigned long          HoleLength;
+   unsigned long          Chunk;
+   int                    rc;
 
-   if( initializationComplete == false )
+   while( Length )
    {
-      Initialize();
-   }
-
-   FFS_LOCK();
+      if( *FromSector == -1 )
+      {
+         if( (rc = LocatePosition( Fdesc, FileOffset, FromSector, FromHead, FromOffset, &HoleLength )) < 0 )
+         {
+            return rc;
+         }
 
-   TotalCrossChain = 0;
-   ErrorSectorCount = 0;
+         if( rc > 0 )
+         {
+            Chunk = ( Length < HoleLength ) ? Length : HoleLength;
 
-   //---------------------------------------------------------------------------
-   // Check for errors in the file system that we can clean up...
-   // CheckForErrors();
-   //---------------------------------------------------------------------------
+            if( (rc = ZeroSectorData( Sector, Offset, Chunk )) < 0 )
+            {
+               return rc;
+            }
 
-   // First, count total number of sectors in file system...
-   Section = &(FlashSectionTable[0]);
+            FileOffset += Chunk;
+            Offset     += Chunk;
+            Length     -= Chunk;
+            *FromSector = -1;
+            continue;
+         }
+      }
 
-   // Go thru the table until we get to the end...
-   for(TotalSectors = 0; Section->Device != 0xff; Section++)
-   {
-      TotalSectors += Section->Count;     // Tally count.
-   }
+      Chunk = FromHead->SectorLength - *FromOffset;
+      if( Chunk > Length )
+      {
+         Chunk = Length;
+      }
 
-   SectorArray = _mem_alloc_zero(TotalSectors);
+      if( (rc = CopySectorData( *FromSector, *FromOffset, Sector, Offset, Chunk )) < 0 )
+      {
+         return rc;
+      }
+      NoteBankRead( *FromSector );
 
-   // Now look thru sectors for Fnodes.  When one is found, follow chain and mark
-   // each sector array entry for each valid sector...
-   for( Sector = 0; Sector < TotalSectors; Sector++ )
-   {
-      ReadSector( Sector, 0, &SecHeader, sizeof(FFS_SECTOR_HEADER) );
+      FileOffset  += Chunk;
+      Offset      += Chunk;
+      Length      -= Chunk;
+      *FromOffset += Chunk;
 
-      if( SecHeader.Key != FFS_SECTOR_HEADER_KEY )
+      // On to the next sector of the file, if it carries on from this one...
+      if( *FromOffset == FromHead->SectorLength )
       {
-         // Only mark it bad if status byte does not indicate FREE. If it says
-         // free, then it can still be allocated later...
-         if(SecHeader.Status != FFS_SECTOR_HEADER_FREE &&
-            SecHeader.Status != FFS_SECTOR_HEADER_FREE_DIRTY )
+         *FromSector = FFS_SUCCESSOR(*FromHead);
+         if( *FromSector == -1 ||
+             ReadSectorHeader( *FromSector, FromHead ) < 0 ||
+             (FromHead->FileOffset != -1 && FromHead->FileOffset != FileOffset) )
          {
-            SectorArray[Sector] |= CHECK_SECTOR_BAD;
+            *FromSector = -1;
          }
-      }
-
+         else
+         {
+            *FromOffset = FromHead->DataOffset;
+         }
+      }
+   }
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::SetGcPolicy
+//
+//    Purpose:          Set the garbage collection watermarks and foreground budget.
+//
+//    Inputs:           LowWater         - Collect in the foreground below this many
+//                                         clean sectors.
+//                      HighWater        - Idle collection stops at this many.
+//                      ForegroundBudget - Ticks an allocating call may spend
+//                                         collecting.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            A low watermark of 0 turns foreground collection off, and a
+//                      high watermark of 0 turns collection off altogether.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::SetGcPolicy( unsigned long LowWater, unsigned long HighWater, unsigned long ForegroundBudget )
+{
+   if( HighWater < LowWater )
+   {
+      return FFS_RC_INVALID_ARGUMENT;
+   }
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   GcLowWater         = LowWater;
+   GcHighWater        = HighWater;
+   GcForegroundBudget = ForegroundBudget;
+
+   FFS_UPDATE_UNLOCK();
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::GarbageCollect
+//
+//    Purpose:          Idle time garbage collection.
+//
+//    Inputs:           Budget - Ticks we may spend.
+//
+//    Returns:          Number of sectors freed and cleaned, or Jcffs error code.
+//
+//    Notes:            Meant to be called by the RTOS idle task, or by a host
+//                      between requests.  Each call does a little, so the erases
+//                      are spread over idle periods instead of landing on writes.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::GarbageCollect( unsigned long Budget )
+{
+   int   rc;
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   IoClass = -1;
+   rc      = CollectGarbage( GcHighWater, Budget );
+
+   FFS_UPDATE_UNLOCK();
+
+   return rc;
+}
+
+
+#ifdef FFS_MICROBENCH
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::Bench
+//
+//    Purpose:          Run an internal routine for a benchmark.
+//
+//    Inputs:           Bench - What to run and how many times.
+//
+//    Outputs:          Bench->Found - Times it found what it looked for.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            Routines run under the update lock, as they would in the calls
+//                      that use them.  Check() takes the lock itself.  FreeSectors()
+//                      is run once, on the whole file, and the file is gone after.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::Bench( FFS_BENCH* Bench )
+{
+   FFS_FILE_NODE         Fnode;
+   FFS_SECTOR_HEADER     SecHead;
+   FFS_FLASH_SECTION*    Section;
+   char                   Name[FFS_MAX_FILENAME_LENGTH + 1];
+   char                   OtherName[FFS_MAX_FILENAME_LENGTH + 1];
+   unsigned long          Sector;
+   unsigned long          Offset;
+   unsigned long          HoleLength;
+   unsigned long          i;
+   int                    rc = 0;
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   Bench->Found = 0;
+
+   if( Bench->Routine == FFS_BENCH_CHECK )
+   {
+      BenchMark = Bench->Mark;
+      rc        = Check();
+      BenchMark = NULL;
+
+      return rc < 0 ? rc : 0;
+   }
+
+   FFS_UPDATE_LOCK();
+
+   switch( Bench->Routine )
+   {
+      case FFS_BENCH_LOCATE_FILE:
+         for( i = 0; i < Bench->Count; i++ )
+         {
+            LocateFileNode( Bench->Name, &Fnode, &Sector );
+            Bench->Found += (Sector != -1);
+         }
+         break;
+
+      case FFS_BENCH_FIND_FREE:
+         for( i = 0; i < Bench->Count; i++ )
+         {
+            Bench->Found += FindFreeSector( &Sector, &SecHead, &Section );
+         }
+         break;
+
+      case FFS_BENCH_LOCATE_POSITION:
+         if( Bench->fd < 0 || Bench->fd >= FFS_MAX_FILE_DESCRIPTORS || !FileDescriptors[Bench->fd].InUse )
+         {
+            rc = FFS_RC_INVALID_FILE_DESCRIPTOR;
+            break;
+         }
+
+         for( i = 0; i < Bench->Count; i++ )
+         {
+            Bench->Found += (LocatePosition( &FileDescriptors[Bench->fd], Bench->Arg,
+                                             &Sector, &SecHead, &Offset, &HoleLength ) == 0);
+         }
+         break;
+
+      case FFS_BENCH_FREE_SECTORS:
+         LocateFileNode( Bench->Name, &Fnode, &Sector );
+         if( Sector == -1 )
+         {
+            rc = FFS_RC_FILE_NOT_FOUND;
+            break;
+         }
+
+         rc = FreeSectors( Sector );
+         Bench->Found = 1;
+         ForgetFile( Bench->Name );
+         break;
+
+      case FFS_BENCH_SECTION_ENTRY:
+         for( i = 0; i < Bench->Count; i++ )
+         {
+            Bench->Found += GetFlashSectionEntry( (Bench->Arg + i) % TotalSectors, &Section, &Sector );
+         }
+         break;
+
+      case FFS_BENCH_NAME_MATCH:
+         for( i = 0; i < Bench->Count; i++ )
+         {
+            strncpy( Name, Bench->Name, sizeof(Name) - 1 );
+            strncpy( OtherName, Bench->Name, sizeof(OtherName) - 1 );
+            Name[sizeof(Name) - 1] = OtherName[sizeof(OtherName) - 1] = 0;
+            StringToUpperCase( Name );
+            StringToUpperCase( OtherName );
+            Bench->Found += (strcmp( Name, OtherName ) == 0);
+         }
+         break;
+
+      default:
+         rc = FFS_RC_INVALID_ARGUMENT;
+         break;
+   }
+
+   FFS_UPDATE_UNLOCK();
+
+   return rc < 0 ? rc : 0;
+}
+#endif
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::GetWriteStats
+//
+//    Purpose:          Copy out the write statistics.
+//
+//    Inputs:           Reset - Start the statistics again from zero.
+//
+//    Outputs:          Stats - The statistics.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::GetWriteStats( FFS_WRITE_STATS* Stats, int Reset )
+{
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_READ_LOCK();
+
+   memcpy( Stats, &WriteStats, sizeof(WriteStats) );
+
+   if( Reset )
+   {
+      memset( &WriteStats, 0, sizeof(WriteStats) );
+   }
+
+   FFS_READ_UNLOCK();
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::GetLookupStats
+//
+//    Purpose:          Copy out the name lookup statistics.
+//
+//    Inputs:           Reset - Start the counts again from zero.
+//
+//    Outputs:          Stats - The statistics.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The filter's size and fill aren't counts, so aren't reset.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::GetLookupStats( FFS_LOOKUP_STATS* Stats, int Reset )
+{
+   unsigned long   Word;
+   unsigned long   i;
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_READ_LOCK();
+
+   memcpy( Stats, &LookupStats, sizeof(LookupStats) );
+
+   Stats->FilterBits    = FFS_NAME_FILTER_BITS;
+   Stats->FilterBitsSet = 0;
+   for( i = 0; i < FFS_NAME_FILTER_WORDS && NameFilterValid; i++ )
+   {
+      for( Word = NameFilter[i]; Word != 0; Word &= Word - 1 )
+      {
+         Stats->FilterBitsSet++;
+      }
+   }
+
+   if( Reset )
+   {
+      memset( &LookupStats, 0, sizeof(LookupStats) );
+   }
+
+   FFS_READ_UNLOCK();
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::SetFileClassifier
+//
+//    Purpose:          Set the function that picks files' write statistics classes.
+//
+//    Inputs:           Classify - The classifier, or NULL to put every file in
+//                                 class 0.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            Files already open keep the class they had.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::SetFileClassifier( FFS_FILE_CLASSIFIER Classifier )
+{
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   Classify = Classifier;
+
+   FFS_UPDATE_UNLOCK();
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::SetYieldHook
+//
+//    Purpose:          Set what is called while an update waits for a background erase.
+//
+//    Inputs:           Hook    - The function, or NULL to call FFS_YIELD().
+//                      Context - Passed to it.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The hook is called from the task making the update, with the
+//                      update lock held and the volume lock let go.  It may make reads
+//                      on the volume, but an update from it would wait for itself.
+//                      See my_ffs_coro.h.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::SetYieldHook( FFS_YIELD_HOOK Hook, void* Context )
+{
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   YieldHook    = Hook;
+   YieldContext = Context;
+
+   FFS_UPDATE_UNLOCK();
+
+   return 0;
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::NextDirectory
+//
+//    Purpose:          Return next Fnode on each call.
+//
+//    Inputs:           fd  - File descriptor number.
+//                      buf - Pointer to buffer to write from.
+//                      n   - Length of buffer, maximum size to write.
+//
+//    Returns:          0   - Operation was successful. An fnode was returned.
+//                      1   - Operation complete, no more files.
+//                      <0  - Jcffs return code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::NextDirectory( unsigned long* Handle, FFS_FILE_NODE* Fnode  )
+{
+   FFS_SECTOR_HEADER     SecHead;            // Current sector file pos is in.
+   unsigned long          Sector;             // Sector number.
+
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_READ_LOCK();
+
+   for( Sector = *Handle; ValidSector(Sector); Sector++ )
+   {
+      // An update may be erasing this one.  It is free, whatever it reads as...
+      if( Sector == ErasingSector )
+      {
+         continue;
+      }
+
+      ReadSectorHeader( Sector, &SecHead );
+
+      if( SecHead.Status == FFS_SECTOR_HEADER_INUSE_FILENODE )
+      {
+         // Read Fnode...
+         ReadFileNode( Sector, &SecHead, Fnode );
+
+         *Handle = Sector + 1;
+
+         // Check to see if this file is currently being created and there
+         // isn't a displayable name...
+         if( (unsigned char)Fnode->Filename[0] == 0xff && Fnode->FileSize == -1)
+         {
+            strcpy(Fnode->Filename, "[New File]");
+         }
+
+         FFS_READ_UNLOCK();
+         return 0;
+      }
+   }
+
+   FFS_READ_UNLOCK();
+
+   return 1;          // No more files.
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::Stat
+//
+//    Purpose:          Look up one file by name.
+//
+//    Inputs:           filename - Name of the file.
+//
+//    Outputs:          Fnode    - Its file node.
+//
+//    Returns:          0 - The file was found.
+//                      <0 - Jcffs return code.
+//
+//    Notes:            The file is found the way open() finds it, from the open cache
+//                      or with LocateFileNode(), so a name the name filter doesn't have
+//                      costs no flash reads.  Walking the directory with NextDirectory()
+//                      to find one name reads every sector.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::Stat( char* filename, FFS_FILE_NODE* Fnode )
+{
+   FFS_FILE_DESCRIPTOR    Fdesc;
+   unsigned long           Sector = -1;
+
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_READ_LOCK();
+
+   if( RecallFile( filename, &Fdesc ) )
+   {
+      *Fnode = Fdesc.Fnode;
+      Sector = Fdesc.FnodeSector;
+   }
+   else
+   {
+      LocateFileNode( filename, Fnode, &Sector );
+   }
+
+   FFS_READ_UNLOCK();
+
+   return ( Sector == -1 ) ? FFS_RC_FILE_NOT_FOUND : 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::Erase
+//
+//    Purpose:          Erase a file.
+//
+//    Inputs:           filename - Name of file to erase.
+//
+//    Returns:          0 - If operation was successful.
+//                      <0 - Returns Jcffs return code.
+//
+//    Notes:            The file is gone once its fnode is marked deleted.  Its sectors
+//                      are freed later; see DeleteFile().
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::Erase( char* filename  )
+{
+   FFS_FILE_NODE         Fnode;              // File node returned by LocateFileNode().
+   unsigned long          Sector;             // Sector number.
+
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   IoClass = ClassOf( filename );
+
+   // See if file exists. Find Fnode on flash and copy into memory.
+   // LocateFileNode() will return with sector==-1 if file is not found...
+   LocateFileNode(filename, &Fnode, &Sector);
+
+   // See if file was found. If not, return.
+   if(Sector == -1)
+   {
+      FFS_UPDATE_UNLOCK();
+      return FFS_RC_FILE_NOT_FOUND;
+   }
+
+   // Erase file...
+   DeleteFile(Sector);
+
+   ForgetFile( filename );
+
+   FFS_UPDATE_UNLOCK();
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::Rename
+//
+//    Purpose:          Rename a file.
+//
+//    Inputs:           filename     - Name of file to rename.
+//                      new_filename - new file name.
+//
+//    Returns:          0 - Operation successful, file renamed.
+//                      <0 - Jcffs error code.
+//
+//    Notes:            To perform this feature, we will allocate a new fnode sector,
+//                      copy data to new sector, erase old file, save new fnode.  See
+//                      MoveFileNode().
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::Rename( char* filename, char* new_filename )
+{
+   FFS_FILE_NODE         Fnode;              // File node returned by LocateFileNode().
+   unsigned long          Sector;             // Sector number.
+   unsigned long          NewSector;          // New sector number.
+   int                    rc;
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   IoClass = ClassOf( new_filename );
+
+   // See if file exists. Find Fnode on flash and copy into memory.
+   // LocateFileNode() will return with sector==-1 if file is not found...
+   LocateFileNode(filename, &Fnode, &Sector);
+
+   // See if file was found. If not, return.
+   if(Sector == -1)
+   {
+      FFS_UPDATE_UNLOCK();
+      return FFS_RC_FILE_NOT_FOUND;
+   }
+
+   // Now, make sure new filename doesn't exist...
+   LocateFileNode(new_filename, &Fnode, &NewSector);
+
+   // See if file was found. If it was, return.
+   if(NewSector != -1)
+   {
+      FFS_UPDATE_UNLOCK();
+      return FFS_RC_NEW_NAME_EXISTS;
+   }
+
+   // Update fnode with new name...
+   if( strlen(new_filename ) >= sizeof(Fnode.Filename) )
+   {
+      memcpy(Fnode.Filename, new_filename, sizeof(Fnode.Filename) - 1);
+      Fnode.Filename[ sizeof(Fnode.Filename) - 1 ] = 0;
+   }
+   else
+   {
+      strcpy(Fnode.Filename, new_filename);
+   }
+   Fnode.NameHash = FFSHashName(Fnode.Filename);
+
+   rc = MoveFileNode( Sector, &Fnode, &NewSector );
+
+   ForgetFile( filename );
+
+   FFS_UPDATE_UNLOCK();
+
+   return rc;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::Copy
+//
+//    Purpose:          Copy a file.
+//
+//    Inputs:           filename     - Name of file to copy.
+//                      new_filename - Name of the copy.
+//
+//    Returns:          0 - Operation successful, file copied.
+//                      <0 - Jcffs error code.
+//
+//    Notes:            The copy is made as a one file import whose data comes straight
+//                      from the file's sectors, see ImportEntries() and CopyData(), so
+//                      it is planned in one pass and only exists once its fnode is
+//                      programmed.  A file already called new_filename is replaced.
+//                      A file of size 0 can't be copied, see ImportBatch().
+//
+//                      The file is held open on a descriptor while it is copied, which
+//                      keeps its chain from being freed under us and lets it be
+//                      located like any open file.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::Copy( char* filename, char* new_filename )
+{
+   FFS_IMPORT_ENTRY       Entry;
+   FFS_FILE_DESCRIPTOR*   Fdesc;
+   FFS_SECTOR_HEADER      SecHead;
+   int                     fd;
+   int                     rc;
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   if( (fd = GetDescriptor()) < 0 )
+   {
+      FFS_UPDATE_UNLOCK();
+      return fd;
+   }
+
+   Fdesc = &(FileDescriptors[fd]);
+
+   if( !RecallFile( filename, Fdesc ) )
+   {
+      LocateFileNode( filename, &Fdesc->Fnode, &Fdesc->FnodeSector );
+      Fdesc->TailSector = -1;
+
+      if( Fdesc->FnodeSector != -1 )
+      {
+         ReadSectorHeader( Fdesc->FnodeSector, &SecHead );
+         Fdesc->FnodeVersion = SecHead.Version;
+      }
+   }
+
+   if( Fdesc->FnodeSector == -1 )
+   {
+      FreeDescriptor( fd );
+      FFS_UPDATE_UNLOCK();
+      return FFS_RC_FILE_NOT_FOUND;
+   }
+
+   Fdesc->Flags = FFS_RDONLY;
+
+   memset( &Entry, 0, sizeof(Entry) );
+   Entry.Filename    = new_filename;
+   Entry.Size        = Fdesc->Fnode.FileSize;
+   Entry.Permissions = Fdesc->Fnode.Permissions;
+   Entry.CopyFrom    = fd;
+
+   rc = ImportEntries( &Entry, 1 );
+
+   // Copying a file onto itself replaced it...
+   if( Fdesc->Unlinked )
+   {
+      FreeDescriptor( fd );
+      QueueDelete( Fdesc->FnodeSector );
+   }
+   else
+   {
+      RememberFile( Fdesc );
+      FreeDescriptor( fd );
+   }
+
+   FFS_UPDATE_UNLOCK();
+
+   return rc < 0 ? rc : Entry.Result;
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::Space
+//
+//    Purpose:          Get information about used and free space or clear all space.
+//
+//    Inputs:           Option     - 0 - Return number of free bytes.
+//                                   1 - Return the number of free Sectors.
+//                                   2 - Return the total number of bytes in file system.
+//                                   3 - Return the total number of Sectors in file system.
+//                                   128 - Clear all space (used and unused).
+//
+//
+//    Returns:          Total Free size in bytes.
+//
+//    Notes:            Currently, this feature assumes that all sectors are the same size.
+//
+//                      To perform this feature, we will allocate a new fnode sector,
+//                      copy data to new sector, erase old file, save new fnode.
+//
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::Space( int Option )
+{
+   FFS_SECTOR_HEADER     SecHead;
+   FFS_FLASH_SECTION*    Section;
+   unsigned long          Sector;
+   unsigned long          RelSector;
+   unsigned long          TotalSize = 0;
+
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   FFS_UPDATE_LOCK();
+
+   IoClass = -1;
+
+   if( Option == 128 )
+   {
+      // Erase all sectors in flash file system...
+      for( Sector = 0; GetFlashSectionEntry( Sector, &Section, &RelSector ); Sector++ )
+      {
+         EraseSector( Sector );
+         TotalSize += (Section->SectorSize - FFSHeaderSize(FFS_FILE_SYSTEM_VERSION));
+      }
+
+      ForgetFile( NULL );
+      NameFilterValid = false;
+   } else if( Option >= 0 && Option <= 3 )
+   {
+      // Free what files being deleted still hold, so it is counted...
+      if( Option <= 1 )
+      {
+         ReclaimDeleted( -1 );
+      }
+
+      // Go thru all sectors and tally space depending on option...
+      for( Sector = 0; GetFlashSectionEntry( Sector, &Section, &RelSector ); Sector++ )
+      {
+         ReadSectorHeader( Sector, &SecHead );
+
+         if( Option == 2                        ||          // Tally all Bytes
+             Option == 3                        ||          // Tally all
+             SecHead.Status == FFS_SECTOR_HEADER_FREE ||
+             SecHead.Status == FFS_SECTOR_HEADER_FREE_DIRTY )
+         {
+            if(Option == 0 || Option == 2)
+            {
+               TotalSize += (Section->SectorSize - FFSHeaderSize(FFS_FILE_SYSTEM_VERSION));
+            }
+            else
+            {
+               TotalSize += 1;   // Just count sectors.
+            }
+
+         }
+      }
+   }
+
+   FFS_UPDATE_UNLOCK();
+
+   return TotalSize;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::Check
+//
+//    Purpose:          Check and fix file system.
+//
+//    Inputs:           None
+//
+//
+//    Returns:          Total count of sectors fixed, or FFS_RC_OUT_OF_MEMORY if the
+//                      volume has no check map.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::Check( void )
+{
+   int                   TotalFixedSectors = 0;
+   unsigned long         Sector;
+   unsigned long         DeleteSector;
+   unsigned long         DeleteNext;
+   unsigned long         NextSector;
+   unsigned long         Word;
+   unsigned long         Orphans;
+   FFS_SECTOR_HEADER    SecHeader;
+   FFS_FILE_NODE        Fnode;
+   FFS_FILE_NODE        NextFnode;
+   FFS_SECTOR_HEADER    ProbeHeader;
+   unsigned long         ProbeHash;
+   int                   HasHash;
+   FFS_SECTOR_INDEX     Index;
+   unsigned long         IndexSector;
+   unsigned long         KeepSector;
+   unsigned long         Walked;
+
+
+   if( initializationComplete == false )
+   {
+      Initialize();
+   }
+
+   if( CheckMap == NULL )
+   {
+      return FFS_RC_OUT_OF_MEMORY;
+   }
+
+   FFS_UPDATE_LOCK();
+
+   IoClass = -1;
+
+   // Finish deleting files first.  Their sectors would be taken for orphans...
+   ReclaimDeleted( -1 );
+
+   TotalCrossChain = 0;
+   ErrorSectorCount = 0;
+
+   //---------------------------------------------------------------------------
+   // Check for errors in the file system that we can clean up...
+   // CheckForErrors();
+   //---------------------------------------------------------------------------
+
+   CHECK_PASS( FFS_CHECK_PASS_MAP );
+
+   // The check map was allocated when the volume was mounted. Just clear it...
+   memset( CheckMap, 0, FFS_CHECK_MAP_SIZE(TotalSectors) );
+
+   // Now look thru sectors for Fnodes.  When one is found, follow chain and mark
+   // each sector in the check map for each valid sector...
+   for( Sector = 0; Sector < TotalSectors; Sector++ )
+   {
+      ReadSectorHeader( Sector, &SecHeader );
+
+      if( SecHeader.Key != FFS_SECTOR_HEADER_KEY )
+      {
+         // Only mark it bad if status byte does not indicate FREE. If it says
+         // free, then it can still be allocated later...
+         if(SecHeader.Status != FFS_SECTOR_HEADER_FREE &&
+            SecHeader.Status != FFS_SECTOR_HEADER_FREE_DIRTY )
+         {
+            CHECK_MAP_SET( CHECK_PLANE_BAD, Sector );
+         }
+      }
+
       switch ( SecHeader.Status )
       {
-         // Mark the free ones.
-         case FFS_SECTOR_HEADER_FREE:
-         case FFS_SECTOR_HEADER_FREE_DIRTY:
-            SectorArray[Sector] |= CHECK_SECTOR_FREE;
-            break;
+         // Mark the free ones.
+         case FFS_SECTOR_HEADER_FREE:
+         case FFS_SECTOR_HEADER_FREE_DIRTY:
+            CHECK_MAP_SET( CHECK_PLANE_CLAIMED, Sector );
+            break;
+
+         // Ordinary in-use sector. just ignore for now.
+         case FFS_SECTOR_HEADER_INUSE:
+            break;
+
+         // A deleted file that is still open is kept until it is closed...
+         case FFS_SECTOR_HEADER_DELETED_FILENODE:
+            if( !FileIsOpen( Sector ) )
+            {
+               break;
+            }
+            // Fall thru...
+
+         case FFS_SECTOR_HEADER_INUSE_FILENODE:
+            // Read Fnode...
+            ReadFileNode( Sector, &SecHeader, &Fnode );
+            // Check for valid Fnode...
+            if( Fnode.FileSize == 0 || Fnode.FileSize == -1 )
+            {
+               // Mark this one as bad.  It needs to be cleaned up...
+               CHECK_MAP_SET( CHECK_PLANE_BAD, Sector );
+            }
+            else
+            {
+               // We have a sector with a file node - the start of a file.
+               CHECK_MAP_SET( CHECK_PLANE_CLAIMED, Sector );
+
+               // Its index, if it has one, belongs to it...
+               if( (IndexSector = FindIndex( Sector, &Fnode, &Index, NULL )) != -1 )
+               {
+                  CHECK_MAP_SET( CHECK_PLANE_CLAIMED, IndexSector );
+               }
+
+               // Check chain of sectors for this file...
+               NextSector = FFS_SUCCESSOR(SecHeader);
+               while( NextSector != -1 && NextSector < TotalSectors )
+               {
+                  if( CHECK_MAP_TEST( CHECK_PLANE_CLAIMED, NextSector ) ||
+                      CHECK_MAP_TEST( CHECK_PLANE_BAD,     NextSector ) )
+                  {
+                     TotalCrossChain++;
+                  }
+
+                  // A sector we have already chained is either cross-linked or part
+                  // of a loop. Either way, don't follow it again...
+                  if( CHECK_MAP_TEST( CHECK_PLANE_CHAINED, NextSector ) )
+                  {
+                     TotalCrossChain++;
+                     break;
+                  }
+                  CHECK_MAP_SET( CHECK_PLANE_CHAINED, NextSector );
+
+                  ReadSectorHeader( NextSector, &SecHeader );
+                  NextSector = FFS_SUCCESSOR(SecHeader);
+               }
+            }
+            break;
+
+         // Anything else indicates something wrong.
+         // Don't mark these bad quite yet...
+         default:
+            //CHECK_MAP_SET( CHECK_PLANE_BAD, Sector );
+            break;
+
+      }
+   }
+
+   CHECK_PASS( FFS_CHECK_PASS_ORPHANS );
+
+   // OK, now we have a map that will help us find sectors that have been left
+   // estranged: those neither claimed nor chained.  Go thru the map a word at a time
+   // and mark them FREE_DIRTY. If they are BAD, then try to erase them....
+   for( Word = 0; Word < CheckMapWords; Word++ )
+   {
+      Orphans = ~( CheckMap[CHECK_PLANE_CLAIMED * CheckMapWords + Word] |
+                   CheckMap[CHECK_PLANE_CHAINED * CheckMapWords + Word] );
+
+      // Ignore bits past the end of the volume in the last word...
+      if( (Word + 1) * FFS_CHECK_WORD_BITS > TotalSectors )
+      {
+         Orphans &= CHECK_MAP_BIT(TotalSectors) - 1;
+      }
+
+      while( Orphans )
+      {
+         Sector   = Word * FFS_CHECK_WORD_BITS + LowestBit( Orphans );
+         Orphans &= Orphans - 1;                  // Clear the bit we just took.
+
+         // If sector isn't bad...
+         if( !CHECK_MAP_TEST( CHECK_PLANE_BAD, Sector ) )
+         {
+            ReadSectorHeader( Sector, &SecHeader );
+            WriteSectorStatus( Sector, SecHeader.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+            TotalFixedSectors++;
+         }
+         else
+         {
+            EraseSector( Sector );
+            TotalFixedSectors++;
+         }
+      }
+   }
+
+   CHECK_PASS( FFS_CHECK_PASS_DUPLICATES );
+
+   // Now, check for duplicate files.  Delete oldest one.  Only claimed sectors can
+   // hold an fnode at this point, so skip over everything else a word at a time...
+   for( Sector = NextMapSector( CHECK_PLANE_CLAIMED, 0 );
+        Sector < TotalSectors;
+        Sector = NextMapSector( CHECK_PLANE_CLAIMED, Sector + 1 ) )
+   {
+      ReadSectorHeader( Sector, &SecHeader );
+
+      if( SecHeader.Status == FFS_SECTOR_HEADER_INUSE_FILENODE )
+      {
+         // Read Fnode and uppercase name so compare is case-insensitive...
+         ReadFileNode( Sector, &SecHeader, &Fnode );
+         StringToUpperCase(Fnode.Filename);
+
+         // Now, go thru each following sector looking for an Fnode with matching
+         // name.  If we find one, then check counter and delete file with lower count.
+         for( NextSector = NextMapSector( CHECK_PLANE_CLAIMED, Sector + 1 );
+              NextSector < TotalSectors;
+              NextSector = NextMapSector( CHECK_PLANE_CLAIMED, NextSector + 1 ) )
+         {
+            // Read header and name hash. Only look at fnodes whose hash can match.
+            // Version 1 fnodes have no hash, so always look at those...
+            HasHash = ReadNameProbe( NextSector, &ProbeHeader, &ProbeHash );
+
+            if( ProbeHeader.Status == FFS_SECTOR_HEADER_INUSE_FILENODE &&
+                ( !HasHash || ProbeHash == Fnode.NameHash ) )
+            {
+               // Read Fnode...
+               ReadFileNode( NextSector, &ProbeHeader, &NextFnode );
+
+               // Uppercase names for compare so compare is case-insensitive...
+               StringToUpperCase(NextFnode.Filename);
+
+               // See if files match.  If they do, delete oldest one...
+               if( strcmp(Fnode.Filename, NextFnode.Filename) == 0 )
+               {
+                  if(Fnode.Count < NextFnode.Count)
+                  {
+                     DeleteSector = Sector;
+                  }
+                  else
+                  {
+                     DeleteSector = NextSector;
+                  }
+
+                  IndexSector = FindIndex( DeleteSector,
+                                           (DeleteSector == Sector) ? &Fnode : &NextFnode,
+                                           &Index,
+                                           NULL );
+                  if( IndexSector != -1 )
+                  {
+                     FreeIndex( IndexSector );
+                     TotalFixedSectors++;
+                  }
+
+                  // A file that grew has a new fnode that shares the old one's chain
+                  // (see GrowFileNode()), so the chain of the file kept is marked and
+                  // left alone.  The bad plane isn't needed any more, so it is used...
+                  memset( &CHECK_MAP_WORD( CHECK_PLANE_BAD, 0 ), 0, CheckMapWords * sizeof(unsigned long) );
+
+                  KeepSector = (DeleteSector == Sector) ? NextSector : Sector;
+                  ReadSectorHeader( KeepSector, &SecHeader );
+                  for( Walked = 0, KeepSector = FFS_SUCCESSOR(SecHeader);
+                       KeepSector != -1 && KeepSector < TotalSectors && Walked < TotalSectors;
+                       Walked++, KeepSector = FFS_SUCCESSOR(SecHeader) )
+                  {
+                     CHECK_MAP_SET( CHECK_PLANE_BAD, KeepSector );
+                     ReadSectorHeader( KeepSector, &SecHeader );
+                  }
+
+                  // A chain that loops or leaves the volume is stopped, as in the first
+                  // pass, after as many sectors as the volume has...
+                  for( Walked = 0;
+                       DeleteSector != -1 && DeleteSector < TotalSectors && Walked < TotalSectors;
+                       Walked++ )
+                  {
+                     // All of sector header.  One we have freed already means the chain
+                     // came back on itself, and one that is marked belongs to the file
+                     // kept as well...
+                     ReadSectorHeader( DeleteSector, &SecHeader );
+                     if( SecHeader.Status == FFS_SECTOR_HEADER_FREE_DIRTY ||
+                         CHECK_MAP_TEST( CHECK_PLANE_BAD, DeleteSector ) )
+                     {
+                        break;
+                     }
+
+                     // Save number of next sector in chain...
+                     DeleteNext = FFS_SUCCESSOR(SecHeader);
+
+                     // Change status to FREE. Mark this sector as free but needing erase...
+                     WriteSectorStatus( DeleteSector, SecHeader.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+                     TotalFixedSectors++;
+
+                     DeleteSector = DeleteNext;                // Next sector is now current sector.
+                  }
+
+                  if(Fnode.Count < NextFnode.Count)
+                  {
+                     // We don't need to check any more for this sector.
+                     break;
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   CHECK_PASS( FFS_CHECK_PASS_DONE );
+
+   // We have freed and erased sectors behind the collector's back, and maybe files that
+   // are cached...
+   GcCountsValid = false;
+   ForgetFile( NULL );
+
+   // Names of the files deleted can go from the name filter...
+   NameFilterValid = false;
+
+   FFS_UPDATE_UNLOCK();
+
+   return TotalFixedSectors;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::NextMapSector
+//
+//    Purpose:          Find the next sector whose bit is set in one plane of the
+//                      check map.
+//
+//    Inputs:           Plane  - Which check map plane to search.
+//                      Sector - Sector number to start searching from.
+//
+//    Returns:          Next sector number with its bit set, or TotalSectors if none.
+//
+//    Notes:            Whole words of clear bits are skipped with one compare.
+//
+//---------------------------------------------------------------------------------------
+unsigned long Jcffs::NextMapSector( int Plane, unsigned long Sector )
+{
+   unsigned long*   Map = &CheckMap[Plane * CheckMapWords];
+   unsigned long    Word;
+   unsigned long    Bits;
+
+   if( Sector >= TotalSectors )
+   {
+      return TotalSectors;
+   }
+
+   // Mask off bits below the starting sector in the first word...
+   Word = Sector / FFS_CHECK_WORD_BITS;
+   Bits = Map[Word] & ~(CHECK_MAP_BIT(Sector) - 1);
+
+   while( Bits == 0 )
+   {
+      if( ++Word >= CheckMapWords )
+      {
+         return TotalSectors;
+      }
+      Bits = Map[Word];
+   }
+
+   Sector = Word * FFS_CHECK_WORD_BITS + LowestBit( Bits );
+
+   return (Sector < TotalSectors) ? Sector : TotalSectors;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::LowestBit
+//
+//    Purpose:          Return the bit number of the lowest set bit in a word.
+//
+//    Inputs:           Word - Word to look at. Must not be zero.
+//
+//    Returns:          Bit number, 0 being the least significant bit.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::LowestBit( unsigned long Word )
+{
+#if defined(__GNUC__)
+   return __builtin_ctzl( Word );
+#else
+   int   Bit = 0;
+
+   while( !(Word & 1) )
+   {
+      Word >>= 1;
+      Bit++;
+   }
+
+   return Bit;
+#endif
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::LocatePosition
+//
+//    Purpose:          Locate the current position of a file.
+//
+//    Inputs:           Fdesc    - Pointer to file descriptor.
+//                      Position - Position of fle to locate.
+//
+//    Outputs:          Sector     - Returned sector number where position is located.
+//                      SecHead    - Returned sector header from that sector.
+//                      Offset     - Returned offset into sector where position is at.
+//                      HoleLength - If position is in a hole, bytes until the next data,
+//                                   or -1 if there is no data after it.
+//
+//    Returns:          0, 1 if position is in a hole, or Jcffs error code.
+//
+//    Notes:
+//                      We locate where the current file position is. That is, we locate
+//                      in what sector and at what offset into that sector. And, we return
+//                      the sector number of that sector, and the offset into that sector.
+//                      Also, the sector header is returned, which contains the size of
+//                      the sector.
+//
+//                      Version 3 sectors carry the file offset of their data.  Older ones
+//                      don't, and their offset is the running total of the sectors before
+//                      them.  A chain is in file order unless the fnode says otherwise;
+//                      in that case a hole can only be told from the whole chain.  When
+//                      the walk reaches the end of the chain, the descriptor's tail is
+//                      updated.
+//
+//                      A file with an index is located from that instead, see
+//                      LocateIndexed().  Positions past its last sector are walked to.
+//                      In an ordered chain the walk follows a sector's Skip when the
+//                      sector it points to starts at or before the position, which
+//                      takes O(log n) header reads, see FFSSkipIndex().
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::LocatePosition( FFS_FILE_DESCRIPTOR* Fdesc,
+                          unsigned long         Position,
+                          unsigned long*        Sector,
+                          FFS_SECTOR_HEADER*   SecHead,
+                          unsigned long*        Offset,
+                          unsigned long*        HoleLength )
+{
+    FFS_FILE_NODE*        Fnode;                 // Ptr to In-core fnode in file desc entry.
+    int                    rc;
+    unsigned long          Count = 0;             // File offset of current sector's data.
+    unsigned long          DataLength;            // Data length of current sector.
+    unsigned long          NextStart = -1;        // Nearest data past position.
+    unsigned long          Tail = -1;             // Last sector we've seen.
+    unsigned long          TailStart = 0;
+    unsigned long          Walked = 0;            // Loop guard.
+    bool                   Skipped = false;       // Header was read by TakeSkip().
+
+    Fnode = &(Fdesc->Fnode);                      // Copy ptr for convenience.
+
+    // An indexed file doesn't need its chain walked...
+    if( (rc = LocateIndexed( Fdesc, Position, Sector, SecHead, Offset, HoleLength )) <= 1 )
+    {
+        return rc;
+    }
+
+    *Sector = Fdesc->FnodeSector;                 // Start with first sector.
+
+    while( *Sector != -1 )
+    {
+        // Read sector header from this sector. If error, return with that error...
+        if( !Skipped && (rc = ReadSectorHeader( *Sector, SecHead )) < 0)
+        {
+            return rc;
+        }
+        Skipped = false;
+
+        if( ++Walked > TotalSectors )
+        {
+            return FFS_RC_INVALID_SECTOR_NUMBER;  // Chain loops.
+        }
+
+        if( SecHead->FileOffset != -1 )
+        {
+            Count = SecHead->FileOffset;
+        }
+        DataLength = SecHead->SectorLength - SecHead->DataOffset;
+
+        // Is position within this sector?
+        if( Position >= Count && Position < Count + DataLength )
+        {
+            // Position is within this sector. Calculate Offset...
+            *Offset = SecHead->DataOffset + (Position - Count);
+            return 0;
+        }
+
+        if( (Skipped = TakeSkip( Fdesc, SecHead, Count, Position, Sector )) )
+        {
+            continue;
+        }
+
+        // Keep track of where the next data after position starts...
+        if( Count > Position && Count < NextStart )
+        {
+            NextStart = Count;
+
+            // In an ordered chain, nothing further on can be closer...
+            if( !(Fnode->Flags & FFS_FNODE_UNORDERED) )
+            {
+                break;
+            }
+        }
+
+        Tail      = *Sector;
+        TailStart = Count;
+
+        Count += DataLength;                      // Calc running total.
+
+        *Sector = FFS_SUCCESSOR(*SecHead);        // Get next sector number.
+    }
+
+    // If we walked the whole chain, remember its end for appending...
+    if( *Sector == -1 && Tail != -1 )
+    {
+        Fdesc->TailSector = Tail;
+        Fdesc->TailStart  = TailStart;
+        Fdesc->TailEnd    = Count;
+    }
+
+    *HoleLength = (NextStart == -1) ? -1 : NextStart - Position;
+
+    return 1;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::FindTail
+//
+//    Purpose:          Find the last sector of a file's chain.
+//
+//    Inputs:           Fdesc - Pointer to file descriptor.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            Sets TailSector, TailStart and TailEnd in the descriptor.  Skips
+//                      are followed, so this takes O(log n) header reads.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::FindTail( FFS_FILE_DESCRIPTOR* Fdesc )
+{
+    FFS_SECTOR_HEADER     SecHead;
+    unsigned long          Sector;
+    unsigned long          Count = 0;             // File offset of current sector's data.
+    unsigned long          Walked = 0;            // Loop guard.
+    bool                   Skipped = false;       // Header was read by TakeSkip().
+    int                    rc;
+
+    Sector = Fdesc->FnodeSector;
+
+    while( Sector != -1 )
+    {
+        if( !Skipped && (rc = ReadSectorHeader( Sector, &SecHead )) < 0 )
+        {
+            return rc;
+        }
+        Skipped = false;
+
+        if( ++Walked > TotalSectors )
+        {
+            return FFS_RC_INVALID_SECTOR_NUMBER;
+        }
+
+        if( SecHead.FileOffset != -1 )
+        {
+            Count = SecHead.FileOffset;
+        }
+
+        // A sector that is skipped over isn't the last one...
+        if( (Skipped = TakeSkip( Fdesc, &SecHead, Count, -1, &Sector )) )
+        {
+            continue;
+        }
+
+        Fdesc->TailSector = Sector;
+        Fdesc->TailStart  = Count;
+
+        Count += SecHead.SectorLength - SecHead.DataOffset;
+        Sector = FFS_SUCCESSOR(SecHead);
+    }
+
+    Fdesc->TailEnd = Count;
+
+    return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::TakeSkip
+//
+//    Purpose:          Follow a sector's Skip if it doesn't go past a file position.
+//
+//    Inputs:           Fdesc    - Pointer to file descriptor.
+//                      SecHead  - Header of the current sector.
+//                      Start    - File offset of the current sector's data.
+//                      Position - File position being looked for, -1 for the end.
+//
+//    Outputs:          Sector   - The sector skipped to, if it was.
+//                      SecHead  - And its header.
+//
+//    Returns:          true if the skip was taken.
+//
+//    Notes:            Only an ordered chain can be searched this way.  Once sectors
+//                      have been unlinked from a file its skips may point at sectors
+//                      it no longer has, so they are left alone.  A skip only ever goes
+//                      to a sector in use past the fnode sector; one that finds a freed
+//                      or reused sector isn't taken.
+//
+//---------------------------------------------------------------------------------------
+bool Jcffs::TakeSkip( FFS_FILE_DESCRIPTOR* Fdesc,
+                     FFS_SECTOR_HEADER*   SecHead,
+                     unsigned long         Start,
+                     unsigned long         Position,
+                     unsigned long*        Sector )
+{
+    FFS_SECTOR_HEADER     SkipHead;
+
+    if( SecHead->Skip == -1 ||
+        (Fdesc->Fnode.Flags & (FFS_FNODE_UNORDERED | FFS_FNODE_SKIPS_STALE)) )
+    {
+        return false;
+    }
+
+    if( ReadSectorHeader( SecHead->Skip, &SkipHead ) < 0 ||
+        SkipHead.Key != FFS_SECTOR_HEADER_KEY ||
+        SkipHead.Status != FFS_SECTOR_HEADER_INUSE ||
+        SkipHead.FileOffset == -1 ||
+        SkipHead.FileOffset <= Start ||
+        SkipHead.FileOffset > Position )
+    {
+        return false;
+    }
+
+    *Sector  = SecHead->Skip;
+    *SecHead = SkipHead;
+
+    return true;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::LocateIndexed
+//
+//    Purpose:          Locate a file position from the file's index.
+//
+//    Inputs:           Fdesc    - Pointer to file descriptor.
+//                      Position - Position of file to locate.
+//
+//    Outputs:          As for LocatePosition().
+//
+//    Returns:          0, 1 if position is in a hole, 2 if the chain has to be walked,
+//                      or Jcffs error code.
+//
+//    Notes:            The index is looked for the first time it is needed and kept in
+//                      the descriptor.  The sectors after the fnode sector are usually
+//                      the same size, so the entry for a position can be worked out
+//                      and is read together with the one after it: one read of the
+//                      index and one of the sector header.  If the guess is wrong, the
+//                      entries are searched.
+//
+//                      Positions past the last sector are left to the walk, which finds
+//                      the tail for appending.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::LocateIndexed( FFS_FILE_DESCRIPTOR* Fdesc,
+                         unsigned long         Position,
+                         unsigned long*        Sector,
+                         FFS_SECTOR_HEADER*   SecHead,
+                         unsigned long*        Offset,
+                         unsigned long*        HoleLength )
+{
+    FFS_SECTOR_INDEX*     Index;
+    unsigned char          Raw[2 * FFS_V3_INDEX_ENTRY_SIZE];
+    unsigned long          Entry;                 // Entry being looked at.
+    unsigned long          Low = 0;               // The one we want is in [Low, High).
+    unsigned long          High;
+    unsigned long          Start;                 // File offset of the entry's data.
+    unsigned long          NextStart;             // And of the entry after it.
+    unsigned long          NextSector;
+    int                    Length;
+    int                    rc;
+
+    Index = &(Fdesc->Index);
+
+    if( !Fdesc->IndexLoaded )
+    {
+        Fdesc->IndexSector = FindIndex( Fdesc->FnodeSector, &(Fdesc->Fnode), Index, &(Fdesc->IndexData) );
+        Fdesc->IndexLoaded = 1;
+    }
+
+    if( Fdesc->IndexSector == -1 )
+    {
+        return 2;
+    }
+
+    // Work out which entry the position should be in...
+    if( Position < Index->Base || Index->Stride == 0 )
+    {
+        Entry = 0;
+    }
+    else
+    {
+        Entry = 1 + (Position - Index->Base) / Index->Stride;
+    }
+
+    High = Index->Entries;
+    if( Entry >= High )
+    {
+        Entry = High - 1;
+    }
+
+    for( ;; )
+    {
+        Length = (Entry + 1 < Index->Entries) ? 2 * FFS_V3_INDEX_ENTRY_SIZE : FFS_V3_INDEX_ENTRY_SIZE;
+
+        if( (rc = ReadSector( Fdesc->IndexSector,
+                              Fdesc->IndexData + Entry * FFS_V3_INDEX_ENTRY_SIZE,
+                              Raw,
+                              Length )) < 0 )
+        {
+            return rc;
+        }
+
+        FFSDecodeIndexEntry( Raw, &Start, Sector );
+
+        NextStart = -1;
+        if( Length > FFS_V3_INDEX_ENTRY_SIZE )
+        {
+            FFSDecodeIndexEntry( Raw + FFS_V3_INDEX_ENTRY_SIZE, &NextStart, &NextSector );
+        }
+
+        if( Start > Position )
+        {
+            High = Entry;
+        }
+        else if( NextStart != -1 && NextStart <= Position )
+        {
+            Low = Entry + 1;
+        }
+        else
+        {
+            break;                                // This is the one.
+        }
+
+        if( Low >= High )
+        {
+            return 2;                             // Index is out of order.
+        }
+
+        Entry = Low + (High - Low) / 2;
+    }
+
+    if( (rc = ReadSectorHeader( *Sector, SecHead )) < 0 )
+    {
+        return rc;
+    }
+
+    // The sector has to be the one that was indexed...
+    if( SecHead->Key != FFS_SECTOR_HEADER_KEY ||
+        SecHead->FileOffset != Start ||
+        ( SecHead->Status != FFS_SECTOR_HEADER_INUSE &&
+          SecHead->Status != FFS_SECTOR_HEADER_INUSE_FILENODE ) )
+    {
+        return 2;
+    }
+
+    if( Position < Start + (SecHead->SectorLength - SecHead->DataOffset) )
+    {
+        *Offset = SecHead->DataOffset + (Position - Start);
+        return 0;
+    }
+
+    if( NextStart == -1 )
+    {
+        return 2;
+    }
+
+    // Between this sector and the next one is a hole...
+    *HoleLength = NextStart - Position;
+
+    return 1;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteIndex
+//
+//    Purpose:          Write an index of a file's chain.
+//
+//    Inputs:           FnodeSector - First sector of the chain.
+//                      Fnode       - The fnode that will be written there.  It is
+//                                    pointed to the index.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            Called before the fnode is written, at close or when a file gets
+//                      a new fnode sector, so the fnode can point to the index.  If power is lost before the fnode goes out,
+//                      Check() frees the index along with the rest of the file.  Files
+//                      of fewer than FFS_INDEX_MIN_SECTORS sectors, chains out of file
+//                      order, and chains too long for one sector aren't indexed.
+//                      Having no index only makes the file slower to locate in, so
+//                      running out of space isn't an error.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteIndex( unsigned long FnodeSector, FFS_FILE_NODE* Fnode )
+{
+    FFS_SECTOR_HEADER     SecHead;
+    FFS_SECTOR_HEADER     IndexHead;
+    FFS_SECTOR_INDEX      Index;
+    unsigned char          Raw[16 * FFS_V3_INDEX_ENTRY_SIZE];
+    unsigned long          Sector;
+    unsigned long          IndexSector;
+    unsigned long          Count = 0;             // File offset of current sector's data.
+    unsigned long          Entries = 0;
+    unsigned long          Offset;                // Where the next entries go.
+    int                    Length = 0;            // Bytes of entries in Raw.
+    int                    rc;
+
+    if( Fnode->Flags & FFS_FNODE_UNORDERED )
+    {
+        return 0;
+    }
+
+    // Small files are quick to walk and aren't worth a sector...
+    for( Sector = FnodeSector; Sector != -1; Sector = FFS_SUCCESSOR(SecHead) )
+    {
+        if( (rc = ReadSectorHeader( Sector, &SecHead )) < 0 )
+        {
+            return rc;
+        }
+
+        if( Sector == FnodeSector && SecHead.Version < FFS_FILE_SYSTEM_VERSION_V3 )
+        {
+            return 0;
+        }
+
+        if( ++Entries > TotalSectors )
+        {
+            return FFS_RC_INVALID_SECTOR_NUMBER;
+        }
+    }
+
+    if( Entries < FFS_INDEX_MIN_SECTORS )
+    {
+        return 0;
+    }
+
+    if( (rc = AllocateSectorWithStatus( &IndexSector,
+                                        &IndexHead,
+                                        FFS_SECTOR_HEADER_INUSE_INDEX,
+                                        FFSHeaderSize( FFS_FILE_SYSTEM_VERSION ),
+                                        -1,
+                                        FFS_V3_INDEX_SIZE + Entries * FFS_V3_INDEX_ENTRY_SIZE )) != 0 )
+    {
+        return (rc == FFS_RC_OUT_OF_SPACE) ? 0 : rc;
+    }
+
+    if( IndexHead.SectorLength - IndexHead.DataOffset < FFS_V3_INDEX_SIZE + Entries * FFS_V3_INDEX_ENTRY_SIZE )
+    {
+        return WriteSectorStatus( IndexSector, IndexHead.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+    }
+
+    Index.Owner   = FnodeSector;
+    Index.Count   = Fnode->Count;
+    Index.Entries = Entries;
+    Index.Base    = -1;
+    Index.Stride  = 0;
+    Offset        = IndexHead.DataOffset + FFS_V3_INDEX_SIZE;
+
+    BeginWrites();
+
+    for( Sector = FnodeSector, Entries = 0; Sector != -1; Sector = FFS_SUCCESSOR(SecHead), Entries++ )
+    {
+        ReadSectorHeader( Sector, &SecHead );
+
+        if( SecHead.FileOffset != -1 )
+        {
+            Count = SecHead.FileOffset;
+        }
+
+        // The second sector is taken as the size of the rest...
+        if( Entries == 1 )
+        {
+            Index.Base   = Count;
+            Index.Stride = SecHead.SectorLength - SecHead.DataOffset;
+        }
+
+        Length += FFSEncodeIndexEntry( Count, Sector, Raw + Length );
+
+        if( Length == sizeof(Raw) )
+        {
+            WriteSector( IndexSector, Offset, Raw, Length );
+            Offset += Length;
+            Length  = 0;
+        }
+
+        Count += SecHead.SectorLength - SecHead.DataOffset;
+    }
+
+    if( Length )
+    {
+        WriteSector( IndexSector, Offset, Raw, Length );
+    }
+
+    Length = FFSEncodeIndex( &Index, Raw );
+    WriteSector( IndexSector, IndexHead.DataOffset, Raw, Length );
+
+    if( (rc = EndWrites()) < 0 )
+    {
+        return rc;
+    }
+
+    Fnode->IndexSector = IndexSector;
+    Fnode->Flags      |= FFS_FNODE_INDEXED;
+
+    return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::FindIndex
+//
+//    Purpose:          Find and check the index of a file's chain.
+//
+//    Inputs:           FnodeSector - The file's fnode sector.
+//                      Fnode       - Its fnode.
+//
+//    Outputs:          Index       - The index, less its entries.
+//                      IndexData   - If not NULL, offset of the first entry.
+//
+//    Returns:          The index sector, or -1 if the file has no index that can be used.
+//
+//    Notes:            The index has to name the file as its owner, so an index sector
+//                      that was freed and used again is never taken for the file's.
+//
+//---------------------------------------------------------------------------------------
+unsigned long Jcffs::FindIndex( unsigned long      FnodeSector,
+                               FFS_FILE_NODE*     Fnode,
+                               FFS_SECTOR_INDEX*  Index,
+                               unsigned long*     IndexData )
+{
+    FFS_SECTOR_HEADER     SecHead;
+    unsigned char          Raw[FFS_V3_INDEX_SIZE];
+
+    if( (Fnode->Flags & (FFS_FNODE_INDEXED | FFS_FNODE_INDEX_STALE)) != FFS_FNODE_INDEXED ||
+        Fnode->IndexSector >= TotalSectors )
+    {
+        return -1;
+    }
+
+    if( ReadSectorHeader( Fnode->IndexSector, &SecHead ) < 0 ||
+        SecHead.Key     != FFS_SECTOR_HEADER_KEY ||
+        SecHead.Status  != FFS_SECTOR_HEADER_INUSE_INDEX ||
+        SecHead.Version <  FFS_FILE_SYSTEM_VERSION_V3 ||
+        ReadSector( Fnode->IndexSector, SecHead.DataOffset, Raw, sizeof(Raw) ) < 0 )
+    {
+        return -1;
+    }
+
+    FFSDecodeIndex( Raw, Index );
+
+    if( Index->Owner != FnodeSector ||
+        Index->Count != Fnode->Count ||
+        Index->Entries == 0 ||
+        Index->Entries > TotalSectors ||
+        SecHead.DataOffset + FFS_V3_INDEX_SIZE + Index->Entries * FFS_V3_INDEX_ENTRY_SIZE > SecHead.SectorLength )
+    {
+        return -1;
+    }
+
+    if( IndexData != NULL )
+    {
+        *IndexData = SecHead.DataOffset + FFS_V3_INDEX_SIZE;
+    }
+
+    return Fnode->IndexSector;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::FreeIndex
+//
+//    Purpose:          Free a file's index sector.
+//
+//    Inputs:           IndexSector - The index sector, as FindIndex() returned it.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The status is written in the layout of the sector's own header,
+//                      as WriteIndex() does, since the index may have been written by
+//                      any version from V3 on.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::FreeIndex( unsigned long IndexSector )
+{
+    FFS_SECTOR_HEADER     SecHead;
+    int                    rc;
+
+    if( (rc = ReadSectorHeader( IndexSector, &SecHead )) < 0 )
+    {
+        return rc;
+    }
+
+    return WriteSectorStatus( IndexSector, SecHead.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::DropIndex
+//
+//    Purpose:          Give up an open file's index because its chain is changing.
+//
+//    Inputs:           Fdesc - Pointer to file descriptor.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The fnode is flagged stale before the index is freed, so it
+//                      never points to a free sector.  An index can't be rewritten in
+//                      place; the file is walked from now on.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::DropIndex( FFS_FILE_DESCRIPTOR* Fdesc )
+{
+    FFS_SECTOR_INDEX      Index;
+    unsigned long          IndexSector;
+    int                    rc;
+
+    if( (Fdesc->Fnode.Flags & (FFS_FNODE_INDEXED | FFS_FNODE_INDEX_STALE)) != FFS_FNODE_INDEXED )
+    {
+        return 0;
+    }
+
+    IndexSector = FindIndex( Fdesc->FnodeSector, &(Fdesc->Fnode), &Index, NULL );
+
+    if( (rc = WriteFileNodeFlags( Fdesc, FFS_FNODE_INDEX_STALE )) < 0 )
+    {
+        return rc;
+    }
+
+    Fdesc->IndexSector = -1;
+    Fdesc->IndexLoaded = 1;
+
+    if( IndexSector != -1 )
+    {
+        return FreeIndex( IndexSector );
+    }
+
+    return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteSkips
+//
+//    Purpose:          Program the Skip fields of a new chain.
+//
+//    Inputs:           FnodeSector - First sector of the chain.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            FFSSkipIndex() says where each sector skips to by chain
+//                      position, so the chain is counted first.  A sector always skips
+//                      forward, and the ones still waiting for the sector they skip to
+//                      always want the nearest first, so they are kept on a stack that
+//                      is never deeper than the tree, and each is programmed when the
+//                      walk gets there.  Only version 4 sectors have a Skip.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteSkips( unsigned long FnodeSector )
+{
+    FFS_SECTOR_HEADER     SecHead;
+    unsigned long          Waiting[8 * sizeof(unsigned long)];     // Sectors waiting...
+    unsigned long          WaitingFor[8 * sizeof(unsigned long)];  // ...for this position.
+    unsigned char          WaitingVersion[8 * sizeof(unsigned long)];
+    int                    Depth = 0;
+    unsigned long          Sector;
+    unsigned long          Count = 0;
+    unsigned long          Index;
+    unsigned long          Target;
+    int                    rc = 0;
+
+    for( Sector = FnodeSector; Sector != -1; Sector = FFS_SUCCESSOR(SecHead) )
+    {
+        if( (rc = ReadSectorHeader( Sector, &SecHead )) < 0 )
+        {
+            return rc;
+        }
+
+        if( ++Count > TotalSectors )
+        {
+            return FFS_RC_INVALID_SECTOR_NUMBER;
+        }
+    }
+
+    BeginWrites();
+
+    for( Sector = FnodeSector, Index = 0; Sector != -1; Sector = FFS_SUCCESSOR(SecHead), Index++ )
+    {
+        if( (rc = ReadSectorHeader( Sector, &SecHead )) < 0 )
+        {
+            break;
+        }
+
+        if( Depth > 0 && WaitingFor[Depth - 1] == Index )
+        {
+            Depth--;
+            WriteSectorSkip( Waiting[Depth], WaitingVersion[Depth], Sector );
+        }
+
+        Target = FFSSkipIndex( Index, Count );
+
+        if( Target != -1 &&
+            SecHead.Version >= FFS_FILE_SYSTEM_VERSION_V4 &&
+            SecHead.Skip == -1 &&
+            Depth < (int)(sizeof(Waiting) / sizeof(Waiting[0])) )
+        {
+            Waiting[Depth]        = Sector;
+            WaitingFor[Depth]     = Target;
+            WaitingVersion[Depth] = SecHead.Version;
+            Depth++;
+        }
+    }
+
+    if( rc < 0 )
+    {
+        EndWrites();
+        return rc;
+    }
+
+    return EndWrites();
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::LocateWritePosition
+//
+//    Purpose:          Locate the sector to write the file position into, allocating
+//                      one if there isn't one.
+//
+//    Inputs:           Fdesc  - Pointer to file descriptor.
+//                      Length - Bytes the caller is about to write there.
+//
+//    Outputs:          Sector  - Sector number where position is located.
+//                      SecHead - Sector header from that sector.
+//                      Offset  - Offset into sector where position is at.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            A new sector always goes on the end of the chain, since that is
+//                      the only Next field that is still erased.  It starts at the file
+//                      position, the fnode sector of a new file too.  A sector that fills a hole is cut short to what is
+//                      about to be written, so it never overlaps the data after it and
+//                      has no unwritten bytes inside the file.  If that puts the chain
+//                      out of file order, the fnode is flagged; older format fnodes
+//                      can't be, so holes in their files can't be filled.
+//
+//                      Sequential writes only ever use the tail, which the descriptor
+//                      remembers, so they don't walk the chain.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::LocateWritePosition( FFS_FILE_DESCRIPTOR* Fdesc,
+                               unsigned long         Length,
+                               unsigned long*        Sector,
+                               FFS_SECTOR_HEADER*   SecHead,
+                               unsigned long*        Offset )
+{
+    FFS_SECTOR_HEADER     TailHead;
+    FFS_FILE_NODE*        Fnode;
+    unsigned long          Position;
+    unsigned long          HoleLength = -1;
+    int                    rc;
+
+    Fnode    = &(Fdesc->Fnode);
+    Position = Fdesc->Position;
+
+    // Is this a new file and first time?  Then we need to allocate the first sector. The
+    // first sector is where the Fnode will live, but not now; when the file is closed.
+    // It starts at the first position written, so whatever is before that is a hole...
+    if( Fdesc->FnodeSector == -1 )
+    {
+        if( (rc = AllocateSectorWithFilenode( Sector, SecHead, Fnode, Position )) != 0)
+        {
+            return rc;
+        }
+
+        // Indicate we need to write out fnode when file closes.
+        Fdesc->WriteFnode  = 1;
+        Fdesc->FnodeSector = *Sector;             // And save first sector# where fnode goes.
+        Fdesc->TailSector  = *Sector;
+        Fdesc->TailStart   = Position;
+        Fdesc->TailEnd     = Position + (SecHead->SectorLength - SecHead->DataOffset);
+    }
+
+    // Is position within the last sector?  This is where sequential writes go...
+    if( Fdesc->TailSector != -1 &&
+        Position >= Fdesc->TailStart && Position < Fdesc->TailEnd )
+    {
+        if( (rc = ReadSectorHeader( Fdesc->TailSector, SecHead )) < 0 )
+        {
+            return rc;
+        }
+
+        *Sector = Fdesc->TailSector;
+        *Offset = SecHead->DataOffset + (Position - Fdesc->TailStart);
+        return 0;
+    }
+
+    // Past the last sector of an ordered chain, nothing can be in the way. Otherwise,
+    // find the sector or the hole the position is in...
+    if( Fdesc->TailSector == -1 ||
+        Position < Fdesc->TailEnd ||
+        (Fnode->Flags & FFS_FNODE_UNORDERED) )
+    {
+        if( (rc = LocatePosition( Fdesc, Position, Sector, SecHead, Offset, &HoleLength )) <= 0 )
+        {
+            return rc;
+        }
+
+        // LocatePosition() stops at the hole in an ordered chain...
+        if( Fdesc->TailSector == -1 )
+        {
+            if( (rc = FindTail( Fdesc )) < 0 )
+            {
+                return rc;
+            }
+        }
+
+        // Data past the position means the new sector goes out of order...
+        if( HoleLength != -1 && !(Fnode->Flags & FFS_FNODE_UNORDERED) )
+        {
+            if( (rc = WriteFileNodeFlags( Fdesc, FFS_FNODE_UNORDERED )) < 0 )
+            {
+                return rc;
+            }
+        }
+    }
+
+    if( (rc = ReadSectorHeader( Fdesc->TailSector, &TailHead )) < 0 )
+    {
+        return rc;
+    }
+
+    // Allocate another sector. If we can't, then we are out of room. AllocateSector()
+    // allocates a free sector and writes out an updated sector header, which is also
+    // returned.
+    if( HoleLength != -1 && HoleLength > Length )
+    {
+        HoleLength = Length;
+    }
+
+    // The chain is about to change, so its index no longer describes it...
+    if( (rc = DropIndex( Fdesc )) < 0 )
+    {
+        return rc;
+    }
+
+    if( (rc = AllocateSector( Sector, SecHead, Position, HoleLength )) != 0 )
+    {
+        return rc;
+    }
+
+    // Chain new sector to the last one.  When a Sector is allocated, it's Next chain
+    // pointer is 0xFFFFFFFF so that we can update it later (like right now)...
+    WriteSectorNext( Fdesc->TailSector, TailHead.Version, *Sector );
+
+    Fdesc->TailSector = *Sector;
+    Fdesc->TailStart  = Position;
+    Fdesc->TailEnd    = Position + (SecHead->SectorLength - SecHead->DataOffset);
+
+    // For every sector after the first one, data starts right after header...
+    *Offset = SecHead->DataOffset;
+
+    return 0;
+}
+
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::LocateFileNode
+//
+//    Purpose:          Locate the file in the file system.  If it is found, then
+//                      copy filenode to caller's place and return sector where
+//                      filenode is, which is also the start of the file.
+//
+//                      Locate the file by going thru every sector and if it is a sector
+//                      with a valid fnode, check the name.
+//
+//    Inputs:           Filename - the name of the file to locate.
+//
+//    Outputs:          Fnode  - Where to copy the filenode.
+//                      Sector - The sector number where the filenode lives.
+//
+//    Returns:          0=Found, 1=Not Found, or Jcffs error code.
+//
+//    Notes:            Names the name filter doesn't have are not looked for.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::LocateFileNode(char* Filename, FFS_FILE_NODE* RtnFnode, unsigned long* RtnSector)
+{
+    unsigned long         Sector;
+    unsigned long         Hash;
+    unsigned long         ProbeHash;
+    FFS_SECTOR_HEADER    ProbeHeader;
+    FFS_FILE_NODE        Fnode;
+    char                  CompName[FFS_MAX_FILENAME_LENGTH + 1];
+    char                  FnodeName[FFS_MAX_FILENAME_LENGTH + 1];
+    int                   HasHash;
+
+    Sector = 0;                                   // Start with the first sector.
+
+    // Copy Filename so we can compare case-insensitive. Names are stored truncated,
+    // so truncate ours the same way...
+    strncpy(CompName, Filename, FFS_MAX_FILENAME_LENGTH);
+    CompName[FFS_MAX_FILENAME_LENGTH] = 0;
+    StringToUpperCase(CompName);
+
+    Hash = FFSHashName(CompName);
+
+    // A name that isn't in the filter isn't on the volume...
+    if( !NameFilterValid )
+    {
+        BuildNameFilter();
+    }
+
+    LookupStats.Lookups++;
+
+    if( !InNameFilter( Hash ) )
+    {
+        LookupStats.Filtered++;
+        *RtnSector = -1;
+        return 0;
+    }
+
+    while( ValidSector( Sector ) )
+    {
+        // An update may be erasing this one.  It holds no file...
+        if( Sector == ErasingSector )
+        {
+            Sector += 1;
+            continue;
+        }
+
+        // Read sector header and the name hash that follows it. Version 1 fnodes
+        // have no hash...
+        HasHash = ReadNameProbe( Sector, &ProbeHeader, &ProbeHash );
+
+        // Does this sector have an fnode?  If it does and its hash doesn't match, it
+        // can't be our file. Always look at fnodes that have no hash...
+        if( ProbeHeader.Status == FFS_SECTOR_HEADER_INUSE_FILENODE &&
+            ( !HasHash || ProbeHash == Hash ) )
+        {
+            // Read File Node, which contains filename...
+            ReadFileNode( Sector, &ProbeHeader, &Fnode );
+
+            // Copy and uppercase name from fnode so we can compare case-insensitive...
+            strcpy(FnodeName, Fnode.Filename);
+            StringToUpperCase(FnodeName);
+
+            // Now see if filenames match...
+            if( strcmp(FnodeName, CompName) == 0 )
+            {
+                // Filenames match, so return fnode and sector...
+                memcpy(RtnFnode, &Fnode, sizeof(FFS_FILE_NODE));
+                *RtnSector = Sector;
+                LookupStats.Found++;
+                return 1;
+            }
+        }
+
+        Sector += 1;              // Next sequencial sector number.
+
+    }
+
+    // Could not find file...
+    *RtnSector = -1;
+    LookupStats.FalsePositives++;
+    return 0;
+}
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::BuildNameFilter
+//
+//    Purpose:          Build the name filter from the fnodes on the volume.
+//
+//    Inputs:           None.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            Only the name hash after each header is read, except for
+//                      version 1 fnodes, which have none.  If a sector can't be read,
+//                      the filter is left full, so that every lookup scans.
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::BuildNameFilter( void )
+{
+    unsigned long         Sector;
+    unsigned long         ProbeHash;
+    FFS_SECTOR_HEADER    ProbeHeader;
+    FFS_FILE_NODE        Fnode;
+    int                   HasHash;
+
+    memset( NameFilter, 0, sizeof(NameFilter) );
+
+    for( Sector = 0; ValidSector( Sector ); Sector++ )
+    {
+        if( Sector == ErasingSector )
+        {
+            continue;
+        }
+
+        HasHash = ReadNameProbe( Sector, &ProbeHeader, &ProbeHash );
+
+        // A sector we can't read might hold any name, so let every name thru...
+        if( HasHash < 0 )
+        {
+            memset( NameFilter, 0xff, sizeof(NameFilter) );
+            break;
+        }
+
+        if( ProbeHeader.Status != FFS_SECTOR_HEADER_INUSE_FILENODE )
+        {
+            continue;
+        }
+
+        if( !HasHash )
+        {
+            ReadFileNode( Sector, &ProbeHeader, &Fnode );
+            ProbeHash = FFSHashName( Fnode.Filename );
+        }
+
+        AddToNameFilter( ProbeHash );
+    }
+
+    NameFilterValid = true;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::AddToNameFilter / Jcffs::InNameFilter
+//
+//    Purpose:          Add a name to the name filter, or see if it might be there.
+//
+//    Inputs:           Hash - FFSHashName() of the name.
+//
+//    Returns:          InNameFilter(): false if no file has the name.
+//
+//    Notes:            The filter's bits are picked by double hashing: the hash, and
+//                      the hash rotated, step thru the filter.
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::AddToNameFilter( unsigned long Hash )
+{
+    unsigned long          Step = (((Hash >> 17) | (Hash << 15)) & 0xffffffff) | 1;
+    unsigned long          Bit;
+    int                    i;
+
+    for( i = 0; i < FFS_NAME_FILTER_HASHES; i++ )
+    {
+        Bit = (Hash + i * Step) % FFS_NAME_FILTER_BITS;
+        NameFilter[Bit / (8 * sizeof(unsigned long))] |= 1UL << (Bit % (8 * sizeof(unsigned long)));
+    }
+}
+
+bool Jcffs::InNameFilter( unsigned long Hash )
+{
+    unsigned long          Step = (((Hash >> 17) | (Hash << 15)) & 0xffffffff) | 1;
+    unsigned long          Bit;
+    int                    i;
+
+    for( i = 0; i < FFS_NAME_FILTER_HASHES; i++ )
+    {
+        Bit = (Hash + i * Step) % FFS_NAME_FILTER_BITS;
+        if( !(NameFilter[Bit / (8 * sizeof(unsigned long))] & (1UL << (Bit % (8 * sizeof(unsigned long))))) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::SameName
+//
+//    Purpose:          Compare two file names the way LocateFileNode() does.
+//
+//    Inputs:           Name, OtherName - The names.
+//
+//    Returns:          true if they name the same file.
+//
+//    Notes:            Case is ignored, and so is anything past the longest name
+//                      that can be stored.
+//
+//---------------------------------------------------------------------------------------
+bool Jcffs::SameName( const char* Name, const char* OtherName )
+{
+    char                  CompName[FFS_MAX_FILENAME_LENGTH + 1];
+    char                  OtherCompName[FFS_MAX_FILENAME_LENGTH + 1];
+
+    strncpy(CompName, Name, FFS_MAX_FILENAME_LENGTH);
+    CompName[FFS_MAX_FILENAME_LENGTH] = 0;
+    StringToUpperCase(CompName);
+
+    strncpy(OtherCompName, OtherName, FFS_MAX_FILENAME_LENGTH);
+    OtherCompName[FFS_MAX_FILENAME_LENGTH] = 0;
+    StringToUpperCase(OtherCompName);
+
+    return strcmp(CompName, OtherCompName) == 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::RecallFile
+//
+//    Purpose:          Set up a descriptor from the open cache.
+//
+//    Inputs:           Filename - Name of the file being opened.
+//
+//    Outputs:          Fdesc    - Its fnode, fnode sector, tail and index, if cached.
+//
+//    Returns:          true if the file was in the cache.
+//
+//    Notes:            While an update waits for an erase it has let go of the volume
+//                      lock part way thru, and hasn't yet dropped the entries for the
+//                      files it is changing, so the cache isn't used then.
+//
+//---------------------------------------------------------------------------------------
+bool Jcffs::RecallFile( char* Filename, FFS_FILE_DESCRIPTOR* Fdesc )
+{
+    FFS_OPEN_CACHE_ENTRY*  Entry;
+    unsigned long          Hash;
+    int                    i;
+
+    if( ErasingSector != -1 )
+    {
+        return false;
+    }
+
+    Hash = FFSHashName( Filename );
+
+    for( i = 0; i < FFS_OPEN_CACHE_SIZE; i++ )
+    {
+        Entry = &OpenCache[i];
+
+        if( Entry->Used != 0 && Entry->NameHash == Hash &&
+            SameName( Entry->Fnode.Filename, Filename ) )
+        {
+            Entry->Used = ++OpenCacheClock;
+
+            Fdesc->FnodeSector  = Entry->FnodeSector;
+            Fdesc->FnodeVersion = Entry->FnodeVersion;
+            Fdesc->TailSector   = Entry->TailSector;
+            Fdesc->TailStart    = Entry->TailStart;
+            Fdesc->TailEnd      = Entry->TailEnd;
+            Fdesc->IndexLoaded  = Entry->IndexLoaded;
+            Fdesc->IndexSector  = Entry->IndexSector;
+            Fdesc->IndexData    = Entry->IndexData;
+            Fdesc->Index        = Entry->Index;
+            Fdesc->Fnode        = Entry->Fnode;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::RememberFile
+//
+//    Purpose:          Keep what a descriptor found about its file in the open cache.
+//
+//    Inputs:           Fdesc - Descriptor of a file being closed.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            A file changed while it was open, by this descriptor or
+//                      another, may not be the way this descriptor saw it, so it isn't
+//                      kept.  Otherwise its entry, or the least recently used, is
+//                      replaced.
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::RememberFile( FFS_FILE_DESCRIPTOR* Fdesc )
+{
+    FFS_OPEN_CACHE_ENTRY*  Entry = &OpenCache[0];
+    unsigned long          Hash;
+    int                    i;
+
+    if( Fdesc->Changed || Fdesc->FnodeSector == -1 )
+    {
+        return;
+    }
+
+    Hash = FFSHashName( Fdesc->Fnode.Filename );
+
+    for( i = 0; i < FFS_OPEN_CACHE_SIZE; i++ )
+    {
+        if( OpenCache[i].Used != 0 && OpenCache[i].NameHash == Hash &&
+            SameName( OpenCache[i].Fnode.Filename, Fdesc->Fnode.Filename ) )
+        {
+            Entry = &OpenCache[i];
+            break;
+        }
+
+        if( OpenCache[i].Used < Entry->Used )
+        {
+            Entry = &OpenCache[i];
+        }
+    }
+
+    Entry->Used         = ++OpenCacheClock;
+    Entry->NameHash     = Hash;
+    Entry->FnodeSector  = Fdesc->FnodeSector;
+    Entry->FnodeVersion = Fdesc->FnodeVersion;
+    Entry->TailSector   = Fdesc->TailSector;
+    Entry->TailStart    = Fdesc->TailStart;
+    Entry->TailEnd      = Fdesc->TailEnd;
+    Entry->IndexLoaded  = Fdesc->IndexLoaded;
+    Entry->IndexSector  = Fdesc->IndexSector;
+    Entry->IndexData    = Fdesc->IndexData;
+    Entry->Index        = Fdesc->Index;
+    Entry->Fnode        = Fdesc->Fnode;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ForgetFile
+//
+//    Purpose:          Drop a file from the open cache once it has changed.
+//
+//    Inputs:           Filename - Name of the file, or NULL for every file.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            Called at the end of the update that changed the file, so that
+//                      nothing found part way thru it is kept.  Descriptors that have
+//                      the file open are marked so that they don't put it back when
+//                      they close.
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::ForgetFile( const char* Filename )
+{
+    unsigned long          Hash = 0;
+    int                    i;
+
+    if( Filename != NULL )
+    {
+        Hash = FFSHashName( Filename );
+    }
+
+    for( i = 0; i < FFS_OPEN_CACHE_SIZE; i++ )
+    {
+        if( OpenCache[i].Used != 0 &&
+            ( Filename == NULL ||
+              ( OpenCache[i].NameHash == Hash && SameName( OpenCache[i].Fnode.Filename, Filename ) ) ) )
+        {
+            OpenCache[i].Used = 0;
+        }
+    }
+
+    for( i = 0; i < FFS_MAX_FILE_DESCRIPTORS; i++ )
+    {
+        if( FileDescriptors[i].InUse &&
+            ( Filename == NULL || SameName( FileDescriptors[i].Fnode.Filename, Filename ) ) )
+        {
+            FileDescriptors[i].Changed = 1;
+        }
+    }
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ReadSectorHeader
+//
+//    Purpose:          Read a sector header, whatever format version the sector was
+//                      written in.
+//
+//    Inputs:           Sector  - Sector number to read the header from.
+//
+//    Outputs:          SecHead - Header in in-core form.
+//
+//    Returns:          0 > the length read or an Jcffs error code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ReadSectorHeader( unsigned long Sector, FFS_SECTOR_HEADER* SecHead )
+{
+    unsigned char         Raw[FFS_MAX_HEADER_SIZE];
+    int                   rc;
+
+    if( (rc = ReadSector( Sector, 0, Raw, sizeof(Raw) )) < 0 )
+    {
+        return rc;
+    }
+
+    FFSDecodeSectorHeader( Raw, SecHead );
+
+    return rc;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteSectorHeader
+//
+//    Purpose:          Write a whole sector header in the format its Version says.
+//
+//    Inputs:           Sector  - Sector number to write the header to.
+//                      SecHead - Header in in-core form.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteSectorHeader( unsigned long Sector, FFS_SECTOR_HEADER* SecHead )
+{
+    unsigned char         Raw[FFS_MAX_HEADER_SIZE];
+    int                   Length;
+
+    Length = FFSEncodeSectorHeader( SecHead, Raw );
+
+    return WriteSector( Sector, 0, Raw, Length );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteSectorNext
+//
+//    Purpose:          Program just the Next field of a sector header.
+//
+//    Inputs:           Sector  - Sector number whose header to update.
+//                      Version - Format version of that sector.
+//                      Next    - Sector number to chain to.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:            Next is all ones until it is programmed, so this can only be
+//                      done once per sector.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteSectorNext( unsigned long Sector, int Version, unsigned long Next )
+{
+    unsigned char         Raw[sizeof(unsigned long)];
+    int                   Length;
+
+    Length = FFSEncodeSectorNumber( Version, Next, Raw );
+
+    return WriteSector( Sector, FFSNextFieldOffset( Version ), Raw, Length );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteSectorStatus
+//
+//    Purpose:          Program just the Status field of a sector header.
+//
+//    Inputs:           Sector  - Sector number whose header to update.
+//                      Version - Format version of that sector.
+//                      Status  - New status.  Must only clear bits.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:            For version 1 and 2 sectors, the 4 bytes starting at Version
+//                      are rewritten as they always were, with the other bytes left
+//                      at their erased value so only Status changes.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteSectorStatus( unsigned long Sector, int Version, unsigned char Status )
+{
+    unsigned char         Raw[4];
+    int                   rc;
+
+    if( Version >= FFS_FILE_SYSTEM_VERSION_V3 )
+    {
+        rc = WriteSector( Sector, FFS_V3_STATUS_OFFSET, &Status, 1 );
+    }
+    else
+    {
+        Raw[0] = 0xff;                           // Version.
+        Raw[1] = Status;                         // Status.
+        Raw[2] = 0xff;                           // SectorChecksum.
+        Raw[3] = 0xff;
+
+        rc = WriteSector( Sector, FFSStatusFieldOffset( Version ), Raw, sizeof(Raw) );
+    }
+
+    // One more for the collector to clean, and its data can go...
+    if( Status == FFS_SECTOR_HEADER_FREE_DIRTY )
+    {
+        DirtySectors++;
+
+        if( rc >= 0 )
+        {
+            NoteDiscard( Sector, Version );
+        }
+    }
+
+    return rc;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteSectorBypass
+//
+//    Purpose:          Program just the Bypass field of a sector header.
+//
+//    Inputs:           Sector  - Sector number whose header to update.
+//                      Version - Format version of that sector.
+//                      Bypass  - Sector number that now follows this one.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:            Only version 3 headers have a Bypass field, and like Next it
+//                      can only be programmed once.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteSectorBypass( unsigned long Sector, int Version, unsigned long Bypass )
+{
+    unsigned char         Raw[sizeof(unsigned long)];
+    int                   Length;
+
+    if( Version < FFS_FILE_SYSTEM_VERSION_V3 )
+    {
+        return FFS_RC_INVALID_SECTOR_NUMBER;
+    }
+
+    Length = FFSEncodeSectorNumber( Version, Bypass, Raw );
+
+    return WriteSector( Sector, FFS_V3_BYPASS_OFFSET, Raw, Length );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteSectorSkip
+//
+//    Purpose:          Program just the Skip field of a sector header.
+//
+//    Inputs:           Sector  - Sector number whose header to update.
+//                      Version - Format version of that sector.
+//                      Skip    - Sector number it skips to.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:            Only version 4 headers have a Skip field.  It can only be
+//                      programmed once.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteSectorSkip( unsigned long Sector, int Version, unsigned long Skip )
+{
+    unsigned char         Raw[sizeof(unsigned long)];
+    int                   Length;
+
+    if( Version < FFS_FILE_SYSTEM_VERSION_V4 )
+    {
+        return FFS_RC_INVALID_SECTOR_NUMBER;
+    }
+
+    Length = FFSEncodeSectorNumber( Version, Skip, Raw );
+
+    return WriteSector( Sector, FFS_V4_SKIP_OFFSET, Raw, Length );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ReadNameProbe
+//
+//    Purpose:          Read a sector header and the name hash of the fnode that would
+//                      follow it, in one read.
+//
+//    Inputs:           Sector   - Sector number to read.
+//
+//    Outputs:          SecHead  - Header in in-core form.
+//                      NameHash - Stored name hash, if the format has one.
+//
+//    Returns:          1 if NameHash was returned, 0 if the sector's format has no
+//                      name hash, or an Jcffs error code.
+//
+//    Notes:            NameHash means nothing unless the sector holds an fnode.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ReadNameProbe( unsigned long      Sector,
+                         FFS_SECTOR_HEADER* SecHead,
+                         unsigned long*     NameHash )
+{
+    unsigned char         Raw[FFS_MAX_PROBE_SIZE];
+    int                   rc;
+    int                   Version;
+
+    if( (rc = ReadSector( Sector, 0, Raw, sizeof(Raw) )) < 0 )
+    {
+        return rc;
+    }
+
+    Version = FFSDecodeSectorHeader( Raw, SecHead );
+
+    return FFSDecodeNameHash( Version, Raw, NameHash );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ReadFileNode
+//
+//    Purpose:          Read the file node from a sector, whatever format version the
+//                      sector was written in.
+//
+//    Inputs:           Sector  - Sector number holding the fnode.
+//                      SecHead - That sector's header, already read.
+//
+//    Outputs:          Fnode   - File node in the current in-core format.
+//
+//    Returns:          0 > the length read or an Jcffs error code.
+//
+//    Notes:            Version 1 fnodes have no name hash, so one is computed.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ReadFileNode( unsigned long Sector, FFS_SECTOR_HEADER* SecHead, FFS_FILE_NODE* Fnode )
+{
+    unsigned char         Raw[FFS_MAX_FNODE_SIZE];
+    int                   rc;
+
+    if( (rc = ReadSector( Sector, FFSHeaderSize( SecHead->Version ), Raw, sizeof(Raw) )) < 0 )
+    {
+        return rc;
+    }
+
+    FFSDecodeFileNode( SecHead->Version, Raw, Fnode );
+
+    return rc;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteFileNode
+//
+//    Purpose:          Write a file node into a sector in that sector's format.
+//
+//    Inputs:           Sector  - Sector number to hold the fnode.
+//                      Version - Format version of that sector.
+//                      Fnode   - File node in in-core form.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:            The name goes into the name filter.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteFileNode( unsigned long Sector, int Version, FFS_FILE_NODE* Fnode )
+{
+    unsigned char         Raw[FFS_MAX_FNODE_SIZE];
+    int                   Length;
+
+    AddToNameFilter( FFSHashName( Fnode->Filename ) );
+
+    Length = FFSEncodeFileNode( Version, Fnode, Raw );
+
+    return WriteSector( Sector, FFSHeaderSize( Version ), Raw, Length );
+}
+
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteFileNodeFlags
+//
+//    Purpose:          Set flags in an open file's fnode.
+//
+//    Inputs:           Fdesc - Pointer to file descriptor.
+//                      Flags - FFS_FNODE_xxx flags to set.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:            If the fnode hasn't been written yet, it goes out with the flags
+//                      at close.  Otherwise the flags byte is programmed in place, which
+//                      works because flags are stored inverted.  Older format fnodes
+//                      have no flags.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteFileNodeFlags( FFS_FILE_DESCRIPTOR* Fdesc, unsigned char Flags )
+{
+    unsigned char         Raw;
+
+    if( Fdesc->WriteFnode )
+    {
+        Fdesc->Fnode.Flags |= Flags;
+        return 0;
+    }
+
+    if( Fdesc->FnodeVersion < FFS_FILE_SYSTEM_VERSION_V3 )
+    {
+        return FFS_RC_INVALID_FILE_POSITION;
+    }
+
+    Fdesc->Fnode.Flags |= Flags;
+    Raw = (unsigned char)~Fdesc->Fnode.Flags;
+
+    return WriteSector( Fdesc->FnodeSector,
+                        FFSHeaderSize( Fdesc->FnodeVersion ) + FFS_V3_FNODE_FLAGS_OFFSET,
+                        &Raw,
+                        1 );
+}
+
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::MoveFileNode
+//
+//    Purpose:          Give a file a new fnode sector.
+//
+//    Inputs:           Sector - The file's fnode sector.
+//                      Fnode  - The fnode to write in the new one.
+//
+//    Outputs:          NewSector - The new fnode sector.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            An fnode can only be programmed once, so a file that is renamed
+//                      or has grown gets a new one.  The data of the old fnode sector
+//                      is copied to the new one, which is chained to the rest of the
+//                      file, and then the old one is freed.
+//
+//                      The new fnode sector may not hold the same amount of data as the
+//                      old one (a different sector size, or an older format with a
+//                      different size fnode).  If the file continues past the first
+//                      sector, the new sector is shortened to the old data length so
+//                      the rest of the chain still lines up.  If it holds less, the
+//                      remainder goes into a short sector spliced in after it.
+//
+//                      The old index lists the old fnode sector, so it is freed and the
+//                      new chain is indexed again before the fnode is written, and any
+//                      sectors without a skip get one.  Descriptors open on the file
+//                      follow it to the new sector.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::MoveFileNode( unsigned long Sector, FFS_FILE_NODE* Fnode, unsigned long* NewSector )
+{
+   FFS_FILE_NODE         OldFnode;           // File node in the old sector.
+   FFS_SECTOR_HEADER     OldHead;            // Header of old fnode sector.
+   FFS_SECTOR_HEADER     SecHead;            // Header of new fnode sector.
+   FFS_SECTOR_HEADER     SpillHead;          // Header of spill sector, if we need one.
+   FFS_SECTOR_INDEX      Index;              // Index of the old chain, if it has one.
+   unsigned long          IndexSector;        // And its sector.
+   unsigned long          SpillSector = -1;   // Sector holding what didn't fit, if any.
+   unsigned long          NextSector;         // Saved sector chain pointer.
+   unsigned long          CopyLength;         // Bytes of data in the old fnode sector.
+   unsigned long          MaxLength;          // Most data the new sectors may hold.
+   unsigned long          FirstLength;        // Bytes that go into the new fnode sector.
+   unsigned long          Start;              // File offset of the old fnode sector's data.
+   FFS_FILE_DESCRIPTOR*  Fdesc;              // Descriptor open on the file.
+   int                    rc;
+
+   // Read Sector header, and the fnode that says where its index is...
+   if( (rc = ReadSectorHeader( Sector, &OldHead )) < 0 ||
+       (rc = ReadFileNode( Sector, &OldHead, &OldFnode )) < 0 )
+   {
+      return rc;
+   }
+
+   IndexSector = FindIndex( Sector, &OldFnode, &Index, NULL );
+
+   NextSector = FFS_SUCCESSOR(OldHead);
+   CopyLength = OldHead.SectorLength - OldHead.DataOffset;
+   Start      = (OldHead.FileOffset == -1) ? 0 : OldHead.FileOffset;
+
+   // If the first sector is the whole file, we only need to copy the file and the new
+   // sector can be any size. Otherwise, the new sector must hold exactly what the old
+   // one did so that the following sectors keep their file positions.  Either way, its
+   // data starts where the old one's did, past any hole at the start of the file...
+   if( NextSector == -1 )
+   {
+      if( Fnode->FileSize - Start < CopyLength )
+      {
+         CopyLength = Fnode->FileSize - Start;
+      }
+      MaxLength = -1;
+   }
+   else
+   {
+      MaxLength = CopyLength;
+   }
+
+   Fnode->Flags &= ~(FFS_FNODE_INDEXED | FFS_FNODE_INDEX_STALE);
+
+   // Allocate new fnode sector.  The length of the name decides where the data starts...
+   if( (rc = AllocateSectorWithStatus( NewSector,
+                                       &SecHead,
+                                       FFS_SECTOR_HEADER_INUSE_FILENODE,
+                                       FFSHeaderSize( FFS_FILE_SYSTEM_VERSION ) +
+                                          FFSFileNodeSize( FFS_FILE_SYSTEM_VERSION, Fnode ),
+                                       Start,
+                                       MaxLength )) != 0)
+   {
+      return rc;
+   }
+
+   FirstLength = SecHead.SectorLength - SecHead.DataOffset;
+   if( FirstLength > CopyLength )
+   {
+      FirstLength = CopyLength;
+   }
+
+   // If the new sector can't hold all of it, allocate a short sector for the rest...
+   if( FirstLength < CopyLength )
+   {
+      if( (rc = AllocateSectorWithStatus( &SpillSector,
+                                          &SpillHead,
+                                          FFS_SECTOR_HEADER_INUSE,
+                                          FFSHeaderSize(FFS_FILE_SYSTEM_VERSION),
+                                          Start + FirstLength,
+                                          (NextSector == -1) ? -1 : CopyLength - FirstLength )) != 0)
+      {
+         FreeSectors( *NewSector );
+         return rc;
+      }
+   }
+
+   // Now, copy data from old fnode sector to new fnode sector (and spill sector)...
+   IoCause = FFS_WRITE_RELOCATION;
+
+   CopySectorData( Sector, OldHead.DataOffset, *NewSector, SecHead.DataOffset, FirstLength );
+
+   if( SpillSector != -1 )
+   {
+      CopySectorData( Sector, OldHead.DataOffset + FirstLength,
+                      SpillSector, SpillHead.DataOffset,
+                      CopyLength - FirstLength );
+   }
+
+   IoCause = FFS_WRITE_METADATA;
+
+   // Update chain pointers (if not -1)...
+   if( SpillSector != -1 )
+   {
+      if( NextSector != -1 )
+      {
+         WriteSectorNext( SpillSector, SpillHead.Version, NextSector );
+      }
+      NextSector = SpillSector;
+   }
+
+   if( NextSector != -1 )
+   {
+      WriteSectorNext( *NewSector, SecHead.Version, NextSector );
+   }
+
+   // The chain starts at the new sector now, so it gets an index of its own, and the
+   // sectors without a skip get theirs...
+   WriteIndex( *NewSector, Fnode );
+   if( !(Fnode->Flags & (FFS_FNODE_UNORDERED | FFS_FNODE_SKIPS_STALE)) )
+   {
+      WriteSkips( *NewSector );
+   }
+
+   // Write new Fnode back out.  It goes last, so it is never found without its chain...
+   WriteFileNode( *NewSector, SecHead.Version, Fnode );
+
+   // Erase old fnode. Change status to FREE-DIRTY and then rewrite...
+   WriteSectorStatus( Sector, OldHead.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+
+   if( IndexSector != -1 )
+   {
+      FreeIndex( IndexSector );
+   }
+
+   // Descriptors open on the file follow it to its new fnode, and find the rest again...
+   for( Fdesc = FileDescriptors; Fdesc < FileDescriptors + FFS_MAX_FILE_DESCRIPTORS; Fdesc++ )
+   {
+      if( Fdesc->InUse && Fdesc->FnodeSector == Sector )
+      {
+         Fdesc->FnodeSector     = *NewSector;
+         Fdesc->FnodeVersion    = SecHead.Version;
+         Fdesc->TailSector      = -1;
+         Fdesc->IndexLoaded     = 0;
+         strcpy( Fdesc->Fnode.Filename, Fnode->Filename );
+         Fdesc->Fnode.NameHash  = Fnode->NameHash;
+         Fdesc->Fnode.Count     = Fnode->Count;
+         Fdesc->Fnode.Flags     = (Fdesc->Fnode.Flags & ~(FFS_FNODE_INDEXED | FFS_FNODE_INDEX_STALE)) |
+                                  (Fnode->Flags & FFS_FNODE_INDEXED);
+         Fdesc->Fnode.IndexSector = Fnode->IndexSector;
+      }
+   }
+
+   return 0;
+}
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::GrowFileNode
+//
+//    Purpose:          Record the new size of an existing file that was written past
+//                      its end.
+//
+//    Inputs:           Fdesc - Descriptor of the file, which is being closed.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The sectors written are already chained to the file, but its
+//                      size is in the fnode, so the file gets a new one, see
+//                      MoveFileNode().  The fnode is read again first, since another
+//                      descriptor may have renamed the file or grown it further.
+//
+//                      The new fnode has a higher Count.  If power is lost before the
+//                      old fnode sector is freed, Check() finds two files of the name
+//                      sharing a chain, and keeps the new one and the chain.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::GrowFileNode( FFS_FILE_DESCRIPTOR* Fdesc )
+{
+   FFS_SECTOR_HEADER     SecHead;
+   FFS_FILE_NODE         Fnode;
+   unsigned long          NewSector;
+   int                    rc;
+
+   if( (rc = ReadSectorHeader( Fdesc->FnodeSector, &SecHead )) < 0 ||
+       (rc = ReadFileNode( Fdesc->FnodeSector, &SecHead, &Fnode )) < 0 )
+   {
+      return rc;
+   }
+
+   if( Fnode.FileSize < Fdesc->Fnode.FileSize )
+   {
+      Fnode.FileSize = Fdesc->Fnode.FileSize;
+      Fnode.Count++;
+
+      if( (rc = MoveFileNode( Fdesc->FnodeSector, &Fnode, &NewSector )) < 0 )
+      {
+         return rc;
+      }
+   }
+
+   // What is kept in the open cache when the file closes is what is on flash now...
+   Fdesc->Fnode = Fnode;
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::AllocateSector
+//
+//    Purpose:          Allocate a sector that wasn't being used.
+//
+//    Inputs:           FileOffset    - File offset of the sector's first data byte.
+//                      MaxDataLength - Most data the sector may hold, or -1 to use
+//                                      the whole sector.
+//
+//    Outputs:          NewSector - Sector number of newly allocated sector.
+//                      SecHeader - A copy of new sector header.
+//
+//    Returns:          0 or an Jcffs error code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::AllocateSector( unsigned long*       NewSector,
+                          FFS_SECTOR_HEADER*  SecHeader,
+                          unsigned long        FileOffset,
+                          unsigned long        MaxDataLength )
+{
+   return AllocateSectorWithStatus( NewSector,
+                                    SecHeader,
+                                    FFS_SECTOR_HEADER_INUSE,
+                                    FFSHeaderSize( FFS_FILE_SYSTEM_VERSION ),
+                                    FileOffset,
+                                    MaxDataLength );
+}
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::AllocateSectorWithFilenode
+//
+//    Purpose:          Allocate a sector that wasn't being used. Leave space for
+//                      file node.
+//
+//    Inputs:           Fnode      - The file node that will go in the sector.  Its name
+//                                   decides how much space to leave.
+//                      FileOffset - File offset of the sector's first data byte.
+//
+//    Outputs:          NewSector - Sector number of newly allocated sector.
+//                      SecHeader - A copy of new sector header.
+//
+//    Returns:          0 or an Jcffs error code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::AllocateSectorWithFilenode( unsigned long*       NewSector,
+                                      FFS_SECTOR_HEADER*  SecHeader,
+                                      FFS_FILE_NODE*      Fnode,
+                                      unsigned long        FileOffset )
+{
+   return AllocateSectorWithStatus( NewSector,
+                                    SecHeader,
+                                    FFS_SECTOR_HEADER_INUSE_FILENODE,
+                                    FFSHeaderSize( FFS_FILE_SYSTEM_VERSION ) +
+                                       FFSFileNodeSize( FFS_FILE_SYSTEM_VERSION, Fnode ),
+                                    FileOffset,
+                                    -1 );
+}
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::AllocateSectorWithStatus
+//
+//    Purpose:          Allocate a sector that wasn't being used and write out its
+//                      header.
+//
+//    Inputs:           Status        - Status for the new sector header.
+//                      DataOffset    - Offset to where data starts in the sector.
+//                      FileOffset    - File offset of the sector's first data byte.
+//                      MaxDataLength - Most data the sector may hold, or -1 to use
+//                                      the whole sector.
+//
+//    Outputs:          NewSector - Sector number of newly allocated sector.
+//                      SecHeader - A copy of new sector header.
+//
+//    Returns:          0 or an Jcffs error code.
+//
+//    Notes:            A sector limited by MaxDataLength is a "short" sector. Its
+//                      SectorLength says where its data ends, so it reads and locates
+//                      like any other sector.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::AllocateSectorWithStatus( unsigned long*       NewSector,
+                                    FFS_SECTOR_HEADER*  SecHeader,
+                                    unsigned char        Status,
+                                    unsigned long        DataOffset,
+                                    unsigned long        FileOffset,
+                                    unsigned long        MaxDataLength )
+{
+   FFS_FLASH_SECTION*   Section;
+   bool                  Clean;
+
+
+   if( GcCountsValid == false )
+   {
+      CountFreeSectors();
+   }
+
+   // Each sector taken frees one of a deleted file, so deletions keep up with the
+   // writes that made them without any one write paying for all of them...
+   if( TrimCount > 0 )
+   {
+      ReclaimDeleted( 0 );
+   }
+
+   // Find a free sector. If we found one, clean it and update header.  Files being
+   // deleted may be holding the only space there is...
+   if( FindFreeSector( NewSector, SecHeader, &Section ) ||
+       ( ( TrimCount > 0 || TrimOverflow ) &&
+         ReclaimDeleted( -1 ) >= 0 &&
+         FindFreeSector( NewSector, SecHeader, &Section ) ) )
+   {
+      // A clean sector was erased by the collector, which counted the erase...
+      Clean = FFS_SECTOR_CLEAN(*SecHeader);
+
+      // We've already read his sector header, so update the sector header so
+      // that we can rewrite it after we erase the sector...
+      SecHeader->Key            = FFS_SECTOR_HEADER_KEY;
+      SecHeader->Next           = -1;
+      if( !Clean )
+      {
+         SecHeader->EraseCount++;
+      }
+      SecHeader->Version        = FFS_FILE_SYSTEM_VERSION;
+      SecHeader->Status         = Status;
+      SecHeader->SectorChecksum = 0xffff;
+      SecHeader->SectorLength   = Section->SectorSize;
+      SecHeader->DataOffset     = DataOffset;
+      SecHeader->FileOffset     = FileOffset;
+      SecHeader->Bypass         = -1;
+      SecHeader->Skip           = -1;
+
+      if( MaxDataLength != -1 && DataOffset + MaxDataLength < Section->SectorSize )
+      {
+         SecHeader->SectorLength = DataOffset + MaxDataLength;
+      }
+
+      // Only a sector the collector hasn't got to yet has to be erased now.  A clean
+      // one just has the rest of its header programmed...
+      if( Clean )
+      {
+         CleanSectors -= (CleanSectors > 0);
+      }
+      else
+      {
+         EraseSector( *NewSector );
+         DirtySectors -= (DirtySectors > 0);
+      }
+
+      // Now, rewrite sector header back out...
+      WriteSectorHeader( *NewSector, SecHeader );
+
+      // Running low.  Collect here, within the foreground budget, so the allocations
+      // after this one still find clean sectors...
+      if( Clean && CleanSectors < GcLowWater )
+      {
+         CollectGarbage( GcHighWater, GcForegroundBudget );
+      }
+
+      return 0;
+   }
+
+   return FFS_RC_OUT_OF_SPACE;
+}
+
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::FindFreeSector
+//
+//    Purpose:          Find a sector that isn't being used.
+//
+//    Inputs:           None.
+//
+//    Outputs:          NewSector - Return a sector number of a free sector.
+//                      SecHeader - Return a copy of current sector header.
+//                      Section   - Return a pointer to a pointer to the Section
+//                                  table entry.
+//
+//    Returns:          1 if one is found.
+//                      0 if none is found.
+//
+//    Notes:            A clean sector is taken in preference to one that still has
+//                      to be erased, and one in a bank that reads are busy in is only
+//                      taken if there is no other.  When the collector says there are
+//                      none clean, the first free sector is taken without looking
+//                      further.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::FindFreeSector( unsigned long*       Sector,
+                          FFS_SECTOR_HEADER*  SecHeader,
+                          FFS_FLASH_SECTION** Section )
+{
+   FFS_SECTOR_HEADER    DirtyHeader;
+   FFS_SECTOR_HEADER    HotHeader;
+   unsigned long         DirtySector = -1;
+   unsigned long         HotSector = -1;
+   unsigned long         ErrorCount = 0;
+   unsigned long         RelSector;
+   bool                  DirtyHot = false;
+   bool                  Free;
+
+
+   // Find a free sector by sequencially going thru sectors.  Some time later we could
+   // implement a round-robin or balancing algorithm...
+   for( *Sector = 0; GetFlashSectionEntry( *Sector, Section, &RelSector ); (*Sector)++ )
+   {
+      ReadSectorHeader( *Sector, SecHeader );
+
+      // First check to see if sector header looks valid...
+      if( SecHeader->Key == FFS_SECTOR_HEADER_KEY )
+      {
+         // Return: we found a sector that is ready to use...
+         if( FFS_SECTOR_CLEAN(*SecHeader) )
+         {
+            if( !BankIsHot( *Sector ) )
+            {
+               return 1;
+            }
+
+            if( HotSector == -1 )
+            {
+               HotSector = *Sector;
+               HotHeader = *SecHeader;
+            }
+            continue;
+         }
+
+         Free = ( SecHeader->Status == FFS_SECTOR_HEADER_FREE ||
+                  SecHeader->Status == FFS_SECTOR_HEADER_FREE_DIRTY );
+      }
+      else
+      {
+         // Assume that this sector has just never been used before. We'll tally it as
+         // an error, but take it as free...
+         ErrorCount++;
+         if(ErrorCount > ErrorSectorCount)
+         {
+            ErrorSectorCount = ErrorCount;
+         }
+
+         Free = true;
+      }
+
+      // Erasing it will hold up reads of its bank, so a quiet bank is better...
+      if( Free && ( DirtySector == -1 || ( DirtyHot && !BankIsHot( *Sector ) ) ) )
+      {
+         DirtySector = *Sector;
+         DirtyHeader = *SecHeader;
+         DirtyHot    = BankIsHot( *Sector );
+      }
+
+      // Nothing is clean, so there is no point looking any further...
+      if( DirtySector != -1 && !DirtyHot && GcCountsValid && CleanSectors == 0 )
+      {
+         break;
+      }
+   }
+
+   if( HotSector != -1 )
+   {
+      *Sector    = HotSector;
+      *SecHeader = HotHeader;
+      GetFlashSectionEntry( *Sector, Section, &RelSector );
+      return 1;
+   }
+
+   // We looked at every sector and none was clean...
+   if( GetFlashSectionEntry( *Sector, Section, &RelSector ) == 0 )
+   {
+      CleanSectors = 0;
+   }
+
+   if( DirtySector != -1 )
+   {
+      *Sector    = DirtySector;
+      *SecHeader = DirtyHeader;
+      GetFlashSectionEntry( *Sector, Section, &RelSector );
+      return 1;
+   }
+
+   return 0;
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::FreeSectors
+//
+//    Purpose:          Free a list of sectors (because we're deleting a file).
+//
+//    Inputs:           Sector - Starting sector to delete.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The process of freeing a sector involves changing the Status
+//                      field to 00.  This is one byte, so we actually read/write
+//                      4 bytes around it.  The changing of Status to 00 is reasonable
+//                      since we only support NOR flash and because when we write NOR
+//                      flash, we can only change ones to zeros. Only the erase sector
+//                      function can change zeros back to ones in a sector.
+//
+//                      If Sector holds an fnode, the file's index is freed too.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::FreeSectors( unsigned long Sector )
+{
+   FFS_SECTOR_HEADER  SecHead;
+   FFS_FILE_NODE      Fnode;
+   FFS_SECTOR_INDEX   Index;
+   unsigned long       NextSector;
+   unsigned long       IndexSector = -1;
+
+   if( Sector != -1 &&
+       ReadSectorHeader( Sector, &SecHead ) >= 0 &&
+       SecHead.Status == FFS_SECTOR_HEADER_INUSE_FILENODE &&
+       ReadFileNode( Sector, &SecHead, &Fnode ) >= 0 )
+   {
+      IndexSector = FindIndex( Sector, &Fnode, &Index, NULL );
+   }
+
+   while (Sector != -1 )
+   {
+      // All of sector header...
+      ReadSectorHeader( Sector, &SecHead );
+
+      // Save number of next sector in chain...
+      NextSector = FFS_SUCCESSOR(SecHead);
+
+      // Change status to FREE. Mark this sector as free but needing erase...
+      WriteSectorStatus( Sector, SecHead.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+
+      Sector = NextSector;                         // Next sector is now current sector.
+   }
+
+   if( IndexSector != -1 )
+   {
+      FreeIndex( IndexSector );
+   }
+
+   return 0;
+}
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::DeleteFile
+//
+//    Purpose:          Delete a file, leaving its sectors to be freed later.
+//
+//    Inputs:           FnodeSector - The file's fnode sector.
+//
+//    Returns:          0 > the length written or an Jcffs error code.
+//
+//    Notes:            One program marks the fnode deleted, and the file is gone:
+//                      nothing looks at a deleted fnode but ReclaimDeleted() and
+//                      CountFreeSectors(), and Check() takes the sectors for orphans.
+//                      Descriptors still open on it can go on reading it, and it is
+//                      freed when they are closed.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::DeleteFile( unsigned long FnodeSector )
+{
+   FFS_SECTOR_HEADER  SecHead;
+   int                 fd;
+   int                 rc;
+
+   if( (rc = ReadSectorHeader( FnodeSector, &SecHead )) < 0 )
+   {
+      return rc;
+   }
+
+   if( (rc = WriteSectorStatus( FnodeSector, SecHead.Version, FFS_SECTOR_HEADER_DELETED_FILENODE )) < 0 )
+   {
+      return rc;
+   }
+
+   for( fd = 0; fd < FFS_MAX_FILE_DESCRIPTORS; fd++ )
+   {
+      if( FileDescriptors[fd].InUse && FileDescriptors[fd].FnodeSector == FnodeSector )
+      {
+         FileDescriptors[fd].Unlinked = 1;
+      }
+   }
+
+   QueueDelete( FnodeSector );
+
+   return rc;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::QueueDelete
+//
+//    Purpose:          Queue a deleted file to have its sectors freed.
+//
+//    Inputs:           FnodeSector - The file's fnode sector.
+//
+//    Returns:          true if it wasn't queued already and isn't open.
+//
+//    Notes:            If the queue is full, it is left on flash to be found again
+//                      when the queue is empty.  A file still open is left to be
+//                      queued when it is closed.
+//
+//---------------------------------------------------------------------------------------
+bool Jcffs::QueueDelete( unsigned long FnodeSector )
+{
+   int   i;
+
+   if( FileIsOpen( FnodeSector ) )
+   {
+      return false;
+   }
+
+   for( i = 0; i < TrimCount; i++ )
+   {
+      if( TrimQueue[i] == FnodeSector )
+      {
+         return false;
+      }
+   }
+
+   if( TrimCount < FFS_TRIM_QUEUE_DEPTH )
+   {
+      TrimQueue[TrimCount++] = FnodeSector;
+   }
+   else
+   {
+      TrimOverflow = true;
+   }
+
+   return true;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::FileIsOpen
+//
+//    Purpose:          See if any descriptor has a file open.
+//
+//    Inputs:           FnodeSector - The file's fnode sector.
+//
+//    Returns:          true if one does.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+bool Jcffs::FileIsOpen( unsigned long FnodeSector )
+{
+   int   fd;
+
+   for( fd = 0; fd < FFS_MAX_FILE_DESCRIPTORS; fd++ )
+   {
+      if( FileDescriptors[fd].InUse && FileDescriptors[fd].FnodeSector == FnodeSector )
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ReclaimDeleted
+//
+//    Purpose:          Free the sectors of deleted files.
+//
+//    Inputs:           Budget - Ticks we may spend, or -1 to free them all.  With 0,
+//                               one step of the walk is taken.
+//
+//    Returns:          Number of sectors freed, or Jcffs error code.
+//
+//    Notes:            Each chain is freed in order, then the index, then last the
+//                      fnode sector, so a chain cut short by a power loss is walked
+//                      again from its fnode.  That walk goes thru sectors already
+//                      freed, which works because none of them is erased until the
+//                      fnode is freed too (see EraseSector()).  A chain that can't be
+//                      followed is left for Check() to free as orphans.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ReclaimDeleted( unsigned long Budget )
+{
+   FFS_SECTOR_HEADER  SecHead;
+   FFS_FILE_NODE      Fnode;
+   FFS_SECTOR_INDEX   Index;
+   unsigned long       Start = FFS_TICKS();
+   unsigned long       Sector;
+   unsigned long       IndexSector;
+   int                 Freed = 0;
+
+   // Deletions left from before mount are queued when the volume is counted...
+   if( GcCountsValid == false )
+   {
+      CountFreeSectors();
+   }
+
+   BeginWrites();
+
+   while( TrimCount > 0 || TrimOverflow )
+   {
+      // Look for the ones there wasn't room for...
+      if( TrimCount == 0 )
+      {
+         TrimOverflow = false;
+         CountFreeSectors();
+         continue;
+      }
+
+      Sector = TrimQueue[0];
+
+      if( !TrimStarted )
+      {
+         // Check() may have freed it as an orphan...
+         if( ReadSectorHeader( Sector, &SecHead ) < 0 ||
+             SecHead.Key    != FFS_SECTOR_HEADER_KEY ||
+             SecHead.Status != FFS_SECTOR_HEADER_DELETED_FILENODE )
+         {
+            TrimCount--;
+            memmove( &TrimQueue[0], &TrimQueue[1], TrimCount * sizeof(TrimQueue[0]) );
+            continue;
+         }
+
+         TrimCursor  = FFS_SUCCESSOR(SecHead);
+         TrimWalked  = 0;
+         TrimStarted = true;
+      }
+
+      if( TrimCursor != -1 )
+      {
+         if( TrimCursor >= TotalSectors ||
+             ++TrimWalked > TotalSectors ||
+             ReadSectorHeader( TrimCursor, &SecHead ) < 0 ||
+             SecHead.Key != FFS_SECTOR_HEADER_KEY )
+         {
+            TrimCursor = -1;
+            continue;
+         }
+
+         if( SecHead.Status != FFS_SECTOR_HEADER_FREE_DIRTY )
+         {
+            WriteSectorStatus( TrimCursor, SecHead.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+            Freed++;
+         }
+
+         TrimCursor = FFS_SUCCESSOR(SecHead);
+      }
+      else
+      {
+         // The chain is free.  Then the index, and last the fnode...
+         if( ReadSectorHeader( Sector, &SecHead ) >= 0 )
+         {
+            if( ReadFileNode( Sector, &SecHead, &Fnode ) >= 0 &&
+                (IndexSector = FindIndex( Sector, &Fnode, &Index, NULL )) != -1 )
+            {
+               FreeIndex( IndexSector );
+               Freed++;
+            }
+
+            WriteSectorStatus( Sector, SecHead.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+            Freed++;
+         }
+
+         TrimCount--;
+         memmove( &TrimQueue[0], &TrimQueue[1], TrimCount * sizeof(TrimQueue[0]) );
+         TrimStarted = false;
+      }
+
+      if( FFS_TICKS() - Start >= Budget )
+      {
+         break;
+      }
+   }
+
+   if( TrimCount == 0 && !TrimOverflow )
+   {
+      TrimFound = false;
+   }
+
+   EndWrites();
+
+   return Freed;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ReleaseSectors
+//
+//    Purpose:          Unlink a run of sectors from the middle of a chain and free them.
+//
+//    Inputs:           Pred        - Sector just before the run.
+//                      PredVersion - Its format version.
+//                      First       - First sector of the run.
+//                      Stop        - Sector just after the run.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            Pred's Bypass is programmed first, so if power is lost before
+//                      the run is freed, the run is orphaned and Check() frees it.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ReleaseSectors( unsigned long Pred,
+                          int           PredVersion,
+                          unsigned long First,
+                          unsigned long Stop )
+{
+   FFS_SECTOR_HEADER  SecHead;
+   unsigned long       Sector;
+   int                 rc;
+
+   if( (rc = WriteSectorBypass( Pred, PredVersion, Stop )) < 0 )
+   {
+      return rc;
+   }
+
+   for( Sector = First; Sector != Stop && Sector != -1; Sector = FFS_SUCCESSOR(SecHead) )
+   {
+      if( (rc = ReadSectorHeader( Sector, &SecHead )) < 0 )
+      {
+         return rc;
+      }
+
+      WriteSectorStatus( Sector, SecHead.Version, FFS_SECTOR_HEADER_FREE_DIRTY );
+   }
+
+   return 0;
+}
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::UnlinkRun
+//
+//    Purpose:          Release a run of sectors from the middle of an open file.
+//
+//    Inputs:           Fdesc       - Descriptor the file is being changed thru.
+//                      Pred        - Sector just before the run.
+//                      PredVersion - Its format version.
+//                      First       - First sector of the run.
+//                      Stop        - Sector just after the run.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The index and skips may point into the run, so the fnode is
+//                      flagged first and nothing is freed if that fails.  Every
+//                      descriptor open on the file takes the flags and looks for its
+//                      tail and index again.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::UnlinkRun( FFS_FILE_DESCRIPTOR* Fdesc,
+                     unsigned long        Pred,
+                     int                  PredVersion,
+                     unsigned long        First,
+                     unsigned long        Stop )
+{
+   FFS_FILE_DESCRIPTOR*  Other;
+   int                    rc;
+
+   if( (rc = DropIndex( Fdesc )) < 0 )
+   {
+      return rc;
+   }
+
+   // An older fnode has no flags, and no skips either...
+   if( !(Fdesc->Fnode.Flags & FFS_FNODE_SKIPS_STALE) &&
+       Fdesc->FnodeVersion >= FFS_FILE_SYSTEM_VERSION_V3 &&
+       (rc = WriteFileNodeFlags( Fdesc, FFS_FNODE_SKIPS_STALE )) < 0 )
+   {
+      return rc;
+   }
+
+   for( Other = FileDescriptors; Other < FileDescriptors + FFS_MAX_FILE_DESCRIPTORS; Other++ )
+   {
+      if( Other->InUse && Other->FnodeSector == Fdesc->FnodeSector )
+      {
+         Other->TailSector   = -1;
+         Other->IndexLoaded  = 0;
+         Other->Fnode.Flags |= Fdesc->Fnode.Flags & (FFS_FNODE_INDEX_STALE | FFS_FNODE_SKIPS_STALE);
+      }
+   }
+
+   return ReleaseSectors( Pred, PredVersion, First, Stop );
+}
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::CollectGarbage
+//
+//    Purpose:          Clean dirty sectors until there are enough clean ones or the
+//                      budget runs out.
+//
+//    Inputs:           Target - Stop when this many sectors are clean.
+//                      Budget - Ticks we may spend.  At least one sector is cleaned
+//                               if one needs to be, whatever the budget.
+//
+//    Returns:          Number of sectors freed and cleaned, or Jcffs error code.
+//
+//    Notes:            The search for dirty sectors carries on from where the last one
+//                      left off, so erases go round the whole volume.
+//
+//                      Deleted files are freed first, and nothing is cleaned until
+//                      they all are; see ReclaimDeleted().
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::CollectGarbage( unsigned long Target, unsigned long Budget )
+{
+   FFS_SECTOR_HEADER  SecHead;
+   unsigned long       Start = FFS_TICKS();
+   unsigned long       Sector = 0;
+   unsigned long       Hot;
+   unsigned long       Looked;
+   int                 Cleaned = 0;
+   int                 rc;
+
+   if( GcCountsValid == false )
+   {
+      CountFreeSectors();
+   }
+
+   if( TrimCount > 0 || TrimOverflow )
+   {
+      if( (Cleaned = ReclaimDeleted( Budget )) < 0 || TrimCount > 0 || TrimOverflow )
+      {
+         return Cleaned;
+      }
+   }
+
+   while( CleanSectors < Target && DirtySectors > 0 )
+   {
+      // Find the next free sector that isn't clean.  One in a bank reads are busy in
+      // is left until there are no others...
+      for( Looked = 0, Hot = -1; Looked < TotalSectors; Looked++ )
+      {
+         Sector   = GcCursor;
+         GcCursor = (GcCursor + 1 < TotalSectors) ? GcCursor + 1 : 0;
+
+         if( (rc = ReadSectorHeader( Sector, &SecHead )) < 0 )
+         {
+            return rc;
+         }
+
+         if( SecHead.Key != FFS_SECTOR_HEADER_KEY ||
+             ( !FFS_SECTOR_CLEAN(SecHead) &&
+               ( SecHead.Status == FFS_SECTOR_HEADER_FREE ||
+                 SecHead.Status == FFS_SECTOR_HEADER_FREE_DIRTY ) ) )
+         {
+            if( !BankIsHot( Sector ) )
+            {
+               break;
+            }
+
+            if( Hot == -1 )
+            {
+               Hot = Sector;
+            }
+         }
+      }
+
+      if( Looked == TotalSectors )
+      {
+         // The count was off. There is nothing left to clean...
+         if( Hot == -1 )
+         {
+            DirtySectors = 0;
+            break;
+         }
+
+         Sector = Hot;
+         if( (rc = ReadSectorHeader( Sector, &SecHead )) < 0 )
+         {
+            return rc;
+         }
+      }
+
+      if( (rc = CleanSector( Sector, &SecHead )) < 0 )
+      {
+         return rc;
+      }
+
+      Cleaned++;
+
+      if( FFS_TICKS() - Start >= Budget )
+      {
+         break;
+      }
+   }
+
+   return Cleaned;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::CountFreeSectors
+//
+//    Purpose:          Count the clean and dirty sectors for the collector.
+//
+//    Inputs:           None.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            A sector without our key is taken as dirty, since
+//                      FindFreeSector() would take it and erase it.
+//
+//                      Deleted files are queued to be freed on the way, which is how
+//                      deletions left from before mount are picked up.  Their chains
+//                      may have been partly freed already, see EraseSector().
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::CountFreeSectors( void )
+{
+   FFS_SECTOR_HEADER  SecHead;
+   unsigned long       Sector;
+
+   CleanSectors = 0;
+   DirtySectors = 0;
+
+   for( Sector = 0; Sector < TotalSectors; Sector++ )
+   {
+      ReadSectorHeader( Sector, &SecHead );
+
+      if( FFS_SECTOR_CLEAN(SecHead) )
+      {
+         CleanSectors++;
+      }
+      else if( SecHead.Key != FFS_SECTOR_HEADER_KEY ||
+               SecHead.Status == FFS_SECTOR_HEADER_FREE ||
+               SecHead.Status == FFS_SECTOR_HEADER_FREE_DIRTY )
+      {
+         DirtySectors++;
+      }
+      else if( SecHead.Status == FFS_SECTOR_HEADER_DELETED_FILENODE && QueueDelete( Sector ) )
+      {
+         TrimFound = true;
+      }
+   }
+
+   GcCountsValid = true;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::CleanSector
+//
+//    Purpose:          Erase a free sector and give it a clean header.
+//
+//    Inputs:           Sector  - Sector number.
+//                      SecHead - Its current header.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            The erase is counted here.  If power is lost before the header
+//                      is written, the sector has no key and is still taken as free.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::CleanSector( unsigned long Sector, FFS_SECTOR_HEADER* SecHead )
+{
+   int   rc;
+
+   SecHead->EraseCount     = (SecHead->Key == FFS_SECTOR_HEADER_KEY) ? SecHead->EraseCount + 1 : 0;
+   SecHead->Key            = FFS_SECTOR_HEADER_KEY;
+   SecHead->Next           = -1;
+   SecHead->Version        = FFS_FILE_SYSTEM_VERSION;
+   SecHead->Status         = FFS_SECTOR_HEADER_FREE;
+   SecHead->SectorChecksum = 0xffff;
+   SecHead->SectorLength   = -1;
+   SecHead->DataOffset     = -1;
+   SecHead->FileOffset     = -1;
+   SecHead->Bypass         = -1;
+   SecHead->Skip           = -1;
+
+   if( (rc = EraseSector( Sector )) < 0 )
+   {
+      return rc;
+   }
+
+   IoCause = FFS_WRITE_RECLAIM;
+   rc      = WriteSectorHeader( Sector, SecHead );
+   IoCause = FFS_WRITE_METADATA;
+
+   if( rc < 0 )
+   {
+      return rc;
+   }
+
+   DirtySectors -= (DirtySectors > 0);
+   CleanSectors++;
+
+   return 0;
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ZeroSectorData
+//
+//    Purpose:          Program a range of a sector to zeros.
+//
+//    Inputs:           Sector - Sector number.
+//                      Offset - Offset into sector.
+//                      Length - Bytes to zero.
+//
+//    Returns:          0 or Jcffs error code.
+//
+//    Notes:            On NOR flash any byte can be programmed to zero, written or not.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ZeroSectorData( unsigned long Sector,
+                          unsigned long Offset,
+                          unsigned long Length )
+{
+   static unsigned char  Zeros[64];
+   unsigned long          Chunk;
+   int                    rc;
+
+   while( Length )
+   {
+      Chunk = (Length < sizeof(Zeros)) ? Length : sizeof(Zeros);
+
+      if( (rc = WriteSector( Sector, Offset, Zeros, Chunk )) < 0 )
+      {
+         return rc;
+      }
+
+      Offset += Chunk;
+      Length -= Chunk;
+   }
+
+   return 0;
+}
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::CopySectorData
+//
+//    Purpose:          Copy data from one sector to another.
+//
+//    Inputs:           FromSector - Sector number to copy from.
+//                      FromOffset - Offset into that sector.
+//                      ToSector   - Sector number to copy to.
+//                      ToOffset   - Offset into that sector.
+//                      Length     - Number of bytes to copy.
+//
+//    Returns:          0 or an Jcffs error code.
+//
+//    Notes:            The section's Copy() is used when both sectors are in it, and
+//                      nothing queued is for the sector copied from.  The data doesn't
+//                      go thru the queue then; it is only ever copied into a sector no
+//                      file uses yet, which nothing queued can depend on.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::CopySectorData( unsigned long FromSector,
+                          unsigned long FromOffset,
+                          unsigned long ToSector,
+                          unsigned long ToOffset,
+                          unsigned long Length )
+{
+   FFS_FLASH_SECTION*    FromSection;
+   FFS_FLASH_SECTION*    ToSection;
+   FFS_IO_REQUEST*       Request;
+   unsigned long          FromRel;
+   unsigned long          ToRel;
+   unsigned char          Buffer[100];
+   int                    n;
+   int                    rc;
+
+   for( Request = IoQueue; Request < IoQueue + IoCount; Request++ )
+   {
+      if( Request->Sector == FromSector )
+      {
+         break;
+      }
+   }
+
+   if(
+#ifdef FFS_FIXED_DEVICE
+       Sections != NULL &&
+#endif
+       Length && Request == IoQueue + IoCount &&
+       GetFlashSectionEntry( FromSector, &FromSection, &FromRel ) &&
+       GetFlashSectionEntry( ToSector, &ToSection, &ToRel ) &&
+       FromSection == ToSection && FromSection->Copy != NULL &&
+       FromSection->Copy( FromSection, FromRel, FromOffset, ToRel, ToOffset, Length ) == (int)Length )
+   {
+      // Charged as WriteSector() would charge it...
+      WriteStats.Volume.ProgramBytes[IoCause] += Length;
+      if( IoClass >= 0 )
+      {
+         WriteStats.Class[IoClass].ProgramBytes[IoCause] += Length;
+      }
+      if( ToSector == WindowSector )
+      {
+         WindowSector = -1;
+      }
+      return 0;
+   }
+
+   while( Length )
+   {
+      n = sizeof(Buffer);
+      if( Length < n )
+      {
+         n = Length;
+      }
+      if( (rc = ReadSector( FromSector, FromOffset, Buffer, n)) < 0 )
+      {
+         return rc;
+      }
+      if( (rc = WriteSector( ToSector, ToOffset, Buffer, n)) < 0 )
+      {
+         return rc;
+      }
+      Length     -= n;
+      FromOffset += n;
+      ToOffset   += n;
+   }
+
+   return 0;
+}
+
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ReadSector
+//
+//    Purpose:          Read a portion of a sector.
+//
+//    Inputs:           Sector - Sector number to read from.
+//                      Offset - Offset into sector to start reading from.
+//                      Buffer - Caller's buffer to copy the read data into.
+//                      Length - Length of how much to read from sector.
+//
+//    Returns:          0 > the length of data read or an Jcffs error code.
+//
+//    Notes:            Programs still in the queue are applied to what is read, the
+//                      way the part will apply them, by clearing bits.  The window
+//                      already has them.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ReadSector(  unsigned long  Sector,
+                       unsigned long  Offset,
+                       unsigned char* Buffer,
+                       int            Length)
+{
+   int                   rc;
+
+   // A read from the start of a sector that fits in the window fills it...
+   if( Sector != WindowSector && Offset == 0 && Length <= (int)sizeof(Window) )
+   {
+      WindowSector = -1;
+
+      if( ReadFlash( Sector, 0, Window, sizeof(Window) ) == (int)sizeof(Window) )
+      {
+         ApplyQueuedWrites( Sector, 0, Window, sizeof(Window) );
+         WindowSector = Sector;
+      }
+   }
+
+   if( Sector == WindowSector && Offset + Length <= sizeof(Window) )
+   {
+      memcpy( Buffer, Window + Offset, Length );
+      return Length;
+   }
+
+   if( (rc = ReadFlash( Sector, Offset, Buffer, Length )) < 0 )
+   {
+      return rc;
+   }
+
+   ApplyQueuedWrites( Sector, Offset, Buffer, Length );
+
+   return rc;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ApplyQueuedWrites
+//
+//    Purpose:          Apply queued programs to data read from a sector.
+//
+//    Inputs:           Sector - Sector number the data is from.
+//                      Offset - Offset into sector it starts at.
+//                      Buffer - The data.
+//                      Length - Its length.
+//
+//    Returns:          Nothing.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::ApplyQueuedWrites( unsigned long  Sector,
+                              unsigned long  Offset,
+                              unsigned char* Buffer,
+                              unsigned long  Length )
+{
+   FFS_IO_REQUEST*      Request;
+   unsigned long         From;
+   unsigned long         To;
+   unsigned long         i;
+
+   for( Request = IoQueue; Request < IoQueue + IoCount; Request++ )
+   {
+      if( Request->Sector != Sector ||
+          Request->Offset >= Offset + Length ||
+          Request->Offset + Request->Length <= Offset )
+      {
+         continue;
+      }
+
+      From = ( Request->Offset > Offset ) ? Request->Offset : Offset;
+      To   = ( Request->Offset + Request->Length < Offset + Length ) ?
+             Request->Offset + Request->Length : Offset + Length;
+
+      for( i = From; i < To; i++ )
+      {
+         Buffer[i - Offset] &= IoData[Request->Data + i - Request->Offset];
+      }
+   }
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteSector
+//
+//    Purpose:          Write a portion of a sector, or queue it in a batch.
+//
+//    Inputs:           Sector - Sector number to write to.
+//                      Offset - Offset into sector to start writing to.
+//                      Buffer - Caller's buffer of data to write.
+//                      Length - Length of how much to write to sector.
+//
+//    Returns:          0 > the length of data written or an Jcffs error code.
+//
+//    Notes:            A queued program is merged into the last one queued for its
+//                      sector if it carries on from it.  That one must be the last in
+//                      the queue, or program the sector's header: a sector whose
+//                      header hasn't gone out is still free, so nothing programmed
+//                      since can depend on what it holds, and its data may go sooner.
+//                      Otherwise the order programs are made in is kept, since that
+//                      is what makes an update safe against power loss.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteSector( unsigned long  Sector,
+                       unsigned long  Offset,
+                       unsigned char* Buffer,
+                       int            Length )
+{
+   FFS_IO_REQUEST*      Request;
+   FFS_IO_REQUEST*      Last = NULL;
+   unsigned long         End;
+   unsigned long         i;
+   int                   rc;
+
+   // Charge it to what it is for...
+   WriteStats.Volume.ProgramBytes[IoCause] += Length;
+   if( IoClass >= 0 )
+   {
+      WriteStats.Class[IoClass].ProgramBytes[IoCause] += Length;
+   }
+
+   // Keep the window up to date.  Programming only clears bits...
+   if( Sector == WindowSector )
+   {
+      for( i = Offset; i < Offset + Length && i < sizeof(Window); i++ )
+      {
+         Window[i] &= Buffer[i - Offset];
+      }
+   }
+
+   if( IoBatch == 0 )
+   {
+      if( (rc = WriteFlash( Sector, Offset, Buffer, Length )) < 0 )
+      {
+         WindowSector = -1;
+      }
+      return rc;
+   }
+
+   for( Request = IoQueue; Request < IoQueue + IoCount; Request++ )
+   {
+      if( Request->Sector == Sector )
+      {
+         Last = Request;
+      }
+   }
+
+   // Merge.  The bytes of the requests queued after it move up to make room...
+   if( Last != NULL &&
+       Last->Offset + Last->Length == Offset &&
+       ( Last == &IoQueue[IoCount - 1] || Last->Offset == 0 ) &&
+       IoDataUsed + Length <= sizeof(IoData) )
+   {
+      End = Last->Data + Last->Length;
+
+      memmove( IoData + End + Length, IoData + End, IoDataUsed - End );
+      memcpy( IoData + End, Buffer, Length );
+
+      for( Request = Last + 1; Request < IoQueue + IoCount; Request++ )
+      {
+         Request->Data += Length;
+      }
+
+      Last->Length += Length;
+      IoDataUsed   += Length;
+      return Length;
+   }
+
+   if( IoCount == FFS_IO_QUEUE_DEPTH || IoDataUsed + Length > sizeof(IoData) )
+   {
+      if( (rc = FlushWrites()) < 0 )
+      {
+         return rc;
+      }
+   }
+
+   // Too big to queue.  The queue is empty now, so it can go straight out...
+   if( (unsigned long)Length > sizeof(IoData) )
+   {
+      if( (rc = WriteFlash( Sector, Offset, Buffer, Length )) < 0 )
+      {
+         WindowSector = -1;
+      }
+      return rc;
+   }
+
+   Request = &IoQueue[IoCount++];
+   Request->Sector = Sector;
+   Request->Offset = Offset;
+   Request->Length = Length;
+   Request->Data   = IoDataUsed;
+
+   memcpy( IoData + IoDataUsed, Buffer, Length );
+   IoDataUsed += Length;
+
+   return Length;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::BeginWrites / Jcffs::EndWrites / Jcffs::FlushWrites
+//
+//    Purpose:          Start and end a batch of queued programs, and submit the queue.
+//
+//    Inputs:           None.
+//
+//    Returns:          EndWrites() and FlushWrites() return 0, or the Jcffs error code
+//                      of the first program that failed.
+//
+//    Notes:            Batches nest; the queue goes out when the outermost one ends.
+//                      Once a program fails, the rest of the queue is dropped, since
+//                      it may depend on the one that failed.
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::BeginWrites( void )
+{
+   IoBatch++;
+}
+
+int Jcffs::EndWrites( void )
+{
+   if( --IoBatch > 0 )
+   {
+      return 0;
+   }
+
+   return FlushWrites();
+}
+
+int Jcffs::FlushWrites( void )
+{
+   FFS_IO_REQUEST*      Request;
+   int                   rc = 0;
+
+   for( Request = IoQueue; Request < IoQueue + IoCount && rc >= 0; Request++ )
+   {
+      rc = WriteFlash( Request->Sector, Request->Offset, IoData + Request->Data, Request->Length );
+   }
+
+   IoCount    = 0;
+   IoDataUsed = 0;
+
+   // The window took the programs that failed.  The frees waiting to be discarded may
+   // not have reached the part either...
+   if( rc < 0 )
+   {
+      WindowSector = -1;
+      DiscardCount = 0;
+      return rc;
+   }
+
+   IssueDiscards();
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::NoteDiscard / Jcffs::IssueDiscards
+//
+//    Purpose:          Collect freed sectors into runs, and pass the runs to the
+//                      sections' Discard() routines.
+//
+//    Inputs:           Sector  - Sector just marked FREE_DIRTY.
+//                      Version - Format version of its header, which is kept.
+//
+//    Returns:          None.
+//
+//    Notes:            A run is only issued once the status programs of its sectors
+//                      have gone out, so a power loss can't leave a live sector with
+//                      its data gone.  Discard() failing is of no matter; the sectors
+//                      are erased before they are used again anyway.
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::NoteDiscard( unsigned long Sector, int Version )
+{
+   FFS_DISCARD_RUN*     Run;
+   unsigned long         Offset = FFSHeaderSize( Version );
+
+#ifdef FFS_FIXED_DEVICE
+   // The fixed primitives have no discard...
+   if( Sections == NULL )
+   {
+      return;
+   }
+#endif
+
+   // Grow a run it borders on...
+   for( Run = DiscardRuns; Run < DiscardRuns + DiscardCount; Run++ )
+   {
+      if( Run->Offset != Offset )
+      {
+         continue;
+      }
+
+      if( Run->Sector + Run->Count == Sector )
+      {
+         Run->Count++;
+         return;
+      }
+
+      if( Sector + 1 == Run->Sector )
+      {
+         Run->Sector = Sector;
+         Run->Count++;
+         return;
+      }
+   }
+
+   // Or start a new one, sending the others on first if there's no room...
+   if( DiscardCount == FFS_DISCARD_RUNS )
+   {
+      if( IoCount )
+      {
+         FlushWrites();
+      }
+      else
+      {
+         IssueDiscards();
+      }
+   }
+
+   Run = &DiscardRuns[DiscardCount++];
+   Run->Sector = Sector;
+   Run->Count  = 1;
+   Run->Offset = Offset;
+}
+
+void Jcffs::IssueDiscards( void )
+{
+   FFS_DISCARD_RUN*     Run;
+   FFS_FLASH_SECTION*   Section;
+   unsigned long         Sector;
+   unsigned long         Count;
+   unsigned long         RelSector;
+   unsigned long         n;
+
+   for( Run = DiscardRuns; Run < DiscardRuns + DiscardCount; Run++ )
+   {
+      // The window may hold more than the header...
+      if( WindowSector >= Run->Sector && WindowSector < Run->Sector + Run->Count )
+      {
+         WindowSector = -1;
+      }
+
+      // A run can cross from one section into the next...
+      for( Sector = Run->Sector, Count = Run->Count; Count > 0; Sector += n, Count -= n )
+      {
+         if( GetFlashSectionEntry( Sector, &Section, &RelSector ) == 0 )
+         {
+            break;
+         }
+
+         n = Section->Count - RelSector;
+         if( n > Count )
+         {
+            n = Count;
+         }
+
+         if( Section->Discard != NULL && Run->Offset < Section->SectorSize )
+         {
+            Section->Discard( Section, RelSector, n, Run->Offset );
+         }
+      }
+   }
+
+   DiscardCount = 0;
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ReadFlash
+//
+//    Purpose:          Read a portion of a sector from the part.
+//
+//    Inputs:           Sector - Sector number to read from.
+//                      Offset - Offset into sector to start reading from.
+//                      Buffer - Caller's buffer to copy the read data into.
+//                      Length - Length of how much to read from sector.
+//
+//    Returns:          0 > the length of data read or an Jcffs error code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ReadFlash(   unsigned long  Sector,
+                       unsigned long  Offset,
+                       unsigned char* Buffer,
+                       int            Length)
+{
+   FFS_FLASH_SECTION*   Section;
+   unsigned long         RelSector;
+
+#ifdef FFS_FIXED_DEVICE
+   // Fixed device: geometry is constant and the primitive is a direct call...
+   if( Sections == NULL )
+   {
+      if( Sector >= FFS_DEVICE_SECTOR_COUNT )
+      {
+         return FFS_RC_INVALID_SECTOR_NUMBER;
+      }
+      return FFSDeviceRead( Sector, Offset, Buffer, Length );
+   }
+#endif
 
-         // Ordinary in-use sector. just ignore for now.
-         case FFS_SECTOR_HEADER_INUSE:
-            break;
+   // Locate which section this sector is in...
+   if( GetFlashSectionEntry( Sector, &Section, &RelSector ) == 0)
+   {
+      return FFS_RC_INVALID_SECTOR_NUMBER;
+   }
 
-         case FFS_SECTOR_HEADER_INUSE_FILENODE:
-            // Read Fnode...
-            ReadSector(  Sector,
-                         sizeof(FFS_SECTOR_HEADER),
-                         &Fnode,
-                         sizeof(FFS_FILE_NODE) );
-            // Check for valid Fnode...
-            if( Fnode.FileSize == 0 || Fnode.FileSize == -1 )
-            {
-               // Mark this one as bad.  It needs to be cleaned up...
-               SectorArray[Sector] |= CHECK_SECTOR_BAD;
-            }
-            else
-            {
-               // We have a sector with a file node - the start of a file.
-               SectorArray[Sector] |= CHECK_SECTOR_FNODE;
-               // Check chain of sectors for this file...
-               NextSector = SecHeader.Next;
-               while( NextSector != -1 )
-               {
-                  ReadSector( NextSector, 0, &SecHeader, sizeof(FFS_SECTOR_HEADER) );
-                  if( (SectorArray[NextSector] & CHECK_SECTOR_FREE)  ||
-                      (SectorArray[NextSector] & CHECK_SECTOR_FNODE) ||
-                      (SectorArray[NextSector] & CHECK_SECTOR_BAD)   )
-                  {
-                     TotalCrossChain++;
-                  }
-                  SectorArray[NextSector] |= CHECK_SECTOR_INUSE;
-                  NextSector = SecHeader.Next;
-               }
-            }
-            break;
+   SuspendErase( Section, RelSector );
 
-         // Anything else indicates something wrong.
-         // Don't mark these bad quite yet...
-         default:
-            //(*SectorArray)[Sector] |= CHECK_SECTOR_BAD;
-            break;
+   return Section->Read( Section, RelSector, Offset, Buffer, Length );
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::WriteFlash
+//
+//    Purpose:          Program a portion of a sector on the part.
+//
+//    Inputs:           Sector - Sector number to write to.
+//                      Offset - Offset into sector to start writing to.
+//                      Buffer - Caller's buffer of data to write.
+//                      Length - Length of how much to write to sector.
+//
+//    Returns:          0 > the length of data written or an Jcffs error code.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::WriteFlash(  unsigned long  Sector,
+                       unsigned long  Offset,
+                       unsigned char* Buffer,
+                       int            Length )
+{
+   FFS_FLASH_SECTION*   Section;
+   unsigned long         RelSector;
 
+#ifdef FFS_FIXED_DEVICE
+   if( Sections == NULL )
+   {
+      if( Sector >= FFS_DEVICE_SECTOR_COUNT )
+      {
+         return FFS_RC_INVALID_SECTOR_NUMBER;
       }
+      return FFSDeviceWrite( Sector, Offset, Buffer, Length );
    }
+#endif
 
-   // OK, now we have a table that will help us find sectors that have been left
-   // estranged.  Go thru table and mark the sector FREE_DIRTY. If they are BAD, then
-   // try to erase them....
-   for( Sector = 0; Sector < TotalSectors; Sector++ )
+   // Locate which section this sector is in...
+   if( GetFlashSectionEntry( Sector, &Section, &RelSector ) == 0)
+   {
+      return FFS_RC_INVALID_SECTOR_NUMBER;
+   }
+
+   return Section->Write( Section, RelSector, Offset, Buffer, Length );
+}
+
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::EraseSector
+//
+//    Purpose:          Erase a complete sector.
+//
+//    Inputs:           Sector - Sector number to erase.
+//
+//    Returns:          0 or an Jcffs error code.
+//
+//    Notes:            The deletion under way is finished first, see below.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::EraseSector( unsigned long Sector )
+{
+   FFS_FLASH_SECTION*   Section;
+   unsigned long         RelSector;
+   int                   rc;
+
+   // A deleted file's chain is followed from its fnode thru the sectors of it already
+   // freed, so those can't be erased until the fnode is freed too.  Only the file being
+   // freed has any, and the others wait their turn.  The ones found on flash may have
+   // been partly freed before the volume was mounted, so all of those are finished...
+   if( GcCountsValid == false )
    {
-      if( !(SectorArray[Sector] & CHECK_SECTOR_INUSE) &&
-          !(SectorArray[Sector] & CHECK_SECTOR_FNODE) &&
-          !(SectorArray[Sector] & CHECK_SECTOR_FREE)  )
+      CountFreeSectors();
+   }
+
+   if( TrimFound )
+   {
+      ReclaimDeleted( -1 );
+   }
+
+   while( TrimStarted )
+   {
+      ReclaimDeleted( 0 );
+   }
+
+   // Programs queued before the erase go out before it, and so do discards, which
+   // would otherwise take the sector's new contents...
+   if( IoCount && (rc = FlushWrites()) < 0 )
+   {
+      return rc;
+   }
+
+   IssueDiscards();
+
+   if( Sector == WindowSector )
+   {
+      WindowSector = -1;
+   }
+
+#ifdef FFS_FIXED_DEVICE
+   if( Sections == NULL )
+   {
+      if( Sector >= FFS_DEVICE_SECTOR_COUNT )
       {
-         // If sector isn't bad...
-         if( !(SectorArray[Sector] & CHECK_SECTOR_BAD) )
+         return FFS_RC_INVALID_SECTOR_NUMBER;
+      }
+      NoteErase( FFS_DEVICE_SECTOR_SIZE );
+      return FFSDeviceErase( Sector );
+   }
+#endif
+
+   // Locate which section this sector is in...
+   if( GetFlashSectionEntry( Sector, &Section, &RelSector ) == 0)
+   {
+      return FFS_RC_INVALID_SECTOR_NUMBER;
+   }
+
+   NoteErase( Section->SectorSize );
+
+#ifndef FFS_NO_READ_WINDOW
+   // If the part can erase in the background, let readers in while it does.  Only
+   // updates erase, and they hold the update lock, so nothing else changes the volume
+   // while we are out of the volume lock...
+   if( Section->EraseStart != NULL )
+   {
+      if( (rc = Section->EraseStart( Section, RelSector )) < 0 )
+      {
+         return rc;
+      }
+
+      ErasingSection   = Section;
+      ErasingSector    = Sector;
+      ErasingRelSector = RelSector;
+
+      while( (rc = Section->EraseDone( Section )) == 0 )
+      {
+         FFS_UNLOCK();
+         if( YieldHook )
          {
-            ReadSector( Sector, 0, &SecHeader, sizeof(FFS_SECTOR_HEADER) );
-            SecHeader.Status = FFS_SECTOR_HEADER_FREE_DIRTY;
-            WriteSector( Sector, 0, &SecHeader, sizeof(FFS_SECTOR_HEADER) );
-            TotalFixedSectors++;
+            YieldHook( YieldContext );
          }
          else
          {
-            EraseSector( Sector );
-            TotalFixedSectors++;
+            FFS_YIELD();
          }
+         FFS_LOCK();
       }
+
+      ErasingSection = NULL;
+      ErasingSector  = -1;
+
+      return rc < 0 ? rc : 0;
    }
+#endif
 
-   // Now, check for duplicate files.  Delete oldest one...
-   for( Sector = 0; Sector < TotalSectors; Sector++ )
+   return Section->Erase( Section, RelSector );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::SuspendErase / Jcffs::ResumeErase
+//
+//    Purpose:          Suspend a background erase for a read, and resume it after.
+//
+//    Inputs:           Section   - Section about to be read.
+//                      RelSector - Sector in it about to be read.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            Called with the volume lock held, from ReadFlash() and
+//                      FFS_READ_UNLOCK().  An erase is only in progress while its
+//                      update is waiting for it, so these do nothing otherwise.
+//                      A read of another bank, or another device, runs alongside
+//                      the erase.  Sections on the same device count as one bank.
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::SuspendErase( FFS_FLASH_SECTION* Section, unsigned long RelSector )
+{
+   if( ErasingSection == NULL || EraseSuspended || ErasingSection->EraseSuspend == NULL ||
+       ErasingSection->Device != Section->Device )
    {
-      ReadSector( Sector, 0, &SecHeader, sizeof(FFS_SECTOR_HEADER) );
+      return;
+   }
 
-      if( SecHeader.Status == FFS_SECTOR_HEADER_INUSE_FILENODE )
-      {
-         // Read Fnode...
-         ReadSector(  Sector,
-                      sizeof(FFS_SECTOR_HEADER),
-                      &Fnode,
-                      sizeof(FFS_FILE_NODE) );
+   if( Section == ErasingSection && Section->BankSectors != 0 &&
+       RelSector / Section->BankSectors != ErasingRelSector / Section->BankSectors )
+   {
+      return;
+   }
 
-         // Now, go thru each following sector looking for an Fnode with matching
-         // name.  If we find one, then check counter and delete file with lower count.
-         for( NextSector = Sector + 1; NextSector < TotalSectors; NextSector++ )
-         {
-            ReadSector( NextSector, 0, &SecHeader, sizeof(FFS_SECTOR_HEADER) );
+   ErasingSection->EraseSuspend( ErasingSection );
+   EraseSuspended = true;
+}
 
-            if( SecHeader.Status == FFS_SECTOR_HEADER_INUSE_FILENODE )
-            {
-               // Read Fnode...
-               ReadSector(  NextSector,
-                            sizeof(FFS_SECTOR_HEADER),
-                            &NextFnode,
-                            sizeof(FFS_FILE_NODE) );
+void Jcffs::ResumeErase( void )
+{
+   if( EraseSuspended )
+   {
+      ErasingSection->EraseResume( ErasingSection );
+      EraseSuspended = false;
+   }
+}
 
-               // Uppercase names for compare so compare is case-insensitive...
-               StringToUpperCase(Fnode.Filename);
-               StringToUpperCase(NextFnode.Filename);
 
-               // See if files match.  If they do, delete oldest one...
-               if( strcmp(Fnode.Filename, NextFnode.Filename) == 0 )
-               {
-                  if(Fnode.Count < NextFnode.Count)
-                  {
-                     DeleteSector = Sector;
-                  }
-                  else
-                  {
-                     DeleteSector = NextSector;
-                  }
 
-                  while (DeleteSector != -1 )
-                  {
-                     // All of sector header...
-                     ReadSector( DeleteSector, 0, &SecHeader, sizeof(FFS_SECTOR_HEADER) );
 
-                     // Save number of next sector in chain...
-                     NextSector = SecHeader.Next;
 
-                     // Change status to FREE...
-                     SecHeader.Status = FFS_SECTOR_HEADER_FREE_DIRTY;  // Mark this sector as free but needing erase.
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ValidSector
+//
+//    Purpose:          Check to see if sector number is within our file system.
+//
+//    Inputs:           Sector - Sector number to check to see if valid.
+//
+//    Returns:          True if within one of the defined sections of flash devices, or
+//                      False if not.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ValidSector( unsigned long Sector )
+{
+    FFS_FLASH_SECTION*   Section;
+    unsigned long         RelSector;
+
+#ifdef FFS_FIXED_DEVICE
+    if( Sections == NULL )
+    {
+       return Sector < FFS_DEVICE_SECTOR_COUNT;
+    }
+#endif
 
-                     // Rewrite portion of sector header that has Status in it..,
-                     WriteSector( DeleteSector, (char*)&SecHeader.Version - (char*)&SecHeader, &(SecHeader.Version), 4);
-                     TotalFixedSectors++;
+    return  GetFlashSectionEntry( Sector, &Section, &RelSector );
+}
 
-                     DeleteSector = NextSector;                // Next sector is now current sector.
-                  }
 
-                  if(Fnode.Count < NextFnode.Count)
-                  {
-                     // We don't need to check any more for this sector.
-                     break;
-                  }
-               }
-            }
-         }
-      }
-   }
 
-   FFS_UNLOCK();
 
-   return TotalFixedSectors;
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::GetFlashSectionEntry
+//
+//    Purpose:          Locate which flash section a particular sector is in and return
+//                      the FFS_FLASH_SECTION table entry that represents the area
+//                      the sector is in.
+//
+//    Inputs:           Sector - Sector number to locate.
+//
+//    Outputs:          Section - A pointer to where to return the section table entry ptr.
+//                      RelSector - Sector nbr relative to start of a flash device section.
+//
+//    Returns:          True if within one of the defined sections of flash devices, or
+//                      False if not.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::GetFlashSectionEntry(  unsigned long        Sector,
+                                 FFS_FLASH_SECTION** Section,
+                                 unsigned long*       RelSector )
+{
+#ifdef FFS_FIXED_DEVICE
+    // Fixed device: one section covering the whole device...
+    if( Sections == NULL )
+    {
+        *Section   = &FixedDeviceSection;
+        *RelSector = Sector;
+        return Sector < FFS_DEVICE_SECTOR_COUNT;
+    }
+#endif
+
+    *Section = &(Sections[0]);
+
+    // Go thru the table until we get to the end...
+    while ((*Section)->Device != 0xff)
+    {
+        if (Sector < (*Section)->Count )
+        {
+           *RelSector = Sector;
+            return 1;
+        }
+
+        // Skip past this section's sectors, then bump up to next section...
+        Sector -= (*Section)->Count;
+        (*Section)++;
+    }
+
+    return 0;                       // not found/not valid.
 }
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::LocatePosition
-//
-//    Purpose:          Locate the current position of a file.
+//    Function Name:    Jcffs::BankOf
 //
-//    Inputs:           Fdesc    - Pointer to file descriptor.
-//                      Position - Position of fle to locate.
+//    Purpose:          Find which bank a sector is in.
 //
-//    Outputs:          Sector   - Returned sector number where position is located.
-//                      SecHead  - Returned sector header from that sector.
-//                      Offset   - Returned offset into sector where position is at.
+//    Inputs:           Sector - Sector number.
 //
-//    Returns:          Either 0 or Jcffs error code.
+//    Returns:          Bank number, counting banks across the whole volume.
 //
-//    Notes:
-//                      We locate where the current file position is. That is, we locate
-//                      in what sector and at what offset into that sector. And, we return
-//                      the sector number of that sector, and the offset into that sector.
-//                      Also, the sector header is returned, which contains the size of
-//                      the sector.
+//    Notes:            A section that doesn't declare banks is one bank.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::LocatePosition( FFS_FILE_DESCRIPTOR* Fdesc,
-                          unsigned long         Position,
-                          unsigned long*        Sector,
-                          FFS_SECTOR_HEADER*   SecHead,
-                          unsigned long*        Offset )
+unsigned long Jcffs::BankOf( unsigned long Sector )
 {
-    FFS_FILE_NODE*        Fnode;                 // Ptr to In-core fnode in file desc entry.
-    int                    rc;
-    unsigned long          Count = 0;             // As we're reading sectors, keep count.
-
-    Fnode = &(Fdesc->Fnode);                      // Copy ptr for convenience.
-
-    *Sector = Fdesc->FnodeSector;                 // Start with first sector.
+    FFS_FLASH_SECTION*   Section;
+    unsigned long         Bank = 0;
 
-    while(1)
+#ifdef FFS_FIXED_DEVICE
+    if( Sections == NULL )
     {
-        // Read sector header from this sector. If error, return with that error...
-        if( (rc = ReadSector( *Sector, 0, SecHead, sizeof(FFS_SECTOR_HEADER) )) < 0)
-        {
-            return rc;
-        }
+        return 0;
+    }
+#endif
 
-        // Is position within this sector?
-        if (Position < (Count + (SecHead->SectorLength - SecHead->DataOffset)))
+    for( Section = &(Sections[0]); Section->Device != 0xff; Section++ )
+    {
+        if( Sector < Section->Count )
         {
-            // Position is within this sector. Calculate Offset...
-            *Offset = SecHead->DataOffset + (Position - Count);
-            break;
+            return Bank + ( Section->BankSectors ? Sector / Section->BankSectors : 0 );
         }
 
-        Count += (SecHead->SectorLength - SecHead->DataOffset);    // Calc running total.
-
-        *Sector = SecHead->Next;                  // Get next sector number.
+        Bank   += Section->BankSectors ? (Section->Count + Section->BankSectors - 1) / Section->BankSectors : 1;
+        Sector -= Section->Count;
     }
 
-    return 0;
+    return Bank;
 }
 
 
-
-
-
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::LocateFileNode
-//
-//    Purpose:          Locate the file in the file system.  If it is found, then
-//                      copy filenode to caller's place and return sector where
-//                      filenode is, which is also the start of the file.
-//
-//                      Locate the file by going thru every sector and if it is a sector
-//                      with a valid fnode, check the name.
+//    Function Name:    Jcffs::NoteBankRead / Jcffs::BankIsHot
 //
-//    Inputs:           Filename - the name of the file to locate.
+//    Purpose:          Count a read of file data against its bank, and see whether
+//                      a bank is busier with reads than the average.
 //
-//    Outputs:          Fnode  - Where to copy the filenode.
-//                      Sector - The sector number where the filenode lives.
+//    Inputs:           Sector - Sector read, or to be written.
 //
-//    Returns:          0=Found, 1=Not Found, or Jcffs error code.
+//    Returns:          BankIsHot() returns true if reads favour the sector's bank.
 //
-//    Notes:            At some point we could cache the names in a local directory array.
+//    Notes:            With one bank, no bank is ever hot.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::LocateFileNode(char* Filename, FFS_FILE_NODE* RtnFnode, unsigned long* RtnSector)
+void Jcffs::NoteBankRead( unsigned long Sector )
 {
-    unsigned long         Sector;
-    FFS_SECTOR_HEADER    SecHead;
-    FFS_FILE_NODE        Fnode;
-    char                  CompName[FFS_MAX_FILENAME_LENGTH + 1];
-    char                  FnodeName[FFS_MAX_FILENAME_LENGTH + 1];
+    unsigned long         Bank;
 
-    Sector = 0;                                   // Start with the first sector.
+    if( BankCount < 2 )
+    {
+        return;
+    }
 
-    strcpy(CompName, Filename);                   // Copy Filename so we can compare case-insensitive.
-    StringToUpperCase(CompName);
+    BankReads[ BankOf( Sector ) % FFS_MAX_BANKS ]++;
 
-    while( ValidSector( Sector ) )
+    // Age the counts...
+    if( ++BankReadTotal >= FFS_BANK_HEAT_DECAY )
     {
-        // Read sector header...
-        ReadSector( Sector, 0, &SecHead, sizeof(FFS_SECTOR_HEADER) );
-
-        // Does this sector have an fnode?
-        if (SecHead.Status == FFS_SECTOR_HEADER_INUSE_FILENODE )
+        BankReadTotal = 0;
+        for( Bank = 0; Bank < BankCount; Bank++ )
         {
-            // Read File Node, which contains filename...
-            ReadSector( Sector, sizeof(FFS_SECTOR_HEADER), &Fnode, sizeof(FFS_FILE_NODE) );
+            BankReads[Bank] /= 2;
+            BankReadTotal   += BankReads[Bank];
+        }
+    }
+}
 
-            // Copy and uppercase name from fnode so we can compare case-insensitive...
-            strcpy(FnodeName, Fnode.Filename);
-            StringToUpperCase(FnodeName);
+bool Jcffs::BankIsHot( unsigned long Sector )
+{
+    return BankReads[ BankOf( Sector ) % FFS_MAX_BANKS ] * BankCount > BankReadTotal;
+}
 
-            // Now see if filenames match...
-            if( strcmp(FnodeName, CompName) == 0 )
-            {
-                // Filenames match, so return fnode and sector...
-                memcpy(RtnFnode, &Fnode, sizeof(FFS_FILE_NODE));
-                *RtnSector = Sector;
-                return 1;
-            }
-        }
 
-        Sector += 1;              // Next sequencial sector number.
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::ClassOf
+//
+//    Purpose:          Find a file's write statistics class.
+//
+//    Inputs:           Filename - Name of the file.
+//
+//    Returns:          Class, 0 to FFS_WRITE_CLASSES - 1.
+//
+//    Notes:            A class the classifier gets wrong is taken as the last one.
+//
+//---------------------------------------------------------------------------------------
+int Jcffs::ClassOf( const char* Filename )
+{
+    int                   Class;
 
+    if( Classify == NULL )
+    {
+        return 0;
     }
 
-    // Could not find file...
-    *RtnSector = -1;
-    return 0;
+    Class = Classify( Filename );
+
+    return ( Class < 0 || Class >= FFS_WRITE_CLASSES ) ? FFS_WRITE_CLASSES - 1 : Class;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::NoteLogical / Jcffs::NoteErase
+//
+//    Purpose:          Count bytes the caller wrote, and a sector erased, against the
+//                      volume and the class being worked on.
+//
+//    Inputs:           Length     - Bytes written.
+//                      SectorSize - Size of the sector erased.
+//
+//    Returns:          Nothing.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::NoteLogical( unsigned long Length )
+{
+    WriteStats.Volume.LogicalBytes += Length;
+    if( IoClass >= 0 )
+    {
+        WriteStats.Class[IoClass].LogicalBytes += Length;
+    }
 }
 
+void Jcffs::NoteErase( unsigned long SectorSize )
+{
+    WriteStats.Volume.Erases++;
+    WriteStats.Volume.EraseBytes += SectorSize;
+    if( IoClass >= 0 )
+    {
+        WriteStats.Class[IoClass].Erases++;
+        WriteStats.Class[IoClass].EraseBytes += SectorSize;
+    }
+}
 
 
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::AllocateSector
+//    Function Name:    Jcffs::CountSectors
 //
-//    Purpose:          Allocate a sector that wasn't being used.
+//    Purpose:          Count the total number of sectors this volume manages.
 //
 //    Inputs:           None.
 //
-//    Outputs:          NewSector - Sector number of newly allocated sector.
-//                      SecHeader - A copy of new sector header.
-//
-//    Returns:          0 or an Jcffs error code.
+//    Returns:          Total number of sectors in all sections of the volume.
 //
 //    Notes:
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::AllocateSector( unsigned long* NewSector, FFS_SECTOR_HEADER* SecHeader )
+unsigned long Jcffs::CountSectors( void )
 {
-   FFS_FLASH_SECTION*   Section;
+    FFS_FLASH_SECTION*   Section;
+    unsigned long         Total = 0;
 
+#ifdef FFS_FIXED_DEVICE
+    if( Sections == NULL )
+    {
+        return FFS_DEVICE_SECTOR_COUNT;
+    }
+#endif
 
-   // Find a free sector. If we found one, clean it and update header...
-   if( FindFreeSector( NewSector, SecHeader, &Section ) )
-   {
-      // We've already read his sector header, so update the sector header so
-      // that we can rewrite it after we erase the sector...
-      SecHeader->Key            = FFS_SECTOR_HEADER_KEY;
-      SecHeader->Next           = -1;
-      SecHeader->EraseCount++;
-      SecHeader->Version        = FFS_FILE_SYSTEM_VERSION;
-      SecHeader->Status         = FFS_SECTOR_HEADER_INUSE;
-      SecHeader->SectorChecksum = 0xffff;
-      SecHeader->SectorLength   = Section->SectorSize;
-      SecHeader->DataOffset     = sizeof(FFS_SECTOR_HEADER);
-
-      EraseSector( *NewSector );
-
-      // Now, rewrite sector header back out...
-      WriteSector( *NewSector, 0, SecHeader, sizeof(FFS_SECTOR_HEADER));
-
-      return 0;
-   }
+    // Go thru the table until we get to the end...
+    for( Section = &(Sections[0]); Section->Device != 0xff; Section++ )
+    {
+        Total += Section->Count;             // Tally count.
+    }
 
-   return FFS_RC_OUT_OF_SPACE;
+    return Total;
 }
 
 
@@ -1207,455 +6519,617 @@ int Jcffs::AllocateSector( unsigned long* NewSector, FFS_SECTOR_HEADER* SecHeade
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::AllocateSectorWithFilenode
+//    Function Name:    Jcffs::GetDescriptor
 //
-//    Purpose:          Allocate a sector that wasn't being used. Leave space for
-//                      file node.
+//    Purpose:          Allocate a descriptor table entry.
 //
 //    Inputs:           None.
 //
-//    Outputs:          NewSector - Sector number of newly allocated sector.
-//                      SecHeader - A copy of new sector header.
-//
-//    Returns:          0 or an Jcffs error code.
+//    Returns:          Either a desriptor number (index into table), or an
+//                      Jcffs error code.
 //
 //    Notes:
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::AllocateSectorWithFilenode( unsigned long* NewSector, FFS_SECTOR_HEADER* SecHeader )
+int Jcffs::GetDescriptor( void )
 {
-   FFS_FLASH_SECTION*   Section;
-
+   int   fd;
 
-   // Find a free sector. If we found one, clean it and update header...
-   if( FindFreeSector( NewSector, SecHeader, &Section ) )
+   for( fd = 0; fd < FFS_MAX_FILE_DESCRIPTORS; fd++ )
    {
-      // We've already read his sector header, so update the sector header so
-      // that we can rewrite it after we erase the sector...
-      SecHeader->Key            = FFS_SECTOR_HEADER_KEY;
-      SecHeader->Next           = -1;
-      SecHeader->EraseCount++;
-      SecHeader->Version        = FFS_FILE_SYSTEM_VERSION;
-      SecHeader->Status         = FFS_SECTOR_HEADER_INUSE_FILENODE;
-      SecHeader->SectorChecksum = 0xffff;
-      SecHeader->SectorLength   = Section->SectorSize;
-      SecHeader->DataOffset     = sizeof(FFS_SECTOR_HEADER) + sizeof(FFS_FILE_NODE);
-
-      EraseSector( *NewSector );
+      // Is this one free?
+      if( !FileDescriptors[fd].InUse )
+      {
+         // Clean up this entry...
+         memset( (void*)&(FileDescriptors[fd]), 0, sizeof(FFS_FILE_DESCRIPTOR) );
 
-      // Now, rewrite sector header back out...
-      WriteSector( *NewSector, 0, SecHeader, sizeof(FFS_SECTOR_HEADER));
+         // Mark this one in use...
+         FileDescriptors[fd].InUse = 1;
 
-      return 0;
+         // return this descriptor.
+         return fd;
+      }
    }
 
-   return FFS_RC_OUT_OF_SPACE;
+   return FFS_RC_TOO_MANY_OPEN_FILES;
 }
 
 
-
-
-
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::FindFreeSector
+//    Function Name:    Jcffs::FreeDescriptor
 //
-//    Purpose:          Find a sector that isn't being used.
+//    Purpose:          Free a descriptor table entry.
 //
 //    Inputs:           None.
 //
-//    Outputs:          NewSector - Return a sector number of a free sector.
-//                      SecHeader - Return a copy of current sector header.
-//                      Section   - Return a pointer to a pointer to the Section
-//                                  table entry.
-//
-//    Returns:          1 if one is found.
-//                      0 if none is found.
+//    Returns:          Either a desriptor number (index into table), or an
+//                      Jcffs error code.
 //
 //    Notes:
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::FindFreeSector( unsigned long*       Sector,
-                          FFS_SECTOR_HEADER*  SecHeader,
-                          FFS_FLASH_SECTION** Section )
+int Jcffs::FreeDescriptor( int fd )
 {
-   unsigned long         ErrorCount = 0;
-   unsigned long         RelSector;
+   FileDescriptors[fd].InUse = 0;            // Clear IN USE flag.
 
+   return 0;
+}
 
-   // Find a free sector by sequencially going thru sectors.  Some time later we could
-   // implement a round-robin or balancing algorithm...
-   for( *Sector = 0; GetFlashSectionEntry( *Sector, Section, &RelSector ); (*Sector)++ )
-   {
-      ReadSector( *Sector, 0, SecHeader, sizeof(FFS_SECTOR_HEADER) );
 
-      // First check to see if sector header looks valid...
-      if( SecHeader->Key == FFS_SECTOR_HEADER_KEY )
-      {
-         if( SecHeader->Status == FFS_SECTOR_HEADER_FREE ||
-             SecHeader->Status == FFS_SECTOR_HEADER_FREE_DIRTY  )
-         {
-            // Return: we found a free sector...
-            return 1;
-         }
-      }
-      else
-      {
-#if 1
-         // Return: Assume that this sector has just never been used before. We'll tally
-         // it as an error, but assume it's free and return it to caller...
-         ErrorCount++;
-         if(ErrorCount > ErrorSectorCount)
-         {
-            ErrorSectorCount = ErrorCount;
-         }
-         return 1;
-#else
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Jcffs::StringToUpperCase
+//
+//    Purpose:          Copy a string and uppercase it.
+//
+//    Inputs:           Ptr to string to uppercase.
+//
+//    Returns:          None.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+void Jcffs::StringToUpperCase( char* str )
+{
+   int i;
 
-         // Sector header does not look valid. The first time that the Jcffs system
-         // was started, we went thru and erased all sectors and put in new headers,
-         // so this should not happen.  This is probably an error that we should
-         // deal with at some time, but for now, just keep count of bad ones and
-         // ignore it for now.
-         ErrorCount++;
-         if(ErrorCount > ErrorSectorCount)
-         {
-            ErrorSectorCount = ErrorCount;
-         }
-#endif
-      }
+   for(i = strlen(str); i > 0 ; i--)
+   {
+      str[i-1] = toupper(str[i-1]);
    }
-
-   return 0;
 }
 
 
-
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::FreeSectors
+//    Function Name:    Jcffs::Initialize
 //
-//    Purpose:          Free a list of sectors (because we're deleting a file).
+//    Purpose:          Do any necessary initialization.
 //
-//    Inputs:           Sector - Starting sector to delete.
+//    Inputs:           None.
 //
-//    Returns:          0 or Jcffs error code.
+//    Returns:          0, or FFS_RC_OUT_OF_MEMORY if there is no check map.
 //
-//    Notes:            The process of freeing a sector involves changing the Status
-//                      field to 00.  This is one byte, so we actually read/write
-//                      4 bytes around it.  The changing of Status to 00 is reasonable
-//                      since we only support NOR flash and because when we write NOR
-//                      flash, we can only change ones to zeros. Only the erase sector
-//                      function can change zeros back to ones in a sector.
+//    Notes:            A volume without a check map can still be used, but Check()
+//                      and imports fail.  FFSMount() doesn't mount one.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::FreeSectors( unsigned long Sector )
+int Jcffs::Initialize( void )
 {
-   FFS_SECTOR_HEADER  SecHead;
-   unsigned long       NextSector;
-
-   while (Sector != -1 )
+   if( initializationComplete == false )
    {
-      // All of sector header...
-      ReadSector( Sector, 0, &SecHead, sizeof(FFS_SECTOR_HEADER) );
+      FFS_INITLOCK();
 
-      // Save number of next sector in chain...
-      NextSector = SecHead.Next;
+      // The volume's geometry doesn't change while mounted, so count it once...
+      TotalSectors  = CountSectors();
+      CheckMapWords = FFS_CHECK_MAP_WORDS(TotalSectors);
+
+      GcLowWater         = FFS_GC_LOW_WATER;
+      GcHighWater        = FFS_GC_HIGH_WATER;
+      GcForegroundBudget = FFS_GC_FOREGROUND_BUDGET;
+      GcCursor           = 0;
+      GcCountsValid      = false;            // Counted when first needed.
+
+      ErasingSection     = NULL;
+      ErasingSector      = -1;
+      EraseSuspended     = false;
+
+      IoCount            = 0;
+      IoDataUsed         = 0;
+      IoBatch            = 0;
+      WindowSector       = -1;
+      DiscardCount       = 0;
+
+      memset( BankReads, 0, sizeof(BankReads) );
+      BankReadTotal      = 0;
+      BankCount          = TotalSectors ? BankOf( TotalSectors - 1 ) + 1 : 1;
+      if( BankCount > FFS_MAX_BANKS )
+      {
+         BankCount = FFS_MAX_BANKS;
+      }
 
-      // Change status to FREE...
-      SecHead.Status = FFS_SECTOR_HEADER_FREE_DIRTY;  // Mark this sector as free but needing erase.
+      memset( OpenCache, 0, sizeof(OpenCache) );
+      OpenCacheClock     = 0;
 
-      // Rewrite portion of sector header that has Status in it..,
-      WriteSector( Sector, (char*)&SecHead.Version - (char*)&SecHead, &(SecHead.Version), 4);
+      NameFilterValid    = false;            // Built when first needed.
+      memset( &LookupStats, 0, sizeof(LookupStats) );
 
-      Sector = NextSector;                         // Next sector is now current sector.
-   }
+      TrimCount          = 0;                // Deleted files are found when counting.
+      TrimStarted        = false;
+      TrimOverflow       = false;
+      TrimFound          = false;
 
-   return 0;
-}
+#ifdef FFS_MICROBENCH
+      BenchMark          = NULL;
+#endif
+
+      memset( &WriteStats, 0, sizeof(WriteStats) );
+      Classify           = NULL;
+      YieldHook          = NULL;
+      YieldContext       = NULL;
+      IoCause            = FFS_WRITE_METADATA;
+      IoClass            = -1;
+
+      // If the caller didn't give us an arena for the check map, allocate it now,
+      // once, so Check() never has to...
+      if( CheckMap == NULL )
+      {
+         CheckMap      = (unsigned long*)_mem_alloc_zero( FFS_CHECK_MAP_SIZE(TotalSectors) );
+         CheckMapOwned = true;
+      }
 
+      initializationComplete = true;
+   }
 
+   return ( CheckMap == NULL ) ? FFS_RC_OUT_OF_MEMORY : 0;
+}
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::ReadSector
+//    Function Name:    Jcffs::Unmount
 //
-//    Purpose:          Read a portion of a sector.
+//    Purpose:          Release everything a volume owns.
 //
-//    Inputs:           Sector - Sector number to read from.
-//                      Offset - Offset into sector to start reading from.
-//                      Buffer - Caller's buffer to copy the read data into.
-//                      Length - Length of how much to read from sector.
+//    Inputs:           None.
 //
-//    Returns:          0 > the length of data read or an Jcffs error code.
+//    Returns:          0 or FFS_RC_VOLUME_BUSY if files are still open.
 //
-//    Notes:
+//    Notes:            The volume object itself is freed by the caller.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::ReadSector(  unsigned long  Sector,
-                       unsigned long  Offset,
-                       unsigned char* Buffer,
-                       int            Length)
+int Jcffs::Unmount( void )
 {
-   FFS_FLASH_SECTION*   Section;
-   unsigned long         RelSector;
+   int   fd;
 
-   // Locate which section this sector is in...
-   if( GetFlashSectionEntry( Sector, &Section, &RelSector ) == 0)
+   if( initializationComplete == false )
    {
-      return FFS_RC_INVALID_SECTOR_NUMBER;
+      return 0;
    }
 
-   return Section->Read( Section, RelSector, Offset, Buffer, Length );
-}
-
+   FFS_UPDATE_LOCK();
 
+   // Refuse to unmount while any file is still open on this volume...
+   for( fd = 0; fd < FFS_MAX_FILE_DESCRIPTORS; fd++ )
+   {
+      if( FileDescriptors[fd].InUse )
+      {
+         FFS_UPDATE_UNLOCK();
+         return FFS_RC_VOLUME_BUSY;
+      }
+   }
 
-//---------------------------------------------------------------------------------------
-//
-//    Function Name:    Jcffs::WriteSector
-//
-//    Purpose:          Write a portion of a sector.
-//
-//    Inputs:           Sector - Sector number to write to.
-//                      Offset - Offset into sector to start writing to.
-//                      Buffer - Caller's buffer of data to write.
-//                      Length - Length of how much to write to sector.
-//
-//    Returns:          0 > the length of data written or an Jcffs error code.
-//
-//    Notes:
-//
-//---------------------------------------------------------------------------------------
-int Jcffs::WriteSector( unsigned long  Sector,
-                       unsigned long  Offset,
-                       unsigned char* Buffer,
-                       int            Length )
-{
-   FFS_FLASH_SECTION*   Section;
-   unsigned long         RelSector;
+   // Let the part have the last sectors freed...
+   IssueDiscards();
 
-   // Locate which section this sector is in...
-   if( GetFlashSectionEntry( Sector, &Section, &RelSector ) == 0)
+   // Free the check map if we allocated it...
+   if( CheckMap && CheckMapOwned )
    {
-      return FFS_RC_INVALID_SECTOR_NUMBER;
+      _mem_free(CheckMap);
    }
+   CheckMap = NULL;
 
-   return Section->Write( Section, RelSector, Offset, Buffer, Length );
+   initializationComplete = false;
+
+   FFS_UPDATE_UNLOCK();
+   FFS_TERMLOCK();
+
+   return 0;
 }
 
 
 
 //---------------------------------------------------------------------------------------
-//
-//    Function Name:    Jcffs::EraseSector
-//
-//    Purpose:          Erase a complete sector.
-//
-//    Inputs:           Sector - Sector number to erase.
-//
-//    Returns:          0 or an Jcffs error code.
-//
-//    Notes:
-//
+//    C wrappers for volume management...
 //---------------------------------------------------------------------------------------
-int Jcffs::EraseSector( unsigned long Sector )
+extern "C" FFS_GLOBALS* FFSMount( FFS_FLASH_SECTION* SectionTable,
+                                  void*              CheckArena,
+                                  unsigned long      CheckArenaSize )
 {
-   FFS_FLASH_SECTION*   Section;
-   unsigned long         RelSector;
+   FFS_GLOBALS*   Volume;
 
-   // Locate which section this sector is in...
-   if( GetFlashSectionEntry( Sector, &Section, &RelSector ) == 0)
+#ifndef FFS_FIXED_DEVICE
+   // Only a fixed device build can mount a volume without a section table...
+   if( SectionTable == NULL )
    {
-      return FFS_RC_INVALID_SECTOR_NUMBER;
+      return NULL;
    }
+#endif
 
-   return Section->Erase( Section, RelSector );
+   if( (Volume = (FFS_GLOBALS*)_mem_alloc_zero(sizeof(FFS_GLOBALS))) == NULL )
+   {
+      return NULL;
+   }
+
+   Volume->Sections    = SectionTable;
+   Volume->CheckMap    = NULL;
+
+   // Use the caller's arena for the check map if it is big enough...
+   if( CheckArena )
+   {
+      if( CheckArenaSize < FFS_CHECK_MAP_SIZE(Volume->CountSectors()) )
+      {
+         _mem_free(Volume);
+         return NULL;
+      }
+      Volume->CheckMap      = (unsigned long*)CheckArena;
+      Volume->CheckMapOwned = false;
+   }
+
+   // Without a check map the volume can't be checked after a power loss...
+   if( Volume->Initialize() < 0 )
+   {
+      Volume->Unmount();
+      _mem_free(Volume);
+      return NULL;
+   }
+
+   return Volume;
 }
 
+extern "C" int FFSUnmount( FFS_GLOBALS* Volume )
+{
+   int   rc;
+
+   // The default volume is never freed...
+   if( Volume == NULL || Volume == myffsObj )
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+
+   if( (rc = Volume->Unmount()) < 0 )
+   {
+      return rc;
+   }
 
+   _mem_free(Volume);
 
+   return 0;
+}
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::ValidSector
+//    Function Name:    FFSWriteAmplification
 //
-//    Purpose:          Check to see if sector number is within our file system.
+//    Purpose:          Work out the write amplification factor from write statistics.
 //
-//    Inputs:           Sector - Sector number to check to see if valid.
+//    Inputs:           Traffic - The volume's or a class's statistics.
 //
-//    Returns:          True if within one of the defined sections of flash devices, or
-//                      False if not.
+//    Returns:          Bytes programmed per byte written, in hundredths, or 0 if
+//                      nothing was written.
 //
-//    Notes:
+//    Notes:            Erases aren't in it; they are counted on their own.
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::ValidSector( unsigned long Sector )
+extern "C" unsigned long FFSWriteAmplification( FFS_WRITE_TRAFFIC* Traffic )
 {
-    FFS_FLASH_SECTION    Section;
-    unsigned long         RelSector;
-
-    return  GetFlashSectionEntry( Sector, &Section, &RelSector );
-}
+   unsigned long long   Programmed = 0;
+   int                  Cause;
 
+   if( Traffic->LogicalBytes == 0 )
+   {
+      return 0;
+   }
 
+   for( Cause = 0; Cause < FFS_WRITE_CAUSES; Cause++ )
+   {
+      Programmed += Traffic->ProgramBytes[Cause];
+   }
 
+   return (unsigned long)( Programmed * 100 / Traffic->LogicalBytes );
+}
 
 
 //---------------------------------------------------------------------------------------
 //
-//    Function Name:    Jcffs::GetFlashSectionEntry
-//
-//    Purpose:          Locate which flash section a particular sector is in and return
-//                      the FFS_FLASH_SECTION table entry that represents the area
-//                      the sector is in.
+//    Function Name:    FFSLookupFalsePositives
 //
-//    Inputs:           Sector - Sector number to locate.
+//    Purpose:          Work out the name filter's false positive rate from lookup
+//                      statistics.
 //
-//    Outputs:          Section - A pointer to where to return the section table entry ptr.
-//                      RelSector - Sector nbr relative to start of a flash device section.
+//    Inputs:           Stats - The statistics.
 //
-//    Returns:          True if within one of the defined sections of flash devices, or
-//                      False if not.
+//    Returns:          Lookups of names that weren't there that still scanned the
+//                      volume, per lookup of a name that wasn't there, in hundredths of
+//                      a percent, or 0 if there were none.
 //
 //    Notes:
 //
 //---------------------------------------------------------------------------------------
-int Jcffs::GetFlashSectionEntry(  unsigned long        Sector,
-                                 FFS_FLASH_SECTION** Section,
-                                 unsigned long*       RelSector )
+extern "C" unsigned long FFSLookupFalsePositives( FFS_LOOKUP_STATS* Stats )
 {
-    *Section = &(FlashSectionTable[0]);
+   unsigned long long   Missing = (unsigned long long)Stats->Filtered + Stats->FalsePositives;
 
-    // Go thru the table until we get to the end...
-    while ((*Section)->Device != 0xff)
-    {
-        if (Sector < (*Section)->Count )
-        {
-           *RelSector = Sector;
-            return 1;
-        }
+   if( Missing == 0 )
+   {
+      return 0;
+   }
 
-        // bump up to next section...
-        (*Section)++;
-        Sector -= (*Section)->Count;
-    }
+   return (unsigned long)( (unsigned long long)Stats->FalsePositives * 10000 / Missing );
+}
 
-    return 0;                       // not found/not valid.
+
+//---------------------------------------------------------------------------------------
+//    C wrappers for volume-scoped file operations...
+//---------------------------------------------------------------------------------------
+extern "C" int FFSVolOpen( FFS_GLOBALS* Volume, char* Filename, int flags, int permissions )
+{
+   if( Volume )
+   {
+      return Volume->open( Filename, flags, permissions );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
 }
 
+extern "C" int FFSVolClose( FFS_GLOBALS* Volume, int fd )
+{
+   if( Volume )
+   {
+      return Volume->close( fd );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
+extern "C" int FFSVolRead( FFS_GLOBALS* Volume, int fd, char* buf, int n )
+{
+   if( Volume )
+   {
+      return Volume->read( fd, buf, n );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
+extern "C" int FFSVolWrite( FFS_GLOBALS* Volume, int fd, char* buf, int n )
+{
+   if( Volume )
+   {
+      return Volume->write( fd, buf, n );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-//---------------------------------------------------------------------------------------
-//
-//    Function Name:    Jcffs::GetDescriptor
-//
-//    Purpose:          Allocate a descriptor table entry.
-//
-//    Inputs:           None.
-//
-//    Returns:          Either a desriptor number (index into table), or an
-//                      Jcffs error code.
-//
-//    Notes:
-//
-//---------------------------------------------------------------------------------------
-int Jcffs::GetDescriptor( void )
+extern "C" long FFSVolSeek( FFS_GLOBALS* Volume, int fd, long Offset, int Whence )
 {
-   int   fd;
+   if( Volume )
+   {
+      return Volume->Seek( fd, Offset, Whence );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-   for( fd = 0; fd < FFS_MAX_FILE_DESCRIPTORS; fd++ )
+extern "C" int FFSVolPunchHole( FFS_GLOBALS* Volume, int fd, unsigned long Offset, unsigned long Length )
+{
+   if( Volume )
+   {
+      return Volume->PunchHole( fd, Offset, Length );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
+
+extern "C" int FFSVolImportBatch( FFS_GLOBALS* Volume, FFS_IMPORT_ENTRY* Entries, int Count )
+{
+   if( Volume )
+   {
+      return Volume->ImportBatch( Entries, Count );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
+
+extern "C" int FFSVolSetGcPolicy( FFS_GLOBALS*  Volume,
+                                  unsigned long LowWater,
+                                  unsigned long HighWater,
+                                  unsigned long ForegroundBudget )
+{
+   if( Volume )
    {
-      // Is this one free?
-      if( !FileDescriptors[fd].InUse )
-      {
-         // Clean up this entry...
-         memset( (void*)&(FileDescriptors[fd]), 0, sizeof(FFS_FILE_DESCRIPTOR) );
+      return Volume->SetGcPolicy( LowWater, HighWater, ForegroundBudget );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-         // Mark this one in use...
-         FileDescriptors[fd].InUse = 1;
+extern "C" int FFSVolGarbageCollect( FFS_GLOBALS* Volume, unsigned long Budget )
+{
+   if( Volume )
+   {
+      return Volume->GarbageCollect( Budget );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-         // return this descriptor.
-         return fd;
-      }
+extern "C" int FFSVolGetWriteStats( FFS_GLOBALS* Volume, FFS_WRITE_STATS* Stats, int Reset )
+{
+   if( Volume )
+   {
+      return Volume->GetWriteStats( Stats, Reset );
    }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-   return FFS_RC_TOO_MANY_OPEN_FILES;
+extern "C" int FFSVolGetLookupStats( FFS_GLOBALS* Volume, FFS_LOOKUP_STATS* Stats, int Reset )
+{
+   if( Volume )
+   {
+      return Volume->GetLookupStats( Stats, Reset );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
 }
 
+extern "C" int FFSVolSetFileClassifier( FFS_GLOBALS* Volume, FFS_FILE_CLASSIFIER Classify )
+{
+   if( Volume )
+   {
+      return Volume->SetFileClassifier( Classify );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-//---------------------------------------------------------------------------------------
-//
-//    Function Name:    Jcffs::FreeDescriptor
-//
-//    Purpose:          Free a descriptor table entry.
-//
-//    Inputs:           None.
-//
-//    Returns:          Either a desriptor number (index into table), or an
-//                      Jcffs error code.
-//
-//    Notes:
-//
-//---------------------------------------------------------------------------------------
-int Jcffs::FreeDescriptor( int fd )
+extern "C" int FFSVolSetYieldHook( FFS_GLOBALS* Volume, FFS_YIELD_HOOK Hook, void* Context )
 {
-   FileDescriptors[fd].InUse = 0;            // Clear IN USE flag.
+   if( Volume )
+   {
+      return Volume->SetYieldHook( Hook, Context );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-   return 0;
+extern "C" int FFSVolNextDirectory( FFS_GLOBALS* Volume, unsigned long* Handle, FFS_FILE_NODE* Fnode )
+{
+   if( Volume )
+   {
+      return Volume->NextDirectory( Handle, Fnode );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
 }
 
+extern "C" int FFSVolStat( FFS_GLOBALS* Volume, char* filename, FFS_FILE_NODE* Fnode )
+{
+   if( Volume )
+   {
+      return Volume->Stat( filename, Fnode );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-//---------------------------------------------------------------------------------------
-//
-//    Function Name:    Jcffs::StringToUpperCase
-//
-//    Purpose:          Copy a string and uppercase it.
-//
-//    Inputs:           Ptr to string to uppercase.
-//
-//    Returns:          None.
-//
-//    Notes:
-//
-//---------------------------------------------------------------------------------------
-void Jcffs::StringToUpperCase( char* str )
+extern "C" int FFSVolErase( FFS_GLOBALS* Volume, char* filename )
 {
-   int i;
+   if( Volume )
+   {
+      return Volume->Erase( filename );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-   for(i = strlen(str); i > 0 ; i--)
+extern "C" int FFSVolRename( FFS_GLOBALS* Volume, char* filename, char* new_filename )
+{
+   if( Volume )
    {
-      str[i-1] = toupper(str[i-1]);
+      return Volume->Rename( filename, new_filename );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
    }
 }
 
+extern "C" int FFSVolCopy( FFS_GLOBALS* Volume, char* filename, char* new_filename )
+{
+   if( Volume )
+   {
+      return Volume->Copy( filename, new_filename );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
-//---------------------------------------------------------------------------------------
-//
-//    Function Name:    Jcffs::Initialize
-//
-//    Purpose:          Do any necessary initialization.
-//
-//    Inputs:           None.
-//
-//    Returns:          Nothing.
-//
-//    Notes:
-//
-//---------------------------------------------------------------------------------------
-void Jcffs::Initialize( void )
+extern "C" int FFSVolSpace( FFS_GLOBALS* Volume, int Option )
 {
-   if( initializationComplete == false )
+   if( Volume )
    {
-      FFS_INITLOCK();
-      initializationComplete = true;
+      return Volume->Space( Option );
    }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
 
+extern "C" int FFSVolCheck( FFS_GLOBALS* Volume )
+{
+   if( Volume )
+   {
+      return Volume->Check();
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
 }
 
+#ifdef FFS_MICROBENCH
+extern "C" int FFSVolBench( FFS_GLOBALS* Volume, FFS_BENCH* Bench )
+{
+   if( Volume )
+   {
+      return Volume->Bench( Bench );
+   }
+   else
+   {
+      return FFS_RC_INVALID_VOLUME;
+   }
+}
+#endif
 
 
 //---------------------------------------------------------------------------------------
@@ -1709,6 +7183,114 @@ extern "C" int Jcffs_write( int fd, char* buf, int n  )
    }
 }
 
+extern "C" long Jcffs_Seek( int fd, long Offset, int Whence )
+{
+   if( myffsObj )
+   {
+      return myffsObj->Seek( fd, Offset, Whence );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_PunchHole( int fd, unsigned long Offset, unsigned long Length )
+{
+   if( myffsObj )
+   {
+      return myffsObj->PunchHole( fd, Offset, Length );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_ImportBatch( FFS_IMPORT_ENTRY* Entries, int Count )
+{
+   if( myffsObj )
+   {
+      return myffsObj->ImportBatch( Entries, Count );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_SetGcPolicy( unsigned long LowWater, unsigned long HighWater, unsigned long ForegroundBudget )
+{
+   if( myffsObj )
+   {
+      return myffsObj->SetGcPolicy( LowWater, HighWater, ForegroundBudget );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_GarbageCollect( unsigned long Budget )
+{
+   if( myffsObj )
+   {
+      return myffsObj->GarbageCollect( Budget );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_GetWriteStats( FFS_WRITE_STATS* Stats, int Reset )
+{
+   if( myffsObj )
+   {
+      return myffsObj->GetWriteStats( Stats, Reset );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_GetLookupStats( FFS_LOOKUP_STATS* Stats, int Reset )
+{
+   if( myffsObj )
+   {
+      return myffsObj->GetLookupStats( Stats, Reset );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_SetFileClassifier( FFS_FILE_CLASSIFIER Classify )
+{
+   if( myffsObj )
+   {
+      return myffsObj->SetFileClassifier( Classify );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+extern "C" int Jcffs_SetYieldHook( FFS_YIELD_HOOK Hook, void* Context )
+{
+   if( myffsObj )
+   {
+      return myffsObj->SetYieldHook( Hook, Context );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
 extern "C" int Jcffs_NextDirectory( unsigned long* Handle, FFS_FILE_NODE* Fnode )
 {
    if( myffsObj )
@@ -1721,6 +7303,18 @@ extern "C" int Jcffs_NextDirectory( unsigned long* Handle, FFS_FILE_NODE* Fnode
    }
 }
 
+extern "C" int Jcffs_Stat( char* filename, FFS_FILE_NODE* Fnode )
+{
+   if( myffsObj )
+   {
+      return myffsObj->Stat( filename, Fnode );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
 extern "C" int Jcffs_Erase(  char* filename  )
 {
    if( myffsObj )
@@ -1745,6 +7339,18 @@ extern "C" int Jcffs_Rename( char* filename, char* new_filename )
    }
 }
 
+extern "C" int Jcffs_Copy( char* filename, char* new_filename )
+{
+   if( myffsObj )
+   {
+      return myffsObj->Copy( filename, new_filename );
+   }
+   else
+   {
+      return -1;
+   }
+}
+
 extern "C" int Jcffs_Space(  int Option )
 {
    if( myffsObj )
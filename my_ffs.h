@@ -11,10 +11,21 @@
 #ifndef _FFS_H
 #define _FFS_H
 
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
 
 #define FFS_MAX_FILENAME_LENGTH   64      // Maximum filename length excluding null termination.
 
-#define FFS_FILE_SYSTEM_VERSION    1      // Implementation version.
+#define FFS_FILE_SYSTEM_VERSION    4      // Implementation version.
+
+// On-flash format versions we know how to read.  The Version byte in each sector header
+// says which format that sector was written in...
+#define FFS_FILE_SYSTEM_VERSION_V1 1      // Original format, no name hash in fnode.
+#define FFS_FILE_SYSTEM_VERSION_V2 2      // Fnode starts with a case-folded name hash.
+#define FFS_FILE_SYSTEM_VERSION_V3 3      // Packed, fixed-width, little-endian layout.
+#define FFS_FILE_SYSTEM_VERSION_V4 4      // Version 3 with a skip pointer in the header.
 
 //------------------------------------------------------------------------------------------------
 // Each sector starts with this header.  A sector is the smallest unit that is erasable
@@ -32,15 +43,66 @@ typedef struct myffs_sector_header
    unsigned short SectorChecksum;          // Checksum of entire sector, when complete.
    unsigned long  SectorLength;            // Length of this sector.
    unsigned long  DataOffset;              // Offset to where data starts.
+   unsigned long  FileOffset;              // File offset of first data byte, -1 if unknown.
+   unsigned long  Bypass;                  // If set, next sector instead of Next, else -1.
+   unsigned long  Skip;                    // A sector further on in the chain, else -1.
 
 } FFS_SECTOR_HEADER;
 
+// Version 1 and 2 sector header, as found in sectors whose header Version is 1 or 2.
+// These have no FileOffset or Bypass; the file's sectors are contiguous and in order...
+typedef struct myffs_sector_header_v1
+{
+   unsigned long  Key;                     // A sanity check key.
+   unsigned long  Next;                    // Sector number of next sector for file.
+   unsigned long  EraseCount;              // Keep count of erases for sector balancing.
+   unsigned char  Version;                 // Version of FFS File system.
+   unsigned char  Status;                  // Various flags, see below.
+   unsigned short SectorChecksum;          // Checksum of entire sector, when complete.
+   unsigned long  SectorLength;            // Length of this sector.
+   unsigned long  DataOffset;              // Offset to where data starts.
+
+} FFS_SECTOR_HEADER_V1;
+
+// The sector that follows this one in its file's chain.  Bypass is programmed when the
+// sectors after this one have been punched out of the file...
+#define FFS_SUCCESSOR(SecHead)   ((SecHead).Bypass != (unsigned long)-1 ? (SecHead).Bypass : (SecHead).Next)
+
+// A clean sector has been erased by the garbage collector and given a FREE header with
+// everything but Key, Version and EraseCount left erased, so it can be allocated by
+// programming its header without another erase...
+#define FFS_SECTOR_CLEAN(SecHead)  ((SecHead).Key == FFS_SECTOR_HEADER_KEY             && \
+                                    (SecHead).Status == FFS_SECTOR_HEADER_FREE         && \
+                                    (SecHead).Version == FFS_FILE_SYSTEM_VERSION       && \
+                                    (SecHead).SectorLength == (unsigned long)-1)
+
 // Key is used as a sanity check.
 #define FFS_SECTOR_HEADER_KEY        0x6d666673    // "mffs"
 
+// Version 3 sectors start with this 16-bit key instead.  See my_ffs_format.c for the
+// version 3 layout...
+#define FFS_SECTOR_HEADER_KEY_V3     0x336d        // "m3"
+
+#define FFS_V3_HEADER_SIZE           28            // Packed sector header.
+#define FFS_V3_STATUS_OFFSET         3             // Where Status is in the header.
+#define FFS_V3_NEXT_OFFSET           4             // Where Next is in the header.
+#define FFS_V3_BYPASS_OFFSET         24            // Where Bypass is in the header.
+#define FFS_V4_HEADER_SIZE           32            // Version 3 header plus Skip.
+#define FFS_V4_SKIP_OFFSET           28            // Where Skip is in the header.
+#define FFS_V3_FNODE_FIXED_SIZE      20            // Packed fnode, less the name.
+#define FFS_V3_FNODE_FLAGS_OFFSET    18            // Where Flags is in the fnode.
+#define FFS_V3_FNODE_INDEX_SIZE      4             // Index sector number after the name.
+#define FFS_V3_INDEX_SIZE            20            // Packed index, less the entries.
+#define FFS_V3_INDEX_ENTRY_SIZE      8             // One index entry.
+
+// Packed fnode size for a given name length, padded to a word boundary...
+#define FFS_V3_FNODE_SIZE(NameLength) ((FFS_V3_FNODE_FIXED_SIZE + (NameLength) + 3) & ~3UL)
+
 // Possible values for Status...
 #define FFS_SECTOR_HEADER_INUSE            0x0f // This sector is in use.
 #define FFS_SECTOR_HEADER_INUSE_FILENODE   0xf0 // In use and contains a filenode after header.
+#define FFS_SECTOR_HEADER_INUSE_INDEX      0x3c // In use and holds the index of a file's chain.
+#define FFS_SECTOR_HEADER_DELETED_FILENODE 0x30 // Held a filenode, and its file is being deleted.
 #define FFS_SECTOR_HEADER_FREE             0xff // This sector is free.
 #define FFS_SECTOR_HEADER_FREE_DIRTY       0x00 // This sector is free but needing to be erased.
 
@@ -50,23 +112,90 @@ typedef struct myffs_sector_header
 // A filenode, or directory entry. If Sector contains the start of a file, then the file
 // node immediately follows the sector header.  The start of the file's data follows the
 // filenode.  NOTE: Make total size word aligned.
+//
+// NameHash comes first so that a directory scan can read just the sector header and the
+// hash, and only read the whole fnode when the hash matches.
 //------------------------------------------------------------------------------------------------
 typedef struct myffs_file_node
 {
+   unsigned long  NameHash;                // Case-folded hash of Filename, see FFSHashName().
    unsigned char  Permissions;             // Read/write/execute permissions.
    char           Filename[FFS_MAX_FILENAME_LENGTH+1];
    unsigned long  FileSize;                // Total size of file.
    unsigned long  DataTime;                // Data/time in seconds from 1970.
    unsigned long  Count;                   // Count each time a file is created with same name.
+   unsigned char  Flags;                   // FFS_FNODE_xxx, version 3 only.
+   unsigned long  IndexSector;             // Sector holding the chain's index, if INDEXED.
 
 } FFS_FILE_NODE;
 
+// Fnode Flags.  On flash they are stored inverted, so an erased byte means no flags and
+// a flag can be set later by programming its bit...
+#define FFS_FNODE_UNORDERED   0x01         // Chain is not in file order, see LocatePosition().
+#define FFS_FNODE_INDEXED     0x02         // IndexSector holds an index of the chain.
+#define FFS_FNODE_INDEX_STALE 0x04         // The chain has changed since it was indexed.
+#define FFS_FNODE_SKIPS_STALE 0x08         // Sectors have been unlinked; Skip can't be followed.
+
+//------------------------------------------------------------------------------------------------
+// The index of a file's chain, kept in a sector of its own for files of at least
+// FFS_INDEX_MIN_SECTORS sectors.  It lists the file offset and sector number of every sector
+// in the chain, in file order, so a position can be located without walking the chain.
+// Base and Stride give a first guess at the entry for a position: the sectors after the
+// fnode sector are usually all full and the same size...
+//------------------------------------------------------------------------------------------------
+typedef struct myffs_sector_index
+{
+   unsigned long  Owner;                   // Fnode sector of the file indexed.
+   unsigned long  Count;                   // And its fnode's Count.
+   unsigned long  Entries;                 // Number of entries that follow.
+   unsigned long  Base;                    // File offset of the second entry.
+   unsigned long  Stride;                  // Data length of the second entry's sector.
+
+} FFS_SECTOR_INDEX;
+
+#ifndef FFS_INDEX_MIN_SECTORS
+#define FFS_INDEX_MIN_SECTORS     8
+#endif
+
+// Version 2 filenode, as found in sectors whose header Version is 2...
+typedef struct myffs_file_node_v2
+{
+   unsigned long  NameHash;                // Case-folded hash of Filename, see FFSHashName().
+   unsigned char  Permissions;             // Read/write/execute permissions.
+   char           Filename[FFS_MAX_FILENAME_LENGTH+1];
+   unsigned long  FileSize;                // Total size of file.
+   unsigned long  DataTime;                // Data/time in seconds from 1970.
+   unsigned long  Count;                   // Count each time a file is created with same name.
+
+} FFS_FILE_NODE_V2;
+
+// Version 1 filenode, as found in sectors whose header Version is 1...
+typedef struct myffs_file_node_v1
+{
+   unsigned char  Permissions;             // Read/write/execute permissions.
+   char           Filename[FFS_MAX_FILENAME_LENGTH+1];
+   unsigned long  FileSize;                // Total size of file.
+   unsigned long  DataTime;                // Data/time in seconds from 1970.
+   unsigned long  Count;                   // Count each time a file is created with same name.
+
+} FFS_FILE_NODE_V1;
+
+// Largest on-flash header, fnode, and header plus name hash, over all versions.  These
+// size the raw buffers that on-flash structures are read into...
+#define FFS_MAX_HEADER_SIZE   (sizeof(FFS_SECTOR_HEADER_V1) + FFS_V4_HEADER_SIZE)
+#define FFS_MAX_FNODE_SIZE    (sizeof(FFS_FILE_NODE_V2) + FFS_V3_FNODE_FIXED_SIZE)
+#define FFS_MAX_PROBE_SIZE    (FFS_MAX_HEADER_SIZE + sizeof(unsigned long))
+
 
 
 //------------------------------------------------------------------------------------------------
 // File Descriptor table entry.
 //------------------------------------------------------------------------------------------------
+// Open files per volume.  A build may raise this (host tools do), but it must be the
+// same for every module that includes this file...
+#ifndef FFS_MAX_FILE_DESCRIPTORS
 #define FFS_MAX_FILE_DESCRIPTORS  2
+#endif
 
 typedef struct myffs_file_descriptor
 {
@@ -77,25 +206,107 @@ typedef struct myffs_file_descriptor
    unsigned long      FnodeSector;         // Sector where File Node lives.
    unsigned long      OldFnodeSector;      // If we are to delete existing file, here's it's fnode.
    unsigned long      Position;            // Current position into file.
+   unsigned char      FnodeVersion;        // Format version of the fnode sector.
+   unsigned long      TailSector;          // Last sector in the chain, -1 if not known yet.
+   unsigned long      TailStart;           // File offset of the last sector's data.
+   unsigned long      TailEnd;             // File offset just past the last sector's data.
+   unsigned char      Class;               // Write statistics class, from the classifier.
+   unsigned char      IndexLoaded;         // Index has been looked for.
+   unsigned long      IndexSector;         // Then its sector, or -1 if there is none to use.
+   unsigned long      IndexData;           // Offset of its first entry in that sector.
+   FFS_SECTOR_INDEX   Index;               // And the index itself.
+   unsigned char      Changed;             // File changed since it was opened.
+   unsigned char      Unlinked;            // File was erased or replaced while open.
+   unsigned char      Grown;               // File grew, so it gets a new fnode when it closes.
    FFS_FILE_NODE      Fnode;               // Copy of File Node.
 
 } FFS_FILE_DESCRIPTOR;
 
 
+//------------------------------------------------------------------------------------------------
+// Open cache.  When a file is closed, what was found about it (its fnode, where it is,
+// its tail and its index) is kept, so opening it again reads nothing from flash.  The
+// least recently used entry is reused.  An entry is dropped when its file is erased,
+// renamed, replaced or written to...
+//------------------------------------------------------------------------------------------------
+#ifndef FFS_OPEN_CACHE_SIZE
+#define FFS_OPEN_CACHE_SIZE       4
+#endif
+
+typedef struct myffs_open_cache_entry
+{
+   unsigned long      Used;                // When last used, 0 if the entry is empty.
+   unsigned long      NameHash;            // FFSHashName() of the name.
+   unsigned long      FnodeSector;
+   unsigned char      FnodeVersion;
+   unsigned long      TailSector;
+   unsigned long      TailStart;
+   unsigned long      TailEnd;
+   unsigned char      IndexLoaded;
+   unsigned long      IndexSector;
+   unsigned long      IndexData;
+   FFS_SECTOR_INDEX   Index;
+   FFS_FILE_NODE      Fnode;
+
+} FFS_OPEN_CACHE_ENTRY;
+
+
 #define FFS_RDONLY    0x0000
 #define FFS_WRONLY    0x0001
 #define FFS_RDWR      0x0002
 #define FFS_CREATE    0x0100
 
+// Whence values for FFSSeek()...
+#define FFS_SEEK_SET  0
+#define FFS_SEEK_CUR  1
+#define FFS_SEEK_END  2
+
 
 //------------------------------------------------------------------------------------------------
-// File check flags.  These flags are used at initialization time to do a check of the file system.
+// Batch import.  Each entry describes one file for FFSImportBatch().  Its data comes from
+// Buffer, or if Buffer is NULL, from Read, which is called with the file offset and length
+// of each piece it has to supply and returns the length supplied or a negative value...
 //------------------------------------------------------------------------------------------------
-#define CHECK_SECTOR_NOTSEEN   0x00
-#define CHECK_SECTOR_BAD       0x01
-#define CHECK_SECTOR_FNODE     0x02
-#define CHECK_SECTOR_FREE      0x04
-#define CHECK_SECTOR_INUSE     0x08
+typedef int (*FFS_IMPORT_READ)( void*          Context,
+                                unsigned long  Offset,
+                                unsigned char* Buffer,
+                                unsigned long  Length );
+
+typedef struct myffs_import_entry
+{
+   char*              Filename;            // Name of the file to create (or replace).
+   const void*        Buffer;              // Its data, or NULL to use Read.
+   FFS_IMPORT_READ    Read;                // Called for the data when there is no Buffer.
+   void*              Context;             // Passed to Read.
+   unsigned long      Size;                // Size of the file, which can't be 0.
+   int                Permissions;         // As for open().
+   int                Result;              // Returned: 0 or an FFS return code.
+
+   // Used by the import...
+   unsigned long      NameHash;            // Hash of the name.
+   unsigned long      FnodeSector;         // First sector of the new file.
+   unsigned long      Written;             // Sectors of it written so far.
+   unsigned long      OldFnodeSector;      // Existing file of the same name, or -1.
+   unsigned long      Count;               // Create count for the new fnode.
+   int                CopyFrom;            // Descriptor of the file Copy() is copying, or -1.
+
+} FFS_IMPORT_ENTRY;
+
+
+//------------------------------------------------------------------------------------------------
+// File check map.  Check() keeps one bit per sector in each of these planes.  The map is
+// allocated once when a volume is mounted and is scanned a word at a time.
+//------------------------------------------------------------------------------------------------
+#define CHECK_PLANE_CLAIMED    0        // Sector is free or holds a valid fnode.
+#define CHECK_PLANE_CHAINED    1        // Sector was reached by following a file's chain.
+#define CHECK_PLANE_BAD        2        // Sector header or fnode is not valid.
+
+#define FFS_CHECK_PLANES       3
+#define FFS_CHECK_WORD_BITS    (sizeof(unsigned long) * 8)
+
+// Words in each plane and total bytes needed for a volume of a given number of sectors...
+#define FFS_CHECK_MAP_WORDS(Sectors)  (((Sectors) + FFS_CHECK_WORD_BITS - 1) / FFS_CHECK_WORD_BITS)
+#define FFS_CHECK_MAP_SIZE(Sectors)   (FFS_CHECK_PLANES * FFS_CHECK_MAP_WORDS(Sectors) * sizeof(unsigned long))
 
 
 //------------------------------------------------------------------------------------------------
@@ -128,9 +339,254 @@ typedef struct myffs_flash_section
    int (*Erase) ( struct myffs_flash_section* section,
                   unsigned long              Sector );
 
+   // Optional background erase, for parts that can suspend an erase to be read.  Leave
+   // these NULL (or out of the initializer) to erase with Erase() instead.  EraseDone()
+   // returns 1 when the erase has finished, 0 while it is still going, or < 0 if it
+   // failed.  Only one erase per section is ever in progress...
+   int (*EraseStart)   ( struct myffs_flash_section* section,
+                         unsigned long              Sector );
+   int (*EraseDone)    ( struct myffs_flash_section* section );
+   int (*EraseSuspend) ( struct myffs_flash_section* section );
+   int (*EraseResume)  ( struct myffs_flash_section* section );
+
+   // Sectors in each bank, for parts that can read one bank while erasing another, or 0
+   // if the section is all one bank.  Reads of other banks then don't suspend an erase,
+   // and new sectors are taken from banks that reads aren't busy in...
+   unsigned long  BankSectors;
+
+   // Optional discard, for managed flash (eMMC, SD, a file on a host) whose own
+   // translation layer keeps copying whatever it hasn't been told is dead.  Count sectors
+   // from Sector on no longer hold anything from Offset to their end, and may read back
+   // as anything until they are next erased.  Leave NULL for raw flash...
+   int (*Discard) ( struct myffs_flash_section* section,
+                    unsigned long              Sector,
+                    unsigned long              Count,
+                    unsigned long              Offset );
+
+   // Optional copy, for parts that can move data without it coming out over the bus
+   // (NAND copy-back, a file on a host).  Length bytes from FromOffset in FromSector are
+   // programmed into ToSector at ToOffset, as Write() would program them.  Returns Length,
+   // or < 0 to have them read and written instead.  Leave NULL if the part can't...
+   int (*Copy) ( struct myffs_flash_section* section,
+                 unsigned long              FromSector,
+                 unsigned long              FromOffset,
+                 unsigned long              ToSector,
+                 unsigned long              ToOffset,
+                 unsigned long              Length );
+
 } FFS_FLASH_SECTION;
 
 
+//------------------------------------------------------------------------------------------------
+// Fixed device builds.  For boards whose flash never changes, define FFS_FIXED_DEVICE and
+// supply ffs_device.h, which must provide:
+//
+//    FFS_DEVICE_SECTOR_COUNT   - Number of sectors to manage (constant).
+//    FFS_DEVICE_SECTOR_SIZE    - Size of each sector (constant).
+//    FFSDeviceRead()           - static inline, same arguments as Read less the section.
+//    FFSDeviceWrite()          - static inline, same arguments as Write less the section.
+//    FFSDeviceErase()          - static inline, same arguments as Erase less the section.
+//
+// and optionally its own FFS_INITLOCK/FFS_TERMLOCK/FFS_LOCK/FFS_UNLOCK macros.  A volume
+// mounted with a NULL section table then calls the primitives directly, so the compiler
+// can inline them and fold the geometry instead of going thru the function pointers...
+//------------------------------------------------------------------------------------------------
+
+
+//------------------------------------------------------------------------------------------------
+// Garbage collection.  Freed sectors are left FREE_DIRTY; the collector erases them ahead
+// of time so that allocation doesn't have to.  It works toward the high watermark of clean
+// sectors when called from idle time (FFSGarbageCollect()).  When an allocation leaves
+// fewer than the low watermark, the allocating call does up to the foreground budget of
+// collection itself.  Budgets are in the port's ticks (FFSPlatformTicks()), and a call
+// always cleans at least one sector if there is one to clean...
+//------------------------------------------------------------------------------------------------
+#ifndef FFS_GC_LOW_WATER
+#define FFS_GC_LOW_WATER            2
+#endif
+
+#ifndef FFS_GC_HIGH_WATER
+#define FFS_GC_HIGH_WATER           8
+#endif
+
+#ifndef FFS_GC_FOREGROUND_BUDGET
+#define FFS_GC_FOREGROUND_BUDGET    0
+#endif
+
+
+//------------------------------------------------------------------------------------------------
+// I/O request queue.  Within a batch of programs (a write() call, or the data of an import)
+// programs are queued rather than issued, and a program that continues a queued one in the
+// same sector is merged into it, so a header and the data after it go out as one bus
+// transaction.  The queue is submitted in order when it fills, before an erase, and at
+// the end of the batch.  Reads see queued programs.  Reads from the start of a sector are
+// also widened to the read window, and later reads inside it are served from memory...
+//------------------------------------------------------------------------------------------------
+#ifndef FFS_IO_QUEUE_DEPTH
+#define FFS_IO_QUEUE_DEPTH          8
+#endif
+
+#ifndef FFS_IO_QUEUE_BYTES
+#define FFS_IO_QUEUE_BYTES          512
+#endif
+
+#ifndef FFS_IO_READ_WINDOW
+#define FFS_IO_READ_WINDOW          FFS_MAX_PROBE_SIZE
+#endif
+
+//------------------------------------------------------------------------------------------------
+// Bank read counts.  Reads of file data are counted per bank, and the counts are halved
+// every FFS_BANK_HEAT_DECAY reads so they follow what is being read now.  Banks past
+// FFS_MAX_BANKS share counts...
+//------------------------------------------------------------------------------------------------
+#ifndef FFS_MAX_BANKS
+#define FFS_MAX_BANKS               8
+#endif
+
+#ifndef FFS_BANK_HEAT_DECAY
+#define FFS_BANK_HEAT_DECAY         256
+#endif
+
+typedef struct myffs_io_request
+{
+   unsigned long       Sector;
+   unsigned long       Offset;
+   unsigned long       Length;
+   unsigned long       Data;                // Where its bytes are in IoData.
+
+} FFS_IO_REQUEST;
+
+
+//------------------------------------------------------------------------------------------------
+// Discards.  A freed sector's data is passed to the section's Discard() once its FREE_DIRTY
+// status is on the part, with runs of neighbouring sectors passed as one.  Runs are held
+// until FFS_DISCARD_RUNS are waiting, the I/O queue is submitted, or a sector is erased...
+//------------------------------------------------------------------------------------------------
+#ifndef FFS_DISCARD_RUNS
+#define FFS_DISCARD_RUNS            4
+#endif
+
+typedef struct myffs_discard_run
+{
+   unsigned long       Sector;              // First sector of the run.
+   unsigned long       Count;
+   unsigned long       Offset;              // Header size; the rest of each sector goes.
+
+} FFS_DISCARD_RUN;
+
+
+//------------------------------------------------------------------------------------------------
+// Write statistics.  Every byte programmed is charged to a cause, and every operation
+// on a file to the file's class, which the classifier picks from its name (all files
+// are class 0 without one).  Erases are the cost of reclaiming space and are counted on
+// their own.  Collection and Check() that isn't done for a file has no class.  The
+// write amplification factor is the bytes programmed over the bytes written; see
+// FFSWriteAmplification()...
+//------------------------------------------------------------------------------------------------
+#define FFS_WRITE_DATA              0       // File data.
+#define FFS_WRITE_METADATA          1       // Headers, fnodes, chain pointers, status.
+#define FFS_WRITE_RELOCATION        2       // Data copied elsewhere, as by Rename.
+#define FFS_WRITE_RECLAIM           3       // Headers of sectors the collector cleans.
+#define FFS_WRITE_CAUSES            4
+
+#ifndef FFS_WRITE_CLASSES
+#define FFS_WRITE_CLASSES           4
+#endif
+
+typedef struct myffs_write_traffic
+{
+   unsigned long long  LogicalBytes;                    // Written thru write() or imported.
+   unsigned long long  ProgramBytes[FFS_WRITE_CAUSES];  // Programmed, by cause.
+   unsigned long long  EraseBytes;                      // Size of the sectors erased.
+   unsigned long       Erases;
+
+} FFS_WRITE_TRAFFIC;
+
+typedef struct myffs_write_stats
+{
+   FFS_WRITE_TRAFFIC   Volume;
+   FFS_WRITE_TRAFFIC   Class[FFS_WRITE_CLASSES];
+
+} FFS_WRITE_STATS;
+
+// Returns the class of a file from its name, 0 to FFS_WRITE_CLASSES - 1...
+typedef int (*FFS_FILE_CLASSIFIER)( const char* Filename );
+
+// Called instead of FFSPlatformYield() while an update waits for a background erase.
+// The volume lock is let go, so reads may be made from it, but not updates...
+typedef void (*FFS_YIELD_HOOK)( void* Context );
+
+
+//------------------------------------------------------------------------------------------------
+// Name lookups.  A Bloom filter over the name hashes of the files on the volume answers
+// most lookups of names that aren't there without reading a sector.  It is built by the
+// first lookup after mount or Check(), and each fnode written adds its name.  Names of
+// deleted files stay in it until it is built again.  See FFSLookupFalsePositives()...
+//------------------------------------------------------------------------------------------------
+#ifndef FFS_NAME_FILTER_BITS
+#define FFS_NAME_FILTER_BITS        2048
+#endif
+#define FFS_NAME_FILTER_HASHES      3
+#define FFS_NAME_FILTER_WORDS       ((FFS_NAME_FILTER_BITS + 8 * sizeof(unsigned long) - 1) / \
+                                       (8 * sizeof(unsigned long)))
+
+typedef struct myffs_lookup_stats
+{
+   unsigned long       Lookups;             // Names looked for on flash.
+   unsigned long       Found;
+   unsigned long       Filtered;            // Not there, and the filter said so.
+   unsigned long       FalsePositives;      // Not there, found so by a scan.
+   unsigned long       FilterBits;          // Size of the filter...
+   unsigned long       FilterBitsSet;       // ...and bits set in it now.
+
+} FFS_LOOKUP_STATS;
+
+
+//------------------------------------------------------------------------------------------------
+// Deferred deletion.  Erasing a file only marks its fnode sector deleted.  The chain is
+// freed later, a little at a time by FFSGarbageCollect(), or all at once when the space
+// is needed or a sector has to be erased.  Files left deleted by an unmount or a power
+// loss are found again.  Up to FFS_TRIM_QUEUE_DEPTH are remembered; more are looked for
+// when those are done...
+//------------------------------------------------------------------------------------------------
+#ifndef FFS_TRIM_QUEUE_DEPTH
+#define FFS_TRIM_QUEUE_DEPTH        8
+#endif
+
+
+//------------------------------------------------------------------------------------------------
+// Microbenchmarks.  Builds with FFS_MICROBENCH defined have FFSVolBench(), which runs one
+// internal routine on a mounted volume so my_ffs_microbench.c can time it apart from the
+// calls around it.  For Check(), Mark is called as each pass starts and once at the end...
+//------------------------------------------------------------------------------------------------
+#define FFS_BENCH_LOCATE_FILE       0       // LocateFileNode() of Name.
+#define FFS_BENCH_FIND_FREE         1       // FindFreeSector().
+#define FFS_BENCH_LOCATE_POSITION   2       // LocatePosition() of Arg in open file fd.
+#define FFS_BENCH_FREE_SECTORS      3       // FreeSectors() of file Name, once.
+#define FFS_BENCH_SECTION_ENTRY     4       // GetFlashSectionEntry() from sector Arg on.
+#define FFS_BENCH_NAME_MATCH        5       // StringToUpperCase() compare of Name with itself.
+#define FFS_BENCH_CHECK             6       // Check(), once.
+
+#define FFS_CHECK_PASS_MAP          0       // Fnodes found and chains followed.
+#define FFS_CHECK_PASS_ORPHANS      1       // Sectors no file has, freed.
+#define FFS_CHECK_PASS_DUPLICATES   2       // Older copies of a name, deleted.
+#define FFS_CHECK_PASS_DONE         3
+
+typedef void (*FFS_BENCH_MARK)( int Pass );
+
+typedef struct myffs_bench
+{
+   int                 Routine;             // FFS_BENCH_xxx.
+   char*               Name;                // File name, for the routines that take one.
+   int                 fd;                  // Open file, for LocatePosition().
+   unsigned long       Arg;                 // Position or sector.
+   unsigned long       Count;               // Times to run it.
+   FFS_BENCH_MARK      Mark;                // Check() pass hook, or NULL.
+   unsigned long       Found;               // Returned: times it found what it looked for.
+
+} FFS_BENCH;
+
+
 //------------------------------------------------------------------------------------------------
 // The global object contains global information for MY_FFS...
 //------------------------------------------------------------------------------------------------
@@ -139,16 +595,40 @@ typedef struct myffs_globals
 
    bool initializationComplete;
 
+   // Flash section table this volume manages.  Every mounted volume has its own table,
+   // so a volume never touches sectors that belong to another volume...
+   FFS_FLASH_SECTION*  Sections;
+
+   // Platform lock handle for this volume.  Volumes are locked independently so that
+   // operations on different volumes can run in parallel...
+   void*               LockHandle;
+
+   // Held for the whole of any operation that changes the volume, so that one can let
+   // go of LockHandle while the part erases and let reads in.  A read that comes in
+   // suspends the erase for as long as it runs...
+   void*               UpdateLockHandle;
+   FFS_FLASH_SECTION*  ErasingSection;      // Section with an erase in progress, or NULL.
+   unsigned long       ErasingSector;       // Sector being erased, or -1.
+   unsigned long       ErasingRelSector;    // The same, relative to its section.
+   bool                EraseSuspended;
+
    // Table of usable/allocatable descriptors. When a file is open, a descriptor will be used...
    FFS_FILE_DESCRIPTOR  FileDescriptors[FFS_MAX_FILE_DESCRIPTORS];
 
+   // Files closed recently...
+   FFS_OPEN_CACHE_ENTRY OpenCache[FFS_OPEN_CACHE_SIZE];
+   unsigned long        OpenCacheClock;     // Stamps entries as they are used.
+
    // Keep count of sectors that seem to be bad. This is kind'a a high-water mark...
    unsigned long ErrorSectorCount;
 
-   // Pointer to initialization clean-up array.  This array has one byte for every sector in
-   // the file system and is used when Jcffs starts up to go thru all sectors to see if there
-   // are sectors that may have been orphaned due to power loss.
-   unsigned char* SectorArray;
+   // Check map.  FFS_CHECK_PLANES bit planes with one bit for every sector in the file
+   // system, used by Check() to go thru all sectors to see if there are sectors that may
+   // have been orphaned due to power loss.  Allocated once at mount, either from the
+   // caller's arena or from the heap.
+   unsigned long*      CheckMap;
+   unsigned long       CheckMapWords;       // Words in each plane.
+   bool                CheckMapOwned;       // We allocated the map, so we free it.
 
    // Total sectors in the file system.  Calculated when Jcffs is initialized.
    unsigned long       TotalSectors;
@@ -157,6 +637,63 @@ typedef struct myffs_globals
    // count of sectors that have been somehow cross-linked...
    unsigned long       TotalCrossChain;
 
+   // Garbage collection.  The clean and dirty counts are taken on first use and kept up
+   // to date as sectors are allocated, freed and cleaned; Check() has them counted again...
+   unsigned long       GcLowWater;          // Collect in the foreground below this many clean.
+   unsigned long       GcHighWater;         // Idle collection stops at this many clean.
+   unsigned long       GcForegroundBudget;  // Ticks an allocating call may spend collecting.
+   unsigned long       GcCursor;            // Where to look for the next dirty sector.
+   unsigned long       CleanSectors;
+   unsigned long       DirtySectors;        // FREE_DIRTY, or without our key.
+   bool                GcCountsValid;
+
+   // I/O request queue and read window...
+   FFS_IO_REQUEST      IoQueue[FFS_IO_QUEUE_DEPTH];
+   unsigned char       IoData[FFS_IO_QUEUE_BYTES];
+   int                 IoCount;             // Requests queued.
+   unsigned long       IoDataUsed;          // Bytes of IoData they use.
+   int                 IoBatch;             // BeginWrites() nesting, 0 outside a batch.
+   unsigned long       WindowSector;        // Sector the window holds, or -1.
+   unsigned char       Window[FFS_IO_READ_WINDOW];
+
+   // Freed sectors waiting to be discarded...
+   FFS_DISCARD_RUN     DiscardRuns[FFS_DISCARD_RUNS];
+   int                 DiscardCount;
+
+   // Bank read counts...
+   unsigned long       BankReads[FFS_MAX_BANKS];
+   unsigned long       BankReadTotal;
+   unsigned long       BankCount;           // Banks with counts of their own.
+
+   // Write statistics, and what the programs being made now are charged to...
+   FFS_WRITE_STATS     WriteStats;
+   FFS_FILE_CLASSIFIER Classify;
+   int                 IoCause;             // FFS_WRITE_xxx.
+   int                 IoClass;             // Class, or -1 for none.
+
+   // Name filter and lookup statistics...
+   unsigned long       NameFilter[FFS_NAME_FILTER_WORDS];
+   bool                NameFilterValid;     // Built since mount or Check().
+   FFS_LOOKUP_STATS    LookupStats;
+
+   // Files being deleted, by fnode sector, oldest first.  The first one's chain is
+   // freed from TrimCursor on...
+   unsigned long       TrimQueue[FFS_TRIM_QUEUE_DEPTH];
+   int                 TrimCount;
+   bool                TrimStarted;         // TrimCursor is set.
+   unsigned long       TrimCursor;          // Next sector to free, or -1 at the end.
+   unsigned long       TrimWalked;          // Sectors walked, to stop a loop.
+   bool                TrimOverflow;        // Some weren't queued, so look for them.
+   bool                TrimFound;           // Some were found on flash, maybe partly freed.
+
+   // What to do while waiting for a background erase, see FFS_YIELD_HOOK...
+   FFS_YIELD_HOOK      YieldHook;
+   void*               YieldContext;
+
+#ifdef FFS_MICROBENCH
+   FFS_BENCH_MARK      BenchMark;           // Check() pass hook while it is benchmarked.
+#endif
+
 } FFS_GLOBALS;
 
 
@@ -172,6 +709,11 @@ typedef struct myffs_globals
 #define FFS_RC_OUT_OF_SPACE            (-6)
 #define FFS_RC_FILE_NOT_FOUND          (-7)
 #define FFS_RC_NEW_NAME_EXISTS         (-8)
+#define FFS_RC_VOLUME_BUSY             (-9)
+#define FFS_RC_INVALID_VOLUME          (-10)
+#define FFS_RC_IMPORT_READ_FAILED      (-11)
+#define FFS_RC_INVALID_ARGUMENT        (-12)
+#define FFS_RC_OUT_OF_MEMORY           (-13)
 
 
 //------------------------------------------------------------------------------------------------
@@ -188,6 +730,54 @@ int FFSClose( int fd );
 int FFSRead(  int fd, char* buf, int n );
 int FFSWrite( int fd, char* buf, int n  );
 
+// Move the file position.  Writable files may be positioned past the end; the gap is a
+// hole that reads as zeros and takes no flash.  Returns the new position...
+long FFSSeek( int fd, long Offset, int Whence );
+
+// Release the flash behind a range of a file. The range reads as zeros afterwards and
+// the file size does not change...
+int FFSPunchHole( int fd, unsigned long Offset, unsigned long Length );
+
+// Create a whole set of files in one call.  The volume is searched once for free
+// sectors and existing names, the data is streamed into sectors planned in advance,
+// and then all of the fnodes are programmed together.  Existing files of the same
+// names are replaced.  Returns the number of files created, or an FFS return code if
+// nothing could be (each entry's Result says why)...
+int FFSImportBatch( FFS_IMPORT_ENTRY* Entries, int Count );
+
+// Copy a file to a new name, replacing any file of that name, without the data passing
+// thru the caller.  The copy is planned and written like an import, straight from the
+// file's sectors, and exists once its fnode is programmed at the end...
+int FFSCopy( char* filename, char* new_filename );
+
+// Set the garbage collection watermarks (in clean sectors) and the foreground budget (in
+// ticks).  High must not be below low...
+int FFSSetGcPolicy( unsigned long LowWater, unsigned long HighWater, unsigned long ForegroundBudget );
+
+// Idle hook.  Free the chains of deleted files, then erase freed sectors ahead of time
+// until the high watermark is reached or Budget ticks have passed.  Returns the number
+// of sectors freed and cleaned, 0 if there was nothing to do...
+int FFSGarbageCollect( unsigned long Budget );
+
+// Copy out the write statistics, and start them again from zero if Reset is set...
+int FFSGetWriteStats( FFS_WRITE_STATS* Stats, int Reset );
+
+// Copy out the name lookup statistics, and start the counts again from zero if Reset is
+// set...
+int FFSGetLookupStats( FFS_LOOKUP_STATS* Stats, int Reset );
+
+// Set the function that picks files' statistics classes, or NULL for all class 0.  It
+// applies to files opened from now on...
+int FFSSetFileClassifier( FFS_FILE_CLASSIFIER Classify );
+
+// Set what is called while an update waits for a background erase, or NULL to call
+// FFSPlatformYield().  An event loop can run other tasks' reads from it...
+int FFSSetYieldHook( FFS_YIELD_HOOK Hook, void* Context );
+
+// Look up one file's fnode by name, as open() would find it, rather than walking the
+// directory.  Returns 0, or FFS_RC_FILE_NOT_FOUND...
+int FFSStat( char* filename, FFS_FILE_NODE* Fnode );
+
 int FFSNextDirectory( unsigned long* Handle, FFS_FILE_NODE* Fnode  );
 int FFSErase( char* filename  );
 int FFSRename( char* filename, char* new_filename );
@@ -195,6 +785,129 @@ int FFSSpace(  int Option );
 int FFSCheck( void );
 
 
+
+//------------------------------------------------------------------------------------------------
+// On-flash format conversion (my_ffs_format.c).  These have no state and touch no flash,
+// so host tools can use them to read and build images...
+//------------------------------------------------------------------------------------------------
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Case-folded 32-bit hash of a file name, as stored in FFS_FILE_NODE.NameHash...
+unsigned long FFSHashName( const char* Filename );
+
+unsigned long FFSHeaderSize( int Version );
+unsigned long FFSFileNodeSize( int Version, const FFS_FILE_NODE* Fnode );
+unsigned long FFSNextFieldOffset( int Version );
+unsigned long FFSStatusFieldOffset( int Version );
+
+int  FFSDecodeSectorHeader( const unsigned char* Raw, FFS_SECTOR_HEADER* SecHead );
+int  FFSEncodeSectorHeader( const FFS_SECTOR_HEADER* SecHead, unsigned char* Raw );
+int  FFSEncodeSectorNumber( int Version, unsigned long Sector, unsigned char* Raw );
+void FFSDecodeFileNode( int Version, const unsigned char* Raw, FFS_FILE_NODE* Fnode );
+int  FFSEncodeFileNode( int Version, const FFS_FILE_NODE* Fnode, unsigned char* Raw );
+int  FFSDecodeNameHash( int Version, const unsigned char* Raw, unsigned long* Hash );
+
+// Chain position that the sector at chain position Index skips to, in a chain of Count
+// sectors, or -1 if it has no skip...
+unsigned long FFSSkipIndex( unsigned long Index, unsigned long Count );
+
+int  FFSEncodeIndex( const FFS_SECTOR_INDEX* Index, unsigned char* Raw );
+void FFSDecodeIndex( const unsigned char* Raw, FFS_SECTOR_INDEX* Index );
+int  FFSEncodeIndexEntry( unsigned long FileOffset, unsigned long Sector, unsigned char* Raw );
+void FFSDecodeIndexEntry( const unsigned char* Raw, unsigned long* FileOffset, unsigned long* Sector );
+
+// Checksum of a complete sector, as stored in SectorChecksum...
+unsigned short FFSSectorChecksum( int Version, const unsigned char* Raw, unsigned long Length );
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Mount an additional volume on its own flash section table.  Each volume has its own
+// descriptors, caches and lock.  In a fixed device build, a NULL table mounts the fixed
+// device.  CheckArena, if not NULL, holds the check map and must be at least
+// FFS_CHECK_MAP_SIZE(sectors) bytes; otherwise the map comes from the heap.  Returns a
+// volume handle or NULL...
+FFS_GLOBALS* FFSMount( FFS_FLASH_SECTION* SectionTable,
+                       void*              CheckArena,
+                       unsigned long      CheckArenaSize );
+
+// Unmount a volume returned by FFSMount().  Fails if the volume has open files...
+int FFSUnmount( FFS_GLOBALS* Volume );
+
+// Bytes programmed per byte written, in hundredths, from a volume's or a class's write
+// statistics.  0 if nothing was written...
+unsigned long FFSWriteAmplification( FFS_WRITE_TRAFFIC* Traffic );
+
+// Share of the lookups of names that weren't there that the name filter let thru to a
+// scan, in hundredths of a percent, from lookup statistics.  0 if there were none...
+unsigned long FFSLookupFalsePositives( FFS_LOOKUP_STATS* Stats );
+
+// Volume-scoped versions of the API calls above.  The unscoped calls operate on the
+// default volume built from FlashSectionTable...
+int FFSVolOpen(  FFS_GLOBALS* Volume, char* Filename, int flags, int permissions );
+int FFSVolClose( FFS_GLOBALS* Volume, int fd );
+int FFSVolRead(  FFS_GLOBALS* Volume, int fd, char* buf, int n );
+int FFSVolWrite( FFS_GLOBALS* Volume, int fd, char* buf, int n );
+long FFSVolSeek( FFS_GLOBALS* Volume, int fd, long Offset, int Whence );
+int FFSVolPunchHole( FFS_GLOBALS* Volume, int fd, unsigned long Offset, unsigned long Length );
+int FFSVolImportBatch( FFS_GLOBALS* Volume, FFS_IMPORT_ENTRY* Entries, int Count );
+int FFSVolCopy( FFS_GLOBALS* Volume, char* filename, char* new_filename );
+int FFSVolSetGcPolicy( FFS_GLOBALS* Volume, unsigned long LowWater, unsigned long HighWater, unsigned long ForegroundBudget );
+int FFSVolGarbageCollect( FFS_GLOBALS* Volume, unsigned long Budget );
+int FFSVolGetWriteStats( FFS_GLOBALS* Volume, FFS_WRITE_STATS* Stats, int Reset );
+int FFSVolGetLookupStats( FFS_GLOBALS* Volume, FFS_LOOKUP_STATS* Stats, int Reset );
+int FFSVolSetFileClassifier( FFS_GLOBALS* Volume, FFS_FILE_CLASSIFIER Classify );
+int FFSVolSetYieldHook( FFS_GLOBALS* Volume, FFS_YIELD_HOOK Hook, void* Context );
+int FFSVolNextDirectory( FFS_GLOBALS* Volume, unsigned long* Handle, FFS_FILE_NODE* Fnode );
+int FFSVolStat( FFS_GLOBALS* Volume, char* filename, FFS_FILE_NODE* Fnode );
+int FFSVolErase( FFS_GLOBALS* Volume, char* filename );
+int FFSVolRename( FFS_GLOBALS* Volume, char* filename, char* new_filename );
+int FFSVolSpace( FFS_GLOBALS* Volume, int Option );
+int FFSVolCheck( FFS_GLOBALS* Volume );
+
+#ifdef FFS_MICROBENCH
+// Run an internal routine, see FFS_BENCH...
+int FFSVolBench( FFS_GLOBALS* Volume, FFS_BENCH* Bench );
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+
+//------------------------------------------------------------------------------------------------
+// Platform primitives.  These must be supplied by the port.  Two locks are created per
+// mounted volume...
+//------------------------------------------------------------------------------------------------
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* FFSPlatformCreateLock( void );
+void  FFSPlatformDeleteLock( void* Lock );
+void  FFSPlatformLock( void* Lock );
+void  FFSPlatformUnlock( void* Lock );
+
+// Free running tick count, in whatever unit the port likes.  Only differences are used,
+// so it may wrap...
+unsigned long FFSPlatformTicks( void );
+
+// Let other tasks run for a moment.  Called while waiting for a background erase, so
+// that readers blocked on the volume lock get it...
+void  FFSPlatformYield( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+
 //------------------------------------------------------------------------------------------------
 // MY_FFS internal functions...
 //------------------------------------------------------------------------------------------------
@@ -204,13 +917,111 @@ static   int LocatePosition( FFS_FILE_DESCRIPTOR* Fdesc,
                        unsigned long         Position,
                        unsigned long*        Sector,
                        FFS_SECTOR_HEADER*   SecHead,
-                       unsigned long*        Offset );
+                       unsigned long*        Offset,
+                       unsigned long*        HoleLength );
+
+static   int LocateWritePosition( FFS_FILE_DESCRIPTOR* Fdesc,
+                            unsigned long         Length,
+                            unsigned long*        Sector,
+                            FFS_SECTOR_HEADER*   SecHead,
+                            unsigned long*        Offset );
+
+static   int FindTail( FFS_FILE_DESCRIPTOR* Fdesc );
+
+static   bool TakeSkip( FFS_FILE_DESCRIPTOR* Fdesc,
+                    FFS_SECTOR_HEADER*   SecHead,
+                    unsigned long         Start,
+                    unsigned long         Position,
+                    unsigned long*        Sector );
+
+static   int LocateIndexed( FFS_FILE_DESCRIPTOR* Fdesc,
+                      unsigned long         Position,
+                      unsigned long*        Sector,
+                      FFS_SECTOR_HEADER*   SecHead,
+                      unsigned long*        Offset,
+                      unsigned long*        HoleLength );
+
+static   int WriteIndex( unsigned long FnodeSector, FFS_FILE_NODE* Fnode );
+
+static   unsigned long FindIndex( unsigned long      FnodeSector,
+                              FFS_FILE_NODE*     Fnode,
+                              FFS_SECTOR_INDEX*  Index,
+                              unsigned long*     IndexData );
+
+static   int FreeIndex( unsigned long IndexSector );
+
+static   int DropIndex( FFS_FILE_DESCRIPTOR* Fdesc );
+
+static   void ImportFileNode( FFS_IMPORT_ENTRY* Entry, FFS_FILE_NODE* Fnode );
+
+static   int ImportEntries( FFS_IMPORT_ENTRY* Entries, int Count );
+
+static   int ImportFile( FFS_IMPORT_ENTRY* Entry, unsigned long* Sector );
+
+static   void DiscardImport( FFS_IMPORT_ENTRY* Entry );
+
+static   int CopyData(  FFS_FILE_DESCRIPTOR* Fdesc,
+                        unsigned long        FileOffset,
+                        unsigned long        Sector,
+                        unsigned long        Offset,
+                        unsigned long        Length,
+                        unsigned long*       FromSector,
+                        FFS_SECTOR_HEADER*   FromHead,
+                        unsigned long*       FromOffset );
 
 static   int LocateFileNode( char* Filename, FFS_FILE_NODE* RtnFnode, unsigned long* RtnSector);
+static   bool RecallFile( char* Filename, FFS_FILE_DESCRIPTOR* Fdesc );
+static   void RememberFile( FFS_FILE_DESCRIPTOR* Fdesc );
+static   void ForgetFile( const char* Filename );
+static   bool SameName( const char* Name, const char* OtherName );
+static   void BuildNameFilter( void );
+static   void AddToNameFilter( unsigned long Hash );
+static   bool InNameFilter( unsigned long Hash );
+
+static   int ReadSectorHeader( unsigned long Sector, FFS_SECTOR_HEADER* SecHead );
+
+static   int WriteSectorHeader( unsigned long Sector, FFS_SECTOR_HEADER* SecHead );
+
+static   int WriteSectorNext( unsigned long Sector, int Version, unsigned long Next );
+
+static   int WriteSectorStatus( unsigned long Sector, int Version, unsigned char Status );
+
+static   int WriteSectorBypass( unsigned long Sector, int Version, unsigned long Bypass );
 
-static   int AllocateSector( unsigned long* NewSector, FFS_SECTOR_HEADER* SecHeader );
+static   int WriteSectorSkip( unsigned long Sector, int Version, unsigned long Skip );
 
-static   int AllocateSectorWithFilenode( unsigned long* NewSector, FFS_SECTOR_HEADER* SecHeader );
+static   int WriteSkips( unsigned long FnodeSector );
+
+static   int ReadNameProbe( unsigned long      Sector,
+                      FFS_SECTOR_HEADER* SecHead,
+                      unsigned long*     NameHash );
+
+static   int ReadFileNode( unsigned long Sector, FFS_SECTOR_HEADER* SecHead, FFS_FILE_NODE* Fnode );
+
+static   int WriteFileNode( unsigned long Sector, int Version, FFS_FILE_NODE* Fnode );
+
+static   int WriteFileNodeFlags( FFS_FILE_DESCRIPTOR* Fdesc, unsigned char Flags );
+
+static   int MoveFileNode( unsigned long Sector, FFS_FILE_NODE* Fnode, unsigned long* NewSector );
+
+static   int GrowFileNode( FFS_FILE_DESCRIPTOR* Fdesc );
+
+static   int AllocateSector( unsigned long*       NewSector,
+                       FFS_SECTOR_HEADER*  SecHeader,
+                       unsigned long        FileOffset,
+                       unsigned long        MaxDataLength );
+
+static   int AllocateSectorWithFilenode( unsigned long*       NewSector,
+                                   FFS_SECTOR_HEADER*  SecHeader,
+                                   FFS_FILE_NODE*      Fnode,
+                                   unsigned long        FileOffset );
+
+static   int AllocateSectorWithStatus( unsigned long*       NewSector,
+                                 FFS_SECTOR_HEADER*  SecHeader,
+                                 unsigned char        Status,
+                                 unsigned long        DataOffset,
+                                 unsigned long        FileOffset,
+                                 unsigned long        MaxDataLength );
 
 static   int FindFreeSector( unsigned long*       Sector,
                        FFS_SECTOR_HEADER*  SecHeader,
@@ -218,6 +1029,37 @@ static   int FindFreeSector( unsigned long*       Sector,
 
 static   int FreeSectors(    unsigned long Sector );
 
+static   int CollectGarbage( unsigned long Target, unsigned long Budget );
+static   int DeleteFile( unsigned long FnodeSector );
+static   bool QueueDelete( unsigned long FnodeSector );
+static   bool FileIsOpen( unsigned long FnodeSector );
+static   int ReclaimDeleted( unsigned long Budget );
+
+static   void CountFreeSectors( void );
+
+static   int CleanSector( unsigned long Sector, FFS_SECTOR_HEADER* SecHead );
+
+static   int ReleaseSectors( unsigned long Pred,
+                       int           PredVersion,
+                       unsigned long First,
+                       unsigned long Stop );
+
+static   int UnlinkRun( FFS_FILE_DESCRIPTOR* Fdesc,
+                       unsigned long Pred,
+                       int           PredVersion,
+                       unsigned long First,
+                       unsigned long Stop );
+
+static   int ZeroSectorData( unsigned long Sector,
+                       unsigned long Offset,
+                       unsigned long Length );
+
+static   int CopySectorData( unsigned long FromSector,
+                       unsigned long FromOffset,
+                       unsigned long ToSector,
+                       unsigned long ToOffset,
+                       unsigned long Length );
+
 static   int ReadSector(     unsigned long  Sector,
                        unsigned long  Offset,
                        unsigned char* Buffer,
@@ -228,21 +1070,70 @@ static   int WriteSector(    unsigned long  Sector,
                        unsigned char* Buffer,
                        int            Length );
 
+static   void ApplyQueuedWrites( unsigned long  Sector,
+                       unsigned long  Offset,
+                       unsigned char* Buffer,
+                       unsigned long  Length );
+
+static   int ReadFlash(      unsigned long  Sector,
+                       unsigned long  Offset,
+                       unsigned char* Buffer,
+                       int            Length);
+
+static   int WriteFlash(     unsigned long  Sector,
+                       unsigned long  Offset,
+                       unsigned char* Buffer,
+                       int            Length );
+
+static   void BeginWrites(   void );
+
+static   int EndWrites(      void );
+
+static   int FlushWrites(    void );
+
+static   void NoteDiscard(   unsigned long Sector, int Version );
+
+static   void IssueDiscards( void );
+
 static   int EraseSector(    unsigned long Sector );
 
+static   void SuspendErase(  FFS_FLASH_SECTION* Section, unsigned long RelSector );
+
+static   void ResumeErase(   void );
+
 static   int ValidSector(    unsigned long Sector );
 
+static   int ClassOf(        const char* Filename );
+
+static   void NoteLogical(   unsigned long Length );
+
+static   void NoteErase(     unsigned long SectorSize );
+
+static   unsigned long BankOf( unsigned long Sector );
+
+static   void NoteBankRead(  unsigned long Sector );
+
+static   bool BankIsHot(     unsigned long Sector );
+
 static   int GetFlashSectionEntry(  unsigned long        Sector,
                               FFS_FLASH_SECTION** Section,
                               unsigned long*       RelSector );
 
+static   unsigned long CountSectors( void );
+
+static   unsigned long NextMapSector( int Plane, unsigned long Sector );
+
+static   int LowestBit( unsigned long Word );
+
 static   int GetDescriptor( void );
 
 static   int FreeDescriptor( int fd );
 
 static   void StringToUpperCase( char* str );
 
-static   void Initialize( void );
+static   int Initialize( void );
+
+static   int Unmount( void );
 
 
 
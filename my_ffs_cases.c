@@ -0,0 +1,285 @@
+//***************************************************************************************
+//
+//             my_ffs_cases.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Host tool that tries, on the emulated device (see my_ffs_emu.c), a few
+//      cases of the file calls that are easy to get wrong and that random
+//      operations don't reach.  Each case prints a line if it fails, and the
+//      files are read again once the volume is mounted anew.
+//
+//      Usage: my_ffs_cases [-s SectorSize] [-n Sectors] Image
+//
+//         -s   Sector size in bytes (default 4096).
+//         -n   Number of sectors (default 1024).
+//
+//      Exits with 0 if every case passed, 1 if any failed.
+//
+//      Build with FFS_MAX_FILE_DESCRIPTORS set as it would be on the target, and
+//      link with my_ffs.c (as C++), my_ffs_format.c and my_ffs_emu.c.
+//
+//***************************************************************************************
+
+#include "my_ffs.h"
+#include "my_ffs_emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define CHUNK                512
+
+static FFS_GLOBALS*      Volume;
+
+static unsigned long     SectorSize = 4096;
+static unsigned long     SectorCount = 1024;
+
+
+// Byte at Offset of a file of Length bytes...
+static unsigned char PatternByte( unsigned long Length, unsigned long Offset )
+{
+   return (unsigned char)(Offset * 31 + Length);
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    SameContents
+//
+//    Purpose:          Read a whole file and compare it with what it should hold.
+//
+//    Inputs:           Name   - File name.
+//                      Expect - What it should hold.
+//                      Length - And its length.
+//
+//    Returns:          1 if it matches.
+//
+//---------------------------------------------------------------------------------------
+static int SameContents( char* Name, unsigned char* Expect, unsigned long Length )
+{
+   unsigned char   Buffer[CHUNK];
+   unsigned long   Offset = 0;
+   int             Same = 1;
+   int             fd;
+   int             n;
+
+   if( (fd = FFSVolOpen( Volume, Name, FFS_RDONLY, 0 )) < 0 )
+   {
+      return 0;
+   }
+
+   while( (n = FFSVolRead( Volume, fd, (char*)Buffer, sizeof(Buffer) )) > 0 )
+   {
+      if( Offset + n > Length || memcmp( Buffer, Expect + Offset, n ) != 0 )
+      {
+         Same = 0;
+      }
+      Offset += n;
+   }
+
+   FFSVolClose( Volume, fd );
+
+   return Same && Offset == Length;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    RunCases
+//
+//    Purpose:          Try each case.
+//
+//    Inputs:           ImagePath - Scratch image.
+//
+//    Returns:          Number of cases that failed, or -1 if the volume couldn't be
+//                      set up.
+//
+//    Notes:            hole - A new file whose first write is past its start.
+//                             The gap before it reads as zeros, and part of it can
+//                             be written later.
+//
+//                      grow - An existing file opened without FFS_CREATE and written
+//                             past its end.  The new size is kept when it closes.
+//
+//                      empty - An import with an entry of size 0.  It fails, the
+//                             existing file of its name is kept, and the rest of
+//                             the batch is imported.
+//
+//---------------------------------------------------------------------------------------
+static int RunCases( const char* ImagePath )
+{
+   FFS_FLASH_SECTION*   Sections;
+   FFS_IMPORT_ENTRY     Entries[2];
+   unsigned char*       Expect;
+   unsigned long        Hole = SectorSize + SectorSize / 2;
+   unsigned long        Length = Hole + CHUNK;
+   unsigned long        i;
+   int                  Failed = 0;
+   int                  fd;
+
+   unlink( ImagePath );
+   if( (Sections = FFSEmuOpen( ImagePath, SectorSize, SectorCount )) == NULL )
+   {
+      return -1;
+   }
+
+   if( (Volume = FFSMount( Sections, NULL, 0 )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_cases: can't mount %s\n", ImagePath );
+      FFSEmuClose( Sections );
+      return -1;
+   }
+
+   if( (Expect = (unsigned char*)calloc( Length, 1 )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_cases: out of memory\n" );
+      exit( 1 );
+   }
+
+   for( i = Hole; i < Length; i++ )
+   {
+      Expect[i] = PatternByte( Length, i );
+   }
+
+   // Write past the start of a new file, then into the hole before it...
+   if( (fd = FFSVolOpen( Volume, (char*)"HOLE.DAT", FFS_CREATE | FFS_RDWR, 0 )) >= 0 )
+   {
+      FFSVolSeek( Volume, fd, (long)Hole, FFS_SEEK_SET );
+      FFSVolWrite( Volume, fd, (char*)Expect + Hole, (int)(Length - Hole) );
+      FFSVolClose( Volume, fd );
+   }
+
+   if( !SameContents( (char*)"HOLE.DAT", Expect, Length ) )
+   {
+      printf( "case hole: gap before the first write doesn't read as zeros\n" );
+      Failed++;
+   }
+
+   for( i = 0; i < CHUNK; i++ )
+   {
+      Expect[i] = PatternByte( Length, i );
+   }
+
+   if( (fd = FFSVolOpen( Volume, (char*)"HOLE.DAT", FFS_RDWR, 0 )) >= 0 )
+   {
+      FFSVolWrite( Volume, fd, (char*)Expect, CHUNK );
+      FFSVolClose( Volume, fd );
+   }
+
+   if( !SameContents( (char*)"HOLE.DAT", Expect, Length ) )
+   {
+      printf( "case hole: the rest of the hole doesn't read as zeros\n" );
+      Failed++;
+   }
+
+   // Write the start of a file, then open it again and write the rest past its end...
+   if( (fd = FFSVolOpen( Volume, (char*)"GROW.DAT", FFS_CREATE | FFS_RDWR, 0 )) >= 0 )
+   {
+      FFSVolWrite( Volume, fd, (char*)Expect, (int)Hole );
+      FFSVolClose( Volume, fd );
+   }
+
+   if( (fd = FFSVolOpen( Volume, (char*)"GROW.DAT", FFS_RDWR, 0 )) >= 0 )
+   {
+      FFSVolSeek( Volume, fd, 0, FFS_SEEK_END );
+      FFSVolWrite( Volume, fd, (char*)Expect + Hole, (int)(Length - Hole) );
+      FFSVolClose( Volume, fd );
+   }
+
+   if( !SameContents( (char*)"GROW.DAT", Expect, Length ) )
+   {
+      printf( "case grow: file doesn't keep what was written past its end\n" );
+      Failed++;
+   }
+
+   // Import over GROW.DAT with nothing, alongside a file that is fine...
+   memset( Entries, 0, sizeof(Entries) );
+   Entries[0].Filename = (char*)"GROW.DAT";
+   Entries[0].Buffer   = Expect;
+   Entries[0].Size     = 0;
+   Entries[1].Filename = (char*)"EMPTY.DAT";
+   Entries[1].Buffer   = Expect;
+   Entries[1].Size     = Length;
+
+   if( FFSVolImportBatch( Volume, Entries, 2 ) != 1 ||
+       Entries[0].Result != FFS_RC_INVALID_ARGUMENT || Entries[1].Result != 0 )
+   {
+      printf( "case empty: import of size 0 wasn't the only entry refused\n" );
+      Failed++;
+   }
+
+   if( !SameContents( (char*)"GROW.DAT", Expect, Length ) ||
+       !SameContents( (char*)"EMPTY.DAT", Expect, Length ) )
+   {
+      printf( "case empty: import of size 0 changed the files\n" );
+      Failed++;
+   }
+
+   // And again from flash...
+   FFSUnmount( Volume );
+   if( (Volume = FFSMount( Sections, NULL, 0 )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_cases: can't mount %s again\n", ImagePath );
+      FFSEmuClose( Sections );
+      free( Expect );
+      return -1;
+   }
+
+   if( !SameContents( (char*)"HOLE.DAT", Expect, Length ) )
+   {
+      printf( "case hole: file reads back wrong once mounted again\n" );
+      Failed++;
+   }
+
+   if( !SameContents( (char*)"GROW.DAT", Expect, Length ) )
+   {
+      printf( "case grow: file reads back wrong once mounted again\n" );
+      Failed++;
+   }
+
+   if( (i = FFSVolCheck( Volume )) != 0 )
+   {
+      printf( "cases: Check fixed %lu sectors\n", i );
+      Failed++;
+   }
+
+   free( Expect );
+   FFSUnmount( Volume );
+   FFSEmuClose( Sections );
+
+   return Failed;
+}
+
+
+int main( int argc, char** argv )
+{
+   int     Failed;
+   int     Opt;
+
+   while( (Opt = getopt( argc, argv, "s:n:" )) != -1 )
+   {
+      switch( Opt )
+      {
+         case 's': SectorSize  = strtoul( optarg, NULL, 0 ); break;
+         case 'n': SectorCount = strtoul( optarg, NULL, 0 ); break;
+         default:  SectorSize = 0;                           break;
+      }
+   }
+
+   if( SectorSize == 0 || SectorCount == 0 || argc - optind != 1 )
+   {
+      fprintf( stderr, "usage: %s [-s SectorSize] [-n Sectors] Image\n", argv[0] );
+      return 2;
+   }
+
+   if( (Failed = RunCases( argv[optind] )) < 0 )
+   {
+      return 1;
+   }
+
+   printf( "%d case%s failed\n", Failed, (Failed == 1) ? "" : "s" );
+
+   return Failed != 0;
+}
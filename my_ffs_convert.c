@@ -0,0 +1,302 @@
+//***************************************************************************************
+//
+//             my_ffs_convert.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Host tool that converts a version 1 or 2 flash image to the version 3
+//      packed layout.
+//
+//      Version 1 and 2 sectors hold the target's in-core structures, so the tool
+//      has to be told the target's word size and byte order.  Every sector is
+//      converted in place: sector numbers, chains and erase counts are kept, and
+//      each sector's data stays where it was relative to the other sectors of its
+//      file.  The version 3 header and fnode are smaller, so each converted sector
+//      is written as a short sector holding exactly the data it held before.
+//
+//      Usage: my_ffs_convert [-w 4|8] [-B] -s SectorSize InImage OutImage
+//
+//         -w   Size of a long on the target that wrote the image (default 4).
+//         -B   The target was big-endian.
+//         -s   Sector size in bytes.
+//
+//***************************************************************************************
+
+#include "my_ffs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+//---------------------------------------------------------------------------------------
+// Layout of the version 1 and 2 structures on the source target...
+//---------------------------------------------------------------------------------------
+typedef struct source_layout
+{
+   int   Word;                     // sizeof(unsigned long) on the target.
+   int   BigEndian;                // Target byte order.
+
+   // Sector header field offsets and size...
+   int   Key, Next, EraseCount, Version, Status, Checksum, SectorLength, DataOffset;
+
+} SOURCE_LAYOUT;
+
+static SOURCE_LAYOUT Src;
+
+
+static unsigned long Align( unsigned long Offset, unsigned long Word )
+{
+   return (Offset + Word - 1) & ~(Word - 1);
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    GetField
+//
+//    Purpose:          Read an unsigned field of the source target's byte order.
+//
+//    Inputs:           p    - Pointer to field.
+//                      Size - Field size in bytes (1, 2, 4 or 8).
+//
+//    Returns:          Field value.  An all ones field comes back as -1.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static unsigned long GetField( const unsigned char* p, int Size )
+{
+   unsigned long long   Value = 0;
+   int                  i;
+
+   for( i = 0; i < Size; i++ )
+   {
+      if( Src.BigEndian )
+      {
+         Value = (Value << 8) | p[i];
+      }
+      else
+      {
+         Value |= (unsigned long long)p[i] << (8 * i);
+      }
+   }
+
+   if( Size >= 4 && Value == (Size == 8 ? 0xffffffffffffffffULL : 0xffffffffULL) )
+   {
+      return (unsigned long)-1;
+   }
+
+   return (unsigned long)Value;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    SetLayout
+//
+//    Purpose:          Work out where the version 1 and 2 header fields are for a
+//                      target with the given word size.
+//
+//    Inputs:           Word - sizeof(unsigned long) on the target.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            This follows the natural alignment rules of the compilers we
+//                      build the target with.
+//
+//---------------------------------------------------------------------------------------
+static void SetLayout( int Word )
+{
+   Src.Word         = Word;
+   Src.Key          = 0;
+   Src.Next         = Word;
+   Src.EraseCount   = 2 * Word;
+   Src.Version      = 3 * Word;
+   Src.Status       = 3 * Word + 1;
+   Src.Checksum     = 3 * Word + 2;
+   Src.SectorLength = Align( 3 * Word + 4, Word );
+   Src.DataOffset   = Src.SectorLength + Word;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    DecodeSourceFileNode
+//
+//    Purpose:          Decode a version 1 or 2 fnode written by the source target.
+//
+//    Inputs:           Version - Version of the sector it came from.
+//                      Raw     - Bytes right after the sector header.
+//
+//    Outputs:          Fnode   - In-core file node.
+//
+//    Returns:          Nothing.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static void DecodeSourceFileNode( int Version, const unsigned char* Raw, FFS_FILE_NODE* Fnode )
+{
+   unsigned long   Offset = 0;
+
+   if( Version == FFS_FILE_SYSTEM_VERSION_V2 )
+   {
+      Offset = Src.Word;                              // Skip NameHash.
+   }
+
+   Fnode->Permissions = Raw[Offset];
+   memcpy( Fnode->Filename, Raw + Offset + 1, FFS_MAX_FILENAME_LENGTH + 1 );
+   Fnode->Filename[FFS_MAX_FILENAME_LENGTH] = 0;
+
+   Offset = Align( Offset + 1 + FFS_MAX_FILENAME_LENGTH + 1, Src.Word );
+   Fnode->FileSize = GetField( Raw + Offset,                Src.Word );
+   Fnode->DataTime = GetField( Raw + Offset + Src.Word,     Src.Word );
+   Fnode->Count    = GetField( Raw + Offset + 2 * Src.Word, Src.Word );
+   Fnode->Flags    = 0;
+
+   // Always recompute, version 1 never had one...
+   Fnode->NameHash = FFSHashName( Fnode->Filename );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    ConvertSector
+//
+//    Purpose:          Convert one sector to version 3.
+//
+//    Inputs:           In         - Source sector.
+//                      SectorSize - Size of a sector.
+//
+//    Outputs:          Out        - Converted sector.  Starts out erased.
+//
+//    Returns:          0, or -1 if the sector's data won't fit.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static int ConvertSector( const unsigned char* In, unsigned char* Out, unsigned long SectorSize )
+{
+   FFS_SECTOR_HEADER   SecHead;
+   FFS_FILE_NODE       Fnode;
+   unsigned long       OldDataOffset;
+   unsigned long       DataLength;
+   int                 Version;
+
+   memset( Out, 0xff, SectorSize );
+
+   // Anything without our key is left erased. It will be found free...
+   if( GetField( In + Src.Key, Src.Word ) != FFS_SECTOR_HEADER_KEY )
+   {
+      return 0;
+   }
+
+   Version               = In[Src.Version];
+   SecHead.Key           = FFS_SECTOR_HEADER_KEY;
+   SecHead.Next          = GetField( In + Src.Next,         Src.Word );
+   SecHead.EraseCount    = GetField( In + Src.EraseCount,   Src.Word );
+   SecHead.Version       = FFS_FILE_SYSTEM_VERSION_V3;
+   SecHead.Status        = In[Src.Status];
+   SecHead.SectorChecksum= 0xffff;
+   SecHead.DataOffset    = FFS_V3_HEADER_SIZE;
+   SecHead.SectorLength  = SectorSize;
+   SecHead.FileOffset    = -1;                // Sectors are still in file order.
+   SecHead.Bypass        = -1;
+
+   OldDataOffset = GetField( In + Src.DataOffset,   Src.Word );
+   DataLength    = GetField( In + Src.SectorLength, Src.Word ) - OldDataOffset;
+
+   switch( SecHead.Status )
+   {
+      // Free sectors keep only their erase count...
+      case FFS_SECTOR_HEADER_FREE:
+      case FFS_SECTOR_HEADER_FREE_DIRTY:
+         SecHead.Status = FFS_SECTOR_HEADER_FREE;
+         SecHead.Next   = -1;
+         FFSEncodeSectorHeader( &SecHead, Out );
+         return 0;
+
+      case FFS_SECTOR_HEADER_INUSE_FILENODE:
+         DecodeSourceFileNode( Version, In + Align( Src.DataOffset + Src.Word, Src.Word ), &Fnode );
+         SecHead.DataOffset = FFS_V3_HEADER_SIZE + FFSFileNodeSize( FFS_FILE_SYSTEM_VERSION_V3, &Fnode );
+         FFSEncodeFileNode( FFS_FILE_SYSTEM_VERSION_V3, &Fnode, Out + FFS_V3_HEADER_SIZE );
+         break;
+
+      default:
+         break;
+   }
+
+   // Keep exactly the data this sector held so the rest of the chain lines up...
+   SecHead.SectorLength = SecHead.DataOffset + DataLength;
+   if( SecHead.SectorLength > SectorSize || OldDataOffset + DataLength > SectorSize )
+   {
+      return -1;
+   }
+
+   FFSEncodeSectorHeader( &SecHead, Out );
+   memcpy( Out + SecHead.DataOffset, In + OldDataOffset, DataLength );
+
+   return 0;
+}
+
+
+int main( int argc, char** argv )
+{
+   FILE*            InFile;
+   FILE*            OutFile;
+   unsigned char*   In;
+   unsigned char*   Out;
+   unsigned long    SectorSize = 0;
+   unsigned long    Sector     = 0;
+   int              Word       = 4;
+   int              Opt;
+
+   while( (Opt = getopt( argc, argv, "w:Bs:" )) != -1 )
+   {
+      switch( Opt )
+      {
+         case 'w': Word       = atoi( optarg );             break;
+         case 'B': Src.BigEndian = 1;                       break;
+         case 's': SectorSize = strtoul( optarg, NULL, 0 ); break;
+         default:  SectorSize = 0;                          break;
+      }
+   }
+
+   if( SectorSize == 0 || (Word != 4 && Word != 8) || argc - optind != 2 )
+   {
+      fprintf( stderr, "usage: %s [-w 4|8] [-B] -s SectorSize InImage OutImage\n", argv[0] );
+      return 2;
+   }
+
+   SetLayout( Word );
+
+   if( (InFile = fopen( argv[optind], "rb" )) == NULL ||
+       (OutFile = fopen( argv[optind + 1], "wb" )) == NULL )
+   {
+      perror( "my_ffs_convert" );
+      return 1;
+   }
+
+   In  = (unsigned char*)malloc( SectorSize );
+   Out = (unsigned char*)malloc( SectorSize );
+
+   while( fread( In, 1, SectorSize, InFile ) == SectorSize )
+   {
+      if( ConvertSector( In, Out, SectorSize ) < 0 )
+      {
+         fprintf( stderr, "my_ffs_convert: sector %lu: data does not fit\n", Sector );
+         return 1;
+      }
+
+      fwrite( Out, 1, SectorSize, OutFile );
+      Sector++;
+   }
+
+   fclose( InFile );
+   fclose( OutFile );
+
+   printf( "%lu sectors converted\n", Sector );
+
+   return 0;
+}
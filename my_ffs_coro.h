@@ -0,0 +1,320 @@
+//*****************************************************************************
+//
+//             my_ffs_coro.h - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      C++20 coroutine calls for host services, so one thread can have many
+//      file operations going on one volume without a thread for each.
+//
+//      An FFSLoop runs the tasks of one volume.  A task is a coroutine that
+//      returns FFSTask, started with Spawn(), and co_awaits the loop's Open(),
+//      Read(), Write(), Close(), Erase() and Rename(), which return what the
+//      FFSVol calls do.  The calls run one at a time, in the order they were
+//      made, on the thread in Run().
+//
+//      An update waits while a background erase it needs is in flight (parts
+//      with EraseStart(), see FFS_FLASH_SECTION).  The loop takes that wait
+//      from the volume's yield hook and uses it to run other tasks, and the
+//      reads they make, so those don't wait for the erase.  The update goes on
+//      when the driver says the erase is done.  Updates the other tasks make
+//      wait for it, as they would with threads.
+//
+//      For example:
+//
+//         FFSTask Copy( FFSLoop& Loop, char* From, char* To )
+//         {
+//            char   Buffer[512];
+//            int    in  = co_await Loop.Open( From, FFS_RDONLY );
+//            int    out = co_await Loop.Open( To, FFS_CREATE | FFS_RDWR );
+//            int    n;
+//
+//            while( (n = co_await Loop.Read( in, Buffer, sizeof(Buffer) )) > 0 )
+//            {
+//               co_await Loop.Write( out, Buffer, n );
+//            }
+//            co_await Loop.Close( in );
+//            co_await Loop.Close( out );
+//         }
+//
+//         FFSLoop   Loop( Volume );
+//         Loop.Spawn( Copy( Loop, "A.DAT", "B.DAT" ) );
+//         Loop.Spawn( Copy( Loop, "C.DAT", "D.DAT" ) );
+//         Loop.Run();
+//
+//      Only the loop's thread may use the volume while it has a loop.
+//
+//*****************************************************************************
+#ifndef _FFS_CORO_H
+#define _FFS_CORO_H
+
+#include "my_ffs.h"
+#include <string.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+
+
+#define FFS_CORO_OPEN     0
+#define FFS_CORO_READ     1
+#define FFS_CORO_WRITE    2
+#define FFS_CORO_CLOSE    3
+#define FFS_CORO_ERASE    4
+#define FFS_CORO_RENAME   5
+
+
+class FFSLoop;
+
+//---------------------------------------------------------------------------------------
+// A task.  It starts when the loop gets to it, and its frame goes when it returns...
+//---------------------------------------------------------------------------------------
+struct FFSTask
+{
+   struct promise_type
+   {
+      FFSTask             get_return_object()         { return FFSTask{ std::coroutine_handle<promise_type>::from_promise( *this ) }; }
+      std::suspend_always initial_suspend() noexcept  { return {}; }
+      std::suspend_never  final_suspend()   noexcept  { return {}; }
+      void                return_void()               { }
+      void                unhandled_exception()       { std::terminate(); }
+   };
+
+   std::coroutine_handle<>   Handle;
+};
+
+
+//---------------------------------------------------------------------------------------
+// A call waiting for the loop.  It lives in the frame of the task that awaits it, so the
+// loop keeps them on a list thru Next and never allocates...
+//---------------------------------------------------------------------------------------
+class FFSOperation
+{
+public:
+   FFSOperation( FFSLoop* Loop, int Kind, int fd, char* Name, char* Buffer, int n )
+      : Loop( Loop ), Kind( Kind ), fd( fd ), Name( Name ), Buffer( Buffer ), n( n ),
+        Result( 0 ), Next( nullptr )
+   {
+   }
+
+   bool await_ready() const noexcept      { return false; }
+   inline void await_suspend( std::coroutine_handle<> Task );
+   int  await_resume() const noexcept     { return Result; }
+
+   // Reads can be made while an update waits for an erase...
+   inline bool Update() const;
+
+   FFSLoop*                  Loop;
+   int                       Kind;                // FFS_CORO_xxx.
+   int                       fd;
+   char*                     Name;
+   char*                     Buffer;              // Data, or the new name for Rename().
+   int                       n;                   // Length, or the flags for Open().
+   int                       Result;
+   std::coroutine_handle<>   Task;
+   FFSOperation*             Next;
+};
+
+
+//---------------------------------------------------------------------------------------
+// The loop.  Tasks ready to go on, and the calls they are waiting for, both in order...
+//---------------------------------------------------------------------------------------
+class FFSLoop
+{
+public:
+   explicit FFSLoop( FFS_GLOBALS* Volume )
+      : Volume( Volume ), WaitHead( nullptr ), WaitTail( nullptr )
+   {
+      memset( Writing, 0, sizeof(Writing) );
+      FFSVolSetYieldHook( Volume, Yield, this );
+   }
+
+   ~FFSLoop()
+   {
+      FFSVolSetYieldHook( Volume, nullptr, nullptr );
+   }
+
+   FFSLoop( const FFSLoop& ) = delete;
+   FFSLoop& operator=( const FFSLoop& ) = delete;
+
+   FFSOperation Open(   char* Name, int flags )          { return FFSOperation( this, FFS_CORO_OPEN,   -1, Name, nullptr, flags ); }
+   FFSOperation Read(   int fd, char* Buffer, int n )     { return FFSOperation( this, FFS_CORO_READ,   fd, nullptr, Buffer, n ); }
+   FFSOperation Write(  int fd, char* Buffer, int n )     { return FFSOperation( this, FFS_CORO_WRITE,  fd, nullptr, Buffer, n ); }
+   FFSOperation Close(  int fd )                          { return FFSOperation( this, FFS_CORO_CLOSE,  fd, nullptr, nullptr, 0 ); }
+   FFSOperation Erase(  char* Name )                      { return FFSOperation( this, FFS_CORO_ERASE,  -1, Name, nullptr, 0 ); }
+   FFSOperation Rename( char* Name, char* NewName )       { return FFSOperation( this, FFS_CORO_RENAME, -1, Name, NewName, 0 ); }
+
+   // Start a task on the next Run()...
+   void Spawn( FFSTask Task )
+   {
+      Starting.push_back( Task.Handle );
+   }
+
+   //------------------------------------------------------------------------------------
+   // Run the tasks until they have all returned...
+   //------------------------------------------------------------------------------------
+   void Run()
+   {
+      FFSOperation*   Operation;
+
+      for( ;; )
+      {
+         StartTasks();
+
+         // Tasks that were waiting go on in the order their calls were made...
+         if( (Operation = Take( false )) == nullptr )
+         {
+            break;
+         }
+
+         Perform( Operation );
+         Operation->Task.resume();
+      }
+   }
+
+   // Called by an operation as its task waits for it...
+   void Queue( FFSOperation* Operation )
+   {
+      Operation->Next = nullptr;
+      if( WaitTail )
+      {
+         WaitTail->Next = Operation;
+      }
+      else
+      {
+         WaitHead = Operation;
+      }
+      WaitTail = Operation;
+   }
+
+private:
+   void StartTasks()
+   {
+      std::coroutine_handle<>   Task;
+
+      while( !Starting.empty() )
+      {
+         Task = Starting.front();
+         Starting.pop_front();
+         Task.resume();
+      }
+   }
+
+   //------------------------------------------------------------------------------------
+   // Take the first call off the list, or the first read if ReadsOnly...
+   //------------------------------------------------------------------------------------
+   FFSOperation* Take( bool ReadsOnly )
+   {
+      FFSOperation*   Previous = nullptr;
+      FFSOperation*   Operation;
+
+      for( Operation = WaitHead; Operation; Previous = Operation, Operation = Operation->Next )
+      {
+         if( !ReadsOnly || !Operation->Update() )
+         {
+            break;
+         }
+      }
+
+      if( Operation == nullptr )
+      {
+         return nullptr;
+      }
+
+      if( Previous )
+      {
+         Previous->Next = Operation->Next;
+      }
+      else
+      {
+         WaitHead = Operation->Next;
+      }
+      if( WaitTail == Operation )
+      {
+         WaitTail = Previous;
+      }
+
+      return Operation;
+   }
+
+   void Perform( FFSOperation* Operation )
+   {
+      switch( Operation->Kind )
+      {
+         case FFS_CORO_OPEN:   Operation->Result = FFSVolOpen(   Volume, Operation->Name, Operation->n, 0 );
+                               if( Operation->Result >= 0 && Operation->Result < FFS_MAX_FILE_DESCRIPTORS )
+                               {
+                                  Writing[Operation->Result] = Operation->n != FFS_RDONLY;
+                               }
+                               break;
+         case FFS_CORO_READ:   Operation->Result = FFSVolRead(   Volume, Operation->fd, Operation->Buffer, Operation->n );     break;
+         case FFS_CORO_WRITE:  Operation->Result = FFSVolWrite(  Volume, Operation->fd, Operation->Buffer, Operation->n );     break;
+         case FFS_CORO_CLOSE:  Operation->Result = FFSVolClose(  Volume, Operation->fd );                                      break;
+         case FFS_CORO_ERASE:  Operation->Result = FFSVolErase(  Volume, Operation->Name );                                    break;
+         case FFS_CORO_RENAME: Operation->Result = FFSVolRename( Volume, Operation->Name, Operation->Buffer );                  break;
+         default:              Operation->Result = FFS_RC_INVALID_ARGUMENT;                                                    break;
+      }
+   }
+
+   //------------------------------------------------------------------------------------
+   // The volume's yield hook.  An update is waiting for an erase, with the volume lock
+   // let go.  New tasks start, and the reads waiting now are made and their tasks go
+   // on.  Reads those tasks make next wait for the next call, so the erase is looked
+   // at in between.  Their updates wait for this one...
+   //------------------------------------------------------------------------------------
+   static void Yield( void* Context )
+   {
+      FFSLoop*        Loop = (FFSLoop*)Context;
+      FFSOperation*   Operation;
+      int             Reads = 0;
+      bool            Ran = false;
+
+      Loop->StartTasks();
+
+      for( Operation = Loop->WaitHead; Operation; Operation = Operation->Next )
+      {
+         Reads += !Operation->Update();
+      }
+
+      for( ; Reads > 0 && (Operation = Loop->Take( true )) != nullptr; Reads-- )
+      {
+         Loop->Perform( Operation );
+         Operation->Task.resume();
+         Ran = true;
+      }
+
+      // Nothing to do but wait...
+      if( !Ran )
+      {
+         FFSPlatformYield();
+      }
+   }
+
+   friend class FFSOperation;
+
+   FFS_GLOBALS*                          Volume;
+   bool                                  Writing[FFS_MAX_FILE_DESCRIPTORS];   // Opened to write.
+   FFSOperation*                         WaitHead;           // Calls, in the order made.
+   FFSOperation*                         WaitTail;
+   std::deque<std::coroutine_handle<>>   Starting;           // Tasks not started yet.
+};
+
+
+inline void FFSOperation::await_suspend( std::coroutine_handle<> Task )
+{
+   this->Task = Task;
+   Loop->Queue( this );
+}
+
+// Opening a file to read, reading it and closing it only take the volume lock...
+inline bool FFSOperation::Update() const
+{
+   switch( Kind )
+   {
+      case FFS_CORO_OPEN:   return n != FFS_RDONLY;
+      case FFS_CORO_READ:   return false;
+      case FFS_CORO_CLOSE:  return fd < 0 || fd >= FFS_MAX_FILE_DESCRIPTORS || Loop->Writing[fd];
+      default:              return true;
+   }
+}
+
+#endif   // _FFS_CORO_H
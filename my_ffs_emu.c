@@ -0,0 +1,562 @@
+//***************************************************************************************
+//
+//             my_ffs_emu.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Emulated NOR flash device for host builds, backed by an image file that is
+//      mapped into memory.  Programming can only clear bits, as on real NOR flash,
+//      so the file system sees the same behaviour it would on a target.  Discarded
+//      sectors are punched out of the image, as a managed part would drop them.
+//
+//      This is also the host port: it supplies the platform lock primitives
+//      (pthreads), a millisecond tick, a yield, and an empty default section table.  Host
+//      tools mount their images as volumes with FFSMount().
+//
+//***************************************************************************************
+
+#ifdef __linux__
+#define _GNU_SOURCE                        // fallocate()
+#endif
+
+#include "my_ffs_emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+
+//---------------------------------------------------------------------------------------
+// An emulated device.  The section table comes first so the primitives can get from
+// the section they are handed back to the device...
+//---------------------------------------------------------------------------------------
+typedef struct ffs_emu_device
+{
+   FFS_FLASH_SECTION   Sections[2];         // Our section and the end of table marker.
+   int                 Fd;                  // Image file.
+   unsigned char*      Image;               // Image, mapped.
+   unsigned long       ImageSize;
+   FFS_EMU_STATS       Stats;
+
+   // Erase timing.  A background erase finishes once it has run (not suspended) for
+   // EraseTime microseconds...
+   unsigned long       EraseTime;
+   unsigned long       Erasing;             // Sector being erased, or -1.
+   unsigned long long  EraseStarted;        // When it last started or resumed.
+   unsigned long long  EraseRun;            // Time run before that.
+   int                 EraseSuspended;
+
+} FFS_EMU_DEVICE;
+
+#define EMU_DEVICE(Section)   ((FFS_EMU_DEVICE*)(Section))
+
+// The part can't be read or programmed while it is erasing, unless the erase is suspended.
+// With banks, only the bank being erased is busy...
+#define EMU_ERASING(Device)   ((Device)->Erasing != (unsigned long)-1 && !(Device)->EraseSuspended)
+#define EMU_BUSY(Device, Sector)                                                              \
+   ( EMU_ERASING(Device) &&                                                                   \
+     ( (Device)->Sections[0].BankSectors == 0 ||                                              \
+       (Sector) / (Device)->Sections[0].BankSectors == (Device)->Erasing / (Device)->Sections[0].BankSectors ) )
+
+
+static unsigned long long EmuMicroseconds( void )
+{
+   struct timespec   Now;
+
+   clock_gettime( CLOCK_MONOTONIC, &Now );
+
+   return (unsigned long long)Now.tv_sec * 1000000 + Now.tv_nsec / 1000;
+}
+
+
+// The default volume has no flash on a host...
+FFS_FLASH_SECTION FlashSectionTable[] =
+{
+   { .Device = 0xff }
+};
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    EmuRead / EmuWrite / EmuErase
+//
+//    Purpose:          Flash primitives for the emulated device.
+//
+//    Inputs:           As for FFS_FLASH_SECTION.
+//
+//    Returns:          Length read or written, 0 for erase, or -1.
+//
+//    Notes:            Reads past the end of a sector return erased bytes, since the
+//                      driver reads headers in fixed size chunks.
+//
+//---------------------------------------------------------------------------------------
+static int EmuRead( FFS_FLASH_SECTION* Section,
+                    unsigned long      Sector,
+                    unsigned long      Offset,
+                    unsigned char*     Buffer,
+                    int                Length )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+   unsigned long     Avail;
+
+   if( Sector >= Section->Count || Offset > Section->SectorSize || EMU_BUSY(Device, Sector) )
+   {
+      return -1;
+   }
+
+   Avail = Section->SectorSize - Offset;
+   if( (unsigned long)Length > Avail )
+   {
+      memset( Buffer + Avail, 0xff, Length - Avail );
+   }
+   else
+   {
+      Avail = Length;
+   }
+
+   memcpy( Buffer, Device->Image + (Section->Start + Sector) * Section->SectorSize + Offset, Avail );
+
+   Device->Stats.Reads++;
+   Device->Stats.BytesRead += Length;
+
+   return Length;
+}
+
+static int EmuWrite( FFS_FLASH_SECTION* Section,
+                     unsigned long      Sector,
+                     unsigned long      Offset,
+                     unsigned char*     Buffer,
+                     int                Length )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+   unsigned char*    p;
+   int               i;
+
+   if( Sector >= Section->Count || Offset + Length > Section->SectorSize || EMU_BUSY(Device, Sector) )
+   {
+      return -1;
+   }
+
+   p = Device->Image + (Section->Start + Sector) * Section->SectorSize + Offset;
+
+   // Programming only clears bits...
+   for( i = 0; i < Length; i++ )
+   {
+      p[i] &= Buffer[i];
+   }
+
+   Device->Stats.Writes++;
+   Device->Stats.BytesWritten += Length;
+
+   return Length;
+}
+
+static int EmuErase( FFS_FLASH_SECTION* Section, unsigned long Sector )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+   struct timespec   Wait;
+
+   if( Sector >= Section->Count || Device->Erasing != (unsigned long)-1 )
+   {
+      return -1;
+   }
+
+   if( Device->EraseTime )
+   {
+      Wait.tv_sec  = Device->EraseTime / 1000000;
+      Wait.tv_nsec = (Device->EraseTime % 1000000) * 1000;
+      nanosleep( &Wait, NULL );
+   }
+
+   memset( Device->Image + (Section->Start + Sector) * Section->SectorSize, 0xff, Section->SectorSize );
+
+   Device->Stats.Erases++;
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    EmuDiscard
+//
+//    Purpose:          Discard primitive for the emulated device.
+//
+//    Inputs:           As for FFS_FLASH_SECTION.
+//
+//    Returns:          0, or -1.
+//
+//    Notes:            Each sector's discarded part is punched out of the image file
+//                      and reads back as zeros, as it may on a managed part.  Only
+//                      whole host blocks give back space, so small sectors are just
+//                      zeroed.  Where holes can't be punched it is zeroed too.
+//
+//---------------------------------------------------------------------------------------
+static int EmuDiscard( FFS_FLASH_SECTION* Section,
+                       unsigned long      Sector,
+                       unsigned long      Count,
+                       unsigned long      Offset )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+   unsigned long     Position;
+   unsigned long     Length = Section->SectorSize - Offset;
+   unsigned long     i;
+
+   if( Sector + Count > Section->Count || Offset >= Section->SectorSize )
+   {
+      return -1;
+   }
+
+   for( i = Sector; i < Sector + Count; i++ )
+   {
+      if( EMU_BUSY(Device, i) )
+      {
+         return -1;
+      }
+
+      Position = (Section->Start + i) * Section->SectorSize + Offset;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+      if( fallocate( Device->Fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, Position, Length ) < 0 )
+#endif
+      {
+         memset( Device->Image + Position, 0, Length );
+      }
+   }
+
+   Device->Stats.Discards++;
+   Device->Stats.BytesDiscarded += Count * Length;
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    EmuCopy
+//
+//    Purpose:          Copy primitive for the emulated device.
+//
+//    Inputs:           As for FFS_FLASH_SECTION.
+//
+//    Returns:          Length, or -1.
+//
+//    Notes:            The data is programmed, so it only clears bits, as Write does.
+//                      It is counted as a copy, not as a read and a write.
+//
+//---------------------------------------------------------------------------------------
+static int EmuCopy( FFS_FLASH_SECTION* Section,
+                    unsigned long      FromSector,
+                    unsigned long      FromOffset,
+                    unsigned long      ToSector,
+                    unsigned long      ToOffset,
+                    unsigned long      Length )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+   unsigned char*    From;
+   unsigned char*    To;
+   unsigned long     i;
+
+   if( FromSector >= Section->Count || FromOffset + Length > Section->SectorSize ||
+       ToSector >= Section->Count || ToOffset + Length > Section->SectorSize ||
+       FromSector == ToSector || EMU_BUSY(Device, FromSector) || EMU_BUSY(Device, ToSector) )
+   {
+      return -1;
+   }
+
+   From = Device->Image + (Section->Start + FromSector) * Section->SectorSize + FromOffset;
+   To   = Device->Image + (Section->Start + ToSector) * Section->SectorSize + ToOffset;
+
+   for( i = 0; i < Length; i++ )
+   {
+      To[i] &= From[i];
+   }
+
+   Device->Stats.Copies++;
+   Device->Stats.BytesCopied += Length;
+
+   return (int)Length;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    EmuEraseStart / EmuEraseDone / EmuEraseSuspend / EmuEraseResume
+//
+//    Purpose:          Background erase primitives for the emulated device.
+//
+//    Inputs:           As for FFS_FLASH_SECTION.
+//
+//    Returns:          EmuEraseDone() returns 1 when done, 0 while busy.  The others
+//                      return 0, or -1.
+//
+//    Notes:            The sector is only erased when the erase completes, so a read
+//                      while it is suspended sees the old contents.  Real parts give
+//                      no such promise, which is why the driver doesn't look.
+//
+//---------------------------------------------------------------------------------------
+static int EmuEraseStart( FFS_FLASH_SECTION* Section, unsigned long Sector )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+
+   if( Sector >= Section->Count || Device->Erasing != (unsigned long)-1 )
+   {
+      return -1;
+   }
+
+   Device->Erasing        = Sector;
+   Device->EraseStarted   = EmuMicroseconds();
+   Device->EraseRun       = 0;
+   Device->EraseSuspended = 0;
+
+   return 0;
+}
+
+static int EmuEraseDone( FFS_FLASH_SECTION* Section )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+
+   if( Device->Erasing == (unsigned long)-1 )
+   {
+      return 1;
+   }
+
+   if( Device->EraseSuspended ||
+       Device->EraseRun + (EmuMicroseconds() - Device->EraseStarted) < Device->EraseTime )
+   {
+      return 0;
+   }
+
+   memset( Device->Image + (Section->Start + Device->Erasing) * Section->SectorSize, 0xff, Section->SectorSize );
+
+   Device->Erasing = -1;
+   Device->Stats.Erases++;
+
+   return 1;
+}
+
+static int EmuEraseSuspend( FFS_FLASH_SECTION* Section )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+
+   if( !EMU_ERASING(Device) )
+   {
+      return -1;
+   }
+
+   Device->EraseRun      += EmuMicroseconds() - Device->EraseStarted;
+   Device->EraseSuspended = 1;
+   Device->Stats.Suspends++;
+
+   return 0;
+}
+
+static int EmuEraseResume( FFS_FLASH_SECTION* Section )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Section);
+
+   if( !Device->EraseSuspended )
+   {
+      return -1;
+   }
+
+   Device->EraseStarted   = EmuMicroseconds();
+   Device->EraseSuspended = 0;
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSEmuOpen
+//
+//    Purpose:          Open or create an image and build a section table for it.
+//
+//    Inputs:           ImagePath   - Image file.
+//                      SectorSize  - Size of a sector.
+//                      SectorCount - Number of sectors.
+//
+//    Returns:          Section table, or NULL.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+FFS_FLASH_SECTION* FFSEmuOpen( const char*   ImagePath,
+                               unsigned long SectorSize,
+                               unsigned long SectorCount )
+{
+   FFS_EMU_DEVICE*   Device;
+   struct stat       St;
+   unsigned char     Erased[4096];
+   unsigned long     Size = SectorSize * SectorCount;
+   unsigned long     Done;
+   int               Fd;
+
+   if( SectorSize == 0 || SectorCount == 0 )
+   {
+      return NULL;
+   }
+
+   if( (Fd = open( ImagePath, O_RDWR | O_CREAT, 0644 )) < 0 || fstat( Fd, &St ) < 0 )
+   {
+      perror( ImagePath );
+      return NULL;
+   }
+
+   // A new image starts out erased...
+   if( St.st_size == 0 )
+   {
+      memset( Erased, 0xff, sizeof(Erased) );
+      for( Done = 0; Done < Size; Done += sizeof(Erased) )
+      {
+         if( write( Fd, Erased, (Size - Done < sizeof(Erased)) ? Size - Done : sizeof(Erased) ) < 0 )
+         {
+            perror( ImagePath );
+            close( Fd );
+            return NULL;
+         }
+      }
+   }
+   else if( (unsigned long)St.st_size != Size )
+   {
+      fprintf( stderr, "%s: image is %ld bytes, expected %lu\n", ImagePath, (long)St.st_size, Size );
+      close( Fd );
+      return NULL;
+   }
+
+   if( (Device = (FFS_EMU_DEVICE*)calloc( 1, sizeof(FFS_EMU_DEVICE) )) == NULL )
+   {
+      close( Fd );
+      return NULL;
+   }
+
+   Device->Image = (unsigned char*)mmap( NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0 );
+   if( Device->Image == MAP_FAILED )
+   {
+      perror( ImagePath );
+      free( Device );
+      close( Fd );
+      return NULL;
+   }
+
+   Device->Fd        = Fd;
+   Device->ImageSize = Size;
+
+   Device->Sections[0].Device     = 0;
+   Device->Sections[0].Start      = 0;
+   Device->Sections[0].Count      = SectorCount;
+   Device->Sections[0].SectorSize = SectorSize;
+   Device->Sections[0].Read       = EmuRead;
+   Device->Sections[0].Write      = EmuWrite;
+   Device->Sections[0].Erase      = EmuErase;
+   Device->Sections[0].EraseStart   = EmuEraseStart;
+   Device->Sections[0].EraseDone    = EmuEraseDone;
+   Device->Sections[0].EraseSuspend = EmuEraseSuspend;
+   Device->Sections[0].EraseResume  = EmuEraseResume;
+   Device->Sections[0].Discard      = EmuDiscard;
+   Device->Sections[0].Copy         = EmuCopy;
+   Device->Sections[1].Device     = 0xff;
+
+   Device->Erasing = -1;
+
+   return Device->Sections;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSEmuClose
+//
+//    Purpose:          Flush and close an image.
+//
+//    Inputs:           Sections - Table returned by FFSEmuOpen().
+//
+//    Returns:          Nothing.
+//
+//    Notes:            Unmount the volume first.
+//
+//---------------------------------------------------------------------------------------
+void FFSEmuClose( FFS_FLASH_SECTION* Sections )
+{
+   FFS_EMU_DEVICE*   Device = EMU_DEVICE(Sections);
+
+   msync( Device->Image, Device->ImageSize, MS_SYNC );
+   munmap( Device->Image, Device->ImageSize );
+   close( Device->Fd );
+   free( Device );
+}
+
+
+void FFSEmuGetStats( FFS_FLASH_SECTION* Sections, FFS_EMU_STATS* Stats )
+{
+   *Stats = EMU_DEVICE(Sections)->Stats;
+}
+
+void FFSEmuSetEraseTime( FFS_FLASH_SECTION* Sections, unsigned long Microseconds )
+{
+   EMU_DEVICE(Sections)->EraseTime = Microseconds;
+}
+
+void FFSEmuSetBankSectors( FFS_FLASH_SECTION* Sections, unsigned long BankSectors )
+{
+   Sections[0].BankSectors = BankSectors;
+}
+
+
+//---------------------------------------------------------------------------------------
+//    Platform primitives for host builds.  Ticks are milliseconds...
+//---------------------------------------------------------------------------------------
+void* FFSPlatformCreateLock( void )
+{
+   pthread_mutex_t*   Lock;
+
+   if( (Lock = (pthread_mutex_t*)malloc( sizeof(pthread_mutex_t) )) != NULL )
+   {
+      pthread_mutex_init( Lock, NULL );
+   }
+
+   return Lock;
+}
+
+void FFSPlatformDeleteLock( void* Lock )
+{
+   pthread_mutex_destroy( (pthread_mutex_t*)Lock );
+   free( Lock );
+}
+
+void FFSPlatformLock( void* Lock )
+{
+   pthread_mutex_lock( (pthread_mutex_t*)Lock );
+}
+
+void FFSPlatformUnlock( void* Lock )
+{
+   pthread_mutex_unlock( (pthread_mutex_t*)Lock );
+}
+
+unsigned long FFSPlatformTicks( void )
+{
+   struct timespec   Now;
+
+   clock_gettime( CLOCK_MONOTONIC, &Now );
+
+   return (unsigned long)Now.tv_sec * 1000 + Now.tv_nsec / 1000000;
+}
+
+// A bare sched_yield() doesn't get a blocked thread onto the lock before we take it
+// back, so sleep for a little...
+void FFSPlatformYield( void )
+{
+   struct timespec   Wait = { 0, 100000 };
+
+   nanosleep( &Wait, NULL );
+}
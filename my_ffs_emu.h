@@ -0,0 +1,63 @@
+//*****************************************************************************
+//
+//             my_ffs_emu.h - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Emulated NOR flash device for host builds.  The device is backed by
+//      an image file, so a file system can be built, mounted and inspected
+//      on a workstation.
+//
+//*****************************************************************************
+#ifndef _FFS_EMU_H
+#define _FFS_EMU_H
+
+#include "my_ffs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//------------------------------------------------------------------------------------------------
+// Device statistics, counted in the primitives...
+//------------------------------------------------------------------------------------------------
+typedef struct ffs_emu_stats
+{
+   unsigned long long  Reads;              // Read calls.
+   unsigned long long  Writes;             // Write (program) calls.
+   unsigned long long  Erases;             // Sector erases.
+   unsigned long long  BytesRead;
+   unsigned long long  BytesWritten;
+   unsigned long long  Suspends;           // Erases suspended for a read.
+   unsigned long long  Discards;           // Discard calls.
+   unsigned long long  BytesDiscarded;
+   unsigned long long  Copies;             // Copy calls.
+   unsigned long long  BytesCopied;
+
+} FFS_EMU_STATS;
+
+// Open (or create) an image of SectorCount sectors of SectorSize bytes and return a
+// section table for it, ready to pass to FFSMount().  A new image starts out erased.
+// An existing image must be exactly that size.  Returns NULL on error...
+FFS_FLASH_SECTION* FFSEmuOpen( const char*   ImagePath,
+                               unsigned long SectorSize,
+                               unsigned long SectorCount );
+
+// Flush and close an image opened with FFSEmuOpen()...
+void FFSEmuClose( FFS_FLASH_SECTION* Sections );
+
+// Copy out the device statistics...
+void FFSEmuGetStats( FFS_FLASH_SECTION* Sections, FFS_EMU_STATS* Stats );
+
+// Make each erase take this long, as a real part would.  The default is 0...
+void FFSEmuSetEraseTime( FFS_FLASH_SECTION* Sections, unsigned long Microseconds );
+
+// Split the part into banks of this many sectors, which can be read while another is
+// erased.  Set it before mounting.  The default is 0, one bank...
+void FFSEmuSetBankSectors( FFS_FLASH_SECTION* Sections, unsigned long BankSectors );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif   // _FFS_EMU_H
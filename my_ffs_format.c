@@ -0,0 +1,720 @@
+//***************************************************************************************
+//
+//             my_ffs_format.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      This module converts sector headers and file nodes between their in-core
+//      form (FFS_SECTOR_HEADER, FFS_FILE_NODE) and the way they are laid out on
+//      flash.  It has no state and touches no flash, so host tools can link it
+//      to read and build images.
+//
+//      Version 1 and 2 sectors hold the in-core structures as-is, so their layout
+//      depends on the compiler and word size of the target that wrote them.
+//      Version 3 and 4 sectors use a packed, fixed-width, little-endian layout:
+//
+//         Sector header (FFS_V3_HEADER_SIZE bytes, FFS_V4_HEADER_SIZE in version 4):
+//            0   u16  Key            FFS_SECTOR_HEADER_KEY_V3
+//            2   u8   Version
+//            3   u8   Status
+//            4   u32  Next
+//            8   u32  EraseCount
+//            12  u32  SectorLength
+//            16  u16  DataOffset
+//            18  u16  SectorChecksum
+//            20  u32  FileOffset     File offset of the first data byte
+//            24  u32  Bypass         Successor that replaces Next, see FFS_SUCCESSOR
+//            28  u32  Skip           Version 4 only: a sector further on in the chain,
+//                                    see FFSSkipIndex
+//
+//         File node (FFS_V3_FNODE_SIZE(NameLength) bytes, right after the header):
+//            0   u32  NameHash
+//            4   u32  FileSize
+//            8   u32  DataTime
+//            12  u32  Count
+//            16  u8   Permissions
+//            17  u8   NameLength
+//            18  u8   Flags          Inverted FFS_FNODE_xxx
+//            19  u8   Reserved
+//            20  ...  Filename, not null terminated, padded to a word boundary
+//            then u32 IndexSector    Erased unless Flags has FFS_FNODE_INDEXED
+//
+//         Index (after the header of an FFS_SECTOR_HEADER_INUSE_INDEX sector):
+//            0   u32  Owner          Fnode sector of the file indexed
+//            4   u32  Count          That fnode's Count
+//            8   u32  Entries
+//            12  u32  Base           File offset of the second entry
+//            16  u32  Stride         Data length of the second entry's sector
+//            20  ...  Entries of u32 FileOffset, u32 Sector, in file order
+//
+//      Files written before there were indexes have data right after the name, so
+//      an fnode only has the IndexSector word if its flags say so.
+//
+//      An all ones u32 reads back as -1 so erased fields look the same in any
+//      version.
+//
+//***************************************************************************************
+
+#include "my_ffs.h"
+#include <string.h>
+#include <ctype.h>
+
+
+//---------------------------------------------------------------------------------------
+// Little-endian field access...
+//---------------------------------------------------------------------------------------
+static unsigned long GetU16( const unsigned char* p )
+{
+   return (unsigned long)p[0] | ((unsigned long)p[1] << 8);
+}
+
+static unsigned long GetU32( const unsigned char* p )
+{
+   unsigned long   Value;
+
+   Value = (unsigned long)p[0]         | ((unsigned long)p[1] << 8) |
+           ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+
+   // Keep erased fields reading as -1 no matter how wide a long is...
+   return (Value == 0xffffffffUL) ? (unsigned long)-1 : Value;
+}
+
+static void PutU16( unsigned char* p, unsigned long Value )
+{
+   p[0] = (unsigned char)(Value);
+   p[1] = (unsigned char)(Value >> 8);
+}
+
+static void PutU32( unsigned char* p, unsigned long Value )
+{
+   p[0] = (unsigned char)(Value);
+   p[1] = (unsigned char)(Value >> 8);
+   p[2] = (unsigned char)(Value >> 16);
+   p[3] = (unsigned char)(Value >> 24);
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSHeaderSize
+//
+//    Purpose:          Return the on-flash size of a sector header.
+//
+//    Inputs:           Version - Format version of the sector.
+//
+//    Returns:          Size of the header in bytes.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+unsigned long FFSHeaderSize( int Version )
+{
+   if( Version >= FFS_FILE_SYSTEM_VERSION_V4 )
+   {
+      return FFS_V4_HEADER_SIZE;
+   }
+
+   if( Version >= FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      return FFS_V3_HEADER_SIZE;
+   }
+
+   return sizeof(FFS_SECTOR_HEADER_V1);
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSFileNodeSize
+//
+//    Purpose:          Return the on-flash size of a file node.
+//
+//    Inputs:           Version - Format version of the sector.
+//                      Fnode   - The file node.  Only the name length matters.
+//
+//    Returns:          Size of the file node in bytes.
+//
+//    Notes:            Version 3 fnodes have room for an index sector number.
+//
+//---------------------------------------------------------------------------------------
+unsigned long FFSFileNodeSize( int Version, const FFS_FILE_NODE* Fnode )
+{
+   if( Version >= FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      return FFS_V3_FNODE_SIZE( strlen(Fnode->Filename) ) + FFS_V3_FNODE_INDEX_SIZE;
+   }
+
+   if( Version == FFS_FILE_SYSTEM_VERSION_V1 )
+   {
+      return sizeof(FFS_FILE_NODE_V1);
+   }
+
+   return sizeof(FFS_FILE_NODE_V2);
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSDecodeSectorHeader
+//
+//    Purpose:          Convert a sector header as read from flash to in-core form.
+//
+//    Inputs:           Raw - At least FFS_MAX_HEADER_SIZE bytes from the start of
+//                            the sector.
+//
+//    Outputs:          SecHead - The in-core header.
+//
+//    Returns:          Format version of the sector.
+//
+//    Notes:            A version 3 header's Key is returned as FFS_SECTOR_HEADER_KEY
+//                      so callers can check any version the same way.  Anything that
+//                      isn't version 3 (including erased sectors) is taken as the
+//                      in-core layout.
+//
+//---------------------------------------------------------------------------------------
+int FFSDecodeSectorHeader( const unsigned char* Raw, FFS_SECTOR_HEADER* SecHead )
+{
+   FFS_SECTOR_HEADER_V1   SecHeadV1;
+
+   if( GetU16( Raw + 0 ) != FFS_SECTOR_HEADER_KEY_V3 || Raw[2] < FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      memcpy( &SecHeadV1, Raw, sizeof(FFS_SECTOR_HEADER_V1) );
+      SecHead->Key            = SecHeadV1.Key;
+      SecHead->Next           = SecHeadV1.Next;
+      SecHead->EraseCount     = SecHeadV1.EraseCount;
+      SecHead->Version        = SecHeadV1.Version;
+      SecHead->Status         = SecHeadV1.Status;
+      SecHead->SectorChecksum = SecHeadV1.SectorChecksum;
+      SecHead->SectorLength   = SecHeadV1.SectorLength;
+      SecHead->DataOffset     = SecHeadV1.DataOffset;
+      SecHead->FileOffset     = -1;
+      SecHead->Bypass         = -1;
+      SecHead->Skip           = -1;
+      return SecHead->Version;
+   }
+
+   SecHead->Key            = FFS_SECTOR_HEADER_KEY;
+   SecHead->Version        = Raw[2];
+   SecHead->Status         = Raw[3];
+   SecHead->Next           = GetU32( Raw + 4 );
+   SecHead->EraseCount     = GetU32( Raw + 8 );
+   SecHead->SectorLength   = GetU32( Raw + 12 );
+   SecHead->DataOffset     = GetU16( Raw + 16 );
+   SecHead->SectorChecksum = (unsigned short)GetU16( Raw + 18 );
+   SecHead->FileOffset     = GetU32( Raw + 20 );
+   SecHead->Bypass         = GetU32( Raw + FFS_V3_BYPASS_OFFSET );
+   SecHead->Skip           = -1;
+
+   if( SecHead->Version >= FFS_FILE_SYSTEM_VERSION_V4 )
+   {
+      SecHead->Skip = GetU32( Raw + FFS_V4_SKIP_OFFSET );
+   }
+
+   return SecHead->Version;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSEncodeSectorHeader
+//
+//    Purpose:          Convert an in-core sector header to its on-flash form.
+//
+//    Inputs:           SecHead - The in-core header. Its Version picks the layout.
+//
+//    Outputs:          Raw     - At least FFS_MAX_HEADER_SIZE bytes.
+//
+//    Returns:          Number of bytes to write.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int FFSEncodeSectorHeader( const FFS_SECTOR_HEADER* SecHead, unsigned char* Raw )
+{
+   FFS_SECTOR_HEADER_V1   SecHeadV1;
+
+   if( SecHead->Version < FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      memset( &SecHeadV1, 0xff, sizeof(FFS_SECTOR_HEADER_V1) );
+      SecHeadV1.Key            = SecHead->Key;
+      SecHeadV1.Next           = SecHead->Next;
+      SecHeadV1.EraseCount     = SecHead->EraseCount;
+      SecHeadV1.Version        = SecHead->Version;
+      SecHeadV1.Status         = SecHead->Status;
+      SecHeadV1.SectorChecksum = SecHead->SectorChecksum;
+      SecHeadV1.SectorLength   = SecHead->SectorLength;
+      SecHeadV1.DataOffset     = SecHead->DataOffset;
+      memcpy( Raw, &SecHeadV1, sizeof(FFS_SECTOR_HEADER_V1) );
+      return sizeof(FFS_SECTOR_HEADER_V1);
+   }
+
+   PutU16( Raw + 0,  FFS_SECTOR_HEADER_KEY_V3 );
+   Raw[2] = SecHead->Version;
+   Raw[3] = SecHead->Status;
+   PutU32( Raw + 4,  SecHead->Next );
+   PutU32( Raw + 8,  SecHead->EraseCount );
+   PutU32( Raw + 12, SecHead->SectorLength );
+   PutU16( Raw + 16, SecHead->DataOffset );
+   PutU16( Raw + 18, SecHead->SectorChecksum );
+   PutU32( Raw + 20, SecHead->FileOffset );
+   PutU32( Raw + FFS_V3_BYPASS_OFFSET, SecHead->Bypass );
+
+   if( SecHead->Version >= FFS_FILE_SYSTEM_VERSION_V4 )
+   {
+      PutU32( Raw + FFS_V4_SKIP_OFFSET, SecHead->Skip );
+      return FFS_V4_HEADER_SIZE;
+   }
+
+   return FFS_V3_HEADER_SIZE;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSEncodeSectorNumber
+//
+//    Purpose:          Convert a sector number (e.g. a Next field) to on-flash form.
+//
+//    Inputs:           Version - Format version of the sector being written.
+//                      Sector  - The sector number.
+//
+//    Outputs:          Raw     - At least sizeof(unsigned long) bytes.
+//
+//    Returns:          Number of bytes to write.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int FFSEncodeSectorNumber( int Version, unsigned long Sector, unsigned char* Raw )
+{
+   if( Version < FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      memcpy( Raw, &Sector, sizeof(Sector) );
+      return sizeof(Sector);
+   }
+
+   PutU32( Raw, Sector );
+   return 4;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSNextFieldOffset / FFSStatusFieldOffset
+//
+//    Purpose:          Return where the Next and Status fields live in a header, so
+//                      they can be programmed on their own.
+//
+//    Inputs:           Version - Format version of the sector.
+//
+//    Returns:          Offset from the start of the sector.
+//
+//    Notes:            For versions 1 and 2 the Status is written as the 4 bytes
+//                      starting at Version, as it always has been.
+//
+//---------------------------------------------------------------------------------------
+unsigned long FFSNextFieldOffset( int Version )
+{
+   FFS_SECTOR_HEADER_V1   SecHead;
+
+   if( Version >= FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      return FFS_V3_NEXT_OFFSET;
+   }
+
+   return (char*)&SecHead.Next - (char*)&SecHead;
+}
+
+unsigned long FFSStatusFieldOffset( int Version )
+{
+   FFS_SECTOR_HEADER_V1   SecHead;
+
+   if( Version >= FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      return FFS_V3_STATUS_OFFSET;
+   }
+
+   return (char*)&SecHead.Version - (char*)&SecHead;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSDecodeFileNode
+//
+//    Purpose:          Convert a file node as read from flash to in-core form.
+//
+//    Inputs:           Version - Format version of the sector it came from.
+//                      Raw     - At least FFS_MAX_FNODE_SIZE bytes from right after
+//                                the sector header.
+//
+//    Outputs:          Fnode   - The in-core file node.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            Version 1 fnodes have no hash, so one is computed.  An erased
+//                      name (a file still being created) comes back as a name whose
+//                      first byte is 0xff.
+//
+//---------------------------------------------------------------------------------------
+void FFSDecodeFileNode( int Version, const unsigned char* Raw, FFS_FILE_NODE* Fnode )
+{
+   FFS_FILE_NODE_V1   FnodeV1;
+   FFS_FILE_NODE_V2   FnodeV2;
+   unsigned long      NameLength;
+
+   Fnode->Flags       = 0;
+   Fnode->IndexSector = -1;
+
+   if( Version == FFS_FILE_SYSTEM_VERSION_V1 )
+   {
+      memcpy( &FnodeV1, Raw, sizeof(FFS_FILE_NODE_V1) );
+      Fnode->Permissions = FnodeV1.Permissions;
+      memcpy( Fnode->Filename, FnodeV1.Filename, sizeof(Fnode->Filename) );
+      Fnode->Filename[FFS_MAX_FILENAME_LENGTH] = 0;
+      Fnode->FileSize    = FnodeV1.FileSize;
+      Fnode->DataTime    = FnodeV1.DataTime;
+      Fnode->Count       = FnodeV1.Count;
+      Fnode->NameHash    = FFSHashName( Fnode->Filename );
+      return;
+   }
+
+   if( Version < FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      memcpy( &FnodeV2, Raw, sizeof(FFS_FILE_NODE_V2) );
+      Fnode->NameHash    = FnodeV2.NameHash;
+      Fnode->Permissions = FnodeV2.Permissions;
+      memcpy( Fnode->Filename, FnodeV2.Filename, sizeof(Fnode->Filename) );
+      Fnode->Filename[FFS_MAX_FILENAME_LENGTH] = 0;
+      Fnode->FileSize    = FnodeV2.FileSize;
+      Fnode->DataTime    = FnodeV2.DataTime;
+      Fnode->Count       = FnodeV2.Count;
+      return;
+   }
+
+   Fnode->NameHash    = GetU32( Raw + 0 );
+   Fnode->FileSize    = GetU32( Raw + 4 );
+   Fnode->DataTime    = GetU32( Raw + 8 );
+   Fnode->Count       = GetU32( Raw + 12 );
+   Fnode->Permissions = Raw[16];
+   NameLength         = Raw[17];
+   Fnode->Flags       = (unsigned char)~Raw[FFS_V3_FNODE_FLAGS_OFFSET];
+
+   if( NameLength > FFS_MAX_FILENAME_LENGTH )
+   {
+      // Not written yet...
+      memset( Fnode->Filename, 0xff, sizeof(Fnode->Filename) );
+      Fnode->Filename[1] = 0;
+      return;
+   }
+
+   memcpy( Fnode->Filename, Raw + FFS_V3_FNODE_FIXED_SIZE, NameLength );
+   Fnode->Filename[NameLength] = 0;
+
+   if( Fnode->Flags & FFS_FNODE_INDEXED )
+   {
+      Fnode->IndexSector = GetU32( Raw + FFS_V3_FNODE_SIZE( NameLength ) );
+   }
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSEncodeFileNode
+//
+//    Purpose:          Convert an in-core file node to its on-flash form.
+//
+//    Inputs:           Version - Format version of the sector it goes into.
+//                      Fnode   - The in-core file node.
+//
+//    Outputs:          Raw     - At least FFS_MAX_FNODE_SIZE bytes.
+//
+//    Returns:          Number of bytes to write.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int FFSEncodeFileNode( int Version, const FFS_FILE_NODE* Fnode, unsigned char* Raw )
+{
+   FFS_FILE_NODE_V1   FnodeV1;
+   FFS_FILE_NODE_V2   FnodeV2;
+   unsigned long      NameLength;
+   unsigned long      Size;
+
+   if( Version == FFS_FILE_SYSTEM_VERSION_V1 )
+   {
+      FnodeV1.Permissions = Fnode->Permissions;
+      memcpy( FnodeV1.Filename, Fnode->Filename, sizeof(FnodeV1.Filename) );
+      FnodeV1.FileSize    = Fnode->FileSize;
+      FnodeV1.DataTime    = Fnode->DataTime;
+      FnodeV1.Count       = Fnode->Count;
+      memcpy( Raw, &FnodeV1, sizeof(FFS_FILE_NODE_V1) );
+      return sizeof(FFS_FILE_NODE_V1);
+   }
+
+   if( Version < FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      memset( &FnodeV2, 0xff, sizeof(FFS_FILE_NODE_V2) );
+      FnodeV2.NameHash    = Fnode->NameHash;
+      FnodeV2.Permissions = Fnode->Permissions;
+      memcpy( FnodeV2.Filename, Fnode->Filename, sizeof(FnodeV2.Filename) );
+      FnodeV2.FileSize    = Fnode->FileSize;
+      FnodeV2.DataTime    = Fnode->DataTime;
+      FnodeV2.Count       = Fnode->Count;
+      memcpy( Raw, &FnodeV2, sizeof(FFS_FILE_NODE_V2) );
+      return sizeof(FFS_FILE_NODE_V2);
+   }
+
+   NameLength = strlen( Fnode->Filename );
+   Size       = FFS_V3_FNODE_SIZE( NameLength ) + FFS_V3_FNODE_INDEX_SIZE;
+
+   // Pad bytes stay erased...
+   memset( Raw, 0xff, Size );
+
+   PutU32( Raw + 0,  Fnode->NameHash );
+   PutU32( Raw + 4,  Fnode->FileSize );
+   PutU32( Raw + 8,  Fnode->DataTime );
+   PutU32( Raw + 12, Fnode->Count );
+   Raw[16] = Fnode->Permissions;
+   Raw[17] = (unsigned char)NameLength;
+   Raw[FFS_V3_FNODE_FLAGS_OFFSET] = (unsigned char)~Fnode->Flags;
+   memcpy( Raw + FFS_V3_FNODE_FIXED_SIZE, Fnode->Filename, NameLength );
+
+   if( Fnode->Flags & FFS_FNODE_INDEXED )
+   {
+      PutU32( Raw + FFS_V3_FNODE_SIZE( NameLength ), Fnode->IndexSector );
+   }
+
+   return Size;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSDecodeNameHash
+//
+//    Purpose:          Pull the file node's name hash out of a probe read, which is
+//                      the sector header plus the first word of the file node.
+//
+//    Inputs:           Version - Format version of the sector.
+//                      Raw     - At least FFS_MAX_PROBE_SIZE bytes from the start of
+//                                the sector.
+//
+//    Outputs:          Hash    - The stored name hash.
+//
+//    Returns:          1 if the sector stores a hash, 0 if it doesn't (version 1).
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int FFSDecodeNameHash( int Version, const unsigned char* Raw, unsigned long* Hash )
+{
+   if( Version == FFS_FILE_SYSTEM_VERSION_V1 )
+   {
+      return 0;
+   }
+
+   if( Version < FFS_FILE_SYSTEM_VERSION_V3 )
+   {
+      memcpy( Hash, Raw + sizeof(FFS_SECTOR_HEADER_V1), sizeof(*Hash) );
+      return 1;
+   }
+
+   *Hash = GetU32( Raw + FFSHeaderSize( Version ) );
+   return 1;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSSkipIndex
+//
+//    Purpose:          Say where a sector's Skip points, by chain position.
+//
+//    Inputs:           Index - Chain position of the sector, 0 for the fnode sector.
+//                      Count - Number of sectors in the chain.
+//
+//    Returns:          Chain position of the sector it skips to, or -1 if none.
+//
+//    Notes:            The skips make the chain a balanced search tree.  The sector
+//                      at the start of a run of positions [First, End) skips to the
+//                      middle of the rest of the run; Next leads into the first half
+//                      and Skip into the second, and each half is split the same way.
+//                      So a position is found by following Skip when the sector it
+//                      points to starts at or before it, and Next when not, which
+//                      halves the run each time.  Runs of fewer than 3 need no skip.
+//
+//---------------------------------------------------------------------------------------
+unsigned long FFSSkipIndex( unsigned long Index, unsigned long Count )
+{
+   unsigned long   First = 0;
+   unsigned long   End   = Count;
+   unsigned long   Middle;
+
+   while( First < End )
+   {
+      Middle = (End - First < 3) ? (unsigned long)-1 : First + 1 + (End - First - 1) / 2;
+
+      if( First == Index )
+      {
+         return Middle;
+      }
+
+      if( Middle != (unsigned long)-1 && Index >= Middle )
+      {
+         First = Middle;
+      }
+      else
+      {
+         First++;
+         if( Middle != (unsigned long)-1 )
+         {
+            End = Middle;
+         }
+      }
+   }
+
+   return -1;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSEncodeIndex / FFSDecodeIndex
+//
+//    Purpose:          Convert a chain index, less its entries, between in-core and
+//                      on-flash form.
+//
+//    Inputs:           Index - The in-core index (encode).
+//                      Raw   - FFS_V3_INDEX_SIZE bytes from the start of the index
+//                              (decode).
+//
+//    Outputs:          Raw   - FFS_V3_INDEX_SIZE bytes (encode).
+//                      Index - The in-core index (decode).
+//
+//    Returns:          Encode returns the number of bytes to write.
+//
+//    Notes:            Indexes are only written in version 3 sectors.
+//
+//---------------------------------------------------------------------------------------
+int FFSEncodeIndex( const FFS_SECTOR_INDEX* Index, unsigned char* Raw )
+{
+   PutU32( Raw + 0,  Index->Owner );
+   PutU32( Raw + 4,  Index->Count );
+   PutU32( Raw + 8,  Index->Entries );
+   PutU32( Raw + 12, Index->Base );
+   PutU32( Raw + 16, Index->Stride );
+
+   return FFS_V3_INDEX_SIZE;
+}
+
+void FFSDecodeIndex( const unsigned char* Raw, FFS_SECTOR_INDEX* Index )
+{
+   Index->Owner   = GetU32( Raw + 0 );
+   Index->Count   = GetU32( Raw + 4 );
+   Index->Entries = GetU32( Raw + 8 );
+   Index->Base    = GetU32( Raw + 12 );
+   Index->Stride  = GetU32( Raw + 16 );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSEncodeIndexEntry / FFSDecodeIndexEntry
+//
+//    Purpose:          Convert one entry of a chain index between in-core and on-flash
+//                      form.
+//
+//    Inputs:           FileOffset - File offset of the sector's data (encode).
+//                      Sector     - The sector number (encode).
+//                      Raw        - FFS_V3_INDEX_ENTRY_SIZE bytes (decode).
+//
+//    Outputs:          Raw        - FFS_V3_INDEX_ENTRY_SIZE bytes (encode).
+//                      FileOffset, Sector (decode).
+//
+//    Returns:          Encode returns the number of bytes to write.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+int FFSEncodeIndexEntry( unsigned long FileOffset, unsigned long Sector, unsigned char* Raw )
+{
+   PutU32( Raw + 0, FileOffset );
+   PutU32( Raw + 4, Sector );
+
+   return FFS_V3_INDEX_ENTRY_SIZE;
+}
+
+void FFSDecodeIndexEntry( const unsigned char* Raw, unsigned long* FileOffset, unsigned long* Sector )
+{
+   *FileOffset = GetU32( Raw + 0 );
+   *Sector     = GetU32( Raw + 4 );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSSectorChecksum
+//
+//    Purpose:          Compute the checksum of a complete sector.
+//
+//    Inputs:           Version - Format version of the sector.
+//                      Raw     - The whole sector, as it will be on flash.
+//                      Length  - The sector's SectorLength.
+//
+//    Returns:          Checksum for SectorChecksum.
+//
+//    Notes:            CRC-16/CCITT over everything after the header (fnode and
+//                      data), since the header's Next and Status are programmed later.
+//                      0xffff is an erased field, meaning no checksum, so a result
+//                      of 0xffff is stored as 0xfffe.
+//
+//---------------------------------------------------------------------------------------
+unsigned short FFSSectorChecksum( int Version, const unsigned char* Raw, unsigned long Length )
+{
+   unsigned long    Crc = 0xffff;
+   unsigned long    i;
+   int              Bit;
+
+   for( i = FFSHeaderSize( Version ); i < Length; i++ )
+   {
+      Crc ^= (unsigned long)Raw[i] << 8;
+      for( Bit = 0; Bit < 8; Bit++ )
+      {
+         Crc = (Crc & 0x8000) ? ((Crc << 1) ^ 0x1021) : (Crc << 1);
+      }
+      Crc &= 0xffff;
+   }
+
+   return (unsigned short)((Crc == 0xffff) ? 0xfffe : Crc);
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FFSHashName
+//
+//    Purpose:          Hash a file name the way it is stored in FFS_FILE_NODE.NameHash.
+//
+//    Inputs:           Filename - Name to hash.
+//
+//    Returns:          32-bit hash of the uppercased name.
+//
+//    Notes:            This is FNV-1a over the case-folded name, stopping at the
+//                      maximum stored name length.  Names that differ only in case hash
+//                      the same, matching how names are compared.
+//
+//---------------------------------------------------------------------------------------
+unsigned long FFSHashName( const char* Filename )
+{
+   unsigned long   Hash = 2166136261UL;
+   int             i;
+
+   for( i = 0; i < FFS_MAX_FILENAME_LENGTH && Filename[i]; i++ )
+   {
+      Hash ^= (unsigned char)toupper( (unsigned char)Filename[i] );
+      Hash  = (Hash * 16777619UL) & 0xffffffffUL;
+   }
+
+   return Hash;
+}
@@ -0,0 +1,645 @@
+//***************************************************************************************
+//
+//             my_ffs_fuse.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Host tool that mounts a flash image on Linux thru FUSE (libfuse 3), so
+//      standard tools and benchmarks (fio, tar, application test suites) can run
+//      against the file system.  The image is an emulated NOR device, see
+//      my_ffs_emu.c.
+//
+//      FUSE runs the handlers on several threads unless -s is given.  They all
+//      go thru the volume's own lock, the same as tasks on a target would.
+//
+//      Usage: my_ffs_fuse --image=File --sector-size=N --sectors=N [FUSE options] Mountpoint
+//
+//      Build with a larger FFS_MAX_FILE_DESCRIPTORS (e.g. -DFFS_MAX_FILE_DESCRIPTORS=64)
+//      for the whole program, and link with my_ffs.c (as C++), my_ffs_format.c,
+//      my_ffs_emu.c and -lfuse3 -lpthread.
+//
+//      The file system is flat, so there are no directories.  A file that is
+//      created and closed without being written is not kept, since an fnode
+//      always has data.  Rename over an existing file moves that file aside under
+//      a temporary name, and erases it only once the rename is done.  It is not
+//      atomic: a power loss in between leaves the temporary file behind.
+//
+//***************************************************************************************
+
+#define FUSE_USE_VERSION 31
+
+#include "my_ffs.h"
+#include "my_ffs_emu.h"
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE   (1 << 0)
+#define RENAME_EXCHANGE    (1 << 1)
+#endif
+
+
+//---------------------------------------------------------------------------------------
+// Files open thru FUSE.  A file being created doesn't exist on flash until it is
+// closed, so its size is kept here for getattr...
+//---------------------------------------------------------------------------------------
+typedef struct fuse_open_file
+{
+   int               InUse;
+   int               Fd;                   // File system descriptor.
+   int               Created;              // Opened with FFS_CREATE.
+   unsigned long     Size;                 // Size so far, for created files.
+   char              Name[FFS_MAX_FILENAME_LENGTH + 1];
+   pthread_mutex_t   Lock;                 // Seek and transfer go together.
+
+} FUSE_OPEN_FILE;
+
+static FUSE_OPEN_FILE    OpenFiles[FFS_MAX_FILE_DESCRIPTORS];
+static pthread_mutex_t   OpenFilesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static FFS_GLOBALS*        Volume;
+static FFS_FLASH_SECTION*  Sections;
+
+
+//---------------------------------------------------------------------------------------
+// Command line...
+//---------------------------------------------------------------------------------------
+typedef struct fuse_options
+{
+   char*           Image;
+   unsigned long   SectorSize;
+   unsigned long   Sectors;
+
+} FUSE_OPTIONS;
+
+static FUSE_OPTIONS   Options;
+
+static const struct fuse_opt OptionSpec[] =
+{
+   { "--image=%s",       offsetof(FUSE_OPTIONS, Image),      0 },
+   { "--sector-size=%lu", offsetof(FUSE_OPTIONS, SectorSize), 0 },
+   { "--sectors=%lu",    offsetof(FUSE_OPTIONS, Sectors),    0 },
+   FUSE_OPT_END
+};
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FfsErrno
+//
+//    Purpose:          Map a file system return code to a negative errno.
+//
+//    Inputs:           rc - FFS_RC_xxx.
+//
+//    Returns:          Negative errno.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static int FfsErrno( int rc )
+{
+   switch( rc )
+   {
+      case FFS_RC_FILE_DOES_NOT_EXIST:
+      case FFS_RC_FILE_NOT_FOUND:         return -ENOENT;
+      case FFS_RC_TOO_MANY_OPEN_FILES:    return -EMFILE;
+      case FFS_RC_OUT_OF_SPACE:           return -ENOSPC;
+      case FFS_RC_OUT_OF_MEMORY:          return -ENOMEM;
+      case FFS_RC_NEW_NAME_EXISTS:        return -EEXIST;
+      case FFS_RC_INVALID_FILE_POSITION:  return -EINVAL;
+      case FFS_RC_INVALID_FILE_DESCRIPTOR:return -EBADF;
+      default:                            return -EIO;
+   }
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FileName
+//
+//    Purpose:          Turn a FUSE path into a file system name.
+//
+//    Inputs:           Path - "/name".
+//
+//    Outputs:          Name - The name, at least FFS_MAX_FILENAME_LENGTH + 1 bytes.
+//
+//    Returns:          0, or a negative errno if the path can't be a file.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static int FileName( const char* Path, char* Name )
+{
+   if( Path[0] != '/' || Path[1] == 0 || strchr( Path + 1, '/' ) )
+   {
+      return -ENOENT;
+   }
+
+   if( strlen( Path + 1 ) > FFS_MAX_FILENAME_LENGTH )
+   {
+      return -ENAMETOOLONG;
+   }
+
+   strcpy( Name, Path + 1 );
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FindFile
+//
+//    Purpose:          Look a file up by name.
+//
+//    Inputs:           Name  - File name.
+//
+//    Outputs:          Fnode - Its file node.
+//
+//    Returns:          1 if found, 0 if not.
+//
+//    Notes:            Names compare without case, as in the file system.  The lookup
+//                      goes thru the open cache and the name filter, so the getattr
+//                      that follows each name of a readdir doesn't walk the directory
+//                      again.
+//
+//---------------------------------------------------------------------------------------
+static int FindFile( const char* Name, FFS_FILE_NODE* Fnode )
+{
+   return FFSVolStat( Volume, (char*)Name, Fnode ) == 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FileStat
+//
+//    Purpose:          Fill in the attributes of a file on flash.
+//
+//    Inputs:           Fnode - Its file node.
+//
+//    Outputs:          St    - Its attributes.
+//
+//    Returns:          Nothing.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static void FileStat( FFS_FILE_NODE* Fnode, struct stat* St )
+{
+   memset( St, 0, sizeof(*St) );
+
+   St->st_mode  = S_IFREG | 0644;
+   St->st_nlink = 1;
+   St->st_size  = Fnode->FileSize;
+   St->st_mtime = Fnode->DataTime;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FindCreated
+//
+//    Purpose:          Find a file that is being created thru FUSE.
+//
+//    Inputs:           Name - File name.
+//
+//    Returns:          Its open file entry, or NULL.
+//
+//    Notes:            Call with OpenFilesLock held.
+//
+//---------------------------------------------------------------------------------------
+static FUSE_OPEN_FILE* FindCreated( const char* Name )
+{
+   int   i;
+
+   for( i = 0; i < FFS_MAX_FILE_DESCRIPTORS; i++ )
+   {
+      if( OpenFiles[i].InUse && OpenFiles[i].Created && strcasecmp( OpenFiles[i].Name, Name ) == 0 )
+      {
+         return &OpenFiles[i];
+      }
+   }
+
+   return NULL;
+}
+
+
+//---------------------------------------------------------------------------------------
+//    FUSE operations...
+//---------------------------------------------------------------------------------------
+static void* FuseInit( struct fuse_conn_info* Conn, struct fuse_config* Config )
+{
+   // O_TRUNC comes with open, which maps it onto FFS_CREATE...
+   Conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+
+   Config->use_ino     = 0;
+   Config->kernel_cache = 0;
+
+   return NULL;
+}
+
+static int FuseGetattr( const char* Path, struct stat* St, struct fuse_file_info* Fi )
+{
+   FFS_FILE_NODE     Fnode;
+   FUSE_OPEN_FILE*   Open;
+   char              Name[FFS_MAX_FILENAME_LENGTH + 1];
+   int               rc;
+
+   memset( St, 0, sizeof(*St) );
+
+   if( strcmp( Path, "/" ) == 0 )
+   {
+      St->st_mode  = S_IFDIR | 0755;
+      St->st_nlink = 2;
+      return 0;
+   }
+
+   if( (rc = FileName( Path, Name )) < 0 )
+   {
+      return rc;
+   }
+
+   St->st_mode  = S_IFREG | 0644;
+   St->st_nlink = 1;
+
+   pthread_mutex_lock( &OpenFilesLock );
+   if( (Open = FindCreated( Name )) != NULL )
+   {
+      St->st_size = Open->Size;
+      pthread_mutex_unlock( &OpenFilesLock );
+      return 0;
+   }
+   pthread_mutex_unlock( &OpenFilesLock );
+
+   if( !FindFile( Name, &Fnode ) )
+   {
+      return -ENOENT;
+   }
+
+   FileStat( &Fnode, St );
+
+   return 0;
+}
+
+static int FuseReaddir( const char*            Path,
+                        void*                  Buf,
+                        fuse_fill_dir_t        Filler,
+                        off_t                  Offset,
+                        struct fuse_file_info* Fi,
+                        enum fuse_readdir_flags Flags )
+{
+   FFS_FILE_NODE     Fnode;
+   FUSE_OPEN_FILE*   Open;
+   struct stat       St;
+   unsigned long     Handle = 0;
+   char              Created[FFS_MAX_FILE_DESCRIPTORS][FFS_MAX_FILENAME_LENGTH + 1];
+   int               Count = 0;
+   int               i;
+
+   if( strcmp( Path, "/" ) != 0 )
+   {
+      return -ENOTDIR;
+   }
+
+   Filler( Buf, ".",  NULL, 0, 0 );
+   Filler( Buf, "..", NULL, 0, 0 );
+
+   // The walk reads every fnode anyway, so hand their attributes back with the names
+   // when the kernel takes them, rather than have it ask for each one...
+   while( FFSVolNextDirectory( Volume, &Handle, &Fnode ) == 0 )
+   {
+      // Skip files still being created on flash...
+      if( (unsigned char)Fnode.Filename[0] != 0xff && strcmp( Fnode.Filename, "[New File]" ) != 0 )
+      {
+         if( Flags & FUSE_READDIR_PLUS )
+         {
+            FileStat( &Fnode, &St );
+
+            // A file being created over it has the size getattr gives...
+            pthread_mutex_lock( &OpenFilesLock );
+            if( (Open = FindCreated( Fnode.Filename )) != NULL )
+            {
+               St.st_size = Open->Size;
+            }
+            pthread_mutex_unlock( &OpenFilesLock );
+
+            Filler( Buf, Fnode.Filename, &St, 0, FUSE_FILL_DIR_PLUS );
+         }
+         else
+         {
+            Filler( Buf, Fnode.Filename, NULL, 0, 0 );
+         }
+      }
+   }
+
+   // Files being created thru FUSE that don't already exist.  Take their names under
+   // the table lock, and look them up on flash once it's released...
+   pthread_mutex_lock( &OpenFilesLock );
+   for( i = 0; i < FFS_MAX_FILE_DESCRIPTORS; i++ )
+   {
+      if( OpenFiles[i].InUse && OpenFiles[i].Created )
+      {
+         strcpy( Created[Count++], OpenFiles[i].Name );
+      }
+   }
+   pthread_mutex_unlock( &OpenFilesLock );
+
+   for( i = 0; i < Count; i++ )
+   {
+      if( !FindFile( Created[i], &Fnode ) )
+      {
+         Filler( Buf, Created[i], NULL, 0, 0 );
+      }
+   }
+
+   return 0;
+}
+
+static int OpenFile( const char* Path, int Flags, struct fuse_file_info* Fi )
+{
+   FUSE_OPEN_FILE*   Open;
+   char              Name[FFS_MAX_FILENAME_LENGTH + 1];
+   int               FfsFlags;
+   int               fd;
+   int               rc;
+
+   if( (rc = FileName( Path, Name )) < 0 )
+   {
+      return rc;
+   }
+
+   FfsFlags = ((Flags & O_ACCMODE) == O_RDONLY) ? FFS_RDONLY : FFS_RDWR;
+   if( Flags & (O_CREAT | O_TRUNC) )
+   {
+      FfsFlags |= FFS_CREATE;
+   }
+
+   if( (fd = FFSVolOpen( Volume, Name, FfsFlags, 0644 )) < 0 )
+   {
+      return FfsErrno( fd );
+   }
+
+   // Descriptor numbers are unique while open, so they index our table too.  Release
+   // closes and clears its entry under the table lock, so a descriptor handed out again
+   // finds its entry cleared by the time we get the lock...
+   pthread_mutex_lock( &OpenFilesLock );
+
+   Open          = &OpenFiles[fd];
+   Open->InUse   = 1;
+   Open->Fd      = fd;
+   Open->Created = (FfsFlags & FFS_CREATE) != 0;
+   Open->Size    = 0;
+   strcpy( Open->Name, Name );
+   pthread_mutex_init( &Open->Lock, NULL );
+   pthread_mutex_unlock( &OpenFilesLock );
+
+   Fi->fh = fd;
+
+   return 0;
+}
+
+static int FuseOpen( const char* Path, struct fuse_file_info* Fi )
+{
+   return OpenFile( Path, Fi->flags, Fi );
+}
+
+static int FuseCreate( const char* Path, mode_t Mode, struct fuse_file_info* Fi )
+{
+   return OpenFile( Path, Fi->flags | O_CREAT, Fi );
+}
+
+static int FuseRead( const char* Path, char* Buf, size_t Size, off_t Offset, struct fuse_file_info* Fi )
+{
+   FUSE_OPEN_FILE*   Open = &OpenFiles[Fi->fh];
+   long              rc;
+
+   pthread_mutex_lock( &Open->Lock );
+
+   if( (rc = FFSVolSeek( Volume, Open->Fd, Offset, FFS_SEEK_SET )) >= 0 )
+   {
+      rc = FFSVolRead( Volume, Open->Fd, Buf, Size );
+   }
+
+   pthread_mutex_unlock( &Open->Lock );
+
+   // Reading at or past the end is end of file...
+   if( rc == FFS_RC_INVALID_FILE_POSITION )
+   {
+      return 0;
+   }
+
+   return (rc < 0) ? FfsErrno( rc ) : (int)rc;
+}
+
+static int FuseWrite( const char* Path, const char* Buf, size_t Size, off_t Offset, struct fuse_file_info* Fi )
+{
+   FUSE_OPEN_FILE*   Open = &OpenFiles[Fi->fh];
+   long              rc;
+
+   pthread_mutex_lock( &Open->Lock );
+
+   if( (rc = FFSVolSeek( Volume, Open->Fd, Offset, FFS_SEEK_SET )) >= 0 )
+   {
+      rc = FFSVolWrite( Volume, Open->Fd, (char*)Buf, Size );
+   }
+
+   if( rc > 0 && (unsigned long)(Offset + rc) > Open->Size )
+   {
+      Open->Size = Offset + rc;
+   }
+
+   pthread_mutex_unlock( &Open->Lock );
+
+   return (rc < 0) ? FfsErrno( rc ) : (int)rc;
+}
+
+static int FuseRelease( const char* Path, struct fuse_file_info* Fi )
+{
+   FUSE_OPEN_FILE*   Open = &OpenFiles[Fi->fh];
+
+   pthread_mutex_lock( &OpenFilesLock );
+   FFSVolClose( Volume, Open->Fd );
+   pthread_mutex_destroy( &Open->Lock );
+   Open->InUse = 0;
+   pthread_mutex_unlock( &OpenFilesLock );
+
+   return 0;
+}
+
+static int FuseUnlink( const char* Path )
+{
+   char   Name[FFS_MAX_FILENAME_LENGTH + 1];
+   int    rc;
+
+   if( (rc = FileName( Path, Name )) < 0 )
+   {
+      return rc;
+   }
+
+   rc = FFSVolErase( Volume, Name );
+
+   return (rc < 0) ? FfsErrno( rc ) : 0;
+}
+
+static int FuseRename( const char* From, const char* To, unsigned int Flags )
+{
+   static unsigned long   Replaced;           // Numbers the files moved aside.
+   FFS_FILE_NODE          Fnode;
+   char                   FromName[FFS_MAX_FILENAME_LENGTH + 1];
+   char                   ToName[FFS_MAX_FILENAME_LENGTH + 1];
+   char                   AsideName[FFS_MAX_FILENAME_LENGTH + 1];
+   int                    rc;
+
+   if( (rc = FileName( From, FromName )) < 0 || (rc = FileName( To, ToName )) < 0 )
+   {
+      return rc;
+   }
+
+   if( Flags & RENAME_EXCHANGE )
+   {
+      return -EINVAL;
+   }
+
+   // Rename replaces an existing file, unless asked not to.  Move the existing file
+   // aside rather than erase it, so it is still there if the rename fails...
+   if( strcasecmp( FromName, ToName ) != 0 && FindFile( ToName, &Fnode ) )
+   {
+      if( Flags & RENAME_NOREPLACE )
+      {
+         return -EEXIST;
+      }
+
+      if( !FindFile( FromName, &Fnode ) )
+      {
+         return -ENOENT;
+      }
+
+      snprintf( AsideName, sizeof(AsideName), "[Replaced %lu]", __sync_fetch_and_add( &Replaced, 1 ) );
+
+      if( (rc = FFSVolRename( Volume, ToName, AsideName )) < 0 )
+      {
+         return FfsErrno( rc );
+      }
+
+      if( (rc = FFSVolRename( Volume, FromName, ToName )) < 0 )
+      {
+         FFSVolRename( Volume, AsideName, ToName );
+         return FfsErrno( rc );
+      }
+
+      FFSVolErase( Volume, AsideName );
+
+      return 0;
+   }
+
+   rc = FFSVolRename( Volume, FromName, ToName );
+
+   return (rc < 0) ? FfsErrno( rc ) : 0;
+}
+
+static int FuseTruncate( const char* Path, off_t Size, struct fuse_file_info* Fi )
+{
+   struct stat   St;
+   int           rc;
+
+   // Files only shrink by being recreated (O_TRUNC), so only allow no-ops...
+   if( (rc = FuseGetattr( Path, &St, Fi )) < 0 )
+   {
+      return rc;
+   }
+
+   return (St.st_size == Size) ? 0 : -EOPNOTSUPP;
+}
+
+static int FuseStatfs( const char* Path, struct statvfs* Sv )
+{
+   memset( Sv, 0, sizeof(*Sv) );
+
+   Sv->f_bsize   = 512;
+   Sv->f_frsize  = 512;
+   Sv->f_blocks  = (unsigned long)FFSVolSpace( Volume, 2 ) / 512;
+   Sv->f_bfree   = (unsigned long)FFSVolSpace( Volume, 0 ) / 512;
+   Sv->f_bavail  = Sv->f_bfree;
+   Sv->f_namemax = FFS_MAX_FILENAME_LENGTH;
+
+   return 0;
+}
+
+// Times, ownership and modes aren't kept, but tools expect to be able to set them...
+static int FuseUtimens( const char* Path, const struct timespec Tv[2], struct fuse_file_info* Fi )
+{
+   return 0;
+}
+
+static int FuseChmod( const char* Path, mode_t Mode, struct fuse_file_info* Fi )
+{
+   return 0;
+}
+
+static int FuseChown( const char* Path, uid_t Uid, gid_t Gid, struct fuse_file_info* Fi )
+{
+   return 0;
+}
+
+static const struct fuse_operations FuseOperations =
+{
+   .init     = FuseInit,
+   .getattr  = FuseGetattr,
+   .readdir  = FuseReaddir,
+   .open     = FuseOpen,
+   .create   = FuseCreate,
+   .read     = FuseRead,
+   .write    = FuseWrite,
+   .release  = FuseRelease,
+   .unlink   = FuseUnlink,
+   .rename   = FuseRename,
+   .truncate = FuseTruncate,
+   .statfs   = FuseStatfs,
+   .utimens  = FuseUtimens,
+   .chmod    = FuseChmod,
+   .chown    = FuseChown,
+};
+
+
+int main( int argc, char** argv )
+{
+   struct fuse_args   Args = FUSE_ARGS_INIT( argc, argv );
+   int                rc;
+
+   if( fuse_opt_parse( &Args, &Options, OptionSpec, NULL ) < 0 )
+   {
+      return 1;
+   }
+
+   if( Options.Image == NULL || Options.SectorSize == 0 || Options.Sectors == 0 )
+   {
+      fprintf( stderr, "usage: %s --image=File --sector-size=N --sectors=N [FUSE options] Mountpoint\n", argv[0] );
+      return 2;
+   }
+
+   if( (Sections = FFSEmuOpen( Options.Image, Options.SectorSize, Options.Sectors )) == NULL ||
+       (Volume = FFSMount( Sections, NULL, 0 )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_fuse: can't mount %s\n", Options.Image );
+      return 1;
+   }
+
+   // Clean up anything left by a power loss before letting anyone in...
+   FFSVolCheck( Volume );
+
+   rc = fuse_main( Args.argc, Args.argv, &FuseOperations, NULL );
+
+   FFSUnmount( Volume );
+   FFSEmuClose( Sections );
+   fuse_opt_free_args( &Args );
+
+   return rc;
+}
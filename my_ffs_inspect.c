@@ -0,0 +1,717 @@
+//***************************************************************************************
+//
+//             my_ffs_inspect.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Host tool that analyses a flash image (a dump from a returned unit, say)
+//      without mounting it.  The image is mapped read-only and the sector table,
+//      chains and directory are rebuilt by several threads at once, so even very
+//      large NAND dumps take seconds.
+//
+//      Problems are found with the same rules Jcffs::Check uses: a chain that runs
+//      into a free, bad, fnode or already chained sector is a cross-chain, a sector
+//      that is neither claimed nor chained is an orphan, and of two fnodes with the
+//      same name (ignoring case) the one with the lower Count is a duplicate.  The
+//      image itself is never changed; the report says what Check would fix.
+//
+//      Also reported are file fragmentation, chains out of file order, sectors
+//      whose checksum doesn't match, and a histogram of erase counts.
+//
+//      Usage: my_ffs_inspect -s SectorSize [-j Threads] [-v] Image
+//
+//         -s   Sector size in bytes.
+//         -j   Number of threads (default: one per processor).
+//         -v   List each problem sector and file.
+//
+//***************************************************************************************
+
+#include "my_ffs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define WORD_BITS            (8 * sizeof(unsigned long))
+#define MAP_WORDS(Sectors)   (((Sectors) + WORD_BITS - 1) / WORD_BITS)
+#define MAP_BIT(Sector)      (1UL << ((Sector) % WORD_BITS))
+#define MAP_SET(Map, Sector)   ((Map)[(Sector) / WORD_BITS] |= MAP_BIT(Sector))
+#define MAP_TEST(Map, Sector)  (((Map)[(Sector) / WORD_BITS] & MAP_BIT(Sector)) != 0)
+
+#define MAX_THREADS          64
+#define WEAR_BUCKETS         10
+#define FRAG_BUCKETS         6
+
+
+//---------------------------------------------------------------------------------------
+// What we keep of each sector's header...
+//---------------------------------------------------------------------------------------
+typedef struct sector_info
+{
+   unsigned long   Successor;            // FFS_SUCCESSOR() of the header.
+   unsigned long   FileOffset;
+   unsigned long   EraseCount;
+   unsigned char   Status;
+   unsigned char   Keyed;                // Header has our key.
+   unsigned char   ChecksumBad;
+
+} SECTOR_INFO;
+
+//---------------------------------------------------------------------------------------
+// One file, from an fnode sector...
+//---------------------------------------------------------------------------------------
+typedef struct file_info
+{
+   unsigned long   Sector;               // Fnode sector.
+   FFS_FILE_NODE   Fnode;
+   char            UpperName[FFS_MAX_FILENAME_LENGTH + 1];
+   unsigned long   Hash;                 // Computed, version 1 fnodes have none.
+   unsigned long   Sectors;              // Sectors in its chain.
+   unsigned long   Fragments;            // Runs of consecutive sectors.
+   int             Unordered;            // Chain isn't in file order.
+
+} FILE_INFO;
+
+//---------------------------------------------------------------------------------------
+// Work for one thread.  Each scans a range of sectors that starts on a map word, so
+// the maps can be set without locking while scanning...
+//---------------------------------------------------------------------------------------
+typedef struct worker
+{
+   pthread_t       Thread;
+   unsigned long   First;                // Sectors [First, Last).
+   unsigned long   Last;
+
+   FILE_INFO*      Files;                // Fnodes found in the range.
+   unsigned long   FileCount;
+   unsigned long   FileAlloc;
+
+   unsigned long   CrossChains;
+   unsigned long   LeavesVolume;         // Chains pointing past the last sector.
+
+} WORKER;
+
+
+static const unsigned char*   Image;
+static unsigned long          SectorSize;
+static unsigned long          TotalSectors;
+static int                    Verbose;
+
+static SECTOR_INFO*           Sectors;
+static unsigned long*         Claimed;   // Free sectors and fnode sectors.
+static unsigned long*         Chained;   // Reached by following a chain.
+static unsigned long*         Bad;       // No key, or an fnode that isn't valid.
+
+static FILE_INFO*             Files;     // All files, in sector order.
+static unsigned long          FileCount;
+static unsigned long          NextFile;  // Next file for a chain walker to take.
+
+static WORKER                 Workers[MAX_THREADS];
+static int                    ThreadCount;
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    AddFile
+//
+//    Purpose:          Record an fnode found by a scanning thread.
+//
+//    Inputs:           Worker - The thread.
+//                      Sector - Fnode sector.
+//                      Fnode  - Decoded fnode.
+//
+//    Returns:          Nothing.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static void AddFile( WORKER* Worker, unsigned long Sector, const FFS_FILE_NODE* Fnode )
+{
+   FILE_INFO*   File;
+   int          i;
+
+   if( Worker->FileCount == Worker->FileAlloc )
+   {
+      Worker->FileAlloc = Worker->FileAlloc ? 2 * Worker->FileAlloc : 256;
+      Worker->Files     = (FILE_INFO*)realloc( Worker->Files, Worker->FileAlloc * sizeof(FILE_INFO) );
+      if( Worker->Files == NULL )
+      {
+         fprintf( stderr, "my_ffs_inspect: out of memory\n" );
+         exit( 1 );
+      }
+   }
+
+   File = &Worker->Files[Worker->FileCount++];
+   memset( File, 0, sizeof(*File) );
+
+   File->Sector = Sector;
+   File->Fnode  = *Fnode;
+   File->Hash   = FFSHashName( Fnode->Filename );
+
+   for( i = 0; Fnode->Filename[i]; i++ )
+   {
+      File->UpperName[i] = toupper( (unsigned char)Fnode->Filename[i] );
+   }
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    ScanSectors
+//
+//    Purpose:          Thread that decodes a range of sectors, fills in the sector
+//                      table and marks claimed and bad sectors.
+//
+//    Inputs:           Arg - The thread's WORKER.
+//
+//    Returns:          NULL.
+//
+//    Notes:            Mirrors the first pass of Jcffs::Check.
+//
+//---------------------------------------------------------------------------------------
+static void* ScanSectors( void* Arg )
+{
+   WORKER*                Worker = (WORKER*)Arg;
+   FFS_SECTOR_HEADER      SecHead;
+   FFS_FILE_NODE          Fnode;
+   const unsigned char*   Raw;
+   SECTOR_INFO*           Info;
+   unsigned long          Sector;
+
+   for( Sector = Worker->First; Sector < Worker->Last; Sector++ )
+   {
+      Raw  = Image + Sector * SectorSize;
+      Info = &Sectors[Sector];
+
+      FFSDecodeSectorHeader( Raw, &SecHead );
+
+      Info->Successor  = FFS_SUCCESSOR(SecHead);
+      Info->FileOffset = SecHead.FileOffset;
+      Info->EraseCount = SecHead.EraseCount;
+      Info->Status     = SecHead.Status;
+      Info->Keyed      = (SecHead.Key == FFS_SECTOR_HEADER_KEY);
+
+      if( !Info->Keyed )
+      {
+         if( SecHead.Status != FFS_SECTOR_HEADER_FREE &&
+             SecHead.Status != FFS_SECTOR_HEADER_FREE_DIRTY )
+         {
+            MAP_SET( Bad, Sector );
+         }
+      }
+      else if( SecHead.SectorChecksum != 0xffff &&
+               SecHead.SectorLength <= SectorSize &&
+               FFSSectorChecksum( SecHead.Version, Raw, SecHead.SectorLength ) != SecHead.SectorChecksum )
+      {
+         Info->ChecksumBad = 1;
+      }
+
+      switch( SecHead.Status )
+      {
+         case FFS_SECTOR_HEADER_FREE:
+         case FFS_SECTOR_HEADER_FREE_DIRTY:
+            MAP_SET( Claimed, Sector );
+            break;
+
+         case FFS_SECTOR_HEADER_INUSE_FILENODE:
+            FFSDecodeFileNode( SecHead.Version, Raw + FFSHeaderSize( SecHead.Version ), &Fnode );
+            if( Fnode.FileSize == 0 || Fnode.FileSize == (unsigned long)-1 )
+            {
+               MAP_SET( Bad, Sector );
+            }
+            else
+            {
+               MAP_SET( Claimed, Sector );
+               AddFile( Worker, Sector, &Fnode );
+
+               // The file's index is reached from its fnode, as its chain is. It
+               // may be in another worker's range, so its bit is set atomically...
+               if( (Fnode.Flags & (FFS_FNODE_INDEXED | FFS_FNODE_INDEX_STALE)) == FFS_FNODE_INDEXED &&
+                   Fnode.IndexSector < TotalSectors )
+               {
+                  __atomic_fetch_or( &Chained[Fnode.IndexSector / WORD_BITS],
+                                     MAP_BIT(Fnode.IndexSector), __ATOMIC_RELAXED );
+               }
+            }
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   return NULL;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    WalkChains
+//
+//    Purpose:          Thread that follows file chains, taking files one at a time
+//                      until there are none left.
+//
+//    Inputs:           Arg - The thread's WORKER.
+//
+//    Returns:          NULL.
+//
+//    Notes:            Chained bits are set atomically.  A sector whose bit was
+//                      already set is cross-linked or part of a loop, as in Check.
+//                      All claimed sectors are known before any chain is walked, so
+//                      the result doesn't depend on which thread gets there first.
+//
+//---------------------------------------------------------------------------------------
+static void* WalkChains( void* Arg )
+{
+   WORKER*          Worker = (WORKER*)Arg;
+   FILE_INFO*       File;
+   unsigned long    Index;
+   unsigned long    Sector;
+   unsigned long    Next;
+   unsigned long    Offset;
+   unsigned long    Old;
+
+   while( (Index = __atomic_fetch_add( &NextFile, 1, __ATOMIC_RELAXED )) < FileCount )
+   {
+      File            = &Files[Index];
+      File->Sectors   = 1;
+      File->Fragments = 1;
+
+      Sector = File->Sector;
+      Offset = (Sectors[Sector].FileOffset != (unsigned long)-1) ? Sectors[Sector].FileOffset : 0;
+      Next   = Sectors[Sector].Successor;
+
+      while( Next != (unsigned long)-1 )
+      {
+         if( Next >= TotalSectors )
+         {
+            Worker->LeavesVolume++;
+            break;
+         }
+
+         if( MAP_TEST( Claimed, Next ) || MAP_TEST( Bad, Next ) )
+         {
+            Worker->CrossChains++;
+            if( Verbose )
+            {
+               printf( "cross-chain: %s: sector %lu -> %lu\n", File->Fnode.Filename, Sector, Next );
+            }
+         }
+
+         Old = __atomic_fetch_or( &Chained[Next / WORD_BITS], MAP_BIT(Next), __ATOMIC_RELAXED );
+         if( Old & MAP_BIT(Next) )
+         {
+            Worker->CrossChains++;
+            if( Verbose )
+            {
+               printf( "cross-chain: %s: sector %lu -> %lu, already chained\n", File->Fnode.Filename, Sector, Next );
+            }
+            break;
+         }
+
+         if( Next != Sector + 1 )
+         {
+            File->Fragments++;
+         }
+
+         if( Sectors[Next].FileOffset != (unsigned long)-1 )
+         {
+            if( Sectors[Next].FileOffset < Offset )
+            {
+               File->Unordered = 1;
+            }
+            Offset = Sectors[Next].FileOffset;
+         }
+
+         File->Sectors++;
+         Sector = Next;
+         Next   = Sectors[Sector].Successor;
+      }
+   }
+
+   return NULL;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    RunWorkers
+//
+//    Purpose:          Run a thread function on every worker and wait for them all.
+//
+//    Inputs:           Function - Thread function.
+//
+//    Returns:          Nothing.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static void RunWorkers( void* (*Function)( void* ) )
+{
+   int   i;
+
+   for( i = 0; i < ThreadCount; i++ )
+   {
+      if( pthread_create( &Workers[i].Thread, NULL, Function, &Workers[i] ) != 0 )
+      {
+         fprintf( stderr, "my_ffs_inspect: can't create thread\n" );
+         exit( 1 );
+      }
+   }
+
+   for( i = 0; i < ThreadCount; i++ )
+   {
+      pthread_join( Workers[i].Thread, NULL );
+   }
+}
+
+
+//---------------------------------------------------------------------------------------
+// Order files by name (case-insensitive), then by Count so the copy Check keeps
+// comes last.  On equal Counts Check keeps the first one it finds...
+//---------------------------------------------------------------------------------------
+static int CompareFiles( const void* a, const void* b )
+{
+   const FILE_INFO*   Fa = *(const FILE_INFO* const*)a;
+   const FILE_INFO*   Fb = *(const FILE_INFO* const*)b;
+   int                rc;
+
+   if( Fa->Hash != Fb->Hash )
+   {
+      return (Fa->Hash < Fb->Hash) ? -1 : 1;
+   }
+
+   if( (rc = strcmp( Fa->UpperName, Fb->UpperName )) != 0 )
+   {
+      return rc;
+   }
+
+   if( Fa->Fnode.Count != Fb->Fnode.Count )
+   {
+      return (Fa->Fnode.Count < Fb->Fnode.Count) ? -1 : 1;
+   }
+
+   return (Fa->Sector > Fb->Sector) ? -1 : 1;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FindDuplicates
+//
+//    Purpose:          Count fnodes that Check would delete as older duplicates.
+//
+//    Inputs:           None.
+//
+//    Returns:          Number of duplicate files.
+//
+//    Notes:            Sorting replaces Check's pairwise compare.  Of each group of
+//                      equal names, all but the last (highest Count) are duplicates.
+//
+//---------------------------------------------------------------------------------------
+static unsigned long FindDuplicates( void )
+{
+   FILE_INFO**      Sorted;
+   unsigned long    Duplicates = 0;
+   unsigned long    i;
+
+   if( FileCount < 2 )
+   {
+      return 0;
+   }
+
+   Sorted = (FILE_INFO**)malloc( FileCount * sizeof(FILE_INFO*) );
+   for( i = 0; i < FileCount; i++ )
+   {
+      Sorted[i] = &Files[i];
+   }
+
+   qsort( Sorted, FileCount, sizeof(FILE_INFO*), CompareFiles );
+
+   for( i = 0; i + 1 < FileCount; i++ )
+   {
+      if( Sorted[i]->Hash == Sorted[i + 1]->Hash &&
+          strcmp( Sorted[i]->UpperName, Sorted[i + 1]->UpperName ) == 0 )
+      {
+         Duplicates++;
+         if( Verbose )
+         {
+            printf( "duplicate: %s: sector %lu (count %lu), kept copy at sector %lu\n",
+                    Sorted[i]->Fnode.Filename, Sorted[i]->Sector, Sorted[i]->Fnode.Count,
+                    Sorted[i + 1]->Sector );
+         }
+      }
+   }
+
+   free( Sorted );
+
+   return Duplicates;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Report
+//
+//    Purpose:          Count orphans, build the histograms and print the report.
+//
+//    Inputs:           None.
+//
+//    Returns:          Number of problems Check would fix.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static unsigned long Report( void )
+{
+   static const char*  FragLabels[FRAG_BUCKETS] = { "1", "2", "3-4", "5-8", "9-16", "17+" };
+   unsigned long       FragHist[FRAG_BUCKETS] = { 0 };
+   unsigned long       WearHist[WEAR_BUCKETS] = { 0 };
+   unsigned long       Status[6] = { 0 };             // Free, dirty, in use, fnode, index, deleted.
+   unsigned long       CrossChains = 0;
+   unsigned long       LeavesVolume = 0;
+   unsigned long       Orphans = 0;
+   unsigned long       BadOrphans = 0;
+   unsigned long       ChecksumBad = 0;
+   unsigned long       Unordered = 0;
+   unsigned long       Fragmented = 0;
+   unsigned long       Duplicates;
+   unsigned long       WearMin = (unsigned long)-1;
+   unsigned long       WearMax = 0;
+   unsigned long       WearSectors = 0;
+   unsigned long long  WearTotal = 0;
+   unsigned long       Width;
+   unsigned long       Sector;
+   unsigned long       Bucket;
+   unsigned long       i;
+   int                 b;
+
+   for( i = 0; i < (unsigned long)ThreadCount; i++ )
+   {
+      CrossChains  += Workers[i].CrossChains;
+      LeavesVolume += Workers[i].LeavesVolume;
+   }
+
+   for( Sector = 0; Sector < TotalSectors; Sector++ )
+   {
+      switch( Sectors[Sector].Status )
+      {
+         case FFS_SECTOR_HEADER_FREE:           Status[0]++; break;
+         case FFS_SECTOR_HEADER_FREE_DIRTY:     Status[1]++; break;
+         case FFS_SECTOR_HEADER_INUSE:          Status[2]++; break;
+         case FFS_SECTOR_HEADER_INUSE_FILENODE: Status[3]++; break;
+         case FFS_SECTOR_HEADER_INUSE_INDEX:    Status[4]++; break;
+         case FFS_SECTOR_HEADER_DELETED_FILENODE: Status[5]++; break;
+         default:                                            break;
+      }
+
+      if( !MAP_TEST( Claimed, Sector ) && !MAP_TEST( Chained, Sector ) )
+      {
+         if( MAP_TEST( Bad, Sector ) )
+         {
+            BadOrphans++;
+         }
+         else
+         {
+            Orphans++;
+         }
+
+         if( Verbose )
+         {
+            printf( "orphan: sector %lu, status 0x%02x%s\n", Sector, Sectors[Sector].Status,
+                    MAP_TEST( Bad, Sector ) ? ", bad" : "" );
+         }
+      }
+
+      if( Sectors[Sector].ChecksumBad )
+      {
+         ChecksumBad++;
+         if( Verbose )
+         {
+            printf( "checksum: sector %lu does not match\n", Sector );
+         }
+      }
+
+      if( Sectors[Sector].Keyed && Sectors[Sector].EraseCount != (unsigned long)-1 )
+      {
+         WearSectors++;
+         WearTotal += Sectors[Sector].EraseCount;
+         if( Sectors[Sector].EraseCount < WearMin ) WearMin = Sectors[Sector].EraseCount;
+         if( Sectors[Sector].EraseCount > WearMax ) WearMax = Sectors[Sector].EraseCount;
+      }
+   }
+
+   Width = (WearMax - WearMin) / WEAR_BUCKETS + 1;
+   for( Sector = 0; WearSectors && Sector < TotalSectors; Sector++ )
+   {
+      if( Sectors[Sector].Keyed && Sectors[Sector].EraseCount != (unsigned long)-1 )
+      {
+         WearHist[(Sectors[Sector].EraseCount - WearMin) / Width]++;
+      }
+   }
+
+   for( i = 0; i < FileCount; i++ )
+   {
+      for( Bucket = 0, b = 1; Bucket < FRAG_BUCKETS - 1 && Files[i].Fragments > (unsigned long)b; Bucket++ )
+      {
+         b *= 2;
+      }
+      FragHist[Bucket]++;
+
+      Fragmented += (Files[i].Fragments > 1);
+      Unordered  += Files[i].Unordered;
+   }
+
+   Duplicates = FindDuplicates();
+
+   printf( "\n%lu sectors of %lu bytes\n", TotalSectors, SectorSize );
+   printf( "   free %lu, free dirty %lu, in use %lu, fnode %lu, index %lu, deleted %lu, other %lu\n",
+           Status[0], Status[1], Status[2], Status[3], Status[4], Status[5],
+           TotalSectors - Status[0] - Status[1] - Status[2] - Status[3] - Status[4] - Status[5] );
+
+   printf( "\nCheck would fix:\n" );
+   printf( "   cross-chains          %lu\n", CrossChains );
+   printf( "   orphans               %lu (freed)\n", Orphans );
+   printf( "   bad orphans           %lu (erased)\n", BadOrphans );
+   printf( "   duplicate files       %lu (older copy deleted)\n", Duplicates );
+
+   printf( "\nOther findings:\n" );
+   printf( "   chains off the volume %lu\n", LeavesVolume );
+   printf( "   checksum mismatches   %lu\n", ChecksumBad );
+
+   printf( "\n%lu files, %lu fragmented, %lu out of file order\n", FileCount, Fragmented, Unordered );
+   printf( "   fragments    files\n" );
+   for( Bucket = 0; Bucket < FRAG_BUCKETS; Bucket++ )
+   {
+      printf( "   %-9s %8lu\n", FragLabels[Bucket], FragHist[Bucket] );
+   }
+
+   if( WearSectors )
+   {
+      printf( "\nErase counts: min %lu, max %lu, mean %.1f\n",
+              WearMin, WearMax, (double)WearTotal / WearSectors );
+      for( Bucket = 0; Bucket < WEAR_BUCKETS; Bucket++ )
+      {
+         if( WearMin + Bucket * Width > WearMax )
+         {
+            break;
+         }
+         printf( "   %10lu - %-10lu %8lu\n", WearMin + Bucket * Width,
+                 WearMin + (Bucket + 1) * Width - 1, WearHist[Bucket] );
+      }
+   }
+
+   return CrossChains + Orphans + BadOrphans + Duplicates;
+}
+
+
+int main( int argc, char** argv )
+{
+   struct stat      St;
+   unsigned long    Words;
+   unsigned long    PerThread;
+   unsigned long    Offset;
+   unsigned long    i;
+   int              Fd;
+   int              Opt;
+
+   ThreadCount = (int)sysconf( _SC_NPROCESSORS_ONLN );
+
+   while( (Opt = getopt( argc, argv, "s:j:v" )) != -1 )
+   {
+      switch( Opt )
+      {
+         case 's': SectorSize  = strtoul( optarg, NULL, 0 ); break;
+         case 'j': ThreadCount = atoi( optarg );             break;
+         case 'v': Verbose     = 1;                          break;
+         default:  SectorSize  = 0;                          break;
+      }
+   }
+
+   if( SectorSize == 0 || argc - optind != 1 )
+   {
+      fprintf( stderr, "usage: %s -s SectorSize [-j Threads] [-v] Image\n", argv[0] );
+      return 2;
+   }
+
+   // Headers and fnodes are decoded in place, so a sector must hold the largest...
+   if( SectorSize < FFS_MAX_HEADER_SIZE + FFS_MAX_FNODE_SIZE )
+   {
+      fprintf( stderr, "my_ffs_inspect: sector size %lu is too small\n", SectorSize );
+      return 2;
+   }
+
+   if( ThreadCount < 1 )           ThreadCount = 1;
+   if( ThreadCount > MAX_THREADS ) ThreadCount = MAX_THREADS;
+
+   if( (Fd = open( argv[optind], O_RDONLY )) < 0 || fstat( Fd, &St ) < 0 )
+   {
+      perror( argv[optind] );
+      return 1;
+   }
+
+   TotalSectors = St.st_size / SectorSize;
+   if( TotalSectors == 0 )
+   {
+      fprintf( stderr, "my_ffs_inspect: %s: image is smaller than a sector\n", argv[optind] );
+      return 1;
+   }
+
+   Image = (const unsigned char*)mmap( NULL, TotalSectors * SectorSize, PROT_READ, MAP_PRIVATE, Fd, 0 );
+   if( Image == MAP_FAILED )
+   {
+      perror( argv[optind] );
+      return 1;
+   }
+
+   // Sectors are read once each, in order within a thread...
+   madvise( (void*)Image, TotalSectors * SectorSize, MADV_SEQUENTIAL );
+
+   Words   = MAP_WORDS( TotalSectors );
+   Sectors = (SECTOR_INFO*)calloc( TotalSectors, sizeof(SECTOR_INFO) );
+   Claimed = (unsigned long*)calloc( Words, sizeof(unsigned long) );
+   Chained = (unsigned long*)calloc( Words, sizeof(unsigned long) );
+   Bad     = (unsigned long*)calloc( Words, sizeof(unsigned long) );
+   if( Sectors == NULL || Claimed == NULL || Chained == NULL || Bad == NULL )
+   {
+      fprintf( stderr, "my_ffs_inspect: out of memory\n" );
+      return 1;
+   }
+
+   // Split the sectors on map word boundaries...
+   PerThread = (Words + ThreadCount - 1) / ThreadCount * WORD_BITS;
+   for( i = 0; i < (unsigned long)ThreadCount; i++ )
+   {
+      Workers[i].First = (i * PerThread < TotalSectors) ? i * PerThread : TotalSectors;
+      Workers[i].Last  = (Workers[i].First + PerThread < TotalSectors) ? Workers[i].First + PerThread : TotalSectors;
+   }
+
+   RunWorkers( ScanSectors );
+
+   // Gather the files each thread found.  Ranges are in order, so files are too...
+   for( i = 0; i < (unsigned long)ThreadCount; i++ )
+   {
+      FileCount += Workers[i].FileCount;
+   }
+
+   Files = (FILE_INFO*)malloc( (FileCount ? FileCount : 1) * sizeof(FILE_INFO) );
+   for( i = 0, Offset = 0; i < (unsigned long)ThreadCount; i++ )
+   {
+      if( Workers[i].FileCount )
+      {
+         memcpy( Files + Offset, Workers[i].Files, Workers[i].FileCount * sizeof(FILE_INFO) );
+      }
+      Offset += Workers[i].FileCount;
+      free( Workers[i].Files );
+   }
+
+   RunWorkers( WalkChains );
+
+   return Report() ? 1 : 0;
+}
@@ -0,0 +1,441 @@
+//***************************************************************************************
+//
+//             my_ffs_microbench.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Host tool that times the internal routines most of the file system's time
+//      goes to, one at a time, on the emulated device (see my_ffs_emu.c):
+//      LocateFileNode(), FindFreeSector(), LocatePosition(), FreeSectors(),
+//      GetFlashSectionEntry(), the StringToUpperCase() name compare, and each
+//      pass of Check().
+//
+//      CPU time is the thread's own, and the device calls each routine makes are
+//      counted apart from it, so a routine that got slower can be told from one
+//      that reads more.  Each run builds a new image from a fixed seed, so runs
+//      with the same options see the same layout and can be compared.
+//
+//      Files are written a group at a time, a sector's worth to each in turn, so
+//      with -g above 1 the sectors of a file are spread among the others'.
+//
+//      Usage: my_ffs_microbench [-s SectorSize] [-n Sectors] [-f Files] [-z Size]
+//                               [-g Group] [-c Calls] [-r Repeats] Image
+//
+//         -s   Sector size in bytes (default 4096).
+//         -n   Number of sectors (default 1024).
+//         -f   Number of files (default 64).
+//         -z   Size of each file (default 16384).
+//         -g   Files written at once (default 1, no more than descriptors - 1).
+//         -c   Calls timed together (default 1000).
+//         -r   Times each is repeated; the best and the median are shown (default 5).
+//
+//      Build every file with FFS_MICROBENCH defined, FFS_MAX_FILE_DESCRIPTORS set as
+//      it would be on the target, and link with my_ffs.c (as C++), my_ffs_format.c
+//      and my_ffs_emu.c.
+//
+//***************************************************************************************
+
+#include "my_ffs.h"
+#include "my_ffs_emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#ifndef FFS_MICROBENCH
+#error Build with FFS_MICROBENCH defined
+#endif
+
+
+#define MAX_REPEATS          64
+#define CHECK_PASSES         (FFS_CHECK_PASS_DONE + 1)
+
+//---------------------------------------------------------------------------------------
+// What one timed run cost...
+//---------------------------------------------------------------------------------------
+typedef struct sample
+{
+   unsigned long long   Cpu;             // Thread CPU time, nanoseconds.
+   FFS_EMU_STATS        Device;          // Device calls made.
+
+} SAMPLE;
+
+
+static FFS_FLASH_SECTION*   Sections;
+static FFS_GLOBALS*         Volume;
+
+static unsigned long        SectorSize = 4096;
+static unsigned long        SectorCount = 1024;
+static unsigned long        FileCount = 64;
+static unsigned long        FileSize = 16384;
+static unsigned long        Group = 1;
+static unsigned long        Calls = 1000;
+static unsigned long        Repeats = 5;
+
+static SAMPLE               Marks[CHECK_PASSES];
+static int                  MarkCount;
+
+
+static unsigned long long CpuNanoseconds( void )
+{
+   struct timespec   Now;
+
+   clock_gettime( CLOCK_THREAD_CPUTIME_ID, &Now );
+
+   return (unsigned long long)Now.tv_sec * 1000000000ULL + Now.tv_nsec;
+}
+
+static void TakeSample( SAMPLE* Sample )
+{
+   FFSEmuGetStats( Sections, &Sample->Device );
+   Sample->Cpu = CpuNanoseconds();
+}
+
+// End - Start, into Start...
+static void SampleDelta( SAMPLE* Start, SAMPLE* End )
+{
+   Start->Cpu                   = End->Cpu - Start->Cpu;
+   Start->Device.Reads          = End->Device.Reads - Start->Device.Reads;
+   Start->Device.Writes         = End->Device.Writes - Start->Device.Writes;
+   Start->Device.Erases         = End->Device.Erases - Start->Device.Erases;
+   Start->Device.BytesRead      = End->Device.BytesRead - Start->Device.BytesRead;
+   Start->Device.BytesWritten   = End->Device.BytesWritten - Start->Device.BytesWritten;
+}
+
+static int CompareSamples( const void* a, const void* b )
+{
+   const SAMPLE*   A = (const SAMPLE*)a;
+   const SAMPLE*   B = (const SAMPLE*)b;
+
+   return (A->Cpu > B->Cpu) - (A->Cpu < B->Cpu);
+}
+
+static void FileName( char* Name, unsigned long Number )
+{
+   sprintf( Name, "BENCH%05lu.DAT", Number );
+}
+
+// Check() calls this as each pass starts.  The CPU time taken here is small next to a pass...
+static void CheckMark( int Pass )
+{
+   if( Pass == MarkCount && MarkCount < CHECK_PASSES )
+   {
+      TakeSample( &Marks[MarkCount++] );
+   }
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Build
+//
+//    Purpose:          Make a new image and fill it with the files.
+//
+//    Inputs:           ImagePath - Image file, replaced.
+//
+//    Returns:          0 or -1.
+//
+//    Notes:            The contents come from a fixed seed, so every build is the same.
+//
+//---------------------------------------------------------------------------------------
+static int Build( const char* ImagePath )
+{
+   char            Name[32];
+   char*           Buffer;
+   int             fd[FFS_MAX_FILE_DESCRIPTORS];
+   unsigned long   First;
+   unsigned long   Offset;
+   unsigned long   Count;
+   unsigned long   n;
+   unsigned long   i;
+   unsigned long   j;
+   unsigned int    Seed = 1;
+   int             rc = 0;
+
+   unlink( ImagePath );
+   if( (Sections = FFSEmuOpen( ImagePath, SectorSize, SectorCount )) == NULL )
+   {
+      return -1;
+   }
+
+   if( (Volume = FFSMount( Sections, NULL, 0 )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_microbench: can't mount %s\n", ImagePath );
+      FFSEmuClose( Sections );
+      return -1;
+   }
+
+   if( (Buffer = (char*)malloc( SectorSize )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_microbench: out of memory\n" );
+      return -1;
+   }
+
+   for( First = 0; First < FileCount && rc >= 0; First += Count )
+   {
+      Count = (FileCount - First < Group) ? FileCount - First : Group;
+
+      for( i = 0; i < Count; i++ )
+      {
+         FileName( Name, First + i );
+         fd[i] = FFSVolOpen( Volume, Name, FFS_CREATE | FFS_RDWR, 0 );
+      }
+
+      // A sector's worth to each in turn...
+      for( Offset = 0; Offset < FileSize && rc >= 0; Offset += n )
+      {
+         n = (FileSize - Offset < SectorSize) ? FileSize - Offset : SectorSize;
+
+         for( i = 0; i < Count && rc >= 0; i++ )
+         {
+            for( j = 0; j < n; j++ )
+            {
+               Buffer[j] = (char)rand_r( &Seed );
+            }
+            rc = (fd[i] < 0) ? fd[i] : FFSVolWrite( Volume, fd[i], Buffer, (int)n );
+         }
+      }
+
+      for( i = 0; i < Count; i++ )
+      {
+         if( fd[i] >= 0 )
+         {
+            FFSVolClose( Volume, fd[i] );
+         }
+      }
+   }
+
+   free( Buffer );
+
+   if( rc < 0 )
+   {
+      fprintf( stderr, "my_ffs_microbench: can't write the files (%d), try fewer or smaller\n", rc );
+      return -1;
+   }
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Run
+//
+//    Purpose:          Time a routine Repeats times and print a line for it.
+//
+//    Inputs:           Label - Name shown.
+//                      Bench - What to run.  Count is the number of calls each time.
+//
+//    Returns:          0 or the error FFSVolBench() returned.
+//
+//    Notes:            The best time is the one to compare between builds.  Routines
+//                      that change the volume are only run once each time.
+//
+//---------------------------------------------------------------------------------------
+static int Run( const char* Label, FFS_BENCH* Bench )
+{
+   SAMPLE          Samples[MAX_REPEATS];
+   SAMPLE          End;
+   unsigned long   Found = 0;
+   unsigned long   i;
+   double          n;
+   int             rc;
+
+   for( i = 0; i < Repeats; i++ )
+   {
+      if( Bench->Routine == FFS_BENCH_FREE_SECTORS )
+      {
+         FileName( Bench->Name, i );
+      }
+
+      TakeSample( &Samples[i] );
+      rc = FFSVolBench( Volume, Bench );
+      TakeSample( &End );
+
+      if( rc < 0 )
+      {
+         fprintf( stderr, "my_ffs_microbench: %s failed (%d)\n", Label, rc );
+         return rc;
+      }
+
+      SampleDelta( &Samples[i], &End );
+      Found += Bench->Found;
+   }
+
+   // The device counts are the same every time, so any sample's will do...
+   n = (double)Bench->Count;
+   qsort( Samples, Repeats, sizeof(SAMPLE), CompareSamples );
+   printf( "%-20s %8lu %10.1f %10.1f %9.2f %9.2f %11.1f %7.0f%%\n",
+           Label, Bench->Count,
+           Samples[0].Cpu / n, Samples[Repeats / 2].Cpu / n,
+           Samples[0].Device.Reads / n, Samples[0].Device.Writes / n,
+           Samples[0].Device.BytesRead / n,
+           100.0 * Found / (n * Repeats) );
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    RunCheck
+//
+//    Purpose:          Time Check() pass by pass, Repeats times.
+//
+//    Inputs:           None.
+//
+//    Returns:          0 or the error FFSVolBench() returned.
+//
+//    Notes:            The volume is clean, so no pass has anything to fix and the
+//                      time is all looking.
+//
+//---------------------------------------------------------------------------------------
+static int RunCheck( void )
+{
+   static const char*   PassNames[CHECK_PASSES - 1] = { "check map", "check orphans", "check duplicates" };
+   SAMPLE               Samples[CHECK_PASSES - 1][MAX_REPEATS];
+   FFS_BENCH            Bench;
+   unsigned long        i;
+   int                  Pass;
+   int                  rc;
+
+   memset( &Bench, 0, sizeof(Bench) );
+   Bench.Routine = FFS_BENCH_CHECK;
+   Bench.Count   = 1;
+   Bench.Mark    = CheckMark;
+
+   for( i = 0; i < Repeats; i++ )
+   {
+      MarkCount = 0;
+      if( (rc = FFSVolBench( Volume, &Bench )) < 0 )
+      {
+         fprintf( stderr, "my_ffs_microbench: Check failed (%d)\n", rc );
+         return rc;
+      }
+
+      if( MarkCount != CHECK_PASSES )
+      {
+         fprintf( stderr, "my_ffs_microbench: Check marked %d passes\n", MarkCount );
+         return -1;
+      }
+
+      for( Pass = 0; Pass < CHECK_PASSES - 1; Pass++ )
+      {
+         Samples[Pass][i] = Marks[Pass];
+         SampleDelta( &Samples[Pass][i], &Marks[Pass + 1] );
+      }
+   }
+
+   for( Pass = 0; Pass < CHECK_PASSES - 1; Pass++ )
+   {
+      qsort( Samples[Pass], Repeats, sizeof(SAMPLE), CompareSamples );
+      printf( "%-20s %8d %10.1f %10.1f %9llu %9llu %11llu %8s\n",
+              PassNames[Pass], 1,
+              (double)Samples[Pass][0].Cpu, (double)Samples[Pass][Repeats / 2].Cpu,
+              Samples[Pass][0].Device.Reads, Samples[Pass][0].Device.Writes,
+              Samples[Pass][0].Device.BytesRead, "-" );
+   }
+
+   return 0;
+}
+
+
+int main( int argc, char** argv )
+{
+   FFS_BENCH   Bench;
+   char        Name[32];
+   char        Missing[32];
+   int         fd;
+   int         Opt;
+   int         rc = 0;
+
+   while( (Opt = getopt( argc, argv, "s:n:f:z:g:c:r:" )) != -1 )
+   {
+      switch( Opt )
+      {
+         case 's': SectorSize  = strtoul( optarg, NULL, 0 ); break;
+         case 'n': SectorCount = strtoul( optarg, NULL, 0 ); break;
+         case 'f': FileCount   = strtoul( optarg, NULL, 0 ); break;
+         case 'z': FileSize    = strtoul( optarg, NULL, 0 ); break;
+         case 'g': Group       = strtoul( optarg, NULL, 0 ); break;
+         case 'c': Calls       = strtoul( optarg, NULL, 0 ); break;
+         case 'r': Repeats     = strtoul( optarg, NULL, 0 ); break;
+         default:  SectorSize  = 0;                          break;
+      }
+   }
+
+   // One descriptor is kept for LocatePosition(), and FreeSectors() takes a file each time...
+   if( SectorSize == 0 || SectorCount == 0 || FileCount == 0 || FileSize == 0 || Calls == 0 ||
+       Group == 0 || Group >= FFS_MAX_FILE_DESCRIPTORS || Repeats == 0 || Repeats > MAX_REPEATS ||
+       Repeats >= FileCount || argc - optind != 1 )
+   {
+      fprintf( stderr, "usage: %s [-s SectorSize] [-n Sectors] [-f Files] [-z Size]\n"
+                       "          [-g Group] [-c Calls] [-r Repeats] Image\n", argv[0] );
+      return 2;
+   }
+
+   if( Build( argv[optind] ) < 0 )
+   {
+      return 1;
+   }
+
+   printf( "%lu sectors of %lu bytes, %lu files of %lu bytes written %lu at a time\n\n",
+           SectorCount, SectorSize, FileCount, FileSize, Group );
+   printf( "%-20s %8s %10s %10s %9s %9s %11s %8s\n",
+           "routine", "calls", "best ns", "median ns", "reads", "writes", "bytes read", "found" );
+
+   memset( &Bench, 0, sizeof(Bench) );
+   Bench.Count = Calls;
+   Bench.Name  = Name;
+
+   // The last file written is the furthest along the scan.  A name that isn't there
+   // should be turned away without one...
+   FileName( Name, FileCount - 1 );
+   Bench.Routine = FFS_BENCH_LOCATE_FILE;
+   rc |= Run( "locate file", &Bench );
+
+   strcpy( Missing, "NOSUCHFILE.DAT" );
+   Bench.Name = Missing;
+   rc |= Run( "locate missing", &Bench );
+   Bench.Name = Name;
+
+   Bench.Routine = FFS_BENCH_FIND_FREE;
+   rc |= Run( "find free", &Bench );
+
+   Bench.Routine = FFS_BENCH_SECTION_ENTRY;
+   Bench.Arg     = SectorCount / 2;
+   rc |= Run( "section entry", &Bench );
+
+   Bench.Routine = FFS_BENCH_NAME_MATCH;
+   rc |= Run( "name match", &Bench );
+
+   // The start and the end of the first file...
+   FileName( Name, 0 );
+   if( (fd = FFSVolOpen( Volume, Name, FFS_RDONLY, 0 )) < 0 )
+   {
+      fprintf( stderr, "my_ffs_microbench: can't open %s (%d)\n", Name, fd );
+      return 1;
+   }
+
+   Bench.Routine = FFS_BENCH_LOCATE_POSITION;
+   Bench.fd      = fd;
+   Bench.Arg     = 0;
+   rc |= Run( "locate position 0", &Bench );
+   Bench.Arg     = FileSize - 1;
+   rc |= Run( "locate position end", &Bench );
+
+   FFSVolClose( Volume, fd );
+
+   rc |= RunCheck();
+
+   // Last, as each one takes a file away...
+   Bench.Routine = FFS_BENCH_FREE_SECTORS;
+   Bench.Count   = 1;
+   rc |= Run( "free sectors", &Bench );
+
+   FFSUnmount( Volume );
+   FFSEmuClose( Sections );
+
+   return rc < 0;
+}
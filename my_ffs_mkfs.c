@@ -0,0 +1,320 @@
+//***************************************************************************************
+//
+//             my_ffs_mkfs.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Host tool that builds a complete flash image from a directory tree, so a
+//      factory programmer can write it in one pass instead of the target writing
+//      each file thru the API.
+//
+//      Each file is laid out in consecutive sectors with version 4 headers, its
+//      fnode, chain pointers, skips and checksums already filled in.  Sectors not used by a
+//      file are left erased, which the file system takes as free, and which
+//      programmers can skip.
+//
+//      The file system is flat, so a file's name is its path relative to the
+//      top of the tree.  Empty files are skipped, since an fnode always has
+//      data.  Permissions are the owner's read/write/execute bits.
+//
+//      Usage: my_ffs_mkfs -s SectorSize -n Sectors [-v] Directory Image
+//
+//         -s   Sector size in bytes.
+//         -n   Number of sectors in the file system.
+//         -v   List files as they are added.
+//
+//***************************************************************************************
+
+#define _XOPEN_SOURCE 500
+
+#include "my_ffs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+
+static unsigned char*   Image;              // Image being built.
+static unsigned long    SectorSize;
+static unsigned long    SectorCount;
+static unsigned long    NextSector;         // Next unused sector.
+static const char*      Top;                // Top of the tree.
+static size_t           TopLength;
+static int              Verbose;
+static int              Failed;
+
+// Names already in the image, to catch names that differ only in case...
+static char**           Names;
+static unsigned long    NameCount;
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    FinishSector
+//
+//    Purpose:          Fill in a sector's checksum and write its header.
+//
+//    Inputs:           Sector  - Sector number.
+//                      SecHead - Its header, less the checksum.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            The fnode and data must already be in place.
+//
+//---------------------------------------------------------------------------------------
+static void FinishSector( unsigned long Sector, FFS_SECTOR_HEADER* SecHead )
+{
+   unsigned char*   Raw = Image + Sector * SectorSize;
+
+   SecHead->SectorChecksum = FFSSectorChecksum( SecHead->Version, Raw, SecHead->SectorLength );
+   FFSEncodeSectorHeader( SecHead, Raw );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    AddFile
+//
+//    Purpose:          Lay out one file in consecutive sectors.
+//
+//    Inputs:           Path - Host path of the file.
+//                      Name - Name in the file system.
+//                      St   - Its stat.
+//
+//    Returns:          0, or -1 on error.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static int AddFile( const char* Path, const char* Name, const struct stat* St )
+{
+   FFS_SECTOR_HEADER   SecHead;
+   FFS_FILE_NODE       Fnode;
+   FILE*               File;
+   unsigned long       Sector;
+   unsigned long       FirstSector = NextSector;
+   unsigned long       ChainCount = 1;
+   unsigned long       FirstLength;
+   unsigned long       Skip;
+   unsigned long       FileOffset = 0;
+   unsigned long       DataLength;
+   unsigned long       Got;
+   unsigned long       i;
+
+   memset( &Fnode, 0, sizeof(Fnode) );
+   strcpy( Fnode.Filename, Name );
+   Fnode.NameHash    = FFSHashName( Name );
+   Fnode.FileSize    = St->st_size;
+   Fnode.DataTime    = St->st_mtime;
+   Fnode.Count       = 0;
+   Fnode.Permissions = (St->st_mode >> 6) & 7;
+   Fnode.Flags       = 0;
+
+   for( i = 0; i < NameCount; i++ )
+   {
+      if( strcasecmp( Names[i], Name ) == 0 )
+      {
+         fprintf( stderr, "my_ffs_mkfs: %s: name is already in the image as %s\n", Path, Names[i] );
+         return -1;
+      }
+   }
+
+   // Skips are placed by chain position, so count the chain first...
+   FirstLength = SectorSize - FFS_V4_HEADER_SIZE - FFSFileNodeSize( FFS_FILE_SYSTEM_VERSION_V4, &Fnode );
+   if( Fnode.FileSize > FirstLength )
+   {
+      ChainCount += (Fnode.FileSize - FirstLength + (SectorSize - FFS_V4_HEADER_SIZE) - 1) /
+                       (SectorSize - FFS_V4_HEADER_SIZE);
+   }
+
+   if( (File = fopen( Path, "rb" )) == NULL )
+   {
+      perror( Path );
+      return -1;
+   }
+
+   while( FileOffset < Fnode.FileSize )
+   {
+      if( NextSector >= SectorCount )
+      {
+         fprintf( stderr, "my_ffs_mkfs: %s: image is full\n", Path );
+         fclose( File );
+         return -1;
+      }
+
+      Sector = NextSector++;
+
+      SecHead.Key            = FFS_SECTOR_HEADER_KEY;
+      SecHead.Version        = FFS_FILE_SYSTEM_VERSION_V4;
+      SecHead.Status         = (FileOffset == 0) ? FFS_SECTOR_HEADER_INUSE_FILENODE : FFS_SECTOR_HEADER_INUSE;
+      SecHead.EraseCount     = 0;
+      SecHead.SectorLength   = SectorSize;
+      SecHead.DataOffset     = FFS_V4_HEADER_SIZE;
+      SecHead.FileOffset     = FileOffset;
+      SecHead.Bypass         = -1;
+      Skip                   = FFSSkipIndex( Sector - FirstSector, ChainCount );
+      SecHead.Skip           = (Skip != (unsigned long)-1) ? FirstSector + Skip : (unsigned long)-1;
+      SecHead.SectorChecksum = 0xffff;
+
+      if( FileOffset == 0 )
+      {
+         SecHead.DataOffset += FFSEncodeFileNode( FFS_FILE_SYSTEM_VERSION_V4,
+                                                  &Fnode,
+                                                  Image + Sector * SectorSize + FFS_V4_HEADER_SIZE );
+      }
+
+      DataLength = SectorSize - SecHead.DataOffset;
+      if( DataLength > Fnode.FileSize - FileOffset )
+      {
+         DataLength = Fnode.FileSize - FileOffset;
+      }
+
+      Got = fread( Image + Sector * SectorSize + SecHead.DataOffset, 1, DataLength, File );
+      if( Got != DataLength )
+      {
+         fprintf( stderr, "my_ffs_mkfs: %s: file changed while reading\n", Path );
+         fclose( File );
+         return -1;
+      }
+
+      FileOffset += DataLength;
+
+      // The file's sectors are consecutive...
+      SecHead.Next = (FileOffset < Fnode.FileSize) ? Sector + 1 : (unsigned long)-1;
+
+      FinishSector( Sector, &SecHead );
+   }
+
+   fclose( File );
+
+   Names = (char**)realloc( Names, (NameCount + 1) * sizeof(char*) );
+   Names[NameCount++] = strdup( Name );
+
+   if( Verbose )
+   {
+      printf( "%-40s %10lu bytes\n", Name, Fnode.FileSize );
+   }
+
+   return 0;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Visit
+//
+//    Purpose:          nftw() callback for each entry in the tree.
+//
+//    Inputs:           As for nftw().
+//
+//    Returns:          0 to carry on, 1 to stop.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static int Visit( const char* Path, const struct stat* St, int Type, struct FTW* Ftw )
+{
+   const char*   Name;
+
+   (void)Ftw;
+
+   if( Type != FTW_F )
+   {
+      return 0;
+   }
+
+   Name = Path + TopLength;
+   while( *Name == '/' )
+   {
+      Name++;
+   }
+
+   if( strlen( Name ) > FFS_MAX_FILENAME_LENGTH )
+   {
+      fprintf( stderr, "my_ffs_mkfs: %s: name is longer than %d\n", Path, FFS_MAX_FILENAME_LENGTH );
+      Failed = 1;
+      return 1;
+   }
+
+   if( St->st_size == 0 )
+   {
+      fprintf( stderr, "my_ffs_mkfs: %s: empty, skipped\n", Path );
+      return 0;
+   }
+
+   if( AddFile( Path, Name, St ) < 0 )
+   {
+      Failed = 1;
+      return 1;
+   }
+
+   return 0;
+}
+
+
+int main( int argc, char** argv )
+{
+   FILE*   Out;
+   int     Opt;
+
+   while( (Opt = getopt( argc, argv, "s:n:v" )) != -1 )
+   {
+      switch( Opt )
+      {
+         case 's': SectorSize  = strtoul( optarg, NULL, 0 ); break;
+         case 'n': SectorCount = strtoul( optarg, NULL, 0 ); break;
+         case 'v': Verbose     = 1;                          break;
+         default:  SectorSize  = 0;                          break;
+      }
+   }
+
+   if( SectorSize == 0 || SectorCount == 0 || argc - optind != 2 )
+   {
+      fprintf( stderr, "usage: %s -s SectorSize -n Sectors [-v] Directory Image\n", argv[0] );
+      return 2;
+   }
+
+   // A sector must at least hold a header and an fnode with a full length name...
+   if( SectorSize <= FFS_V4_HEADER_SIZE + FFS_V3_FNODE_SIZE( FFS_MAX_FILENAME_LENGTH ) + FFS_V3_FNODE_INDEX_SIZE )
+   {
+      fprintf( stderr, "my_ffs_mkfs: sector size %lu is too small\n", SectorSize );
+      return 2;
+   }
+
+   if( (Image = (unsigned char*)malloc( SectorSize * SectorCount )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_mkfs: out of memory\n" );
+      return 1;
+   }
+
+   memset( Image, 0xff, SectorSize * SectorCount );
+
+   Top       = argv[optind];
+   TopLength = strlen( Top );
+
+   if( nftw( Top, Visit, 16, FTW_PHYS ) < 0 )
+   {
+      perror( Top );
+      return 1;
+   }
+
+   if( Failed )
+   {
+      return 1;
+   }
+
+   if( (Out = fopen( argv[optind + 1], "wb" )) == NULL ||
+       fwrite( Image, SectorSize, SectorCount, Out ) != SectorCount ||
+       fclose( Out ) != 0 )
+   {
+      perror( argv[optind + 1] );
+      return 1;
+   }
+
+   printf( "%lu files, %lu of %lu sectors used\n", NameCount, NextSector, SectorCount );
+
+   return 0;
+}
@@ -0,0 +1,688 @@
+//***************************************************************************************
+//
+//             my_ffs_stress.c - My Simple Flash File System
+//                         John C. Overton
+//
+//   Description:
+//      Host tool that runs many tasks against one volume on the emulated device
+//      (see my_ffs_emu.c) and reports how throughput and latency change as the
+//      number of tasks grows.  Each thread picks operations at random in the
+//      given ratios: read a whole file, write one anew, Erase one, or Rename one.
+//      Lock contention shows as latency climbing with threads while throughput
+//      stays flat, and running out of descriptors as opens refused.
+//
+//      Every file written starts with its length and is filled with a pattern
+//      from it, so a reader can tell a file that is torn or cross-linked.  Each
+//      step starts from a new image, and the volume is checked at the end.
+//
+//      Usage: my_ffs_stress [-s SectorSize] [-n Sectors] [-t Threads,...] [-d Seconds]
+//                           [-f Files] [-z Min:Max] [-m Read:Write:Erase:Rename]
+//                           [-k Microseconds] [-e Microseconds] [-v] Image
+//
+//         -s   Sector size in bytes (default 4096).
+//         -n   Number of sectors (default 1024).
+//         -t   Thread counts to step thru (default 1,2,4,8,16).
+//         -d   Seconds to run each step (default 5).
+//         -f   Number of file names in use (default 64).
+//         -z   Smallest and largest file written (default 512:16384).
+//         -m   Ratios of the operations (default 60:25:10:5).
+//         -k   Longest think time between operations (default 0).
+//         -e   Time each erase takes (default 0).
+//         -v   Break latency down by operation as well.
+//
+//      Build with FFS_MAX_FILE_DESCRIPTORS set as it would be on the target, and
+//      link with my_ffs.c (as C++), my_ffs_format.c, my_ffs_emu.c and -lpthread.
+//
+//***************************************************************************************
+
+#include "my_ffs.h"
+#include "my_ffs_emu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+
+#define MAX_THREADS          256
+#define MAX_STEPS            16
+#define CHUNK                512
+
+#define OP_READ              0
+#define OP_WRITE             1
+#define OP_ERASE             2
+#define OP_RENAME            3
+#define OPS                  4
+
+static const char*   OpNames[OPS] = { "read", "write", "erase", "rename" };
+
+
+//---------------------------------------------------------------------------------------
+// Latencies taken by one thread for one operation, in nanoseconds...
+//---------------------------------------------------------------------------------------
+typedef struct latency_list
+{
+   unsigned long long*   Samples;
+   unsigned long         Count;
+   unsigned long         Size;
+
+} LATENCY_LIST;
+
+//---------------------------------------------------------------------------------------
+// One thread's work and results...
+//---------------------------------------------------------------------------------------
+typedef struct worker
+{
+   pthread_t       Thread;
+   unsigned int    Seed;
+   LATENCY_LIST    Latency[OPS];
+   unsigned long   NoDescriptor;         // Opens refused for want of a descriptor.
+   unsigned long   Missing;              // Names that weren't there (expected).
+   unsigned long   Full;                 // Updates that ran out of space, and reads of
+                                         // the files they cut short.
+   unsigned long   Bad;                  // Files that read back wrong.
+   unsigned long   Failed;               // Any other error.
+
+} WORKER;
+
+
+static FFS_GLOBALS*      Volume;
+static WORKER            Workers[MAX_THREADS];
+static atomic_int        Running;
+
+// For each name, the files cut short by a full volume, and of those, the ones erased
+// again.  A reader that may have seen one under its name doesn't count it as bad.  The
+// writer holds the name's lock from close to erase, so a rename can't take one away...
+static atomic_ulong*     CutShort;
+static atomic_ulong*     CutShortErased;
+static pthread_mutex_t*  NameLocks;
+
+static unsigned long     SectorSize = 4096;
+static unsigned long     SectorCount = 1024;
+static int               Steps[MAX_STEPS] = { 1, 2, 4, 8, 16 };
+static int               StepCount = 5;
+static unsigned long     Seconds = 5;
+static unsigned long     FileCount = 64;
+static unsigned long     MinSize = 512;
+static unsigned long     MaxSize = 16384;
+static unsigned long     Mix[OPS] = { 60, 25, 10, 5 };
+static unsigned long     MixTotal;
+static unsigned long     ThinkTime;
+static unsigned long     EraseTime;
+static int               Verbose;
+
+
+static unsigned long long Nanoseconds( void )
+{
+   struct timespec   Now;
+
+   clock_gettime( CLOCK_MONOTONIC, &Now );
+
+   return (unsigned long long)Now.tv_sec * 1000000000ULL + Now.tv_nsec;
+}
+
+static void AddSample( LATENCY_LIST* List, unsigned long long Sample )
+{
+   if( List->Count == List->Size )
+   {
+      List->Size    = List->Size ? List->Size * 2 : 4096;
+      List->Samples = (unsigned long long*)realloc( List->Samples, List->Size * sizeof(unsigned long long) );
+      if( List->Samples == NULL )
+      {
+         fprintf( stderr, "my_ffs_stress: out of memory\n" );
+         exit( 1 );
+      }
+   }
+
+   List->Samples[List->Count++] = Sample;
+}
+
+static int CompareSamples( const void* a, const void* b )
+{
+   unsigned long long   Sa = *(const unsigned long long*)a;
+   unsigned long long   Sb = *(const unsigned long long*)b;
+
+   return (Sa > Sb) - (Sa < Sb);
+}
+
+// Byte at Offset of a file of Length bytes.  The first four hold the length...
+static unsigned char PatternByte( unsigned long Length, unsigned long Offset )
+{
+   if( Offset < 4 )
+   {
+      return (unsigned char)(Length >> (8 * Offset));
+   }
+
+   return (unsigned char)(Offset * 31 + Length);
+}
+
+static void FileName( char* Name, unsigned long Number )
+{
+   sprintf( Name, "STRESS%04lu.DAT", Number );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    ReadFile / WriteFile
+//
+//    Purpose:          Read a whole file and check it, or write one anew.
+//
+//    Inputs:           Worker - Thread doing it, for its counts and seed.
+//                      Number - Which file name.
+//
+//    Returns:          Nothing.
+//
+//    Notes:            A file written by another thread while it is being read
+//                      belongs to a new fnode, so the reader still sees the old one
+//                      whole.
+//
+//                      A write that runs out of space still has to close the file,
+//                      which keeps what was written, so it erases it again.  A reader
+//                      that finds a file intact but short counts it as full if one of
+//                      those was under its name while it read: more had been cut short
+//                      there by the end of the read than had been erased at its start.
+//
+//---------------------------------------------------------------------------------------
+static void ReadFile( WORKER* Worker, unsigned long Number )
+{
+   unsigned char   Buffer[CHUNK];
+   char            Name[32];
+   unsigned long   Length = 0;
+   unsigned long   Offset = 0;
+   unsigned long   Erased;
+   unsigned long   i;
+   int             fd;
+   int             n;
+   int             Bad = 0;
+
+   FileName( Name, Number );
+
+   Erased = atomic_load( &CutShortErased[Number] );
+
+   if( (fd = FFSVolOpen( Volume, Name, FFS_RDONLY, 0 )) < 0 )
+   {
+      if( fd == FFS_RC_TOO_MANY_OPEN_FILES )
+      {
+         Worker->NoDescriptor++;
+      }
+      else if( fd == FFS_RC_FILE_DOES_NOT_EXIST || fd == FFS_RC_FILE_NOT_FOUND )
+      {
+         Worker->Missing++;
+      }
+      else
+      {
+         Worker->Failed++;
+      }
+      return;
+   }
+
+   while( (n = FFSVolRead( Volume, fd, (char*)Buffer, sizeof(Buffer) )) > 0 )
+   {
+      for( i = 0; i < (unsigned long)n; i++, Offset++ )
+      {
+         if( Offset < 4 )
+         {
+            Length |= (unsigned long)Buffer[i] << (8 * Offset);
+         }
+         else if( Buffer[i] != PatternByte( Length, Offset ) )
+         {
+            Bad = 1;
+         }
+      }
+   }
+
+   // A read at the end fails rather than returning 0...
+   if( n < 0 && n != FFS_RC_INVALID_FILE_POSITION )
+   {
+      Worker->Failed++;
+   }
+   else if( !Bad && Offset < Length && atomic_load( &CutShort[Number] ) > Erased )
+   {
+      Worker->Full++;
+   }
+   else if( Bad || Offset != Length )
+   {
+      Worker->Bad++;
+   }
+
+   FFSVolClose( Volume, fd );
+}
+
+static void WriteFile( WORKER* Worker, unsigned long Number )
+{
+   unsigned char   Buffer[CHUNK];
+   char            Name[32];
+   unsigned long   Length;
+   unsigned long   Offset;
+   unsigned long   i;
+   int             fd;
+   int             n;
+   int             rc = 0;
+
+   FileName( Name, Number );
+
+   Length = MinSize + rand_r( &Worker->Seed ) % (MaxSize - MinSize + 1);
+
+   if( (fd = FFSVolOpen( Volume, Name, FFS_CREATE | FFS_RDWR, 0 )) < 0 )
+   {
+      if( fd == FFS_RC_TOO_MANY_OPEN_FILES )
+      {
+         Worker->NoDescriptor++;
+      }
+      else
+      {
+         Worker->Failed++;
+      }
+      return;
+   }
+
+   for( Offset = 0; Offset < Length && rc >= 0; Offset += n )
+   {
+      n = (Length - Offset < sizeof(Buffer)) ? (int)(Length - Offset) : (int)sizeof(Buffer);
+      for( i = 0; i < (unsigned long)n; i++ )
+      {
+         Buffer[i] = PatternByte( Length, Offset + i );
+      }
+
+      rc = FFSVolWrite( Volume, fd, (char*)Buffer, n );
+   }
+
+   if( rc == FFS_RC_OUT_OF_SPACE )
+   {
+      Worker->Full++;
+      pthread_mutex_lock( &NameLocks[Number] );
+      atomic_fetch_add( &CutShort[Number], 1 );
+      FFSVolClose( Volume, fd );
+      FFSVolErase( Volume, Name );
+      atomic_fetch_add( &CutShortErased[Number], 1 );
+      pthread_mutex_unlock( &NameLocks[Number] );
+      return;
+   }
+   else if( rc < 0 )
+   {
+      Worker->Failed++;
+   }
+
+   FFSVolClose( Volume, fd );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    Work
+//
+//    Purpose:          Thread function.  Do operations until told to stop.
+//
+//    Inputs:           Arg - The thread's WORKER.
+//
+//    Returns:          NULL.
+//
+//    Notes:            Latency is from the call to its return, including time spent
+//                      waiting for the volume lock, but not the think time.
+//
+//---------------------------------------------------------------------------------------
+static void* Work( void* Arg )
+{
+   WORKER*              Worker = (WORKER*)Arg;
+   char                 Name[32];
+   char                 NewName[32];
+   unsigned long long   Start;
+   unsigned long        Pick;
+   unsigned long        Number;
+   int                  Op;
+   int                  rc;
+
+   while( atomic_load( &Running ) )
+   {
+      Pick = rand_r( &Worker->Seed ) % MixTotal;
+      for( Op = 0; Pick >= Mix[Op]; Op++ )
+      {
+         Pick -= Mix[Op];
+      }
+
+      Number = rand_r( &Worker->Seed ) % FileCount;
+      FileName( Name, Number );
+
+      Start = Nanoseconds();
+
+      switch( Op )
+      {
+         case OP_READ:
+            ReadFile( Worker, Number );
+            break;
+
+         case OP_WRITE:
+            WriteFile( Worker, Number );
+            break;
+
+         case OP_ERASE:
+            if( (rc = FFSVolErase( Volume, Name )) == FFS_RC_FILE_NOT_FOUND )
+            {
+               Worker->Missing++;
+            }
+            else if( rc < 0 )
+            {
+               Worker->Failed++;
+            }
+            break;
+
+         case OP_RENAME:
+            FileName( NewName, rand_r( &Worker->Seed ) % FileCount );
+            pthread_mutex_lock( &NameLocks[Number] );
+            rc = FFSVolRename( Volume, Name, NewName );
+            pthread_mutex_unlock( &NameLocks[Number] );
+            if( rc == FFS_RC_FILE_NOT_FOUND ||
+                rc == FFS_RC_NEW_NAME_EXISTS )
+            {
+               Worker->Missing++;
+            }
+            else if( rc == FFS_RC_OUT_OF_SPACE )
+            {
+               Worker->Full++;
+            }
+            else if( rc < 0 )
+            {
+               Worker->Failed++;
+            }
+            break;
+      }
+
+      AddSample( &Worker->Latency[Op], Nanoseconds() - Start );
+
+      if( ThinkTime )
+      {
+         usleep( rand_r( &Worker->Seed ) % (ThinkTime + 1) );
+      }
+   }
+
+   return NULL;
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    PrintLatency
+//
+//    Purpose:          Print throughput and percentiles of a set of samples.
+//
+//    Inputs:           Label   - First column.
+//                      Samples - Latencies, which are sorted.
+//                      Count   - Number of them.
+//                      Elapsed - Length of the step in nanoseconds.
+//
+//    Returns:          Nothing.
+//
+//    Notes:
+//
+//---------------------------------------------------------------------------------------
+static void PrintLatency( const char* Label, unsigned long long* Samples, unsigned long Count,
+                          unsigned long long Elapsed )
+{
+   if( Count == 0 )
+   {
+      printf( "%8s %10s\n", Label, "-" );
+      return;
+   }
+
+   qsort( Samples, Count, sizeof(unsigned long long), CompareSamples );
+
+   printf( "%8s %10.0f %10.1f %10.1f %10.1f %10.1f",
+           Label,
+           Count * 1e9 / Elapsed,
+           Samples[(Count - 1) * 50 / 100] / 1e3,
+           Samples[(Count - 1) * 99 / 100] / 1e3,
+           Samples[(Count - 1) * 999 / 1000] / 1e3,
+           Samples[Count - 1] / 1e3 );
+}
+
+
+//---------------------------------------------------------------------------------------
+//
+//    Function Name:    RunStep
+//
+//    Purpose:          Run one step: a new volume, the files, and Threads threads.
+//
+//    Inputs:           ImagePath - Scratch image.
+//                      Threads   - Number of threads.
+//
+//    Returns:          0, or -1 if the volume couldn't be set up.
+//
+//    Notes:            Returns 1 if the volume fails Check at the end.
+//
+//---------------------------------------------------------------------------------------
+static int RunStep( const char* ImagePath, int Threads )
+{
+   FFS_FLASH_SECTION*   Sections;
+   WORKER               Setup;
+   WORKER               Total;
+   char                 Name[32];
+   unsigned long long   Start;
+   unsigned long long   Elapsed;
+   unsigned long long*  All;
+   unsigned long        AllCount = 0;
+   unsigned long        Count;
+   unsigned long        i;
+   int                  Op;
+   int                  rc;
+
+   unlink( ImagePath );
+   if( (Sections = FFSEmuOpen( ImagePath, SectorSize, SectorCount )) == NULL )
+   {
+      return -1;
+   }
+
+   FFSEmuSetEraseTime( Sections, EraseTime );
+
+   if( (Volume = FFSMount( Sections, NULL, 0 )) == NULL )
+   {
+      fprintf( stderr, "my_ffs_stress: can't mount %s\n", ImagePath );
+      FFSEmuClose( Sections );
+      return -1;
+   }
+
+   // Every name starts out there...
+   memset( &Setup, 0, sizeof(Setup) );
+   for( i = 0; i < FileCount; i++ )
+   {
+      WriteFile( &Setup, i );
+   }
+
+   memset( Workers, 0, sizeof(WORKER) * Threads );
+   atomic_store( &Running, 1 );
+
+   Start = Nanoseconds();
+   for( i = 0; i < (unsigned long)Threads; i++ )
+   {
+      Workers[i].Seed = (unsigned int)(i * 2654435761UL + 1);
+      if( pthread_create( &Workers[i].Thread, NULL, Work, &Workers[i] ) != 0 )
+      {
+         fprintf( stderr, "my_ffs_stress: can't create thread\n" );
+         exit( 1 );
+      }
+   }
+
+   sleep( Seconds );
+   atomic_store( &Running, 0 );
+
+   for( i = 0; i < (unsigned long)Threads; i++ )
+   {
+      pthread_join( Workers[i].Thread, NULL );
+   }
+   Elapsed = Nanoseconds() - Start;
+
+   // Add up the threads...
+   memset( &Total, 0, sizeof(Total) );
+   for( i = 0; i < (unsigned long)Threads; i++ )
+   {
+      Total.NoDescriptor += Workers[i].NoDescriptor;
+      Total.Missing      += Workers[i].Missing;
+      Total.Full         += Workers[i].Full;
+      Total.Bad          += Workers[i].Bad;
+      Total.Failed       += Workers[i].Failed;
+      for( Op = 0; Op < OPS; Op++ )
+      {
+         AllCount += Workers[i].Latency[Op].Count;
+      }
+   }
+
+   All = (unsigned long long*)malloc( (AllCount ? AllCount : 1) * sizeof(unsigned long long) );
+   if( All == NULL )
+   {
+      fprintf( stderr, "my_ffs_stress: out of memory\n" );
+      exit( 1 );
+   }
+
+   for( Op = 0, AllCount = 0; Op < OPS; Op++ )
+   {
+      for( i = 0; i < (unsigned long)Threads; i++ )
+      {
+         memcpy( All + AllCount, Workers[i].Latency[Op].Samples,
+                 Workers[i].Latency[Op].Count * sizeof(unsigned long long) );
+         AllCount += Workers[i].Latency[Op].Count;
+      }
+   }
+
+   sprintf( Name, "%d", Threads );
+   PrintLatency( Name, All, AllCount, Elapsed );
+   printf( " %8lu %8lu %6lu %6lu %6lu\n", Total.NoDescriptor, Total.Missing, Total.Full,
+           Total.Bad, Total.Failed );
+
+   // And by operation.  All was sorted, so gather each one's samples again...
+   if( Verbose )
+   {
+      for( Op = 0; Op < OPS; Op++ )
+      {
+         for( i = 0, Count = 0; i < (unsigned long)Threads; i++ )
+         {
+            memcpy( All + Count, Workers[i].Latency[Op].Samples,
+                    Workers[i].Latency[Op].Count * sizeof(unsigned long long) );
+            Count += Workers[i].Latency[Op].Count;
+         }
+
+         PrintLatency( OpNames[Op], All, Count, Elapsed );
+         printf( "\n" );
+      }
+   }
+
+   free( All );
+   for( i = 0; i < (unsigned long)Threads; i++ )
+   {
+      for( Op = 0; Op < OPS; Op++ )
+      {
+         free( Workers[i].Latency[Op].Samples );
+      }
+   }
+
+   rc = 0;
+   if( (i = FFSVolCheck( Volume )) != 0 )
+   {
+      printf( "         Check fixed %lu sectors\n", i );
+      rc = 1;
+   }
+
+   FFSUnmount( Volume );
+   FFSEmuClose( Sections );
+
+   return rc;
+}
+
+
+int main( int argc, char** argv )
+{
+   char*   p;
+   int     Failed = 0;
+   int     Opt;
+   int     Op;
+   int     i;
+
+   while( (Opt = getopt( argc, argv, "s:n:t:d:f:z:m:k:e:v" )) != -1 )
+   {
+      switch( Opt )
+      {
+         case 's': SectorSize  = strtoul( optarg, NULL, 0 ); break;
+         case 'n': SectorCount = strtoul( optarg, NULL, 0 ); break;
+         case 'd': Seconds     = strtoul( optarg, NULL, 0 ); break;
+         case 'f': FileCount   = strtoul( optarg, NULL, 0 ); break;
+         case 'k': ThinkTime   = strtoul( optarg, NULL, 0 ); break;
+         case 'e': EraseTime   = strtoul( optarg, NULL, 0 ); break;
+         case 'v': Verbose     = 1;                          break;
+
+         case 't':
+            for( StepCount = 0, p = optarg; *p && StepCount < MAX_STEPS; StepCount++ )
+            {
+               Steps[StepCount] = (int)strtol( p, &p, 0 );
+               if( Steps[StepCount] < 1 || Steps[StepCount] > MAX_THREADS )
+               {
+                  SectorSize = 0;
+               }
+               p += (*p == ',');
+            }
+            break;
+
+         case 'z':
+            MinSize = strtoul( optarg, &p, 0 );
+            MaxSize = (*p == ':') ? strtoul( p + 1, NULL, 0 ) : MinSize;
+            break;
+
+         case 'm':
+            for( Op = 0, p = optarg; Op < OPS; Op++ )
+            {
+               Mix[Op] = strtoul( p, &p, 0 );
+               p += (*p == ':');
+            }
+            break;
+
+         default:  SectorSize = 0; break;
+      }
+   }
+
+   for( Op = 0, MixTotal = 0; Op < OPS; Op++ )
+   {
+      MixTotal += Mix[Op];
+   }
+
+   if( SectorSize == 0 || SectorCount == 0 || FileCount == 0 || MixTotal == 0 ||
+       MinSize < 4 || MaxSize < MinSize || StepCount == 0 || argc - optind != 1 )
+   {
+      fprintf( stderr, "usage: %s [-s SectorSize] [-n Sectors] [-t Threads,...] [-d Seconds]\n"
+                       "          [-f Files] [-z Min:Max] [-m Read:Write:Erase:Rename]\n"
+                       "          [-k Microseconds] [-e Microseconds] [-v] Image\n", argv[0] );
+      return 2;
+   }
+
+   CutShort       = (atomic_ulong*)calloc( FileCount, sizeof(atomic_ulong) );
+   CutShortErased = (atomic_ulong*)calloc( FileCount, sizeof(atomic_ulong) );
+   NameLocks      = (pthread_mutex_t*)calloc( FileCount, sizeof(pthread_mutex_t) );
+   if( CutShort == NULL || CutShortErased == NULL || NameLocks == NULL )
+   {
+      fprintf( stderr, "my_ffs_stress: out of memory\n" );
+      return 1;
+   }
+   for( i = 0; i < (int)FileCount; i++ )
+   {
+      pthread_mutex_init( &NameLocks[i], NULL );
+   }
+
+   printf( "%lu sectors of %lu bytes, %lu files of %lu-%lu bytes, %d descriptors\n",
+           SectorCount, SectorSize, FileCount, MinSize, MaxSize, FFS_MAX_FILE_DESCRIPTORS );
+   printf( "mix %lu:%lu:%lu:%lu read:write:erase:rename, think %lu us, erase %lu us, %lu s a step\n\n",
+           Mix[OP_READ], Mix[OP_WRITE], Mix[OP_ERASE], Mix[OP_RENAME], ThinkTime, EraseTime, Seconds );
+
+   printf( "%8s %10s %10s %10s %10s %10s %8s %8s %6s %6s %6s\n",
+           "threads", "ops/s", "p50 us", "p99 us", "p999 us", "max us",
+           "no fd", "missing", "full", "bad", "failed" );
+
+   for( i = 0; i < StepCount; i++ )
+   {
+      if( (Opt = RunStep( argv[optind], Steps[i] )) < 0 )
+      {
+         return 1;
+      }
+      Failed |= Opt;
+   }
+
+   return Failed;
+}